@@ -0,0 +1,332 @@
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/ml.hpp>
+
+#include "common_code.hpp"
+#include "binary_io.hpp"
+
+#ifndef NDEBUG
+int __Debug_Level = 0;
+#endif
+
+const char *keys =
+    "{help h usage ? |      | print this message   }"
+    "{n              |2000  | Train images of the synthetic dataset (up to 100000). The "
+    "validation and test partitions have n/10 and n/5 images.}"
+    "{rseed          |1     | Seed of the synthetic dataset and the classifiers.}"
+    "{dir            |bench_data | Folder of the synthetic datasets. A dataset already "
+    "generated with the same n and rseed is reused.}"
+    "{f              |1 2 3 4 5 6 7 | Extractors to benchmark (with their default parameters).}"
+    "{clf            |0 1 2 3 4 5 6 7 8 | Classifiers to benchmark (with the train_clf defaults, "
+    "the cascade is 5 then 3).}"
+    "{fprec          |0     | Precision of the features. 0: float32, 1: float16, 2: int8.}"
+    "{latency        |200   | Single sample predictions used for the latency percentiles.}"
+    "{out            |bench_pollen.txt | File where the tables are written.}"
+#ifndef NDEBUG
+    "{verbose        |0     | Set the verbose level.}"
+#endif
+    ;
+
+/**
+ * @brief Seconds elapsed since a cv::getTickCount() value.
+ */
+static double
+seconds_since(int64 t0)
+{
+    return (cv::getTickCount() - t0) / cv::getTickFrequency();
+}
+
+/**
+ * @brief Parse a list of ids separated by spaces or ':'.
+ */
+static std::vector<int>
+parse_ids(std::string list)
+{
+    std::replace(list.begin(), list.end(), ':', ' ');
+    std::istringstream in(list);
+    std::vector<int> ids;
+    int id;
+    while (in >> id)
+        ids.push_back(id);
+    return ids;
+}
+
+/**
+ * @brief Create a classifier with the default parameters of train_clf.
+ *
+ * @param id is the classifier id (see train_clf clf).
+ * @return the classifier.
+ * @throw std::runtime_error if the id is unknown.
+ */
+static cv::Ptr<cv::ml::StatModel>
+create_classifier(int id)
+{
+    switch (id)
+    {
+        case 0: return fsiv_create_knn_classifier(1);
+        case 1: return fsiv_create_svm_classifier(cv::ml::SVM::LINEAR, 1.0, 3.0, 1.0);
+        case 2: return fsiv_create_rtrees_classifier(0, 50, 0.1);
+        case 3: return fsiv_create_exact_knn_classifier(1);
+        case 4: return fsiv_create_hnsw_knn_classifier(1, 16, 200, 64);
+        case 5: return fsiv_create_linear_sgd_classifier(10, 0.1, 256, 0.0001);
+        case 6: return fsiv_create_ovr_svm_classifier(cv::ml::SVM::LINEAR, 1.0, 3.0, 1.0, 1024);
+        case 7: return fsiv_create_flat_forest_classifier(0, 50, 0, 1, 256);
+        case 8: return fsiv_create_cascade_classifier(create_classifier(5),
+                                                      create_classifier(3));
+        default:
+            throw std::runtime_error("Unknown classifier id: " + std::to_string(id));
+    }
+}
+
+/**
+ * @brief Get a partition of the synthetic dataset, generating it if needed.
+ *
+ * @param dir is the folder of the datasets.
+ * @param part is the partition name.
+ * @param n_images is the number of images.
+ * @param seed is the dataset seed.
+ * @param out is where the generation time is logged.
+ * @return the dataset pathname.
+ */
+static std::string
+synthetic_partition(const std::string &dir, const std::string &part, int n_images,
+                    std::uint64_t seed, std::ostream &out)
+{
+    const std::string folder = dir + "/synthetic_" + std::to_string(n_images) + "_" +
+                               std::to_string(seed) + "_" + part;
+    if (std::ifstream(folder + ".csv").good())
+        return folder;
+    const int64 t0 = cv::getTickCount();
+    fsiv_generate_synthetic_dataset(folder, n_images, seed);
+    out << "Generated " << folder << " (" << n_images << " images) in "
+        << seconds_since(t0) << " s." << std::endl;
+    return folder;
+}
+
+/**
+ * @brief A loaded dataset partition and its features.
+ */
+struct BenchPartition
+{
+    std::string path;
+    cv::Mat X;        // images.
+    cv::Mat y;        // labels.
+    cv::Mat features; // features of the current extractor.
+};
+
+/**
+ * @brief Get the size of the model file of a trained classifier.
+ */
+static double
+model_size_mb(cv::Ptr<cv::ml::StatModel> &clsf, const std::string &out_fname)
+{
+    const std::string tmp_fname = fsiv_make_temp_path(out_fname);
+    size_t size = 0;
+    {
+        ModelFileWriter model_file(tmp_fname);
+        fsiv_save_classifier_model(clsf, model_file);
+        if (model_file.close())
+            fsiv_compute_file_size(tmp_fname, size);
+    }
+    std::remove(tmp_fname.c_str());
+    return size / (1024.0 * 1024.0);
+}
+
+/**
+ * @brief Get a percentile of a set of values.
+ */
+static double
+percentile(std::vector<double> values, double p)
+{
+    if (values.empty())
+        return 0.0;
+    const size_t k = std::min(values.size() - 1, size_t(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + k, values.end());
+    return values[k];
+}
+
+int main(int argc, char *const *argv)
+{
+  int retCode = EXIT_SUCCESS;
+
+  try
+  {
+    cv::CommandLineParser parser(argc, argv, keys);
+    parser.about("Benchmark the extractors and classifiers on a synthetic pollen dataset.");
+    if (parser.has("help"))
+    {
+      parser.printMessage();
+      return 0;
+    }
+
+    int verbose = 0;
+#ifndef NDEBUG
+    __Debug_Level = parser.get<int>("verbose");
+    verbose = __Debug_Level;
+#endif
+    int n_train = parser.get<int>("n");
+    std::uint64_t seed = std::uint64_t(parser.get<double>("rseed"));
+    std::string dir = parser.get<std::string>("dir");
+    std::vector<int> feature_ids = parse_ids(parser.get<std::string>("f"));
+    std::vector<int> classifier_ids = parse_ids(parser.get<std::string>("clf"));
+    FEATURE_PRECISION precision = FEATURE_PRECISION(parser.get<int>("fprec"));
+    int latency_queries = parser.get<int>("latency");
+    std::string out_fname = parser.get<std::string>("out");
+    if (!parser.check())
+    {
+      parser.printErrors();
+      return 0;
+    }
+    if (n_train < 15 || n_train > 100000)
+    {
+      std::cerr << "Error: n must be in [15, 100000]." << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    std::cout.setf(std::ios::unitbuf);
+    cv::theRNG().state = seed;
+
+    // Generate (the first time) and load the partitions.
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec)
+      throw std::runtime_error("Error: could not create the folder " + dir);
+    BenchPartition train, valid, test;
+    train.path = synthetic_partition(dir, "train", n_train, seed, std::cout);
+    valid.path = synthetic_partition(dir, "valid", std::max(15, n_train / 10), seed + 1,
+                                     std::cout);
+    test.path = synthetic_partition(dir, "test", std::max(15, n_train / 5), seed + 2,
+                                    std::cout);
+
+    std::ostringstream load_table;
+    load_table << "partition\timages\tload_s\timages/s" << std::endl;
+    for (BenchPartition *p : {&train, &valid, &test})
+    {
+      const int64 t0 = cv::getTickCount();
+      fsiv_load_dataset(p->path, p->X, p->y, false, verbose);
+      const double seconds = seconds_since(t0);
+      load_table << p->path << "\t" << p->X.rows << "\t" << seconds << "\t"
+                 << p->X.rows / std::max(seconds, 1.0e-9) << std::endl;
+    }
+    std::cout << load_table.str() << std::endl;
+
+    std::ostringstream extract_table, clf_table;
+    extract_table << "extractor\tfeatures\ttrain_s\textract_images/s" << std::endl;
+    clf_table << "extractor\tclassifier\ttrain_s\tpredict_samples/s\tp50_ms\tp99_ms"
+              << "\taccuracy\tmodel_mb" << std::endl;
+
+    for (int feature_id : feature_ids)
+    {
+      cv::Ptr<FeaturesExtractor> extractor;
+      FeatureQuantizer quantizer(precision);
+      FeatureExtractionStats stats;
+      double extractor_seconds = 0.0;
+      try
+      {
+        extractor = FeaturesExtractor::create(FEATURE_IDS(feature_id));
+        int64 t0 = cv::getTickCount();
+        extractor->train(train.X);
+        extractor_seconds = seconds_since(t0);
+        const int step = std::max(1, train.X.rows / 2048);
+        cv::Mat samples;
+        for (int i = 0; i < train.X.rows; i += step)
+          samples.push_back(train.X.row(i));
+        quantizer.fit(fsiv_extract_features(samples, extractor));
+
+        FeatureExtractionStats part_stats;
+        for (BenchPartition *p : {&train, &valid, &test})
+        {
+          p->features = fsiv_extract_features(p->X, extractor, &part_stats, &quantizer);
+          stats.n_images += part_stats.n_images;
+          stats.seconds += part_stats.seconds;
+        }
+      }
+      catch (std::exception &e)
+      {
+        std::cerr << "Extractor " << feature_id << " failed: " << e.what() << std::endl;
+        extract_table << feature_id << "\tfailed\t\t" << std::endl;
+        continue;
+      }
+      extract_table << extractor->get_extractor_name() << "\t" << train.features.cols
+                    << "\t" << extractor_seconds << "\t" << stats.images_per_second()
+                    << std::endl;
+      std::cout << "Extractor " << extractor->get_extractor_name() << ": "
+                << stats << "." << std::endl;
+
+      for (int classifier_id : classifier_ids)
+      {
+        std::ostringstream row;
+        row << extractor->get_extractor_name() << "\t" << classifier_id;
+        try
+        {
+          cv::Ptr<cv::ml::StatModel> clsf = create_classifier(classifier_id);
+          int64 t0 = cv::getTickCount();
+          fsiv_train_classifier(clsf, train.features, train.y, quantizer);
+          CascadeClassifier *cascade = dynamic_cast<CascadeClassifier *>(clsf.get());
+          if (cascade != nullptr)
+          {
+            cv::Mat first_labels, margins, second_labels;
+            cascade->predict_stages(valid.features, quantizer, first_labels, margins,
+                                    second_labels);
+            cascade->calibrate(margins, first_labels, second_labels, valid.y, 0.005f);
+          }
+          const double train_seconds = seconds_since(t0);
+
+          t0 = cv::getTickCount();
+          cv::Mat labels = fsiv_predict_labels(clsf, test.features, quantizer);
+          const double predict_seconds = seconds_since(t0);
+          MetricsAccumulator metrics(15);
+          metrics.add(test.y, labels);
+
+          std::vector<double> latencies;
+          const int n_queries = std::min(latency_queries, test.features.rows);
+          for (int q = 0; q < n_queries; ++q)
+          {
+            const int i = int(std::int64_t(q) * test.features.rows / n_queries);
+            t0 = cv::getTickCount();
+            fsiv_predict_labels(clsf, test.features.row(i), quantizer);
+            latencies.push_back(1000.0 * seconds_since(t0));
+          }
+
+          row << "\t" << train_seconds << "\t"
+              << test.features.rows / std::max(predict_seconds, 1.0e-9) << "\t"
+              << percentile(latencies, 0.5) << "\t" << percentile(latencies, 0.99) << "\t"
+              << metrics.compute().accuracy << "\t" << model_size_mb(clsf, out_fname);
+        }
+        catch (std::exception &e)
+        {
+          std::cerr << "Classifier " << classifier_id << " failed: " << e.what() << std::endl;
+          row << "\tfailed\t\t\t\t\t";
+        }
+        clf_table << row.str() << std::endl;
+        std::cout << row.str() << std::endl;
+      }
+    }
+
+    std::ofstream out(out_fname);
+    out << "# bench_pollen n=" << n_train << " rseed=" << seed << " fprec=" << int(precision)
+        << " threads=" << cv::getNumThreads() << std::endl;
+    out << std::endl << "## Load" << std::endl << load_table.str();
+    out << std::endl << "## Extraction" << std::endl << extract_table.str();
+    out << std::endl << "## Classification" << std::endl << clf_table.str();
+    if (!out)
+      throw std::runtime_error("Error: could not write " + out_fname);
+    std::cout << std::endl << "Tables written to '" << out_fname << "'." << std::endl;
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Exception caught: " << e.what() << std::endl;
+    retCode = EXIT_FAILURE;
+  }
+  return retCode;
+}
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <system_error>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "binary_io.hpp"
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+    if (mapped_)
+        munmap(data_, size_);
+    else
+#endif
+        delete[] data_;
+}
+
+std::shared_ptr<MappedFile>
+MappedFile::open(const std::string &path)
+{
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    file->path_ = path;
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        ::close(fd);
+        return nullptr;
+    }
+    file->size_ = size_t(st.st_size);
+    void *addr = mmap(nullptr, file->size_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED)
+        return nullptr;
+    file->data_ = static_cast<unsigned char *>(addr);
+    file->mapped_ = true;
+#else
+    // No mmap here: fall back to read the whole file.
+    std::ifstream in(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!in)
+        return nullptr;
+    file->size_ = size_t(in.tellg());
+    if (file->size_ == 0)
+        return nullptr;
+    file->data_ = new unsigned char[file->size_];
+    in.seekg(0);
+    if (!in.read(reinterpret_cast<char *>(file->data_), file->size_))
+        return nullptr;
+#endif
+    return file;
+}
+
+void fsiv_pin_mapped_file(const std::shared_ptr<MappedFile> &file)
+{
+    static std::mutex mutex;
+    static std::vector<std::shared_ptr<MappedFile>> pinned;
+    std::lock_guard<std::mutex> lock(mutex);
+    pinned.push_back(file);
+}
+
+std::uint64_t
+fsiv_hash_bytes(const void *data, size_t size, std::uint64_t h)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+std::uint64_t
+fsiv_hash_string(const std::string &s, std::uint64_t h)
+{
+    h = fsiv_hash_value(std::uint64_t(s.size()), h);
+    return fsiv_hash_bytes(s.data(), s.size(), h);
+}
+
+bool fsiv_file_stat(const std::string &path, std::int64_t &mtime,
+                    std::uint64_t &size)
+{
+    std::error_code ec;
+    auto t = std::filesystem::last_write_time(path, ec);
+    if (ec)
+        return false;
+    size = std::filesystem::file_size(path, ec);
+    if (ec)
+        return false;
+    mtime = std::int64_t(t.time_since_epoch().count());
+    return true;
+}
+
+std::uint64_t
+fsiv_write_padding(std::ostream &out, std::uint64_t alignment)
+{
+    const std::uint64_t pos = std::uint64_t(out.tellp());
+    const std::uint64_t aligned = fsiv_align_offset(pos, alignment);
+    static const std::vector<char> zeros(4096, 0);
+    std::uint64_t n = aligned - pos;
+    while (n > 0)
+    {
+        const std::uint64_t chunk = std::min<std::uint64_t>(n, zeros.size());
+        out.write(zeros.data(), chunk);
+        n -= chunk;
+    }
+    return aligned;
+}
+
+std::string
+fsiv_make_temp_path(const std::string &path)
+{
+    static std::atomic<unsigned> counter(0);
+#ifdef _WIN32
+    const long pid = long(_getpid());
+#else
+    const long pid = long(getpid());
+#endif
+    return path + ".tmp." + std::to_string(pid) + "." +
+           std::to_string(counter++);
+}
+
+bool fsiv_replace_file(const std::string &tmp_path, const std::string &path)
+{
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec)
+    {
+        std::filesystem::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,124 @@
+/**
+ *  @file binary_io.hpp
+ *  Helpers shared by the binary caches and model files.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+/**
+ * @brief A whole file mapped into memory.
+ *
+ * Pages are mapped copy-on-write, so writing through data() never modifies
+ * the file on disk. The mapping is released when the last owner goes away.
+ */
+class MappedFile
+{
+public:
+    ~MappedFile();
+
+    /**
+     * @brief Map a file into memory.
+     * @param path is the pathname of the file.
+     * @return the mapping or nullptr if the file could not be mapped.
+     */
+    static std::shared_ptr<MappedFile> open(const std::string &path);
+
+    unsigned char *data() { return data_; }
+    const unsigned char *data() const { return data_; }
+    size_t size() const { return size_; }
+    const std::string &path() const { return path_; }
+
+private:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    std::string path_;
+    unsigned char *data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+};
+
+/**
+ * @brief Keep a mapping alive until the process ends.
+ *
+ * Use it when cv::Mat views over the mapped memory are handed to code that
+ * does not know about the mapping.
+ */
+void fsiv_pin_mapped_file(const std::shared_ptr<MappedFile> &file);
+
+/**
+ * @brief Hash a memory block with 64 bits FNV-1a.
+ *
+ * @param data is the block.
+ * @param size is the block size in bytes.
+ * @param h is the hash to continue from, so several blocks can be chained.
+ * @return the updated hash.
+ */
+std::uint64_t fsiv_hash_bytes(const void *data, size_t size,
+                              std::uint64_t h = 14695981039346656037ull);
+
+/**
+ * @brief Hash a string (its bytes and its length).
+ */
+std::uint64_t fsiv_hash_string(const std::string &s,
+                               std::uint64_t h = 14695981039346656037ull);
+
+/**
+ * @brief Hash a POD value.
+ */
+template <class T>
+inline std::uint64_t fsiv_hash_value(const T &v,
+                                     std::uint64_t h = 14695981039346656037ull)
+{
+    return fsiv_hash_bytes(&v, sizeof(T), h);
+}
+
+/**
+ * @brief Get the modification time of a file.
+ *
+ * @param[in] path is the pathname of the file.
+ * @param[out] mtime is the modification time in file clock ticks.
+ * @param[out] size is the file size in bytes.
+ * @return true if success.
+ */
+bool fsiv_file_stat(const std::string &path, std::int64_t &mtime,
+                    std::uint64_t &size);
+
+/**
+ * @brief Round up an offset to a given alignment.
+ * @pre alignment is a power of two.
+ */
+inline std::uint64_t fsiv_align_offset(std::uint64_t offset,
+                                       std::uint64_t alignment)
+{
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * @brief Write zero bytes to an stream until its position is aligned.
+ * @return the new (aligned) position.
+ */
+std::uint64_t fsiv_write_padding(std::ostream &out, std::uint64_t alignment);
+
+/**
+ * @brief Get an unique temporary pathname next to a file.
+ *
+ * Writing first to this pathname and then calling fsiv_replace_file()
+ * avoids readers seeing partially written files.
+ */
+std::string fsiv_make_temp_path(const std::string &path);
+
+/**
+ * @brief Atomically replace a file with a temporary one.
+ *
+ * @param tmp_path is the fully written temporary file.
+ * @param path is the destination pathname.
+ * @return true if success. On failure the temporary file is removed.
+ */
+bool fsiv_replace_file(const std::string &tmp_path, const std::string &path);
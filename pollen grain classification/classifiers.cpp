@@ -1,4 +1,13 @@
+#include <algorithm>
+#include <cfloat>
+#include <numeric>
+#include <opencv2/core/utility.hpp>
 #include "classifiers.hpp"
+#include "exact_knn.hpp"
+#include "hnsw_knn.hpp"
+#include "linear_sgd.hpp"
+#include "ovr_svm.hpp"
+#include "flat_forest.hpp"
 
 
 
@@ -18,6 +27,32 @@ fsiv_create_knn_classifier(int K)
 }
 
 
+cv::Ptr<cv::ml::StatModel>
+fsiv_create_exact_knn_classifier(int K)
+{
+    cv::Ptr<cv::ml::StatModel> knn = ExactKNN::create(K);
+    CV_Assert(knn != nullptr);
+    return knn;
+}
+
+cv::Ptr<cv::ml::StatModel>
+fsiv_create_hnsw_knn_classifier(int K, int M, int ef_construction, int ef)
+{
+    cv::Ptr<cv::ml::StatModel> knn = HnswKNN::create(K, M, ef_construction, ef);
+    CV_Assert(knn != nullptr);
+    return knn;
+}
+
+cv::Ptr<cv::ml::StatModel>
+fsiv_create_linear_sgd_classifier(int epochs, float learning_rate, int batch_size,
+                                  float lambda)
+{
+    cv::Ptr<cv::ml::StatModel> sgd = LinearSGD::create(epochs, learning_rate,
+                                                       batch_size, lambda);
+    CV_Assert(sgd != nullptr);
+    return sgd;
+}
+
 cv::Ptr<cv::ml::StatModel>
 fsiv_create_svm_classifier(int Kernel,
                            float C,
@@ -39,6 +74,15 @@ fsiv_create_svm_classifier(int Kernel,
     return svm;
 }
 
+cv::Ptr<cv::ml::StatModel>
+fsiv_create_ovr_svm_classifier(int Kernel, float C, float degree, float gamma,
+                               int cache_mb)
+{
+    cv::Ptr<cv::ml::StatModel> svm = OvrSVM::create(Kernel, C, degree, gamma, cache_mb);
+    CV_Assert(svm != nullptr);
+    return svm;
+}
+
 cv::Ptr<cv::ml::StatModel>
 fsiv_create_rtrees_classifier(int V,
                               int T,
@@ -53,6 +97,24 @@ fsiv_create_rtrees_classifier(int V,
     return rtrees;
 }
 
+cv::Ptr<cv::ml::StatModel>
+fsiv_create_flat_forest_classifier(int V, int T, int max_depth, int min_samples_leaf,
+                                   int n_bins)
+{
+    cv::Ptr<cv::ml::StatModel> forest = FlatForest::create(T, V, max_depth,
+                                                           min_samples_leaf, n_bins);
+    CV_Assert(forest != nullptr);
+    return forest;
+}
+
+cv::Ptr<cv::ml::StatModel>
+fsiv_create_cascade_classifier(const cv::Ptr<cv::ml::StatModel> &first,
+                               const cv::Ptr<cv::ml::StatModel> &second)
+{
+    cv::Ptr<cv::ml::StatModel> cascade = CascadeClassifier::create(first, second);
+    CV_Assert(cascade != nullptr);
+    return cascade;
+}
 
 void
 fsiv_train_classifier(cv::Ptr<cv::ml::StatModel>& clf,
@@ -60,11 +122,252 @@ fsiv_train_classifier(cv::Ptr<cv::ml::StatModel>& clf,
 {
     CV_Assert(clf != nullptr);   
   
-    clf->train(X, cv::ml::ROW_SAMPLE, y);
+    EncodedFeaturesModel *encoded = dynamic_cast<EncodedFeaturesModel *>(clf.get());
+    if (encoded != nullptr && X.type() == CV_32FC1)
+        encoded->train_encoded(X, y, FeatureQuantizer());
+    else
+        clf->train(X, cv::ml::ROW_SAMPLE, y);
 
     CV_Assert(clf->isTrained());    
 }
 
+void
+fsiv_train_classifier(cv::Ptr<cv::ml::StatModel>& clf,
+    cv::Mat const& X, cv::Mat const& y, const FeatureQuantizer& quantizer)
+{
+    EncodedFeaturesModel *encoded = dynamic_cast<EncodedFeaturesModel *>(clf.get());
+    if (encoded != nullptr)
+    {
+        encoded->train_encoded(X, y, quantizer);
+        CV_Assert(clf->isTrained());
+    }
+    else if (X.type() == CV_32FC1)
+        fsiv_train_classifier(clf, X, y);
+    else
+    {
+        cv::Mat X_f;
+        quantizer.decode(X, X_f);
+        fsiv_train_classifier(clf, X_f, y);
+    }
+}
+
+BatchTrainable *
+fsiv_get_batch_trainable(cv::Ptr<cv::ml::StatModel> &clf)
+{
+    return dynamic_cast<BatchTrainable *>(clf.get());
+}
+
+void
+fsiv_train_classifier_batches(
+    cv::Ptr<cv::ml::StatModel> &clf,
+    const std::function<bool(cv::Mat &, cv::Mat &)> &next_batch,
+    const std::function<void()> &rewind)
+{
+    BatchTrainable *batch_clf = fsiv_get_batch_trainable(clf);
+    CV_Assert(batch_clf != nullptr);
+
+    cv::Mat X, y;
+    for (int epoch = 0; epoch < batch_clf->get_epochs(); ++epoch)
+    {
+        if (epoch > 0)
+            rewind();
+        batch_clf->start_epoch(epoch);
+        while (next_batch(X, y))
+            batch_clf->train_batch(X, y);
+    }
+    batch_clf->finish_training();
+
+    CV_Assert(clf->isTrained());
+}
+
+// Max passes of the condensed nearest neighbour selection.
+static const int CNN_MAX_PASSES = 32;
+static const int KMEANS_ITERATIONS = 20;
+
+bool
+fsiv_is_knn_classifier(const cv::Ptr<cv::ml::StatModel> &clf)
+{
+    return dynamic_cast<const cv::ml::KNearest*>(clf.get()) != nullptr ||
+           dynamic_cast<const ExactKNN*>(clf.get()) != nullptr ||
+           dynamic_cast<const HnswKNN*>(clf.get()) != nullptr;
+}
+
+/**
+ * @brief Get the prototypes target of a class.
+ */
+static int
+get_class_prototypes(const std::vector<int> &n_prototypes, int label)
+{
+    return n_prototypes.size() == 1 ? n_prototypes[0] : n_prototypes[label];
+}
+
+static void
+condense_kmeans(const cv::Mat &X, const std::vector<std::vector<int>> &rows,
+                const FeatureQuantizer &quantizer,
+                const std::vector<int> &n_prototypes,
+                std::vector<cv::Mat> &prototypes)
+{
+    const int n_classes = int(rows.size());
+    prototypes.assign(n_classes, cv::Mat());
+    // The seeds are drawn here, so the result does not depend on which
+    // thread clusters each class.
+    std::vector<uint64> seeds(n_classes);
+    for (int c = 0; c < n_classes; ++c)
+        seeds[c] = uint64(cv::theRNG().next()) + 1;
+
+    cv::parallel_for_(cv::Range(0, n_classes), [&](const cv::Range &range)
+    {
+        // cv::theRNG() is per thread and the calling thread also runs
+        // stripes, so its state is restored to keep the later random steps
+        // of the training reproducible.
+        const cv::RNG saved_rng = cv::theRNG();
+        for (int c = range.start; c < range.end; ++c)
+        {
+            const int n_c = int(rows[c].size());
+            if (n_c == 0)
+                continue;
+            cv::Mat X_c(n_c, X.cols, X.type());
+            for (int i = 0; i < n_c; ++i)
+                X.row(rows[c][i]).copyTo(X_c.row(i));
+            const int target = get_class_prototypes(n_prototypes, c);
+            if (target <= 0 || target >= n_c)
+            {
+                prototypes[c] = X_c;
+                continue;
+            }
+            cv::Mat X_f, assignments, centers;
+            quantizer.decode(X_c, X_f);
+            cv::theRNG().state = seeds[c];
+            cv::kmeans(X_f, target, assignments,
+                       cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS,
+                                        KMEANS_ITERATIONS, 1.0e-4),
+                       1, cv::KMEANS_PP_CENTERS, centers);
+            quantizer.encode(centers, prototypes[c]);
+        }
+        cv::theRNG() = saved_rng;
+    });
+}
+
+static void
+condense_cnn(const cv::Mat &X, const cv::Mat &y,
+             std::vector<std::vector<int>> &rows,
+             const FeatureQuantizer &quantizer,
+             const std::vector<int> &n_prototypes,
+             std::vector<cv::Mat> &prototypes)
+{
+    const int n_classes = int(rows.size());
+    std::vector<char> selected(X.rows, 0);
+    std::vector<int> n_selected(n_classes, 0);
+    for (int c = 0; c < n_classes; ++c)
+    {
+        cv::randShuffle(rows[c]);
+        if (!rows[c].empty())
+        {
+            selected[rows[c][0]] = 1;
+            n_selected[c] = 1;
+        }
+    }
+
+    cv::Mat P, P_labels, predictions;
+    for (int pass = 0; pass < CNN_MAX_PASSES; ++pass)
+    {
+        P.release();
+        P_labels.release();
+        for (int i = 0; i < X.rows; ++i)
+            if (selected[i])
+            {
+                P.push_back(X.row(i));
+                P_labels.push_back(y.at<int>(i));
+            }
+        ExactKNN knn;
+        knn.train_encoded(P, P_labels, quantizer);
+        knn.predict_encoded(X, quantizer, predictions);
+
+        // A class at most doubles its prototypes by pass, like the
+        // sequential algorithm where later samples see the earlier ones.
+        int added = 0;
+        for (int c = 0; c < n_classes; ++c)
+        {
+            const int target = get_class_prototypes(n_prototypes, c);
+            int budget = n_selected[c];
+            if (target > 0)
+                budget = std::min(budget, target - n_selected[c]);
+            for (int i : rows[c])
+            {
+                if (budget <= 0)
+                    break;
+                if (!selected[i] && predictions.at<int>(i) != c)
+                {
+                    selected[i] = 1;
+                    ++n_selected[c];
+                    --budget;
+                    ++added;
+                }
+            }
+        }
+        if (added == 0)
+            break;
+    }
+
+    prototypes.assign(n_classes, cv::Mat());
+    for (int c = 0; c < n_classes; ++c)
+        for (int i : rows[c])
+            if (selected[i])
+                prototypes[c].push_back(X.row(i));
+}
+
+void
+fsiv_condense_prototypes(const cv::Mat &X, const cv::Mat &y,
+                         const FeatureQuantizer &quantizer,
+                         PROTOTYPES_METHOD method,
+                         const std::vector<int> &n_prototypes,
+                         cv::Mat &P, cv::Mat &P_labels)
+{
+    CV_Assert(!X.empty() && X.type() == quantizer.get_type());
+    CV_Assert(y.type() == CV_32SC1 && int(y.total()) == X.rows);
+    if (method == FSIV_PROTOTYPES_NONE)
+    {
+        P = X;
+        P_labels = y;
+        return;
+    }
+
+    double min_label = 0.0, max_label = 0.0;
+    cv::minMaxLoc(y, &min_label, &max_label);
+    CV_Assert(min_label >= 0.0);
+    const int n_classes = int(max_label) + 1;
+    if (n_prototypes.size() != 1 && int(n_prototypes.size()) < n_classes)
+        throw std::runtime_error("Expected one prototypes count or one by class (" +
+                                 std::to_string(n_classes) + ").");
+    std::vector<std::vector<int>> rows(n_classes);
+    for (int i = 0; i < X.rows; ++i)
+        rows[y.at<int>(i)].push_back(i);
+
+    std::vector<cv::Mat> prototypes;
+    switch (method)
+    {
+    case FSIV_PROTOTYPES_KMEANS:
+        condense_kmeans(X, rows, quantizer, n_prototypes, prototypes);
+        break;
+    case FSIV_PROTOTYPES_CNN:
+        condense_cnn(X, y, rows, quantizer, n_prototypes, prototypes);
+        break;
+    default:
+        throw std::runtime_error("Unknown prototypes method: " +
+                                 std::to_string(int(method)));
+    }
+
+    P.release();
+    P_labels.release();
+    for (int c = 0; c < n_classes; ++c)
+    {
+        if (prototypes[c].empty())
+            continue;
+        P.push_back(prototypes[c]);
+        P_labels.push_back(cv::Mat(prototypes[c].rows, 1, CV_32SC1, cv::Scalar(c)));
+    }
+}
+
 cv::Mat
 fsiv_predict_labels(cv::Ptr<cv::ml::StatModel>& clf, cv::Mat const& X)
 {
@@ -81,11 +384,36 @@ fsiv_predict_labels(cv::Ptr<cv::ml::StatModel>& clf, cv::Mat const& X)
     return predictions;
 }
 
-void 
-fsiv_save_classifier_model(cv::Ptr<cv::ml::StatModel>& clf,
-    const std::string& model_fname)
+cv::Mat
+fsiv_predict_labels(cv::Ptr<cv::ml::StatModel>& clf, cv::Mat const& X,
+                    const FeatureQuantizer& quantizer)
+{
+    const EncodedFeaturesModel *encoded = dynamic_cast<const EncodedFeaturesModel *>(clf.get());
+    if (encoded != nullptr)
+    {
+        CV_Assert(clf->isTrained());
+        cv::Mat predictions;
+        encoded->predict_encoded(X, quantizer, predictions);
+        return predictions;
+    }
+    if (X.type() == CV_32FC1)
+        return fsiv_predict_labels(clf, X);
+
+    const int block_size = 1024;
+    cv::Mat predictions(X.rows, 1, CV_32SC1);
+    cv::Mat X_f;
+    for (int begin = 0; begin < X.rows; begin += block_size)
+    {
+        const int end = std::min(X.rows, begin + block_size);
+        quantizer.decode(X.rowRange(begin, end), X_f);
+        fsiv_predict_labels(clf, X_f).copyTo(predictions.rowRange(begin, end));
+    }
+    return predictions;
+}
+
+static int
+get_classifier_type(const cv::Ptr<cv::ml::StatModel>& clf)
 {
-    clf->save(model_fname);
     int id = -1;
     if (dynamic_cast<cv::ml::KNearest*>(clf.get()))
         id = 0;
@@ -93,8 +421,341 @@ fsiv_save_classifier_model(cv::Ptr<cv::ml::StatModel>& clf,
         id = 1;
     else if (dynamic_cast<cv::ml::RTrees*>(clf.get()))
         id = 2;
+    else if (dynamic_cast<ExactKNN*>(clf.get()))
+        id = 3;
+    else if (dynamic_cast<HnswKNN*>(clf.get()))
+        id = 4;
+    else if (dynamic_cast<LinearSGD*>(clf.get()))
+        id = 5;
+    else if (dynamic_cast<OvrSVM*>(clf.get()))
+        id = 6;
+    else if (dynamic_cast<FlatForest*>(clf.get()))
+        id = 7;
+    else if (dynamic_cast<CascadeClassifier*>(clf.get()))
+        id = 8;
     else
         throw std::runtime_error("Error: unknown classifier type.");
+    return id;
+}
+
+/**
+ * @brief Create an untrained classifier of a type to read it.
+ * @param id is the classifier type (see get_classifier_type()).
+ */
+static cv::Ptr<cv::ml::StatModel>
+create_empty_classifier(int id)
+{
+    switch (id)
+    {
+        case 0: return cv::ml::KNearest::create();
+        case 1: return cv::ml::SVM::create();
+        case 2: return cv::ml::RTrees::create();
+        case 3: return ExactKNN::create();
+        case 4: return HnswKNN::create();
+        case 5: return LinearSGD::create();
+        case 6: return OvrSVM::create();
+        case 7: return FlatForest::create();
+        default:
+            throw std::runtime_error("Unknown cascade stage classifier id: " +
+                                     std::to_string(id));
+    }
+}
+
+CascadeClassifier::CascadeClassifier()
+    : threshold_(FLT_MAX)
+{}
+
+cv::Ptr<CascadeClassifier>
+CascadeClassifier::create()
+{
+    return cv::makePtr<CascadeClassifier>();
+}
+
+cv::Ptr<CascadeClassifier>
+CascadeClassifier::create(const cv::Ptr<cv::ml::StatModel> &first,
+                          const cv::Ptr<cv::ml::StatModel> &second)
+{
+    CV_Assert(first != nullptr && second != nullptr);
+    if (dynamic_cast<const MarginModel *>(first.get()) == nullptr)
+        throw std::runtime_error("The first stage of a cascade must give margins "
+                                 "(linear SGD, one-vs-rest SVM or flat forest).");
+    if (dynamic_cast<const CascadeClassifier *>(second.get()) != nullptr)
+        throw std::runtime_error("The second stage of a cascade can not be a cascade.");
+    cv::Ptr<CascadeClassifier> cascade = create();
+    cascade->first_ = first;
+    cascade->second_ = second;
+    return cascade;
+}
+
+cv::Ptr<cv::ml::StatModel> CascadeClassifier::get_first() const
+{
+    return first_;
+}
+
+cv::Ptr<cv::ml::StatModel> CascadeClassifier::get_second() const
+{
+    return second_;
+}
+
+float CascadeClassifier::get_threshold() const
+{
+    return threshold_;
+}
+
+void CascadeClassifier::set_threshold(float threshold)
+{
+    threshold_ = threshold;
+}
+
+int CascadeClassifier::getVarCount() const
+{
+    return first_ ? first_->getVarCount() : 0;
+}
+
+bool CascadeClassifier::isTrained() const
+{
+    return first_ && second_ && first_->isTrained() && second_->isTrained();
+}
+
+bool CascadeClassifier::isClassifier() const
+{
+    return true;
+}
+
+void CascadeClassifier::clear()
+{
+    if (first_)
+        first_->clear();
+    if (second_)
+        second_->clear();
+    threshold_ = FLT_MAX;
+    reset_stats();
+}
+
+std::string
+CascadeClassifier::getDefaultName() const
+{
+    return "fsiv_cascade";
+}
+
+bool CascadeClassifier::train(const cv::Ptr<cv::ml::TrainData> &data, int flags)
+{
+    CV_Assert(data != nullptr);
+    cv::Mat X = data->getTrainSamples(cv::ml::ROW_SAMPLE);
+    if (X.type() != CV_32FC1)
+        X.convertTo(X, CV_32F);
+    cv::Mat y;
+    data->getTrainResponses().convertTo(y, CV_32S);
+    train_encoded(X, y, FeatureQuantizer());
+    return isTrained();
+}
+
+void CascadeClassifier::train_encoded(const cv::Mat &X, const cv::Mat &y,
+                                      const FeatureQuantizer &quantizer)
+{
+    CV_Assert(first_ != nullptr && second_ != nullptr);
+    fsiv_train_classifier(first_, X, y, quantizer);
+    fsiv_train_classifier(second_, X, y, quantizer);
+    reset_stats();
+}
+
+void CascadeClassifier::predict_encoded(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                        cv::Mat &labels) const
+{
+    CV_Assert(isTrained());
+    const MarginModel *first = dynamic_cast<const MarginModel *>(first_.get());
+    cv::Mat margins;
+    int64 t0 = cv::getTickCount();
+    first->predict_margins(X, quantizer, labels, margins);
+    const double first_seconds = (cv::getTickCount() - t0) / cv::getTickFrequency();
+
+    std::vector<int> escalated;
+    for (int i = 0; i < X.rows; ++i)
+        if (margins.at<float>(i) < threshold_)
+            escalated.push_back(i);
+    double second_seconds = 0.0;
+    if (!escalated.empty())
+    {
+        t0 = cv::getTickCount();
+        cv::Mat X_e(int(escalated.size()), X.cols, X.type());
+        for (size_t k = 0; k < escalated.size(); ++k)
+            X.row(escalated[k]).copyTo(X_e.row(int(k)));
+        cv::Ptr<cv::ml::StatModel> second = second_;
+        const cv::Mat labels_e = fsiv_predict_labels(second, X_e, quantizer);
+        for (size_t k = 0; k < escalated.size(); ++k)
+            labels.at<int>(escalated[k]) = labels_e.at<int>(int(k));
+        second_seconds = (cv::getTickCount() - t0) / cv::getTickFrequency();
+    }
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.n_samples += X.rows;
+    stats_.n_escalated += escalated.size();
+    stats_.first_seconds += first_seconds;
+    stats_.second_seconds += second_seconds;
+}
+
+float CascadeClassifier::predict(cv::InputArray samples, cv::OutputArray results, int flags) const
+{
+    cv::Mat X = samples.getMat();
+    if (X.type() != CV_32FC1)
+        X.convertTo(X, CV_32F);
+    cv::Mat labels;
+    predict_encoded(X, FeatureQuantizer(), labels);
+    if (results.needed())
+        labels.convertTo(results, CV_32F);
+    return labels.empty() ? 0.0f : float(labels.at<int>(0));
+}
+
+void CascadeClassifier::predict_stages(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                       cv::Mat &first_labels, cv::Mat &margins,
+                                       cv::Mat &second_labels) const
+{
+    CV_Assert(isTrained());
+    dynamic_cast<const MarginModel *>(first_.get())->predict_margins(X, quantizer,
+                                                                     first_labels, margins);
+    cv::Ptr<cv::ml::StatModel> second = second_;
+    second_labels = fsiv_predict_labels(second, X, quantizer);
+}
+
+float CascadeClassifier::calibrate(const cv::Mat &margins, const cv::Mat &first_labels,
+                                   const cv::Mat &second_labels, const cv::Mat &y,
+                                   float max_drop)
+{
+    const int n = margins.rows;
+    CV_Assert(first_labels.rows == n && second_labels.rows == n && y.rows == n);
+    if (n == 0)
+    {
+        threshold_ = FLT_MAX;
+        return 1.0f;
+    }
+    std::vector<int> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b)
+              { return margins.at<float>(a) < margins.at<float>(b); });
+
+    // Escalating the k lowest margins, the hits are the second stage hits
+    // of them plus the first stage hits of the rest.
+    int hits = 0, second_hits = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        hits += first_labels.at<int>(i) == y.at<int>(i);
+        second_hits += second_labels.at<int>(i) == y.at<int>(i);
+    }
+    const double target = double(second_hits) / n - max_drop;
+    int k = 0;
+    while (k < n)
+    {
+        // Only cut between different margins.
+        if (double(hits) / n >= target &&
+            (k == 0 || margins.at<float>(order[k]) > margins.at<float>(order[k - 1])))
+            break;
+        const int i = order[k++];
+        hits += int(second_labels.at<int>(i) == y.at<int>(i)) -
+                int(first_labels.at<int>(i) == y.at<int>(i));
+    }
+    threshold_ = k < n ? margins.at<float>(order[k]) : FLT_MAX;
+    reset_stats();
+    return float(k) / n;
+}
+
+CascadeStats CascadeClassifier::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    return stats_;
+}
+
+void CascadeClassifier::reset_stats()
+{
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_ = CascadeStats();
+}
+
+void CascadeClassifier::write_stages(cv::FileStorage &fs, ModelFileWriter *out) const
+{
+    CV_Assert(isTrained());
+    fs << "fsiv_cascade_threshold" << threshold_;
+    const std::pair<const char *, cv::Ptr<cv::ml::StatModel>> stages[] = {
+        {"fsiv_cascade_first", first_}, {"fsiv_cascade_second", second_}};
+    for (const auto &stage : stages)
+    {
+        // Only the second stage is mapped, so the sections of both stages
+        // can not collide when they have the same type.
+        const MappableModel *mappable = dynamic_cast<const MappableModel *>(stage.second.get());
+        const bool mapped = out != nullptr && mappable != nullptr &&
+                            stage.second == second_;
+        fs << stage.first << "{";
+        fs << "fsiv_classifier_type" << get_classifier_type(stage.second);
+        fs << "fsiv_mapped" << int(mapped);
+        fs << "fsiv_model" << "{";
+        if (mapped)
+            mappable->write_mapped(fs, *out);
+        else
+            stage.second->write(fs);
+        fs << "}";
+        fs << "}";
+    }
+}
+
+void CascadeClassifier::read_stages(const cv::FileNode &fn, const ModelFileReader *in)
+{
+    auto threshold_node = fn["fsiv_cascade_threshold"];
+    auto first_node = fn["fsiv_cascade_first"];
+    auto second_node = fn["fsiv_cascade_second"];
+    if (threshold_node.empty() || first_node.empty() || second_node.empty())
+        throw std::runtime_error("Could not load the 'fsiv_cascade_threshold', "
+                                 "'fsiv_cascade_first' and 'fsiv_cascade_second' "
+                                 "labels from file.");
+    cv::Ptr<cv::ml::StatModel> stages[2];
+    const cv::FileNode nodes[2] = {first_node, second_node};
+    for (int s = 0; s < 2; ++s)
+    {
+        stages[s] = create_empty_classifier(int(nodes[s]["fsiv_classifier_type"]));
+        const cv::FileNode model_node = nodes[s]["fsiv_model"];
+        MappableModel *mappable = dynamic_cast<MappableModel *>(stages[s].get());
+        if (int(nodes[s]["fsiv_mapped"]) != 0)
+        {
+            if (in == nullptr || mappable == nullptr)
+                throw std::runtime_error("Could not load a mapped cascade stage.");
+            mappable->read_mapped(model_node, *in);
+        }
+        else
+            stages[s]->read(model_node);
+        CV_Assert(stages[s]->isTrained());
+    }
+    // Checks the stages as when creating it.
+    create(stages[0], stages[1]);
+    first_ = stages[0];
+    second_ = stages[1];
+    threshold_ = float(threshold_node);
+    reset_stats();
+}
+
+void CascadeClassifier::write(cv::FileStorage &fs) const
+{
+    write_stages(fs, nullptr);
+}
+
+void CascadeClassifier::read(const cv::FileNode &fn)
+{
+    read_stages(fn, nullptr);
+}
+
+void CascadeClassifier::write_mapped(cv::FileStorage &fs, ModelFileWriter &out) const
+{
+    write_stages(fs, &out);
+}
+
+void CascadeClassifier::read_mapped(const cv::FileNode &fn, const ModelFileReader &in)
+{
+    read_stages(fn, &in);
+}
+
+void 
+fsiv_save_classifier_model(cv::Ptr<cv::ml::StatModel>& clf,
+    const std::string& model_fname)
+{
+    clf->save(model_fname);
+    const int id = get_classifier_type(clf);
     cv::FileStorage f (model_fname, cv::FileStorage::APPEND);
     if (!f.isOpened())
         throw std::runtime_error("Error: could append classifier type to "+
@@ -102,6 +763,45 @@ fsiv_save_classifier_model(cv::Ptr<cv::ml::StatModel>& clf,
     f << "fsiv_classifier_type" << id;
 }
 
+void
+fsiv_save_classifier_model(cv::Ptr<cv::ml::StatModel>& clf,
+    ModelFileWriter& out)
+{
+    out.metadata() << "fsiv_classifier_type" << get_classifier_type(clf);
+
+    // Nested as cv::Algorithm::save() does, so the cv::ml models read it
+    // back with their read().
+    cv::FileStorage fs(".yml", cv::FileStorage::WRITE_BASE64 | cv::FileStorage::MEMORY);
+    fs << clf->getDefaultName() << "{";
+    const MappableModel *mappable = dynamic_cast<const MappableModel*>(clf.get());
+    if (mappable != nullptr)
+        mappable->write_mapped(fs, out);
+    else
+        clf->write(fs);
+    fs << "}";
+    out.add_text("fsiv_classifier", fs.releaseAndGetString());
+}
+
+/**
+ * @brief Load a classifier from a model file.
+ */
+template <class T>
+static cv::Ptr<cv::ml::StatModel>
+load_classifier_model(const ModelFileReader& in)
+{
+    cv::FileStorage fs(in.get_text("fsiv_classifier"),
+                       cv::FileStorage::READ | cv::FileStorage::MEMORY);
+    const cv::FileNode node = fs.getFirstTopLevelNode();
+    cv::Ptr<T> clf = T::create();
+    MappableModel *mappable = dynamic_cast<MappableModel*>(clf.get());
+    if (mappable != nullptr)
+        mappable->read_mapped(node, in);
+    else
+        clf->read(node);
+    CV_Assert(clf->isTrained());
+    return clf;
+}
+
 cv::Ptr<cv::ml::StatModel>
 fsiv_load_knn_classifier_model(const std::string &model_fname)
 {
@@ -138,12 +838,86 @@ fsiv_load_rtrees_classifier_model(const std::string &model_fname)
     return clsf;
 }
 
+cv::Ptr<cv::ml::StatModel>
+fsiv_load_exact_knn_classifier_model(const std::string &model_fname)
+{
+    cv::Ptr<cv::ml::StatModel> clsf;
+
+    cv::Ptr<ExactKNN> knn = cv::Algorithm::load<ExactKNN>(model_fname);
+    clsf = knn;
+
+    CV_Assert(clsf != nullptr);
+    return clsf;
+}
+
+cv::Ptr<cv::ml::StatModel>
+fsiv_load_hnsw_knn_classifier_model(const std::string &model_fname)
+{
+    cv::Ptr<cv::ml::StatModel> clsf;
+
+    cv::Ptr<HnswKNN> knn = cv::Algorithm::load<HnswKNN>(model_fname);
+    clsf = knn;
+
+    CV_Assert(clsf != nullptr);
+    return clsf;
+}
+
+cv::Ptr<cv::ml::StatModel>
+fsiv_load_linear_sgd_classifier_model(const std::string &model_fname)
+{
+    cv::Ptr<cv::ml::StatModel> clsf;
+
+    cv::Ptr<LinearSGD> sgd = cv::Algorithm::load<LinearSGD>(model_fname);
+    clsf = sgd;
+
+    CV_Assert(clsf != nullptr);
+    return clsf;
+}
+
+cv::Ptr<cv::ml::StatModel>
+fsiv_load_ovr_svm_classifier_model(const std::string &model_fname)
+{
+    cv::Ptr<cv::ml::StatModel> clsf;
+
+    cv::Ptr<OvrSVM> svm = cv::Algorithm::load<OvrSVM>(model_fname);
+    clsf = svm;
+
+    CV_Assert(clsf != nullptr);
+    return clsf;
+}
+
+cv::Ptr<cv::ml::StatModel>
+fsiv_load_flat_forest_classifier_model(const std::string &model_fname)
+{
+    cv::Ptr<cv::ml::StatModel> clsf;
+
+    cv::Ptr<FlatForest> forest = cv::Algorithm::load<FlatForest>(model_fname);
+    clsf = forest;
+
+    CV_Assert(clsf != nullptr);
+    return clsf;
+}
+
+cv::Ptr<cv::ml::StatModel>
+fsiv_load_cascade_classifier_model(const std::string &model_fname)
+{
+    cv::Ptr<cv::ml::StatModel> clsf;
+
+    cv::Ptr<CascadeClassifier> cascade = cv::Algorithm::load<CascadeClassifier>(model_fname);
+    clsf = cascade;
+
+    CV_Assert(clsf != nullptr);
+    return clsf;
+}
+
 cv::Ptr<cv::ml::StatModel>
 fsiv_load_classifier_model(const std::string &model_fname)
 {
-    cv::FileStorage f (model_fname, cv::FileStorage::READ);
+    // nullptr for the FileStorage models.
+    std::shared_ptr<ModelFileReader> in = ModelFileReader::open(model_fname);
+    cv::FileStorage f = fsiv_open_model_metadata(model_fname);
     if (!f.isOpened())
-        std::runtime_error("Error could not read from "+model_fname);
+        throw std::runtime_error("Error could not read from "+model_fname);
     int id = -1;
     f["fsiv_classifier_type"] >> id;
     f.release();
@@ -152,14 +926,16 @@ fsiv_load_classifier_model(const std::string &model_fname)
     {
         case 0:
         {
-            clsf = fsiv_load_knn_classifier_model(model_fname);
+            clsf = in ? load_classifier_model<cv::ml::KNearest>(*in)
+                      : fsiv_load_knn_classifier_model(model_fname);
             cv::ml::KNearest * clfs_ = dynamic_cast<cv::ml::KNearest*>(clsf.get());
             std::cout << "Loaded a KNN classifier: K=" << clfs_->getDefaultK() << std::endl;
             break;
         }
         case 1:
         {
-            clsf = fsiv_load_svm_classifier_model(model_fname);
+            clsf = in ? load_classifier_model<cv::ml::SVM>(*in)
+                      : fsiv_load_svm_classifier_model(model_fname);
             cv::ml::SVM * clfs_ = dynamic_cast<cv::ml::SVM*>(clsf.get());
             std::cout << "Loaded a SVM classifier:" << 
                 " K=" << clfs_->getKernelType() << 
@@ -170,7 +946,8 @@ fsiv_load_classifier_model(const std::string &model_fname)
         }
         case 2:
         {
-            clsf = fsiv_load_rtrees_classifier_model(model_fname);
+            clsf = in ? load_classifier_model<cv::ml::RTrees>(*in)
+                      : fsiv_load_rtrees_classifier_model(model_fname);
             cv::ml::RTrees * clfs_ = dynamic_cast<cv::ml::RTrees*>(clsf.get());
             cv::TermCriteria tcrit = clfs_->getTermCriteria();
             std::cout << "Loaded a RTrees classifier:" << 
@@ -179,6 +956,74 @@ fsiv_load_classifier_model(const std::string &model_fname)
                 " E=" << tcrit.epsilon << std::endl;
             break;
         }
+        case 3:
+        {
+            clsf = in ? load_classifier_model<ExactKNN>(*in)
+                      : fsiv_load_exact_knn_classifier_model(model_fname);
+            ExactKNN * clfs_ = dynamic_cast<ExactKNN*>(clsf.get());
+            std::cout << "Loaded an exact KNN classifier: K=" << clfs_->getDefaultK() << std::endl;
+            break;
+        }
+        case 4:
+        {
+            clsf = in ? load_classifier_model<HnswKNN>(*in)
+                      : fsiv_load_hnsw_knn_classifier_model(model_fname);
+            HnswKNN * clfs_ = dynamic_cast<HnswKNN*>(clsf.get());
+            std::cout << "Loaded a HNSW KNN classifier:" <<
+                " K=" << clfs_->getDefaultK() <<
+                " M=" << clfs_->get_M() <<
+                " efC=" << clfs_->get_ef_construction() <<
+                " ef=" << clfs_->get_ef() << std::endl;
+            break;
+        }
+        case 5:
+        {
+            clsf = in ? load_classifier_model<LinearSGD>(*in)
+                      : fsiv_load_linear_sgd_classifier_model(model_fname);
+            LinearSGD * clfs_ = dynamic_cast<LinearSGD*>(clsf.get());
+            std::cout << "Loaded a linear SGD classifier:" <<
+                " classes=" << clfs_->get_n_classes() <<
+                " features=" << clfs_->getVarCount() << std::endl;
+            break;
+        }
+        case 6:
+        {
+            clsf = in ? load_classifier_model<OvrSVM>(*in)
+                      : fsiv_load_ovr_svm_classifier_model(model_fname);
+            OvrSVM * clfs_ = dynamic_cast<OvrSVM*>(clsf.get());
+            std::cout << "Loaded a one-vs-rest SVM classifier:" <<
+                " K=" << clfs_->get_kernel_type() <<
+                " C=" << clfs_->get_C() <<
+                " D=" << clfs_->get_degree() <<
+                " G=" << clfs_->get_gamma() <<
+                " SV=" << clfs_->get_n_support_vectors() << std::endl;
+            break;
+        }
+        case 7:
+        {
+            clsf = in ? load_classifier_model<FlatForest>(*in)
+                      : fsiv_load_flat_forest_classifier_model(model_fname);
+            FlatForest * clfs_ = dynamic_cast<FlatForest*>(clsf.get());
+            std::cout << "Loaded a flat forest classifier:" <<
+                " V=" << clfs_->get_active_vars() <<
+                " T=" << clfs_->get_n_trees() <<
+                " depth=" << clfs_->get_max_depth() <<
+                " leaf=" << clfs_->get_min_samples_leaf() <<
+                " bins=" << clfs_->get_n_bins() <<
+                " nodes=" << clfs_->get_n_nodes() << std::endl;
+            break;
+        }
+        case 8:
+        {
+            clsf = in ? load_classifier_model<CascadeClassifier>(*in)
+                      : fsiv_load_cascade_classifier_model(model_fname);
+            CascadeClassifier * clfs_ = dynamic_cast<CascadeClassifier*>(clsf.get());
+            std::cout << "Loaded a cascade classifier:" <<
+                " first=" << clfs_->get_first()->getDefaultName() <<
+                " second=" << clfs_->get_second()->getDefaultName() <<
+                " threshold=" << clfs_->get_threshold() << std::endl;
+            break;
+        }
         default:
         {
             throw std::runtime_error("Unknown classifier id: " + std::to_string(id));
@@ -1,16 +1,176 @@
 #pragma once
 
+#include<functional>
+#include<mutex>
+#include<vector>
 #include<opencv2/core.hpp>
 #include<opencv2/ml.hpp>
+#include "feature_precision.hpp"
+#include "model_file.hpp"
 
+/**
+ * @brief Interface for classifiers that can be trained with a stream of
+ * batches, so the whole training set never needs to be in memory.
+ *
+ * A classifier implementing it must also be a cv::ml::StatModel.
+ */
+class BatchTrainable
+{
+public:
+    virtual ~BatchTrainable() {}
+
+    /**
+     * @brief Get the number of passes over the batches stream.
+     */
+    virtual int get_epochs() const { return 1; }
+
+    /**
+     * @brief Called before the first batch of each epoch.
+     * @param epoch is the epoch number [0, get_epochs()).
+     */
+    virtual void start_epoch(int epoch) {}
+
+    /**
+     * @brief Update the model with a batch.
+     * @param X are the batch samples (one row by sample).
+     * @param y are the batch labels.
+     * @pre y.type()==CV_32SC1
+     */
+    virtual void train_batch(const cv::Mat &X, const cv::Mat &y) = 0;
+
+    /**
+     * @brief Called after the last epoch.
+     */
+    virtual void finish_training() {}
+};
+
+/**
+ * @brief Interface for classifiers that use the features in the format of
+ * a FeatureQuantizer, without decoding the whole matrix.
+ *
+ * A classifier implementing it must also be a cv::ml::StatModel.
+ */
+class EncodedFeaturesModel
+{
+public:
+    virtual ~EncodedFeaturesModel() {}
+
+    /**
+     * @brief Train the model.
+     * @param X are the encoded samples (one row by sample).
+     * @param y are the labels.
+     * @param quantizer is the format of X.
+     * @pre X.type()==quantizer.get_type()
+     * @pre y.type()==CV_32SC1
+     */
+    virtual void train_encoded(const cv::Mat &X, const cv::Mat &y,
+                               const FeatureQuantizer &quantizer) = 0;
+
+    /**
+     * @brief Predict labels.
+     * @param X are the encoded samples (one row by sample).
+     * @param quantizer is the format of X.
+     * @param labels are the predicted labels (CV_32SC1, X.rows x 1).
+     */
+    virtual void predict_encoded(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                 cv::Mat &labels) const = 0;
+};
+
+/**
+ * @brief Interface for classifiers that give a confidence margin with each
+ * prediction: the gap between the scores of the best and the second best
+ * classes (larger is more confident).
+ *
+ * A classifier implementing it must also be a cv::ml::StatModel.
+ */
+class MarginModel
+{
+public:
+    virtual ~MarginModel() {}
+
+    /**
+     * @brief Predict labels and their margins.
+     * @param X are the encoded samples (one row by sample).
+     * @param quantizer is the format of X.
+     * @param labels are the predicted labels (CV_32SC1, X.rows x 1).
+     * @param margins are the margins (CV_32FC1, X.rows x 1).
+     */
+    virtual void predict_margins(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                 cv::Mat &labels, cv::Mat &margins) const = 0;
+
+    /**
+     * @brief Predict the scores of all the classes (larger is better).
+     * @param X are the encoded samples (one row by sample).
+     * @param quantizer is the format of X.
+     * @param scores are the scores (CV_32FC1, X.rows x classes).
+     */
+    virtual void predict_scores(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                cv::Mat &scores) const = 0;
+};
 
 cv::Ptr<cv::ml::StatModel> fsiv_create_knn_classifier(int K);
 
+/**
+ * @brief Create the in-house exact K-NN classifier.
+ *
+ * @param K is the number of neighbours.
+ * @return the created classifier.
+ * @see ExactKNN
+ */
+cv::Ptr<cv::ml::StatModel> fsiv_create_exact_knn_classifier(int K);
+
+/**
+ * @brief Create the approximate K-NN classifier with a HNSW index.
+ *
+ * @param K is the number of neighbours.
+ * @param M is the number of links by node and layer.
+ * @param ef_construction is the beam size used to build the graph.
+ * @param ef is the beam size used to predict.
+ * @return the created classifier.
+ * @see HnswKNN
+ */
+cv::Ptr<cv::ml::StatModel> fsiv_create_hnsw_knn_classifier(int K, int M,
+                                                           int ef_construction,
+                                                           int ef);
+
+
+/**
+ * @brief Create a linear softmax classifier trained with mini-batch SGD.
+ *
+ * @param epochs is the number of passes over the train samples.
+ * @param learning_rate is the AdaGrad base learning rate.
+ * @param batch_size is the mini-batch size.
+ * @param lambda is the L2 regularization weight.
+ * @return the created classifier.
+ * @see LinearSGD
+ */
+cv::Ptr<cv::ml::StatModel> fsiv_create_linear_sgd_classifier(int epochs,
+                                                             float learning_rate,
+                                                             int batch_size,
+                                                             float lambda);
 
 cv::Ptr<cv::ml::StatModel> fsiv_create_svm_classifier(int Kernel,
                                                       float C,
                                                       float degree,
                                                       float gamma);
+
+/**
+ * @brief Create a one-vs-rest SVM classifier trained in parallel.
+ *
+ * @param Kernel is the kernel type (cv::ml::SVM::KernelTypes).
+ * @param C is the penalty parameter.
+ * @param degree is the degree of the polynomial kernel.
+ * @param gamma is the gamma of the kernel.
+ * @param cache_mb is the memory budget of the shared kernel cache in Mb.
+ * @return the created classifier.
+ * @see OvrSVM
+ */
+cv::Ptr<cv::ml::StatModel> fsiv_create_ovr_svm_classifier(int Kernel,
+                                                          float C,
+                                                          float degree,
+                                                          float gamma,
+                                                          int cache_mb);
+
 /**
  * @brief Create a RTree classifier.
  * 
@@ -23,6 +183,159 @@ cv::Ptr<cv::ml::StatModel> fsiv_create_rtrees_classifier(int V,
                                                          int T,
                                                          float E);
 
+/**
+ * @brief Create a random forest classifier grown in parallel with binned
+ * features and a flat nodes layout.
+ *
+ * @param V specifies the number of features tried per node (0 means
+ * sqrt(num. of features)).
+ * @param T specifies the number of trees.
+ * @param max_depth is the max depth of a tree (0 means no limit).
+ * @param min_samples_leaf is the min number of samples of a leaf.
+ * @param n_bins is the max number of bins by feature (2..256).
+ * @return the created classifier.
+ * @see FlatForest
+ */
+cv::Ptr<cv::ml::StatModel> fsiv_create_flat_forest_classifier(int V,
+                                                              int T,
+                                                              int max_depth,
+                                                              int min_samples_leaf,
+                                                              int n_bins);
+
+/**
+ * @brief Timing counters of the predictions of a CascadeClassifier.
+ */
+struct CascadeStats
+{
+    long long n_samples = 0;    // predicted samples.
+    long long n_escalated = 0;  // samples sent to the second stage.
+    double first_seconds = 0.0; // time spent in the first stage.
+    double second_seconds = 0.0;// time spent in the second stage.
+};
+
+/**
+ * @brief Two stages classifier cascade gated by the confidence of the
+ * first stage.
+ *
+ * A cheap first stage (a MarginModel, e.g. the linear SGD or a small flat
+ * forest) labels all the samples, and only the ones whose margin is below
+ * a threshold are labelled again by the expensive second stage, so the
+ * mean cost by sample approaches the one of the first stage when most of
+ * the samples are easy.
+ *
+ * The threshold is calibrated on a validation split (see calibrate()).
+ * Until then all the samples are escalated.
+ */
+class CascadeClassifier : public cv::ml::StatModel, public EncodedFeaturesModel,
+                          public MappableModel
+{
+public:
+    CascadeClassifier();
+
+    /**
+     * @brief Create an empty cascade.
+     *
+     * Needed by cv::Algorithm::load<CascadeClassifier>().
+     */
+    static cv::Ptr<CascadeClassifier> create();
+
+    /**
+     * @brief Create a cascade.
+     * @param first is the first stage.
+     * @param second is the second stage.
+     * @throw std::runtime_error if the first stage is not a MarginModel or
+     * the second stage is a cascade.
+     */
+    static cv::Ptr<CascadeClassifier> create(const cv::Ptr<cv::ml::StatModel> &first,
+                                             const cv::Ptr<cv::ml::StatModel> &second);
+
+    cv::Ptr<cv::ml::StatModel> get_first() const;
+    cv::Ptr<cv::ml::StatModel> get_second() const;
+
+    /**
+     * @brief Get the margin threshold (samples with a lower margin are
+     * escalated).
+     */
+    float get_threshold() const;
+    void set_threshold(float threshold);
+
+    using cv::ml::StatModel::train;
+    virtual bool train(const cv::Ptr<cv::ml::TrainData> &data, int flags = 0) override;
+    virtual float predict(cv::InputArray samples, cv::OutputArray results = cv::noArray(),
+                          int flags = 0) const override;
+    virtual int getVarCount() const override;
+    virtual bool isTrained() const override;
+    virtual bool isClassifier() const override;
+    virtual void clear() override;
+    virtual void write(cv::FileStorage &fs) const override;
+    virtual void read(const cv::FileNode &fn) override;
+    virtual std::string getDefaultName() const override;
+    virtual void write_mapped(cv::FileStorage &fs, ModelFileWriter &out) const override;
+    virtual void read_mapped(const cv::FileNode &fn, const ModelFileReader &in) override;
+    virtual void train_encoded(const cv::Mat &X, const cv::Mat &y,
+                               const FeatureQuantizer &quantizer) override;
+    virtual void predict_encoded(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                 cv::Mat &labels) const override;
+
+    /**
+     * @brief Predict all the samples with both stages.
+     *
+     * Used to calibrate the threshold. It does not update the stats.
+     * @param X are the encoded samples.
+     * @param quantizer is the format of X.
+     * @param first_labels are the labels of the first stage.
+     * @param margins are the margins of the first stage.
+     * @param second_labels are the labels of the second stage.
+     */
+    void predict_stages(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                        cv::Mat &first_labels, cv::Mat &margins,
+                        cv::Mat &second_labels) const;
+
+    /**
+     * @brief Set the smallest threshold whose cascade accuracy is at most
+     * max_drop below the one of the second stage alone.
+     *
+     * @param margins are the first stage margins of the validation samples.
+     * @param first_labels are the first stage labels.
+     * @param second_labels are the second stage labels.
+     * @param y are the true labels.
+     * @param max_drop is the allowed accuracy drop [0, 1].
+     * @return the fraction of the validation samples escalated with the
+     * chosen threshold.
+     */
+    float calibrate(const cv::Mat &margins, const cv::Mat &first_labels,
+                    const cv::Mat &second_labels, const cv::Mat &y, float max_drop);
+
+    /**
+     * @brief Get the counters of the predictions done since the last reset.
+     */
+    CascadeStats get_stats() const;
+    void reset_stats();
+
+protected:
+    void write_stages(cv::FileStorage &fs, ModelFileWriter *out) const;
+    void read_stages(const cv::FileNode &fn, const ModelFileReader *in);
+
+    cv::Ptr<cv::ml::StatModel> first_;
+    cv::Ptr<cv::ml::StatModel> second_;
+    float threshold_;
+    mutable std::mutex stats_mutex_;
+    mutable CascadeStats stats_;
+};
+
+/**
+ * @brief Create a confidence gated cascade of two classifiers.
+ *
+ * @param first is the cheap first stage. It must give margins (linear SGD,
+ * one-vs-rest SVM or flat forest).
+ * @param second is the expensive second stage.
+ * @return the created classifier.
+ * @see CascadeClassifier
+ */
+cv::Ptr<cv::ml::StatModel> fsiv_create_cascade_classifier(
+    const cv::Ptr<cv::ml::StatModel> &first,
+    const cv::Ptr<cv::ml::StatModel> &second);
+
 /**
  * @brief Train a classifier.
  * 
@@ -35,6 +348,88 @@ cv::Ptr<cv::ml::StatModel> fsiv_create_rtrees_classifier(int V,
 void fsiv_train_classifier(cv::Ptr<cv::ml::StatModel>& clf,
     cv::Mat const& X, cv::Mat const& y);
 
+/**
+ * @brief Train a classifier with features stored in a reduced precision.
+ *
+ * The OpenCV classifiers need CV_32F samples, so the features are decoded
+ * for them.
+ *
+ * @param clf is the classifier to be trained.
+ * @param X are the encoded samples.
+ * @param y are the labels.
+ * @param quantizer is the format of X.
+ * @pre y.type()==CV_32SC1
+ */
+void fsiv_train_classifier(cv::Ptr<cv::ml::StatModel>& clf,
+    cv::Mat const& X, cv::Mat const& y, const FeatureQuantizer& quantizer);
+
+/**
+ * @brief Get the batch training interface of a classifier.
+ *
+ * @param clf is the classifier.
+ * @return the interface or nullptr if the classifier can not be trained
+ * with batches.
+ */
+BatchTrainable *fsiv_get_batch_trainable(cv::Ptr<cv::ml::StatModel> &clf);
+
+/**
+ * @brief Train a classifier with a stream of batches.
+ *
+ * @param clf is the classifier to be trained.
+ * @param next_batch gets the next batch (samples, labels). It returns false
+ * when the stream ends.
+ * @param rewind restarts the stream from the first batch.
+ * @pre fsiv_get_batch_trainable(clf) != nullptr
+ */
+void fsiv_train_classifier_batches(
+    cv::Ptr<cv::ml::StatModel> &clf,
+    const std::function<bool(cv::Mat &, cv::Mat &)> &next_batch,
+    const std::function<void()> &rewind);
+
+/**
+ * @brief Define the methods to condense the train samples of a K-NN.
+ */
+typedef enum {
+    FSIV_PROTOTYPES_NONE = 0,   // keep all the train samples.
+    FSIV_PROTOTYPES_KMEANS = 1, // k-means centers of each class.
+    FSIV_PROTOTYPES_CNN = 2,    // condensed nearest neighbour selection.
+} PROTOTYPES_METHOD;
+
+/**
+ * @brief Is the classifier a K-NN (it keeps the train samples)?
+ */
+bool fsiv_is_knn_classifier(const cv::Ptr<cv::ml::StatModel> &clf);
+
+/**
+ * @brief Condense the train samples into a smaller prototypes set.
+ *
+ * With FSIV_PROTOTYPES_KMEANS the prototypes of each class are the centers
+ * of a k-means of its samples, and the classes are clustered in parallel.
+ *
+ * With FSIV_PROTOTYPES_CNN the prototypes are the train samples chosen by
+ * a condensed nearest neighbour: starting with a random sample by class,
+ * each pass classifies all the samples with the 1-NN of the current
+ * prototypes (in parallel) and adds, by class and in random order, some
+ * of the misclassified ones, until all are well classified or the class
+ * budget is used.
+ *
+ * @param X are the train samples (one row by sample).
+ * @param y are the labels (CV_32SC1).
+ * @param quantizer is the format of X. The prototypes have the same one.
+ * @param method is the condensation method.
+ * @param n_prototypes are the prototypes by class: one value for all the
+ * classes or one value by label. 0 keeps all the samples of the class
+ * (k-means) or does not limit the selected ones (CNN).
+ * @param[out] P are the prototypes.
+ * @param[out] P_labels are the prototypes labels (CV_32SC1).
+ * @throw std::runtime_error if there are not enough prototype counts.
+ */
+void fsiv_condense_prototypes(const cv::Mat &X, const cv::Mat &y,
+                              const FeatureQuantizer &quantizer,
+                              PROTOTYPES_METHOD method,
+                              const std::vector<int> &n_prototypes,
+                              cv::Mat &P, cv::Mat &P_labels);
+
 /**
  * @brief Predict labels using a trained classifier.
  * 
@@ -47,6 +442,21 @@ void fsiv_train_classifier(cv::Ptr<cv::ml::StatModel>& clf,
 cv::Mat fsiv_predict_labels(cv::Ptr<cv::ml::StatModel>& clf, cv::Mat const& X);
 
 
+/**
+ * @brief Predict labels of features stored in a reduced precision.
+ *
+ * The samples are decoded by blocks, so only a block is in CV_32F.
+ *
+ * @param clf is the classifier.
+ * @param X are the encoded samples.
+ * @param quantizer is the format of X.
+ * @pre clf is trained.
+ * @post ret_v.rows == X.rows
+ * @post ret_v.type()==CV_32SC1
+ */
+cv::Mat fsiv_predict_labels(cv::Ptr<cv::ml::StatModel>& clf, cv::Mat const& X,
+                            const FeatureQuantizer& quantizer);
+
 /**
  * @brief Save the model of a trained classifier to file.
  * 
@@ -56,6 +466,19 @@ cv::Mat fsiv_predict_labels(cv::Ptr<cv::ml::StatModel>& clf, cv::Mat const& X);
 void fsiv_save_classifier_model(cv::Ptr<cv::ml::StatModel>& clf,
     const std::string& model_fname);
 
+/**
+ * @brief Save the model of a trained classifier into a model file.
+ *
+ * The classifier type is written into the metadata and the classifier
+ * into the 'fsiv_classifier' section. The big matrices of the
+ * MappableModel classifiers are sections of their own.
+ *
+ * @param clf the classifier.
+ * @param out the model file.
+ */
+void fsiv_save_classifier_model(cv::Ptr<cv::ml::StatModel>& clf,
+    ModelFileWriter& out);
+
 
 /**
  * @brief Load a knn classifier's model from file.
@@ -87,8 +510,71 @@ cv::Ptr<cv::ml::StatModel> fsiv_load_svm_classifier_model(
 cv::Ptr<cv::ml::StatModel> fsiv_load_rtrees_classifier_model(
     const std::string &model_fname);
 
+/**
+ * @brief Load an exact knn classifier's model from file.
+ *
+ * @param model_fname is the filename.
+ * @return an instance of the classifier.
+ * @post ret_v != nullptr
+ */
+cv::Ptr<cv::ml::StatModel> fsiv_load_exact_knn_classifier_model(
+    const std::string &model_fname);
+
+/**
+ * @brief Load a HNSW knn classifier's model from file.
+ *
+ * @param model_fname is the filename.
+ * @return an instance of the classifier.
+ * @post ret_v != nullptr
+ */
+cv::Ptr<cv::ml::StatModel> fsiv_load_hnsw_knn_classifier_model(
+    const std::string &model_fname);
+
+/**
+ * @brief Load a linear SGD classifier's model from file.
+ *
+ * @param model_fname is the filename.
+ * @return an instance of the classifier.
+ * @post ret_v != nullptr
+ */
+cv::Ptr<cv::ml::StatModel> fsiv_load_linear_sgd_classifier_model(
+    const std::string &model_fname);
+
+/**
+ * @brief Load a one-vs-rest SVM classifier's model from file.
+ *
+ * @param model_fname is the filename.
+ * @return an instance of the classifier.
+ * @post ret_v != nullptr
+ */
+cv::Ptr<cv::ml::StatModel> fsiv_load_ovr_svm_classifier_model(
+    const std::string &model_fname);
+
+/**
+ * @brief Load a flat forest classifier's model from file.
+ *
+ * @param model_fname is the filename.
+ * @return an instance of the classifier.
+ * @post ret_v != nullptr
+ */
+cv::Ptr<cv::ml::StatModel> fsiv_load_flat_forest_classifier_model(
+    const std::string &model_fname);
+
+/**
+ * @brief Load a cascade classifier's model from file.
+ *
+ * @param model_fname is the filename.
+ * @return an instance of the classifier.
+ * @post ret_v != nullptr
+ */
+cv::Ptr<cv::ml::StatModel> fsiv_load_cascade_classifier_model(
+    const std::string &model_fname);
+
 /**
  * @brief Load a classifier model from file.
+ *
+ * Both model files (see ModelFileWriter) and the FileStorage models of
+ * older versions are loaded.
  * 
  * @param model_fname is the filename. 
  * @return an instance of the classifier.
@@ -7,7 +7,21 @@
 #include "classifiers.hpp"
 #include "dataset.hpp"
 #include "features.hpp"
+#include "feature_store.hpp"
+#include "model_file.hpp"
 #include "metrics.hpp"
+#include "profiling.hpp"
 #include "gray_levels_features.hpp"
 
 // Add your feature extractor headers here.
+#include "lbp_features.hpp"
+#include "pca_gray_levels_features.hpp"
+#include "haralick_features.hpp"
+#include "pipeline_extractor.hpp"
+#include "rff_features.hpp"
+#include "feature_precision.hpp"
+#include "exact_knn.hpp"
+#include "hnsw_knn.hpp"
+#include "linear_sgd.hpp"
+#include "ovr_svm.hpp"
+#include "flat_forest.hpp"
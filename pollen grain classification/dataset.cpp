@@ -1,50 +1,52 @@
 #include <iostream>
 #include <exception>
 #include <fstream>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <sstream>
 #include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 
 #include "dataset.hpp"
-
-static cv::Mat
-to_Mat(std::vector<std::vector<std::uint8_t>> const &images)
+#include "binary_io.hpp"
+
+/**
+ * @brief Header of the packed dataset cache file.
+ *
+ * The header is followed by the labels vector (int32) and, aligned to a
+ * page boundary, the images (one 128x128 uint8 row by image).
+ */
+struct PackedDatasetHeader
 {
-    cv::Mat mat = cv::Mat(images.size(), 16384 /*128x128*/, CV_8UC1);
-    for (size_t i = 0; i < images.size(); i++)
-        std::copy(images[i].begin(), images[i].end(), mat.row(i).begin<uint8_t>());
-    return mat;
-}
-
-static cv::Mat
-to_Mat(std::vector<std::uint8_t> const &labels)
+    char magic[8];
+    std::uint64_t fingerprint;
+    std::int32_t rows;
+    std::int32_t cols;
+    std::uint64_t labels_offset;
+    std::uint64_t images_offset;
+};
+
+static const char PACKED_DATASET_MAGIC[8] = {'F', 'S', 'I', 'V', 'D', 'S', '0', '1'};
+static const int DATASET_IMAGE_SIZE = 16384; /*128x128*/
+
+static bool
+parse_dataset_csv(const std::string &labels_csv, const std::string &folder,
+                  bool ignore_labels, std::vector<DatasetEntry> &entries)
 {
-    cv::Mat mat = cv::Mat(labels.size(), 1, CV_8UC1);
-    std::copy(labels.begin(), labels.end(), mat.begin<uint8_t>());
-    return mat;
-}
-
-void fsiv_load_dataset(std::string &folder,
-                       cv::Mat &X, cv::Mat &y, bool ignore_labels)
-{
-    // images and labels
-    std::vector<std::vector<std::uint8_t>> images;
-    std::vector<std::uint8_t> labels;
-
-    // label file
-    std::string labels_csv = folder + ".csv";
-
-    // load label file
     std::ifstream label_file(labels_csv);
+    if (!label_file.is_open())
+        return false;
 
-    if(!label_file.is_open()){
-        std::cerr<<"error: unable to open csv file"<<labels_csv<<std::endl;
-    }
     std::string line;
-
     std::getline(label_file, line);
-
-    // load images/labels line by line
     while (std::getline(label_file, line))
     {
         std::stringstream line_stream(line);
@@ -53,53 +55,378 @@ void fsiv_load_dataset(std::string &folder,
 
         if (std::getline(line_stream, image_filename, ',') && line_stream >> label)
         {
-            std::string image_path = folder + "/" + image_filename;
-            
-            // debugging
-            std::cout<< "trying to load image: "<<image_path<<std::endl;
+            DatasetEntry entry;
+            entry.path = folder + "/" + image_filename;
+            if (ignore_labels || label == "unknown")
+                entry.label = 15;
+            else
+                entry.label = fsiv_get_dataset_label_id(label);
+            entries.push_back(entry);
+        }
+    }
+    return true;
+}
 
-            cv::Mat img = cv::imread(image_path, cv::IMREAD_GRAYSCALE);
+/**
+ * @brief Compute a fingerprint of the dataset files.
+ *
+ * Any change of the csv file or in the modification time of an image
+ * changes the fingerprint.
+ */
+static std::uint64_t
+compute_dataset_fingerprint(const std::string &labels_csv,
+                            const std::vector<DatasetEntry> &entries,
+                            bool ignore_labels)
+{
+    std::uint64_t h = fsiv_hash_bytes(PACKED_DATASET_MAGIC, sizeof(PACKED_DATASET_MAGIC));
+    h = fsiv_hash_value(std::int32_t(ignore_labels), h);
+    std::int64_t mtime = 0;
+    std::uint64_t size = 0;
+    fsiv_file_stat(labels_csv, mtime, size);
+    h = fsiv_hash_value(mtime, h);
+    h = fsiv_hash_value(size, h);
+    for (auto &entry : entries)
+    {
+        mtime = -1;
+        fsiv_file_stat(entry.path, mtime, size);
+        h = fsiv_hash_string(entry.path, h);
+        h = fsiv_hash_value(mtime, h);
+    }
+    return h;
+}
 
-            //debugging
+std::uint64_t
+fsiv_compute_dataset_fingerprint(const std::string &folder, bool ignore_labels)
+{
+    const std::string labels_csv = folder + ".csv";
+    std::vector<DatasetEntry> entries;
+    parse_dataset_csv(labels_csv, folder, ignore_labels, entries);
+    return compute_dataset_fingerprint(labels_csv, entries, ignore_labels);
+}
 
-            if(img.empty()){
-                std::cerr<<"error: failed to load the image "<<image_path<<std::endl;
-                continue;
-            }else{
-                std::cout<<"successfully loaded image "<<image_path<<std::endl;
-            }
+/**
+ * @brief Keep alive the mapped cache files while the process runs.
+ *
+ * The loaded matrices do not own the mapped memory, so the mappings are
+ * never released. Loading again the same unchanged cache reuses it.
+ */
+static std::map<std::string, std::shared_ptr<MappedFile>> &
+mapped_datasets()
+{
+    static std::map<std::string, std::shared_ptr<MappedFile>> files;
+    return files;
+}
 
-            std::vector<std::uint8_t> img_vec(img.data, img.data + img.total() * img.elemSize());
-            images.push_back(img_vec);
+static std::mutex mapped_datasets_mutex;
+
+static bool
+map_packed_dataset(const std::string &cache_fname, std::uint64_t fingerprint,
+                   cv::Mat &X, cv::Mat &y)
+{
+    std::lock_guard<std::mutex> lock(mapped_datasets_mutex);
+    const std::string key = cache_fname + "#" + std::to_string(fingerprint);
+    std::shared_ptr<MappedFile> file;
+    auto it = mapped_datasets().find(key);
+    if (it != mapped_datasets().end())
+        file = it->second;
+    else
+        file = MappedFile::open(cache_fname);
+    if (file == nullptr || file->size() < sizeof(PackedDatasetHeader))
+        return false;
+
+    PackedDatasetHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, PACKED_DATASET_MAGIC, sizeof(header.magic)) != 0 ||
+        header.fingerprint != fingerprint ||
+        header.rows < 0 || header.cols != DATASET_IMAGE_SIZE ||
+        header.labels_offset + std::uint64_t(header.rows) * sizeof(std::int32_t) > file->size() ||
+        header.images_offset + std::uint64_t(header.rows) * header.cols > file->size())
+        return false;
+
+    mapped_datasets()[key] = file;
+    y = cv::Mat(header.rows, 1, CV_32SC1, file->data() + header.labels_offset);
+    X = cv::Mat(header.rows, header.cols, CV_8UC1, file->data() + header.images_offset);
+    return true;
+}
 
-            if (!ignore_labels)
+static bool
+save_packed_dataset(const std::string &cache_fname, std::uint64_t fingerprint,
+                    const cv::Mat &X, const cv::Mat &y)
+{
+    CV_Assert(X.isContinuous() && y.isContinuous());
+    PackedDatasetHeader header;
+    std::memcpy(header.magic, PACKED_DATASET_MAGIC, sizeof(header.magic));
+    header.fingerprint = fingerprint;
+    header.rows = X.rows;
+    header.cols = X.cols;
+    header.labels_offset = fsiv_align_offset(sizeof(header), 64);
+    header.images_offset = fsiv_align_offset(
+        header.labels_offset + std::uint64_t(y.rows) * sizeof(std::int32_t), 4096);
+
+    const std::string tmp_fname = fsiv_make_temp_path(cache_fname);
+    std::ofstream out(tmp_fname, std::ios::out | std::ios::binary);
+    if (!out)
+        return false;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    fsiv_write_padding(out, 64);
+    out.write(reinterpret_cast<const char *>(y.data), y.total() * y.elemSize());
+    fsiv_write_padding(out, 4096);
+    out.write(reinterpret_cast<const char *>(X.data), X.total() * X.elemSize());
+    out.close();
+    if (!out)
+    {
+        std::remove(tmp_fname.c_str());
+        return false;
+    }
+    return fsiv_replace_file(tmp_fname, cache_fname);
+}
+
+/**
+ * @brief Decode an image file straight into a dataset row.
+ *
+ * @param path is the image pathname.
+ * @param row points to the destination row (128x128 uint8).
+ * @param buffer is a scratch buffer for the file contents, reused between calls.
+ * @return true if success.
+ */
+static bool
+decode_image(const std::string &path, uchar *row, std::vector<uchar> &buffer)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!file)
+        return false;
+    const std::streamsize size = file.tellg();
+    if (size <= 0)
+        return false;
+    buffer.resize(size_t(size));
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char *>(buffer.data()), size))
+        return false;
+
+    // imdecode reuses dst when the decoded image has the same size and type,
+    // so a 128x128 gray image is written straight into the row. On failure
+    // it returns an empty Mat and leaves dst (the row) untouched.
+    cv::Mat dst(128, 128, CV_8UC1, row);
+    cv::Mat img = cv::imdecode(buffer, cv::IMREAD_GRAYSCALE, &dst);
+    if (img.empty())
+        return false;
+    if (img.data != row)
+        cv::resize(img, cv::Mat(128, 128, CV_8UC1, row), cv::Size(128, 128),
+                   0.0, 0.0, cv::INTER_AREA);
+    return true;
+}
+
+/**
+ * @brief Decode the dataset images in parallel.
+ *
+ * X and y are allocated once with the final size and the workers decode
+ * each image into its own row. Images that could not be decoded are
+ * dropped at the end, keeping the csv order.
+ *
+ * @return the number of decoded images.
+ */
+static int
+decode_dataset_images(const DatasetEntry *entries, int n,
+                      cv::Mat &X, cv::Mat &y, int verbose)
+{
+    X.create(n, DATASET_IMAGE_SIZE, CV_8UC1);
+    y.create(n, 1, CV_32SC1);
+    std::vector<uchar> loaded(n, 0);
+    std::mutex log_mutex;
+
+    cv::parallel_for_(cv::Range(0, n), [&](const cv::Range &range)
+    {
+        std::vector<uchar> buffer;
+        for (int i = range.start; i < range.end; ++i)
+        {
+            loaded[i] = decode_image(entries[i].path, X.ptr(i), buffer);
+            y.at<std::int32_t>(i) = entries[i].label;
+            if (!loaded[i])
             {
-                
-                   if(label == "unknown"){
-                    labels.push_back(15);
-                }else{
-                    labels.push_back(fsiv_get_dataset_label_id(label));                    
-                }
-                
-             }
-            else
+                std::lock_guard<std::mutex> lock(log_mutex);
+                std::cerr << "error: failed to load the image " << entries[i].path << std::endl;
+            }
+            else if (verbose > 1)
             {
-                labels.push_back(15);                
-                }
-        
+                std::lock_guard<std::mutex> lock(log_mutex);
+                std::cout << "successfully loaded image " << entries[i].path << std::endl;
+            }
+        }
+    }, std::max(1, cv::getNumThreads()) * 4.0);
+
+    int n_loaded = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        if (!loaded[i])
+            continue;
+        if (n_loaded != i)
+        {
+            std::memcpy(X.ptr(n_loaded), X.ptr(i), DATASET_IMAGE_SIZE);
+            y.at<std::int32_t>(n_loaded) = y.at<std::int32_t>(i);
         }
+        ++n_loaded;
+    }
+    if (n_loaded != n)
+    {
+        X = X.rowRange(0, n_loaded);
+        y = y.rowRange(0, n_loaded);
     }
+    return n_loaded;
+}
+
+void fsiv_load_dataset(std::string &folder,
+                       cv::Mat &X, cv::Mat &y, bool ignore_labels,
+                       int verbose)
+{
+    // label file
+    std::string labels_csv = folder + ".csv";
+    std::string cache_fname = folder + ".cache";
+
+    std::vector<DatasetEntry> entries;
+    if (!parse_dataset_csv(labels_csv, folder, ignore_labels, entries))
+        std::cerr << "error: unable to open csv file" << labels_csv << std::endl;
 
-    label_file.close();
+    const std::uint64_t fingerprint =
+        compute_dataset_fingerprint(labels_csv, entries, ignore_labels);
 
-    X = to_Mat(images);
-    y = cv::Mat_<std::int32_t>(to_Mat(labels));
+    if (!entries.empty() && map_packed_dataset(cache_fname, fingerprint, X, y))
+    {
+        std::cout << "Loaded " << X.rows << " images from cache '"
+                  << cache_fname << "'." << std::endl;
+    }
+    else
+    {
+        const int n_loaded = decode_dataset_images(entries.data(), int(entries.size()),
+                                                   X, y, verbose);
+        if (verbose > 0)
+            std::cout << "Decoded " << n_loaded << " of " << entries.size()
+                      << " images." << std::endl;
+
+        if (!entries.empty() && !save_packed_dataset(cache_fname, fingerprint, X, y))
+            std::cerr << "warning: could not write the dataset cache '"
+                      << cache_fname << "'." << std::endl;
+    }
 
     CV_Assert(X.rows == y.rows);
     CV_Assert(X.type() == CV_8UC1);
     CV_Assert(y.type() == CV_32SC1);
 }
 
+DatasetReader::DatasetReader(const std::string &folder, int batch_size,
+                             bool ignore_labels, int prefetch, int verbose)
+    : batch_size_(batch_size), prefetch_(std::max(1, prefetch)),
+      verbose_(verbose), cursor_(0), stop_(false), done_(false)
+{
+    CV_Assert(batch_size > 0);
+    const std::string labels_csv = folder + ".csv";
+    if (!parse_dataset_csv(labels_csv, folder, ignore_labels, entries_))
+        throw std::runtime_error("Error: unable to open csv file " + labels_csv);
+
+    const std::uint64_t fingerprint =
+        compute_dataset_fingerprint(labels_csv, entries_, ignore_labels);
+    if (!entries_.empty() &&
+        map_packed_dataset(folder + ".cache", fingerprint, mapped_X_, mapped_y_) &&
+        verbose_ > 0)
+        std::cout << "Reading " << mapped_X_.rows << " images from cache '"
+                  << folder << ".cache'." << std::endl;
+    rewind();
+}
+
+DatasetReader::~DatasetReader()
+{
+    stop();
+}
+
+int DatasetReader::size() const
+{
+    return mapped_X_.empty() ? int(entries_.size()) : mapped_X_.rows;
+}
+
+int DatasetReader::batch_size() const
+{
+    return batch_size_;
+}
+
+void DatasetReader::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    if (worker_.joinable())
+        worker_.join();
+}
+
+void DatasetReader::rewind()
+{
+    stop();
+    cursor_ = 0;
+    queue_.clear();
+    error_ = nullptr;
+    stop_ = false;
+    done_ = false;
+    if (mapped_X_.empty())
+        worker_ = std::thread(&DatasetReader::produce, this);
+}
+
+void DatasetReader::produce()
+{
+    try
+    {
+        for (size_t begin = 0; begin < entries_.size(); begin += batch_size_)
+        {
+            const size_t end = std::min(entries_.size(), begin + batch_size_);
+            cv::Mat X, y;
+            decode_dataset_images(entries_.data() + begin, int(end - begin),
+                                  X, y, verbose_);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this]
+                       { return stop_ || int(queue_.size()) < prefetch_; });
+            if (stop_)
+                return;
+            queue_.emplace_back(X, y);
+            cond_.notify_all();
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        error_ = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+    cond_.notify_all();
+}
+
+bool DatasetReader::next(cv::Mat &X, cv::Mat &y)
+{
+    if (!mapped_X_.empty())
+    {
+        if (cursor_ >= mapped_X_.rows)
+            return false;
+        const int end = std::min(mapped_X_.rows, cursor_ + batch_size_);
+        X = mapped_X_.rowRange(cursor_, end);
+        y = mapped_y_.rowRange(cursor_, end);
+        cursor_ = end;
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this]
+               { return !queue_.empty() || done_; });
+    if (error_)
+        std::rethrow_exception(error_);
+    if (queue_.empty())
+        return false;
+    X = queue_.front().first;
+    y = queue_.front().second;
+    queue_.pop_front();
+    cond_.notify_all();
+    return true;
+}
+
 static std::string fsiv_pollen_label_names[] = {"alnus", "betula",
                                                 "carpinus", "corylus", "cupressaceae", "fagus", "fraxinus", "picea", "pinus",
                                                 "poaceae", "populus", "quercus", "salix", "tilia", "urticaceae"};
@@ -183,21 +510,48 @@ void fsiv_subsample_dataset(const cv::Mat &X, const cv::Mat &y,
     }
 }
 
-void fsiv_save_predictions(std::string &path, cv::Mat &y){
-    std::string labels_csv = path + ".csv";
-    std::string predicted_csv = path + "_predicted.csv";
+cv::Mat
+fsiv_make_stratified_folds(const cv::Mat &y, int k)
+{
+    CV_Assert(y.type() == CV_32SC1 && k >= 2);
+    std::vector<std::vector<int>> classes;
+    for (int i = 0; i < int(y.total()); ++i)
+    {
+        const int label = y.at<int>(i);
+        CV_Assert(label >= 0);
+        if (label >= int(classes.size()))
+            classes.resize(label + 1);
+        classes[label].push_back(i);
+    }
 
-    std::ifstream label_file(labels_csv);
-    std::ofstream predicted_file(predicted_csv);
-    std::string line;
+    cv::Mat folds(int(y.total()), 1, CV_32SC1);
+    int next = 0;
+    for (auto &samples : classes)
+    {
+        cv::randShuffle(samples);
+        for (int i : samples)
+        {
+            folds.at<int>(i) = next;
+            next = (next + 1) % k;
+        }
+    }
+    return folds;
+}
 
-    std::getline(label_file, line);
-    predicted_file << line << "\n";
+PredictionsWriter::PredictionsWriter(const std::string &path)
+    : label_file_(path + ".csv"), predicted_file_(path + "_predicted.csv")
+{
+    std::string line;
+    std::getline(label_file_, line);
+    predicted_file_ << line << "\n";
+}
 
-    // load images/labels line by line
+void PredictionsWriter::write(const cv::Mat &y)
+{
+    CV_Assert(y.type() == CV_32SC1);
+    std::string line;
     int i = 0;
-    std::vector<std::int32_t> label_vector(y.begin<std::int32_t>(), y.end<std::int32_t>());
-    while (std::getline(label_file, line))
+    while (i < int(y.total()) && std::getline(label_file_, line))
     {
         std::stringstream line_stream(line);
         std::string image_filename;
@@ -205,11 +559,83 @@ void fsiv_save_predictions(std::string &path, cv::Mat &y){
 
         if (std::getline(line_stream, image_filename, ',') && line_stream >> label)
         {
-            predicted_file << image_filename << "," << fsiv_get_dataset_label_name(label_vector[i]) << "\n";
+            predicted_file_ << image_filename << "," << fsiv_get_dataset_label_name(y.at<std::int32_t>(i)) << "\n";
             i = i + 1;
         }
     }
+    predicted_file_.flush();
+}
+
+void fsiv_save_predictions(std::string &path, cv::Mat &y){
+    PredictionsWriter writer(path);
+    writer.write(y);
+}
 
-    label_file.close();
-    predicted_file.close();
+void fsiv_generate_synthetic_dataset(const std::string &folder, int n_images,
+                                     std::uint64_t seed)
+{
+    CV_Assert(n_images > 0);
+    std::error_code ec;
+    std::filesystem::create_directories(folder, ec);
+    if (ec)
+        throw std::runtime_error("Error: could not create the folder " + folder);
+
+    const int n_classes = 15;
+    std::vector<int> labels(n_images);
+    std::atomic<bool> failed(false);
+    cv::parallel_for_(cv::Range(0, n_images), [&](const cv::Range &range)
+    {
+        cv::Mat img(128, 128, CV_8UC1), texture(128, 128, CV_32FC1), noise(128, 128, CV_32FC1);
+        cv::Mat mask(128, 128, CV_8UC1);
+        char fname[32];
+        for (int i = range.start; i < range.end; ++i)
+        {
+            cv::RNG rng(seed * 1000003 + std::uint64_t(i) + 1);
+            const int c = rng.uniform(0, n_classes);
+            labels[i] = c;
+
+            // Class dependent shape and texture, with some jitter.
+            const double angle = CV_PI * c / n_classes + rng.gaussian(0.1);
+            const double freq = 0.06 + 0.025 * (c % 5) + rng.gaussian(0.004);
+            const double a = 26.0 + 2.0 * (c / 5) * 5.0 + rng.gaussian(2.0);
+            const double b = a * (0.65 + 0.05 * (c % 3)) + rng.gaussian(1.5);
+            const cv::Point center(cvRound(64.0 + rng.gaussian(4.0)),
+                                   cvRound(64.0 + rng.gaussian(4.0)));
+            const double ca = std::cos(angle), sa = std::sin(angle);
+            const double phase = rng.uniform(0.0, 2.0 * CV_PI);
+            for (int r = 0; r < 128; ++r)
+            {
+                float *t = texture.ptr<float>(r);
+                for (int col = 0; col < 128; ++col)
+                    t[col] = float(150.0 + 60.0 * std::sin(2.0 * CV_PI * freq *
+                                                          (col * ca + r * sa) + phase));
+            }
+            mask.setTo(0);
+            cv::ellipse(mask, center, cv::Size(cvRound(a), cvRound(b)),
+                        rng.uniform(0.0, 180.0), 0.0, 360.0, cv::Scalar(255), cv::FILLED);
+            cv::Mat canvas(128, 128, CV_32FC1, cv::Scalar(40.0));
+            texture.copyTo(canvas, mask);
+            rng.fill(noise, cv::RNG::NORMAL, 0.0, 12.0);
+            canvas += noise;
+            cv::GaussianBlur(canvas, canvas, cv::Size(3, 3), 0.0);
+            canvas.convertTo(img, CV_8U);
+
+            std::snprintf(fname, sizeof(fname), "%06d.png", i);
+            if (!cv::imwrite(folder + "/" + fname, img))
+                failed = true;
+        }
+    });
+    if (failed)
+        throw std::runtime_error("Error: could not write the images of " + folder);
+
+    std::ofstream csv(folder + ".csv");
+    csv << "sample,species\n";
+    char fname[32];
+    for (int i = 0; i < n_images; ++i)
+    {
+        std::snprintf(fname, sizeof(fname), "%06d.png", i);
+        csv << fname << "," << fsiv_get_dataset_label_name(labels[i]) << "\n";
+    }
+    if (!csv)
+        throw std::runtime_error("Error: could not write " + folder + ".csv");
 }
@@ -1,19 +1,161 @@
 #pragma once
 
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 #include <opencv2/core.hpp>
 #include <opencv2/ml.hpp>
 
+/**
+ * @brief An image listed in a dataset csv file.
+ */
+struct DatasetEntry
+{
+    std::string path;   // image pathname.
+    std::int32_t label; // class label (15 means unknown).
+};
+
 /**
  * @brief Load the dataset into memory.
  *
+ * The csv file is parsed first and then the images are decoded in parallel
+ * straight into the rows of X. The first load also writes a packed cache file
+ * "<folder>.cache". Later loads map that file and X is a view over the
+ * mapped memory. The cache is rebuilt when the csv file or the
+ * modification time of any image changes.
+ *
  * @param folder the pathname where the dataset files were downloaded.
  * @param X are the images (on row by image)
  * @param y are the labels.
+ * @param ignore_labels if true, all the labels are set to 15 (unknown).
+ * @param verbose is the verbose level. Use >1 to log each loaded image.
  * @post X.rows==y.rows
  * @post X.type()=CV_8UC1
  * @post y.type()=CV_32SC1*/
-void fsiv_load_dataset(std::string &folder, cv::Mat &X, cv::Mat &y, bool ignore_labels = false);
+void fsiv_load_dataset(std::string &folder, cv::Mat &X, cv::Mat &y, bool ignore_labels = false,
+                       int verbose = 0);
+
+/**
+ * @brief Compute a fingerprint of the dataset files.
+ *
+ * It changes when the csv file or the modification time of any listed
+ * image changes. Images are not decoded, so it is cheap to compute.
+ *
+ * @param folder the pathname where the dataset files were downloaded.
+ * @param ignore_labels must be the same value used to load the dataset.
+ * @return the fingerprint.
+ */
+std::uint64_t fsiv_compute_dataset_fingerprint(const std::string &folder,
+                                               bool ignore_labels = false);
+
+/**
+ * @brief Read a dataset in fixed size batches.
+ *
+ * A background thread decodes the next batches while the current one is
+ * being processed, so the memory used depends on the batch size and the
+ * prefetch depth instead of the dataset size. If a valid packed cache
+ * exists (see fsiv_load_dataset) the batches are views over the mapped file.
+ *
+ * Images that could not be decoded are dropped, so a batch may have less
+ * rows than the batch size.
+ */
+class DatasetReader
+{
+public:
+    /**
+     * @brief Open a dataset.
+     *
+     * @param folder the pathname where the dataset files were downloaded.
+     * @param batch_size is the number of images by batch.
+     * @param ignore_labels if true, all the labels are set to 15 (unknown).
+     * @param prefetch is the number of batches decoded ahead.
+     * @param verbose is the verbose level.
+     * @pre batch_size>0
+     */
+    DatasetReader(const std::string &folder, int batch_size,
+                  bool ignore_labels = false, int prefetch = 2, int verbose = 0);
+    ~DatasetReader();
+
+    /**
+     * @brief Get the next batch.
+     *
+     * @param X are the batch images (one row by image).
+     * @param y are the batch labels.
+     * @return false if there are no more batches.
+     * @post X.type()==CV_8UC1 && y.type()==CV_32SC1
+     */
+    bool next(cv::Mat &X, cv::Mat &y);
+
+    /**
+     * @brief Start again from the first batch.
+     */
+    void rewind();
+
+    /**
+     * @brief Get the number of images of the dataset.
+     */
+    int size() const;
+
+    /**
+     * @brief Get the batch size.
+     */
+    int batch_size() const;
+
+private:
+    DatasetReader(const DatasetReader &) = delete;
+    DatasetReader &operator=(const DatasetReader &) = delete;
+    void produce();
+    void stop();
+
+    int batch_size_;
+    int prefetch_;
+    int verbose_;
+    std::vector<DatasetEntry> entries_;
+    cv::Mat mapped_X_;
+    cv::Mat mapped_y_;
+    int cursor_;
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::pair<cv::Mat, cv::Mat>> queue_;
+    std::exception_ptr error_;
+    bool stop_;
+    bool done_;
+};
+
+/**
+ * @brief Write the predicted labels batch by batch.
+ *
+ * The labels are written to "<path>_predicted.csv" following the
+ * image order of "<path>.csv".
+ */
+class PredictionsWriter
+{
+public:
+    /**
+     * @brief Open the predictions file.
+     * @param path is the dataset pathname.
+     */
+    PredictionsWriter(const std::string &path);
+
+    /**
+     * @brief Write the labels for the next images.
+     * @param y are the labels.
+     * @pre y.type()==CV_32SC1
+     */
+    void write(const cv::Mat &y);
+
+private:
+    std::ifstream label_file_;
+    std::ofstream predicted_file_;
+};
 
 /**
  * @brief Get the description of a given class label.
@@ -64,6 +206,20 @@ void fsiv_split_dataset(float val_percent,
 void fsiv_subsample_dataset(const cv::Mat &X, const cv::Mat &y,
                             cv::Mat &X_s, cv::Mat &y_s, float p = 0.5);
 
+/**
+ * @brief Assign the samples to stratified folds.
+ *
+ * The samples of each class are shuffled and dealt to the folds in turn
+ * (continuing with the next class), so all the folds have about the same
+ * size and class proportions.
+ *
+ * @param y are the labels (CV_32SC1).
+ * @param k is the number of folds.
+ * @return the fold of each sample (CV_32SC1, y.rows x 1).
+ * @pre k >= 2
+ */
+cv::Mat fsiv_make_stratified_folds(const cv::Mat &y, int k);
+
 /**
  * @brief Compute the size in bytes of a file.
  *
@@ -78,4 +234,25 @@ bool fsiv_compute_file_size(std::string const &path, size_t &size);
  *
  * @param path the pathname to the file that will contain the new labels.
  * @param y are the labels.*/
-void fsiv_save_predictions(std::string &path, cv::Mat &y);
\ No newline at end of file
+void fsiv_save_predictions(std::string &path, cv::Mat &y);
+
+/**
+ * @brief Generate a synthetic dataset of textured blobs.
+ *
+ * Each 128x128 image is a noisy background with an elliptic blob filled
+ * with an oriented sinusoidal texture. The size of the blob and the
+ * frequency and orientation of its texture depend on the class (15
+ * classes), jittered by image, so the classes are separable but not
+ * trivially. The images are drawn in parallel, each one from its own seed,
+ * so the dataset only depends on the seed and the number of images.
+ *
+ * The layout is the one of the real dataset: "<folder>.csv" lists the
+ * images saved as png into folder.
+ *
+ * @param folder the pathname of the dataset (the folder is created).
+ * @param n_images is the number of images.
+ * @param seed is the seed of the dataset.
+ * @throw std::runtime_error if the files could not be written.
+ */
+void fsiv_generate_synthetic_dataset(const std::string &folder, int n_images,
+                                     std::uint64_t seed);
@@ -0,0 +1,299 @@
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <opencv2/core/utility.hpp>
+#include "exact_knn.hpp"
+
+static const int KNN_QUERY_BLOCK = 128;
+static const int KNN_TRAIN_BLOCK = 2048;
+
+ExactKNN::ExactKNN() : K_(1), n_classes_(0) {}
+
+cv::Ptr<ExactKNN>
+ExactKNN::create(int K)
+{
+    cv::Ptr<ExactKNN> knn = cv::makePtr<ExactKNN>();
+    knn->setDefaultK(K);
+    return knn;
+}
+
+void ExactKNN::setDefaultK(int K)
+{
+    CV_Assert(K > 0);
+    K_ = K;
+}
+
+int ExactKNN::getDefaultK() const
+{
+    return K_;
+}
+
+int ExactKNN::getVarCount() const
+{
+    return samples_.cols;
+}
+
+bool ExactKNN::isTrained() const
+{
+    return !samples_.empty();
+}
+
+bool ExactKNN::isClassifier() const
+{
+    return true;
+}
+
+void ExactKNN::clear()
+{
+    samples_.release();
+    sqnorms_.release();
+    labels_.release();
+    mapping_.reset();
+    n_classes_ = 0;
+}
+
+std::string
+ExactKNN::getDefaultName() const
+{
+    return "fsiv_exact_knn";
+}
+
+const cv::Mat &
+ExactKNN::get_labels() const
+{
+    return labels_;
+}
+
+void ExactKNN::compute_sqnorms()
+{
+    const int N = samples_.rows;
+    sqnorms_.create(N, 1, CV_32FC1);
+    const int n_blocks = (N + KNN_TRAIN_BLOCK - 1) / KNN_TRAIN_BLOCK;
+    cv::parallel_for_(cv::Range(0, n_blocks), [&](const cv::Range &range)
+    {
+        cv::Mat decoded;
+        for (int b = range.start; b < range.end; ++b)
+        {
+            const int begin = b * KNN_TRAIN_BLOCK;
+            const int end = std::min(N, begin + KNN_TRAIN_BLOCK);
+            cv::Mat block = samples_.rowRange(begin, end);
+            if (block.type() != CV_32FC1)
+            {
+                quantizer_.decode(block, decoded);
+                block = decoded;
+            }
+            for (int i = 0; i < block.rows; ++i)
+            {
+                const float *x = block.ptr<float>(i);
+                sqnorms_.at<float>(begin + i) = fsiv_dot(x, x, block.cols);
+            }
+        }
+    });
+}
+
+void ExactKNN::train_encoded(const cv::Mat &X, const cv::Mat &y,
+                             const FeatureQuantizer &quantizer)
+{
+    CV_Assert(!X.empty() && X.type() == quantizer.get_type());
+    CV_Assert(y.rows == X.rows && y.cols == 1);
+    quantizer_ = quantizer;
+    samples_ = X;
+    y.convertTo(labels_, CV_32S);
+    double min_label = 0.0, max_label = 0.0;
+    cv::minMaxLoc(labels_, &min_label, &max_label);
+    CV_Assert(min_label >= 0.0);
+    n_classes_ = int(max_label) + 1;
+    compute_sqnorms();
+}
+
+bool ExactKNN::train(const cv::Ptr<cv::ml::TrainData> &data, int flags)
+{
+    CV_Assert(data != nullptr);
+    cv::Mat X = data->getTrainSamples(cv::ml::ROW_SAMPLE);
+    if (X.type() != CV_32FC1)
+        X.convertTo(X, CV_32F);
+    train_encoded(X, data->getTrainResponses(), FeatureQuantizer());
+    return isTrained();
+}
+
+void ExactKNN::search(const cv::Mat &X, const FeatureQuantizer &quantizer, int k,
+                      cv::Mat &indices, cv::Mat &dists) const
+{
+    CV_Assert(isTrained());
+    CV_Assert(X.type() == quantizer.get_type() && X.cols == samples_.cols);
+    const int M = X.rows;
+    const int N = samples_.rows;
+    k = std::max(1, std::min(k, N));
+    indices.create(M, k, CV_32SC1);
+    dists.create(M, k, CV_32FC1);
+
+    typedef std::pair<float, int> Neighbour;
+    const int n_blocks = (M + KNN_QUERY_BLOCK - 1) / KNN_QUERY_BLOCK;
+    cv::parallel_for_(cv::Range(0, n_blocks), [&](const cv::Range &range)
+    {
+        cv::Mat queries, decoded, G;
+        std::vector<float> q_sqnorms(KNN_QUERY_BLOCK);
+        std::vector<Neighbour> heaps(size_t(KNN_QUERY_BLOCK) * k);
+        std::vector<int> heap_sizes(KNN_QUERY_BLOCK);
+        for (int b = range.start; b < range.end; ++b)
+        {
+            const int q_begin = b * KNN_QUERY_BLOCK;
+            const int q_end = std::min(M, q_begin + KNN_QUERY_BLOCK);
+            const int nq = q_end - q_begin;
+            quantizer.decode(X.rowRange(q_begin, q_end), queries);
+            for (int i = 0; i < nq; ++i)
+            {
+                const float *q = queries.ptr<float>(i);
+                q_sqnorms[i] = fsiv_dot(q, q, queries.cols);
+                heap_sizes[i] = 0;
+            }
+
+            for (int t_begin = 0; t_begin < N; t_begin += KNN_TRAIN_BLOCK)
+            {
+                const int t_end = std::min(N, t_begin + KNN_TRAIN_BLOCK);
+                cv::Mat block = samples_.rowRange(t_begin, t_end);
+                if (block.type() != CV_32FC1)
+                {
+                    quantizer_.decode(block, decoded);
+                    block = decoded;
+                }
+                cv::gemm(queries, block, -2.0, cv::noArray(), 0.0, G, cv::GEMM_2_T);
+                const float *t_sqnorms = sqnorms_.ptr<float>(t_begin);
+                for (int i = 0; i < nq; ++i)
+                {
+                    const float *g = G.ptr<float>(i);
+                    Neighbour *heap = &heaps[size_t(i) * k];
+                    int &size = heap_sizes[i];
+                    for (int j = 0; j < G.cols; ++j)
+                    {
+                        const float d = q_sqnorms[i] + t_sqnorms[j] + g[j];
+                        if (size < k)
+                        {
+                            heap[size++] = Neighbour(d, t_begin + j);
+                            std::push_heap(heap, heap + size);
+                        }
+                        else if (d < heap[0].first)
+                        {
+                            std::pop_heap(heap, heap + k);
+                            heap[k - 1] = Neighbour(d, t_begin + j);
+                            std::push_heap(heap, heap + k);
+                        }
+                    }
+                }
+            }
+
+            for (int i = 0; i < nq; ++i)
+            {
+                Neighbour *heap = &heaps[size_t(i) * k];
+                std::sort_heap(heap, heap + heap_sizes[i]);
+                int *idx = indices.ptr<int>(q_begin + i);
+                float *dist = dists.ptr<float>(q_begin + i);
+                for (int j = 0; j < k; ++j)
+                {
+                    idx[j] = heap[j].second;
+                    // Rounding may give tiny negative values.
+                    dist[j] = std::max(0.0f, heap[j].first);
+                }
+            }
+        }
+    });
+}
+
+void ExactKNN::predict_encoded(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                               cv::Mat &labels) const
+{
+    cv::Mat indices, dists;
+    search(X, quantizer, K_, indices, dists);
+    fsiv_knn_vote(indices, labels_, n_classes_, labels);
+}
+
+void fsiv_knn_vote(const cv::Mat &indices, const cv::Mat &train_labels,
+                   int n_classes, cv::Mat &labels)
+{
+    CV_Assert(indices.type() == CV_32SC1 && train_labels.type() == CV_32SC1);
+    labels.create(indices.rows, 1, CV_32SC1);
+    std::vector<int> votes(n_classes);
+    for (int i = 0; i < indices.rows; ++i)
+    {
+        const int *idx = indices.ptr<int>(i);
+        std::fill(votes.begin(), votes.end(), 0);
+        // Neighbours are sorted by distance, so ties keep the nearest one.
+        int best = -1;
+        for (int j = 0; j < indices.cols && idx[j] >= 0; ++j)
+        {
+            const int label = train_labels.at<int>(idx[j]);
+            ++votes[label];
+            if (best < 0 || votes[label] > votes[best])
+                best = label;
+        }
+        labels.at<int>(i) = best;
+    }
+}
+
+float ExactKNN::predict(cv::InputArray samples, cv::OutputArray results, int flags) const
+{
+    cv::Mat X = samples.getMat();
+    if (X.type() != CV_32FC1)
+        X.convertTo(X, CV_32F);
+    cv::Mat labels;
+    predict_encoded(X, FeatureQuantizer(), labels);
+    if (results.needed())
+        labels.convertTo(results, CV_32F);
+    return labels.empty() ? 0.0f : float(labels.at<int>(0));
+}
+
+void ExactKNN::write(cv::FileStorage &fs) const
+{
+    fs << "fsiv_knn_K" << K_;
+    quantizer_.write(fs);
+    fs << "fsiv_knn_labels" << labels_;
+    fsiv_write_features(fs, "fsiv_knn_samples", samples_);
+}
+
+void ExactKNN::read(const cv::FileNode &fn)
+{
+    clear();
+    auto k_node = fn["fsiv_knn_K"];
+    auto labels_node = fn["fsiv_knn_labels"];
+    if (k_node.empty() || labels_node.empty())
+        throw std::runtime_error("Could not load the 'fsiv_knn_K' and "
+                                 "'fsiv_knn_labels' labels from file.");
+    K_ = int(k_node);
+    quantizer_.read(fn);
+    labels_node >> labels_;
+    samples_ = fsiv_read_features(fn["fsiv_knn_samples"], quantizer_.get_type());
+    init_loaded();
+}
+
+void ExactKNN::write_mapped(cv::FileStorage &fs, ModelFileWriter &out) const
+{
+    fs << "fsiv_knn_K" << K_;
+    quantizer_.write(fs);
+    out.add_section("fsiv_knn_labels", labels_);
+    out.add_section("fsiv_knn_samples", samples_);
+}
+
+void ExactKNN::read_mapped(const cv::FileNode &fn, const ModelFileReader &in)
+{
+    clear();
+    auto k_node = fn["fsiv_knn_K"];
+    if (k_node.empty())
+        throw std::runtime_error("Could not load the 'fsiv_knn_K' label from file.");
+    K_ = int(k_node);
+    quantizer_.read(fn);
+    labels_ = in.get_section("fsiv_knn_labels");
+    samples_ = in.get_section("fsiv_knn_samples");
+    mapping_ = in.mapping();
+    CV_Assert(samples_.type() == quantizer_.get_type());
+    init_loaded();
+}
+
+void ExactKNN::init_loaded()
+{
+    CV_Assert(labels_.type() == CV_32SC1 && labels_.rows == samples_.rows);
+    double min_label = 0.0, max_label = 0.0;
+    cv::minMaxLoc(labels_, &min_label, &max_label);
+    CV_Assert(min_label >= 0.0);
+    n_classes_ = int(max_label) + 1;
+    compute_sqnorms();
+}
@@ -0,0 +1,120 @@
+/**
+ *  @file exact_knn.hpp
+ */
+#pragma once
+
+#include <string>
+#include <opencv2/core.hpp>
+#include <opencv2/ml.hpp>
+#include "classifiers.hpp"
+#include "model_file.hpp"
+
+/**
+ * @brief Exact K-NN classifier with blocked GEMM distances.
+ *
+ * The squared L2 distances between a block of queries and a block of train
+ * samples are computed as ||x||^2 + ||y||^2 - 2x.y, where the dot products
+ * of the whole blocks are a single GEMM. Each query keeps its K nearest
+ * samples in a fixed size max-heap, and the query blocks are processed in
+ * parallel (see cv::setNumThreads).
+ *
+ * The train samples are kept in the format they were given (float32 or a
+ * FeatureQuantizer format) and decoded block by block. In a model file they
+ * are a section used in place.
+ *
+ * The predicted label is the majority label of the K neighbours, ties are
+ * broken by the nearest neighbour.
+ */
+class ExactKNN : public cv::ml::StatModel, public EncodedFeaturesModel,
+                 public MappableModel
+{
+public:
+    ExactKNN();
+
+    /**
+     * @brief Create an untrained classifier.
+     *
+     * Needed by cv::Algorithm::load<ExactKNN>().
+     * @param K is the number of neighbours.
+     */
+    static cv::Ptr<ExactKNN> create(int K = 1);
+
+    void setDefaultK(int K);
+    int getDefaultK() const;
+
+    using cv::ml::StatModel::train;
+    virtual bool train(const cv::Ptr<cv::ml::TrainData> &data, int flags = 0) override;
+    virtual float predict(cv::InputArray samples, cv::OutputArray results = cv::noArray(),
+                          int flags = 0) const override;
+    virtual int getVarCount() const override;
+    virtual bool isTrained() const override;
+    virtual bool isClassifier() const override;
+    virtual void clear() override;
+    virtual void write(cv::FileStorage &fs) const override;
+    virtual void read(const cv::FileNode &fn) override;
+    virtual std::string getDefaultName() const override;
+    virtual void write_mapped(cv::FileStorage &fs, ModelFileWriter &out) const override;
+    virtual void read_mapped(const cv::FileNode &fn, const ModelFileReader &in) override;
+
+    /**
+     * @brief Train the model.
+     *
+     * The samples are not copied, the model keeps a reference to X.
+     */
+    virtual void train_encoded(const cv::Mat &X, const cv::Mat &y,
+                               const FeatureQuantizer &quantizer) override;
+    virtual void predict_encoded(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                 cv::Mat &labels) const override;
+
+    /**
+     * @brief Find the k nearest train samples of each query.
+     *
+     * @param X are the queries (one by row).
+     * @param quantizer is the format of X.
+     * @param k is the number of neighbours.
+     * @param indices are the train samples indices (CV_32SC1, X.rows x k)
+     * sorted by increasing distance.
+     * @param dists are the squared distances (CV_32FC1, X.rows x k).
+     * @pre isTrained()
+     */
+    void search(const cv::Mat &X, const FeatureQuantizer &quantizer, int k,
+                cv::Mat &indices, cv::Mat &dists) const;
+
+    /**
+     * @brief Get the labels of the train samples.
+     */
+    const cv::Mat &get_labels() const;
+
+protected:
+
+    /**
+     * @brief Compute the squared norms of the train samples.
+     */
+    void compute_sqnorms();
+
+    /**
+     * @brief Check the read state and compute the derived one.
+     */
+    void init_loaded();
+
+    int K_;
+    int n_classes_;              // max label + 1.
+    FeatureQuantizer quantizer_; // format of samples_.
+    cv::Mat samples_;            // NxD train samples.
+    cv::Mat sqnorms_;            // Nx1 squared norms of the decoded samples.
+    cv::Mat labels_;             // Nx1 CV_32SC1 labels.
+    std::shared_ptr<MappedFile> mapping_; // owner of the mapped sections, if loaded.
+};
+
+/**
+ * @brief Majority vote of the neighbours' labels.
+ *
+ * @param indices are the neighbours of each sample sorted by distance
+ * (CV_32SC1, one row by sample). Negative indices are ignored.
+ * @param train_labels are the labels of the train samples (CV_32SC1).
+ * @param n_classes is the max label + 1.
+ * @param labels are the voted labels (CV_32SC1, indices.rows x 1). Ties are
+ * broken by the nearest neighbour.
+ */
+void fsiv_knn_vote(const cv::Mat &indices, const cv::Mat &train_labels,
+                   int n_classes, cv::Mat &labels);
@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <cstring>
+#include <opencv2/core/hal/intrin.hpp>
+#include "feature_precision.hpp"
+
+FeatureQuantizer::FeatureQuantizer(FEATURE_PRECISION precision)
+    : precision_(precision)
+{
+    if (precision < FSIV_PRECISION_F32 || precision > FSIV_PRECISION_Q8)
+        throw std::runtime_error("Unknown features precision: " +
+                                 std::to_string(int(precision)));
+}
+
+FEATURE_PRECISION
+FeatureQuantizer::get_precision() const
+{
+    return precision_;
+}
+
+int FeatureQuantizer::get_type() const
+{
+    switch (precision_)
+    {
+    case FSIV_PRECISION_F16:
+        return CV_16FC1;
+    case FSIV_PRECISION_Q8:
+        return CV_8SC1;
+    default:
+        return CV_32FC1;
+    }
+}
+
+bool FeatureQuantizer::is_fitted() const
+{
+    return precision_ != FSIV_PRECISION_Q8 || !scale_.empty();
+}
+
+void FeatureQuantizer::fit(const cv::Mat &X)
+{
+    CV_Assert(!X.empty() && X.type() == CV_32FC1);
+    if (precision_ != FSIV_PRECISION_Q8)
+        return;
+
+    cv::Mat min_v, max_v;
+    cv::reduce(X, min_v, 0, cv::REDUCE_MIN);
+    cv::reduce(X, max_v, 0, cv::REDUCE_MAX);
+    scale_.create(1, X.cols, CV_32FC1);
+    inv_scale_.create(1, X.cols, CV_32FC1);
+    offset_.create(1, X.cols, CV_32FC1);
+    for (int j = 0; j < X.cols; ++j)
+    {
+        const float lo = min_v.at<float>(j);
+        const float hi = max_v.at<float>(j);
+        const float s = (hi - lo) / 254.0f;
+        scale_.at<float>(j) = s > 0.0f ? s : 1.0f;
+        inv_scale_.at<float>(j) = 1.0f / scale_.at<float>(j);
+        offset_.at<float>(j) = 0.5f * (hi + lo);
+    }
+}
+
+void FeatureQuantizer::encode(const cv::Mat &X, cv::Mat &Q) const
+{
+    CV_Assert(X.type() == CV_32FC1);
+    CV_Assert(is_fitted());
+    switch (precision_)
+    {
+    case FSIV_PRECISION_F32:
+        X.copyTo(Q);
+        break;
+    case FSIV_PRECISION_F16:
+        X.convertTo(Q, CV_16F);
+        break;
+    case FSIV_PRECISION_Q8:
+    {
+        CV_Assert(X.cols == scale_.cols);
+        Q.create(X.rows, X.cols, CV_8SC1);
+        const float *inv_scale = inv_scale_.ptr<float>();
+        const float *offset = offset_.ptr<float>();
+        for (int i = 0; i < X.rows; ++i)
+        {
+            const float *x = X.ptr<float>(i);
+            schar *q = Q.ptr<schar>(i);
+            for (int j = 0; j < X.cols; ++j)
+            {
+                const int v = cvRound((x[j] - offset[j]) * inv_scale[j]);
+                q[j] = schar(std::min(127, std::max(-127, v)));
+            }
+        }
+        break;
+    }
+    }
+}
+
+void FeatureQuantizer::decode(const cv::Mat &Q, cv::Mat &X) const
+{
+    CV_Assert(Q.type() == get_type());
+    CV_Assert(&Q != &X);
+    switch (precision_)
+    {
+    case FSIV_PRECISION_F32:
+        Q.copyTo(X);
+        break;
+    case FSIV_PRECISION_F16:
+        Q.convertTo(X, CV_32F);
+        break;
+    case FSIV_PRECISION_Q8:
+    {
+        CV_Assert(Q.cols == scale_.cols);
+        X.create(Q.rows, Q.cols, CV_32FC1);
+        const float *scale = scale_.ptr<float>();
+        const float *offset = offset_.ptr<float>();
+        for (int i = 0; i < Q.rows; ++i)
+        {
+            const schar *q = Q.ptr<schar>(i);
+            float *x = X.ptr<float>(i);
+            for (int j = 0; j < Q.cols; ++j)
+                x[j] = offset[j] + scale[j] * q[j];
+        }
+        break;
+    }
+    }
+}
+
+float FeatureQuantizer::l2sqr(const cv::Mat &Q, int row, const float *b) const
+{
+    CV_Assert(Q.type() == get_type());
+    switch (precision_)
+    {
+    case FSIV_PRECISION_F16:
+        return fsiv_l2sqr(Q.ptr<fsiv_half>(row), b, Q.cols);
+    case FSIV_PRECISION_Q8:
+        return fsiv_l2sqr(Q.ptr<schar>(row), scale_.ptr<float>(),
+                          offset_.ptr<float>(), b, Q.cols);
+    default:
+        return fsiv_l2sqr(Q.ptr<float>(row), b, Q.cols);
+    }
+}
+
+void FeatureQuantizer::write(cv::FileStorage &f) const
+{
+    f << "fsiv_feature_precision" << int(precision_);
+    if (precision_ == FSIV_PRECISION_Q8)
+    {
+        f << "fsiv_quant_scale" << scale_;
+        f << "fsiv_quant_offset" << offset_;
+    }
+}
+
+void FeatureQuantizer::read(const cv::FileNode &node)
+{
+    auto precision_node = node["fsiv_feature_precision"];
+    precision_ = FSIV_PRECISION_F32;
+    scale_ = cv::Mat();
+    inv_scale_ = cv::Mat();
+    offset_ = cv::Mat();
+    if (precision_node.empty())
+        return;
+    if (!precision_node.isInt())
+        throw std::runtime_error("Could not load the 'fsiv_feature_precision' "
+                                 "label from file.");
+    precision_ = FEATURE_PRECISION(int(precision_node));
+    if (precision_ == FSIV_PRECISION_Q8)
+    {
+        auto scale_node = node["fsiv_quant_scale"];
+        auto offset_node = node["fsiv_quant_offset"];
+        if (scale_node.empty() || offset_node.empty())
+            throw std::runtime_error("Could not load the 'fsiv_quant_scale' and "
+                                     "'fsiv_quant_offset' labels from file.");
+        scale_node >> scale_;
+        offset_node >> offset_;
+        CV_Assert(scale_.type() == CV_32FC1 && scale_.size() == offset_.size());
+        cv::divide(1.0, scale_, inv_scale_);
+    }
+}
+
+void fsiv_write_features(cv::FileStorage &fs, const std::string &name,
+                         const cv::Mat &X)
+{
+    cv::Mat stored = X.isContinuous() ? X : X.clone();
+    if (stored.type() == CV_16FC1)
+        stored = cv::Mat(stored.rows, stored.cols, CV_16SC1, stored.data);
+    fs << name << stored;
+}
+
+cv::Mat
+fsiv_read_features(const cv::FileNode &node, int type)
+{
+    if (node.empty())
+        throw std::runtime_error("Could not load the '" + node.name() +
+                                 "' label from file.");
+    cv::Mat stored;
+    node >> stored;
+    if (type != CV_16FC1)
+    {
+        CV_Assert(stored.type() == type);
+        return stored;
+    }
+    CV_Assert(stored.type() == CV_16SC1 && stored.isContinuous());
+    cv::Mat X(stored.rows, stored.cols, CV_16FC1);
+    std::memcpy(X.data, stored.data, stored.total() * stored.elemSize());
+    return X;
+}
+
+// The kernels load 4 values at a time, widening the reduced formats to
+// float in registers (F16C or its fallback for half floats, sign extension
+// for int8), so only the encoded bytes are read from memory. The tails and
+// the builds without SIMD use plain loops.
+
+#if CV_SIMD128
+static inline cv::v_float32x4
+simd_sub(const cv::v_float32x4 &a, const cv::v_float32x4 &b)
+{
+#if CV_VERSION_MAJOR >= 5
+    return cv::v_sub(a, b);
+#else
+    return a - b;
+#endif
+}
+#endif
+
+float fsiv_l2sqr(const float *a, const float *b, int n)
+{
+    int j = 0;
+    float sum = 0.0f;
+#if CV_SIMD128
+    cv::v_float32x4 acc = cv::v_setzero_f32();
+    for (; j + 4 <= n; j += 4)
+    {
+        const cv::v_float32x4 d = simd_sub(cv::v_load(a + j), cv::v_load(b + j));
+        acc = cv::v_muladd(d, d, acc);
+    }
+    sum = cv::v_reduce_sum(acc);
+#endif
+    for (; j < n; ++j)
+    {
+        const float d = a[j] - b[j];
+        sum += d * d;
+    }
+    return sum;
+}
+
+float fsiv_l2sqr(const fsiv_half *a, const float *b, int n)
+{
+    int j = 0;
+    float sum = 0.0f;
+#if CV_SIMD128
+    cv::v_float32x4 acc = cv::v_setzero_f32();
+    for (; j + 4 <= n; j += 4)
+    {
+        const cv::v_float32x4 d = simd_sub(cv::v_load_expand(a + j), cv::v_load(b + j));
+        acc = cv::v_muladd(d, d, acc);
+    }
+    sum = cv::v_reduce_sum(acc);
+#endif
+    for (; j < n; ++j)
+    {
+        const float d = float(a[j]) - b[j];
+        sum += d * d;
+    }
+    return sum;
+}
+
+float fsiv_l2sqr(const schar *a, const float *scale, const float *offset,
+                 const float *b, int n)
+{
+    int j = 0;
+    float sum = 0.0f;
+#if CV_SIMD128
+    cv::v_float32x4 acc = cv::v_setzero_f32();
+    for (; j + 4 <= n; j += 4)
+    {
+        const cv::v_float32x4 q = cv::v_cvt_f32(cv::v_load_expand_q(a + j));
+        const cv::v_float32x4 x = cv::v_muladd(cv::v_load(scale + j), q,
+                                               cv::v_load(offset + j));
+        const cv::v_float32x4 d = simd_sub(x, cv::v_load(b + j));
+        acc = cv::v_muladd(d, d, acc);
+    }
+    sum = cv::v_reduce_sum(acc);
+#endif
+    for (; j < n; ++j)
+    {
+        const float d = offset[j] + scale[j] * a[j] - b[j];
+        sum += d * d;
+    }
+    return sum;
+}
+
+float fsiv_dot(const float *a, const float *b, int n)
+{
+    int j = 0;
+    float sum = 0.0f;
+#if CV_SIMD128
+    cv::v_float32x4 acc = cv::v_setzero_f32();
+    for (; j + 4 <= n; j += 4)
+        acc = cv::v_muladd(cv::v_load(a + j), cv::v_load(b + j), acc);
+    sum = cv::v_reduce_sum(acc);
+#endif
+    for (; j < n; ++j)
+        sum += a[j] * b[j];
+    return sum;
+}
@@ -0,0 +1,171 @@
+/**
+ *  @file feature_precision.hpp
+ */
+#pragma once
+
+#include <opencv2/core.hpp>
+
+#if CV_VERSION_MAJOR >= 5
+typedef cv::hfloat fsiv_half;
+#else
+typedef cv::float16_t fsiv_half;
+#endif
+
+/**
+ * @brief Define the storage formats of the feature matrices.
+ */
+typedef enum {
+    FSIV_PRECISION_F32 = 0, // CV_32F.
+    FSIV_PRECISION_F16 = 1, // CV_16F.
+    FSIV_PRECISION_Q8 = 2,  // CV_8S with a scale and offset by column.
+} FEATURE_PRECISION;
+
+/**
+ * @brief Encode/decode feature matrices in a reduced precision format.
+ *
+ * With FSIV_PRECISION_Q8 a feature x of column j is stored as the integer
+ * q in [-127, 127] so that x ~ offset_j + scale_j * q. The scales and
+ * offsets are fitted with the range of each column of a sample of the
+ * train features (values out of range are saturated).
+ *
+ * The reduced formats save memory everywhere. They only speed up the
+ * distances of the HNSW K-NN, which read the encoded rows with the SIMD
+ * kernels of l2sqr(). The other models decode bounded blocks of rows to
+ * float32 and use GEMMs over them.
+ */
+class FeatureQuantizer
+{
+public:
+
+    /**
+     * @brief Create a quantizer.
+     * @param precision is the storage format.
+     */
+    FeatureQuantizer(FEATURE_PRECISION precision = FSIV_PRECISION_F32);
+
+    /**
+     * @brief Get the storage format.
+     */
+    FEATURE_PRECISION get_precision() const;
+
+    /**
+     * @brief Get the OpenCV type of the encoded matrices.
+     * @return CV_32FC1, CV_16FC1 or CV_8SC1.
+     */
+    int get_type() const;
+
+    /**
+     * @brief Is the quantizer ready to encode?
+     *
+     * Only FSIV_PRECISION_Q8 needs to be fitted.
+     */
+    bool is_fitted() const;
+
+    /**
+     * @brief Fit the scale and offset of each column.
+     * @param X are sample features (CV_32FC1, one row by sample).
+     */
+    void fit(const cv::Mat& X);
+
+    /**
+     * @brief Encode features.
+     * @param X are the features (CV_32FC1).
+     * @param Q is the output. If it already has the right size and type
+     * (e.g. a view of a bigger matrix) it is written in place.
+     * @pre is_fitted()
+     */
+    void encode(const cv::Mat& X, cv::Mat& Q) const;
+
+    /**
+     * @brief Decode features.
+     * @param Q are the encoded features.
+     * @param X is the output (CV_32FC1). If it already has the right size
+     * it is written in place. It must not be Q.
+     */
+    void decode(const cv::Mat& Q, cv::Mat& X) const;
+
+    /**
+     * @brief Squared L2 distance between an encoded row and a vector.
+     * @param Q are the encoded features.
+     * @param row is the row of Q.
+     * @param b is the vector (Q.cols floats).
+     */
+    float l2sqr(const cv::Mat& Q, int row, const float* b) const;
+
+    /**
+     * @brief Write the format and the fitted state.
+     *
+     * Labels 'fsiv_feature_precision', 'fsiv_quant_scale' and
+     * 'fsiv_quant_offset' are used.
+     */
+    void write(cv::FileStorage& f) const;
+
+    /**
+     * @brief Read the format and the fitted state.
+     *
+     * If the node has not the 'fsiv_feature_precision' label (e.g. older
+     * models) the format is FSIV_PRECISION_F32.
+     */
+    void read(const cv::FileNode& node);
+
+protected:
+    FEATURE_PRECISION precision_;
+    cv::Mat scale_;     // 1xD scale by column (Q8).
+    cv::Mat inv_scale_; // 1xD 1/scale.
+    cv::Mat offset_;    // 1xD offset by column (Q8).
+};
+
+/**
+ * @brief Write a feature matrix in any of the storage formats.
+ *
+ * FileStorage has no half float type, so CV_16F matrices are written as
+ * 16 bits ints.
+ *
+ * @param fs is the file storage opened to write.
+ * @param name is the label.
+ * @param X is the matrix.
+ */
+void fsiv_write_features(cv::FileStorage& fs, const std::string& name,
+                         const cv::Mat& X);
+
+/**
+ * @brief Read a feature matrix written by fsiv_write_features().
+ *
+ * @param node is the node of the matrix.
+ * @param type is the expected type (see FeatureQuantizer::get_type()).
+ * @return the matrix.
+ * @throw std::runtime_error if the node is empty.
+ */
+cv::Mat fsiv_read_features(const cv::FileNode& node, int type);
+
+/**
+ * @brief Squared L2 distance between two vectors.
+ *
+ * The distance and dot product kernels use 128 bits SIMD when available
+ * (CV_SIMD128), so their sums are not in the order of a scalar loop.
+ * @param a is a stored vector.
+ * @param b is a float vector.
+ * @param n is the vectors size.
+ */
+float fsiv_l2sqr(const float* a, const float* b, int n);
+
+/**
+ * @brief Squared L2 distance between a half float vector and a float one.
+ */
+float fsiv_l2sqr(const fsiv_half* a, const float* b, int n);
+
+/**
+ * @brief Squared L2 distance between a quantized vector and a float one.
+ * @param a is the quantized vector (a_j ~ offset_j + scale_j*q_j).
+ * @param scale are the scales by column.
+ * @param offset are the offsets by column.
+ * @param b is the float vector.
+ * @param n is the vectors size.
+ */
+float fsiv_l2sqr(const schar* a, const float* scale, const float* offset,
+                 const float* b, int n);
+
+/**
+ * @brief Dot product of two vectors.
+ */
+float fsiv_dot(const float* a, const float* b, int n);
@@ -0,0 +1,155 @@
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "feature_store.hpp"
+#include "binary_io.hpp"
+
+/**
+ * @brief Header of a stored features file.
+ *
+ * The header is followed by the labels (int32) and, aligned to a page
+ * boundary, the features matrix (row major).
+ */
+struct StoredFeaturesHeader
+{
+    char magic[8];
+    std::uint64_t key;
+    std::int32_t rows;
+    std::int32_t cols;
+    std::int32_t type;
+    std::int32_t reserved;
+    std::uint64_t labels_offset;
+    std::uint64_t features_offset;
+};
+
+static const char STORED_FEATURES_MAGIC[8] = {'F', 'S', 'I', 'V', 'F', 'S', '0', '1'};
+
+std::uint64_t
+fsiv_compute_features_key(std::uint64_t data_key,
+                          const cv::Ptr<FeaturesExtractor> &extractor,
+                          const std::string &tmp_dir)
+{
+    std::uint64_t h = fsiv_hash_bytes(STORED_FEATURES_MAGIC, sizeof(STORED_FEATURES_MAGIC));
+    h = fsiv_hash_value(data_key, h);
+    h = fsiv_hash_value(std::int32_t(extractor->get_extractor_type()), h);
+    for (float p : extractor->get_params())
+        h = fsiv_hash_value(p, h);
+
+    // The trained state is whatever save_model writes.
+    std::error_code ec;
+    std::filesystem::create_directories(tmp_dir, ec);
+    const std::string tmp_fname = fsiv_make_temp_path(tmp_dir + "/extractor") + ".yml";
+    if (extractor->save_model(tmp_fname))
+    {
+        std::ifstream in(tmp_fname, std::ios::in | std::ios::binary);
+        std::vector<char> buffer(1 << 16);
+        while (in)
+        {
+            in.read(buffer.data(), buffer.size());
+            h = fsiv_hash_bytes(buffer.data(), size_t(in.gcount()), h);
+        }
+    }
+    std::remove(tmp_fname.c_str());
+    return h;
+}
+
+std::string
+fsiv_stored_features_path(const std::string &store_dir, std::uint64_t key)
+{
+    std::ostringstream fname;
+    fname << store_dir << "/" << std::hex << std::setw(16) << std::setfill('0')
+          << key << ".feat";
+    return fname.str();
+}
+
+bool fsiv_load_stored_features(const std::string &store_dir, std::uint64_t key,
+                               cv::Mat &X, cv::Mat &y)
+{
+    auto file = MappedFile::open(fsiv_stored_features_path(store_dir, key));
+    if (file == nullptr || file->size() < sizeof(StoredFeaturesHeader))
+        return false;
+
+    StoredFeaturesHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, STORED_FEATURES_MAGIC, sizeof(header.magic)) != 0 ||
+        header.key != key || header.rows < 0 || header.cols <= 0 ||
+        header.type != CV_32FC1 ||
+        header.labels_offset + std::uint64_t(header.rows) * sizeof(std::int32_t) > file->size() ||
+        header.features_offset + std::uint64_t(header.rows) * header.cols * sizeof(float) > file->size())
+        return false;
+
+    fsiv_pin_mapped_file(file);
+    y = cv::Mat(header.rows, 1, CV_32SC1, file->data() + header.labels_offset);
+    X = cv::Mat(header.rows, header.cols, header.type, file->data() + header.features_offset);
+    return true;
+}
+
+bool fsiv_store_features(const std::string &store_dir, std::uint64_t key,
+                         const cv::Mat &X, const cv::Mat &y)
+{
+    CV_Assert(X.type() == CV_32FC1 && y.type() == CV_32SC1);
+    CV_Assert(X.rows == int(y.total()));
+
+    std::error_code ec;
+    std::filesystem::create_directories(store_dir, ec);
+
+    StoredFeaturesHeader header;
+    std::memcpy(header.magic, STORED_FEATURES_MAGIC, sizeof(header.magic));
+    header.key = key;
+    header.rows = X.rows;
+    header.cols = X.cols;
+    header.type = X.type();
+    header.reserved = 0;
+    header.labels_offset = fsiv_align_offset(sizeof(header), 64);
+    header.features_offset = fsiv_align_offset(
+        header.labels_offset + std::uint64_t(X.rows) * sizeof(std::int32_t), 4096);
+
+    const std::string fname = fsiv_stored_features_path(store_dir, key);
+    const std::string tmp_fname = fsiv_make_temp_path(fname);
+    std::ofstream out(tmp_fname, std::ios::out | std::ios::binary);
+    if (!out)
+        return false;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    fsiv_write_padding(out, 64);
+    cv::Mat labels = y.isContinuous() ? y : y.clone();
+    out.write(reinterpret_cast<const char *>(labels.data), labels.total() * labels.elemSize());
+    fsiv_write_padding(out, 4096);
+    for (int i = 0; i < X.rows; ++i)
+        out.write(reinterpret_cast<const char *>(X.ptr(i)), X.cols * X.elemSize());
+    out.close();
+    if (!out)
+    {
+        std::remove(tmp_fname.c_str());
+        return false;
+    }
+    return fsiv_replace_file(tmp_fname, fname);
+}
+
+cv::Mat
+fsiv_extract_features_stored(const cv::Mat &dt, const cv::Mat &y,
+                             cv::Ptr<FeaturesExtractor> &extractor,
+                             const std::string &store_dir,
+                             std::uint64_t data_key, bool *hit)
+{
+    const std::uint64_t key = fsiv_compute_features_key(data_key, extractor, store_dir);
+    cv::Mat X, y_stored;
+    const bool found = fsiv_load_stored_features(store_dir, key, X, y_stored) &&
+                       X.rows == dt.rows;
+    if (!found)
+    {
+        X = fsiv_extract_features(dt, extractor);
+        if (!fsiv_store_features(store_dir, key, X, y))
+            std::cerr << "Warning: could not store the features in '"
+                      << store_dir << "'." << std::endl;
+    }
+    if (hit != nullptr)
+        *hit = found;
+    CV_Assert(X.rows == dt.rows);
+    return X;
+}
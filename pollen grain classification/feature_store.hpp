@@ -0,0 +1,84 @@
+/**
+ *  @file feature_store.hpp
+ *  On disk store of extracted features.
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <opencv2/core.hpp>
+
+#include "features.hpp"
+
+/**
+ * @brief Compute the key that identifies the features of a set of samples.
+ *
+ * The key combines the key of the input samples with the extractor type,
+ * its parameters and its trained state as written by save_model().
+ *
+ * @param data_key identifies the input samples (e.g. the dataset
+ *        fingerprint combined with the subsample settings).
+ * @param extractor is the (trained) feature extractor.
+ * @param tmp_dir is a folder where a temporary file can be written.
+ * @return the key.
+ */
+std::uint64_t fsiv_compute_features_key(std::uint64_t data_key,
+                                        const cv::Ptr<FeaturesExtractor> &extractor,
+                                        const std::string &tmp_dir);
+
+/**
+ * @brief Get the pathname of the stored features for a key.
+ */
+std::string fsiv_stored_features_path(const std::string &store_dir,
+                                      std::uint64_t key);
+
+/**
+ * @brief Load stored features.
+ *
+ * The file is memory mapped and X, y are views over the mapped memory
+ * (the mapping is kept until the process ends).
+ *
+ * @param[in] store_dir is the store folder.
+ * @param[in] key identifies the features.
+ * @param[out] X are the features (one row by sample).
+ * @param[out] y are the labels.
+ * @return true if the features were found.
+ */
+bool fsiv_load_stored_features(const std::string &store_dir, std::uint64_t key,
+                               cv::Mat &X, cv::Mat &y);
+
+/**
+ * @brief Store features.
+ *
+ * The file has a header followed by the labels and the features, each
+ * section aligned so it can be mapped as a cv::Mat without copying.
+ *
+ * @param store_dir is the store folder (created if needed).
+ * @param key identifies the features.
+ * @param X are the features (one row by sample, CV_32FC1).
+ * @param y are the labels (CV_32SC1).
+ * @return true if success.
+ */
+bool fsiv_store_features(const std::string &store_dir, std::uint64_t key,
+                         const cv::Mat &X, const cv::Mat &y);
+
+/**
+ * @brief Extract features reusing the store.
+ *
+ * If features with the same key are stored they are loaded, else they are
+ * extracted and stored.
+ *
+ * @param dt are the samples (one sample per row).
+ * @param y are the samples labels.
+ * @param extractor is the (trained) feature extractor.
+ * @param store_dir is the store folder.
+ * @param data_key identifies the samples in dt.
+ * @param hit if not null, it is set to true when the features were loaded.
+ * @return the features.
+ * @post ret_v.rows==dt.rows
+ */
+cv::Mat fsiv_extract_features_stored(const cv::Mat &dt, const cv::Mat &y,
+                                     cv::Ptr<FeaturesExtractor> &extractor,
+                                     const std::string &store_dir,
+                                     std::uint64_t data_key,
+                                     bool *hit = nullptr);
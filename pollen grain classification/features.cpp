@@ -1,14 +1,23 @@
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <exception>
 #include <fstream>
+#include <opencv2/core/utility.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 #include "features.hpp"
+#include "model_file.hpp"
 
 
 #include "gray_levels_features.hpp"
 #include "my_extractor.hpp"
+#include "lbp_features.hpp"
+#include "pca_gray_levels_features.hpp"
+#include "haralick_features.hpp"
+#include "pipeline_extractor.hpp"
+#include "rff_features.hpp"
 
 
 FEATURE_IDS
@@ -34,6 +43,36 @@ cv::Ptr<FeaturesExtractor> FeaturesExtractor::create(FEATURE_IDS id)
         break;
     }
 
+    case FSIV_LBP:
+    {
+        extractor = cv::makePtr<LBPFeatures>();
+        break;
+    }
+
+    case FSIV_PCA_GREY_LEVELS:
+    {
+        extractor = cv::makePtr<PCAGrayLevelsFeatures>();
+        break;
+    }
+
+    case FSIV_HARALICK:
+    {
+        extractor = cv::makePtr<HaralickFeatures>();
+        break;
+    }
+
+    case FSIV_PIPELINE:
+    {
+        extractor = cv::makePtr<PipelineExtractor>();
+        break;
+    }
+
+    case FSIV_RFF:
+    {
+        extractor = cv::makePtr<RandomFourierFeatures>();
+        break;
+    }
+
     default:
     {
         throw std::runtime_error("Error: unknown feature id.");
@@ -44,23 +83,78 @@ cv::Ptr<FeaturesExtractor> FeaturesExtractor::create(FEATURE_IDS id)
     return extractor;
 }
 
+void FeaturesExtractor::extract_batch(const cv::Mat &rows, cv::Mat &out)
+{
+    CV_Assert(out.rows == rows.rows && out.type() == CV_32FC1);
+    for (int i = 0; i < rows.rows; ++i)
+        extract_features(rows.row(i)).copyTo(out.row(i));
+}
+
+cv::Mat
+fsiv_to_gray_image(const cv::Mat &sample)
+{
+    cv::Mat gray = sample;
+    if (sample.channels() == 3)
+        cv::cvtColor(sample, gray, cv::COLOR_BGR2GRAY);
+    if (gray.rows == 1)
+        gray = (gray.isContinuous() ? gray : gray.clone()).reshape(1, 128);
+    CV_Assert(gray.type() == CV_8UC1);
+    return gray;
+}
+
 cv::Mat
 fsiv_extract_features(const cv::Mat &dt,
-                      cv::Ptr<FeaturesExtractor> &extractor)
+                      cv::Ptr<FeaturesExtractor> &extractor,
+                      FeatureExtractionStats *stats,
+                      const FeatureQuantizer *quantizer)
 {
-  
+    const int block_size = 256;
+    const int64 t0 = cv::getTickCount();
+    CV_Assert(quantizer == nullptr || quantizer->is_fitted());
+    const bool encode = quantizer != nullptr && quantizer->get_type() != CV_32FC1;
     cv::Mat feature = extractor->extract_features(dt.row(0));
+    cv::Mat X(dt.rows, feature.cols, encode ? quantizer->get_type() : CV_32FC1);
 
+    const int n_blocks = (dt.rows + block_size - 1) / block_size;
+    const int n_workers = std::max(1, std::min(cv::getNumThreads(), n_blocks));
 
-    cv::Mat X(dt.rows, feature.cols, CV_32F);
-    feature.copyTo(X.row(0));
+    // The clones are made before going parallel, clone() need not be reentrant.
+    std::vector<cv::Ptr<FeaturesExtractor>> workers(n_workers);
+    for (auto &w : workers)
+        w = extractor->clone();
+    std::vector<cv::Mat> scratch(n_workers);
 
-
-#ifdef USE_OPENMP
-#pragma omp parallel for
-#endif
-    for (int i = 1; i < dt.rows; ++i)
-        extractor->extract_features(dt.row(i)).copyTo(X.row(i));
+    // Blocks are handed out dynamically so slow blocks do not stall a worker.
+    std::atomic<int> next_block(0);
+    cv::parallel_for_(cv::Range(0, n_workers), [&](const cv::Range &range)
+    {
+        for (int w = range.start; w < range.end; ++w)
+        {
+            int b;
+            while ((b = next_block++) < n_blocks)
+            {
+                const int begin = b * block_size;
+                const int end = std::min(dt.rows, begin + block_size);
+                cv::Mat out = X.rowRange(begin, end);
+                if (encode)
+                {
+                    scratch[w].create(block_size, X.cols, CV_32FC1);
+                    cv::Mat block = scratch[w].rowRange(0, end - begin);
+                    workers[w]->extract_batch(dt.rowRange(begin, end), block);
+                    quantizer->encode(block, out);
+                }
+                else
+                    workers[w]->extract_batch(dt.rowRange(begin, end), out);
+            }
+        }
+    }, n_workers);
+
+    if (stats != nullptr)
+    {
+        stats->n_images = dt.rows;
+        stats->n_workers = n_workers;
+        stats->seconds = (cv::getTickCount() - t0) / cv::getTickFrequency();
+    }
     return X;
 }
 
@@ -89,15 +183,31 @@ bool FeaturesExtractor::save_model(std::string const& model_fname) const
     if (f.isOpened())
     {
         ret_v = true;
-        f << "fsiv_feature_id" << int(type_);
-        f << "fsiv_feature_params" << params_;
+        write_model(f);
     }
     return ret_v;
 }
 
+void FeaturesExtractor::write_model(cv::FileStorage &f) const
+{
+    f << "fsiv_feature_id" << int(type_);
+    f << "fsiv_feature_params" << params_;
+    write_state(f);
+}
+
+void FeaturesExtractor::write_state(cv::FileStorage &f) const
+{
+    return;
+}
+
+void FeaturesExtractor::read_state(const cv::FileNode &node)
+{
+    return;
+}
+
 bool FeaturesExtractor::load_model(std::string const& model_fname)
 {    
-    cv::FileStorage f (model_fname, cv::FileStorage::READ);
+    cv::FileStorage f = fsiv_open_model_metadata(model_fname);
 
     auto node = f["fsiv_feature_id"];
     if (node.empty() || !node.isInt())
@@ -113,6 +223,7 @@ bool FeaturesExtractor::load_model(std::string const& model_fname)
         throw std::runtime_error("Could not load the 'fsiv_feature_params' "
                                  "label from file.");
     node >> params_;
+    read_state(f.root());
     return true;
 }
 
@@ -120,8 +231,7 @@ cv::Ptr<FeaturesExtractor>
 FeaturesExtractor::create(const std::string &fname)
 {
     cv::Ptr<FeaturesExtractor> extr;
-    cv::FileStorage f;
-    f.open(fname, cv::FileStorage::READ);
+    cv::FileStorage f = fsiv_open_model_metadata(fname);
     if (f.isOpened())
     {
         auto node = f["fsiv_feature_id"];
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <opencv2/core.hpp>
+#include "feature_precision.hpp"
 
 /**
  * @brief Define feature extractors.
@@ -12,7 +13,11 @@ typedef enum {
     FSIV_NON_EXTRACTOR = 0,
     FSIV_GREY_LEVELS=1, // Use pixel grey levels [0,1].
     FSIV_MY_EXTRACTOR = 2,
-    
+    FSIV_LBP = 3, // Rotation invariant uniform LBP histograms.
+    FSIV_PCA_GREY_LEVELS = 4, // PCA projection of grey levels [0,1].
+    FSIV_HARALICK = 5, // Haralick features of co-occurrence matrices.
+    FSIV_PIPELINE = 6, // Preprocessing steps and concatenated extractors.
+    FSIV_RFF = 7, // Random Fourier features (RBF kernel approximation).
 } FEATURE_IDS;
 
 /**
@@ -35,6 +40,20 @@ public:
      */
     virtual std::string get_extractor_name() const = 0;
 
+    /**
+     * @brief Make an independent copy of the extractor.
+     *
+     * The parallel extraction gives a clone to each worker thread, so
+     * extract_features() and extract_batch() are only called by one thread
+     * at a time for each instance. A clone must copy the parameters and the
+     * trained state and must not share mutable data (e.g. scratch buffers)
+     * with the original. Read only trained data (e.g. a projection matrix)
+     * may be shared.
+     *
+     * @return the copy.
+     */
+    virtual cv::Ptr<FeaturesExtractor> clone() const = 0;
+
     /**
      * @brief Virtual constructor for defined feature extractors.
      * @param id is the feature extractor type to create.
@@ -44,7 +63,8 @@ public:
 
     /**
      * @brief Virtual constructor loading from a file storage.
-     * @param fname is the file storage from which load the feature extractor.
+     * @param fname is the file storage or model file from which load the
+     *        feature extractor.
      * @return a shared ptr to the extractor.
      */
     static cv::Ptr<FeaturesExtractor> create(const std::string& fname);
@@ -75,6 +95,20 @@ public:
      */
     virtual cv::Mat extract_features(const cv::Mat& img) = 0;
 
+    /**
+     * @brief Extract features from a block of images.
+     *
+     * The output must be preallocated (out.rows==rows.rows, the feature
+     * size columns and CV_32FC1) and it may be a view of a bigger matrix,
+     * so overrides must write into it without reallocating.
+     *
+     * @param rows are the input images (one image by row).
+     * @param out is the output, one feature vector by row.
+     * @warning By default this method calls extract_features() for each row.
+     *          Override it if your extractor can process a block at once.
+     */
+    virtual void extract_batch(const cv::Mat& rows, cv::Mat& out);
+
     /**
      * @brief Save the trained data for the feature extractor.
      * 
@@ -87,33 +121,121 @@ public:
      */
     virtual bool save_model(std::string const& fname) const;
 
+    /**
+     * @brief Write the feature type id, the parameters and the trained
+     * state into a storage.
+     *
+     * save_model() uses it, and it is used to write the extractor into the
+     * metadata of a model file.
+     *
+     * @param f is the file storage opened to write.
+     */
+    void write_model(cv::FileStorage& f) const;
+
     /**
      * @brief Load the trained data for the feature extractor.
      * 
      * At least the feature type id and the parameters are load using
      * the labels 'fsiv_feature_id' and 'fsiv_feature_params'.
      * 
-     * @param f is the model filename.
+     * @param f is the model filename. It may be a FileStorage or a
+     *        model file (see ModelFileWriter).
      * @return true if success.     
      */
     virtual bool load_model(std::string const& fname);
 
+    /**
+     * @brief Write the trained state of the extractor.
+     *
+     * It is called by save_model() after writing the feature id and the
+     * parameters. Use 'fsiv_xxxx' labels for your data.
+     *
+     * @param f is the file storage opened to write.
+     * @warning By default this method does nothing. Override if your
+     *          extractor has a trained state.
+     */
+    virtual void write_state(cv::FileStorage& f) const;
+
+    /**
+     * @brief Read the trained state of the extractor.
+     *
+     * It is called by load_model() with the file root node, but the node
+     * may also be a map nested in another model.
+     *
+     * @param node is the node where the state was written.
+     * @warning By default this method does nothing.
+     */
+    virtual void read_state(const cv::FileNode& node);
+
 protected:
     FEATURE_IDS type_;
     std::vector<float> params_;
 };
 
 
+/**
+ * @brief Throughput of a features extraction.
+ */
+struct FeatureExtractionStats
+{
+    int n_images = 0;     // number of processed images.
+    int n_workers = 0;    // number of worker threads used.
+    double seconds = 0.0; // wall time.
+
+    /**
+     * @brief Get the achieved throughput.
+     * @return the number of images processed by second.
+     */
+    double images_per_second() const
+    {
+        return seconds > 0.0 ? n_images / seconds : 0.0;
+    }
+};
+
 /**
  * @brief Extract features from a dataset.
  *
+ * The rows are processed in blocks by as many workers as OpenCV threads
+ * (see cv::setNumThreads). Each worker uses its own clone of the
+ * extractor, so the result is the same as a serial extraction.
+ *
+ * If a quantizer is given, each block is extracted into a float scratch
+ * of the worker and encoded into the output rows, so the CV_32F features
+ * of the whole dataset are never in memory.
+ *
  * @param dt is are the dataset's samples (one sample per row).
  * @param extractor is the features extractor to use.
- * @post ret_v.type()==CV_32FC1
+ * @param stats if not null, it is filled with the achieved throughput.
+ * @param quantizer if not null, the features are stored with its format.
+ * @pre quantizer==nullptr || quantizer->is_fitted()
+ * @post ret_v.type()==CV_32FC1 or quantizer->get_type()
  * @post ret_v.rows==dataset.rows
  */
 cv::Mat fsiv_extract_features (const cv::Mat& dt,
-                               cv::Ptr<FeaturesExtractor>& extractor);
+                               cv::Ptr<FeaturesExtractor>& extractor,
+                               FeatureExtractionStats* stats = nullptr,
+                               const FeatureQuantizer* quantizer = nullptr);
+
+/**
+ * @brief Outputs the throughput of a features extraction.
+ */
+inline std::ostream&
+operator << (std::ostream& out, const FeatureExtractionStats& stats)
+{
+    out << stats.n_images << " images in " << stats.seconds << " s ("
+        << stats.images_per_second() << " images/s, "
+        << stats.n_workers << " workers)";
+    return out;
+}
+
+/**
+ * @brief Get a gray image from a dataset sample.
+ *
+ * @param sample is a dataset row (1x16384) or an image (gray or BGR).
+ * @return a 128x128 (or the image size) CV_8UC1 image. It is a view of
+ * the sample when possible.
+ */
+cv::Mat fsiv_to_gray_image(const cv::Mat& sample);
 
 /**
  * @brief Outputs a parameters vector.
@@ -0,0 +1,516 @@
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <utility>
+#include <vector>
+#include <opencv2/core/utility.hpp>
+#include "flat_forest.hpp"
+
+// Features binned by task and samples by prediction task.
+static const int FOREST_FEATURE_BLOCK = 64;
+static const int FOREST_PREDICT_BLOCK = 256;
+// Encoded samples decoded at once by predict_margins().
+static const int FOREST_DECODE_BLOCK = 4096;
+// Min gain of a split over the parent node score.
+static const double FOREST_MIN_GAIN = 1.0e-7;
+
+FlatForest::FlatForest()
+    : n_trees_(50), active_vars_(0), max_depth_(0), min_samples_leaf_(1), n_bins_(256),
+      n_features_(0), n_classes_(0)
+{
+}
+
+cv::Ptr<FlatForest>
+FlatForest::create(int n_trees, int active_vars, int max_depth, int min_samples_leaf,
+                   int n_bins)
+{
+    CV_Assert(n_trees > 0 && active_vars >= 0 && max_depth >= 0);
+    CV_Assert(min_samples_leaf > 0 && n_bins >= 2 && n_bins <= 256);
+    cv::Ptr<FlatForest> forest = cv::makePtr<FlatForest>();
+    forest->n_trees_ = n_trees;
+    forest->active_vars_ = active_vars;
+    forest->max_depth_ = max_depth;
+    forest->min_samples_leaf_ = min_samples_leaf;
+    forest->n_bins_ = n_bins;
+    return forest;
+}
+
+int FlatForest::get_n_trees() const
+{
+    return n_trees_;
+}
+
+int FlatForest::get_active_vars() const
+{
+    return active_vars_;
+}
+
+int FlatForest::get_max_depth() const
+{
+    return max_depth_;
+}
+
+int FlatForest::get_min_samples_leaf() const
+{
+    return min_samples_leaf_;
+}
+
+int FlatForest::get_n_bins() const
+{
+    return n_bins_;
+}
+
+int FlatForest::get_n_nodes() const
+{
+    return nodes_.rows;
+}
+
+int FlatForest::getVarCount() const
+{
+    return n_features_;
+}
+
+bool FlatForest::isTrained() const
+{
+    return !roots_.empty();
+}
+
+bool FlatForest::isClassifier() const
+{
+    return true;
+}
+
+void FlatForest::clear()
+{
+    nodes_.release();
+    roots_.release();
+    mapping_.reset();
+    n_features_ = 0;
+    n_classes_ = 0;
+}
+
+std::string
+FlatForest::getDefaultName() const
+{
+    return "fsiv_flat_forest";
+}
+
+const ForestNode *
+FlatForest::nodes() const
+{
+    return reinterpret_cast<const ForestNode *>(nodes_.ptr());
+}
+
+void FlatForest::bin_features(const cv::Mat &X, cv::Mat &bins,
+                              std::vector<std::vector<float>> &cuts) const
+{
+    const int N = X.rows;
+    const int D = X.cols;
+    bins.create(D, N, CV_8UC1);
+    cuts.assign(D, std::vector<float>());
+    const int n_blocks = (D + FOREST_FEATURE_BLOCK - 1) / FOREST_FEATURE_BLOCK;
+    cv::parallel_for_(cv::Range(0, n_blocks), [&](const cv::Range &range)
+    {
+        std::vector<float> columns(size_t(FOREST_FEATURE_BLOCK) * N);
+        std::vector<float> sorted(N);
+        for (int b = range.start; b < range.end; ++b)
+        {
+            const int begin = b * FOREST_FEATURE_BLOCK;
+            const int end = std::min(D, begin + FOREST_FEATURE_BLOCK);
+            // Gather the columns reading the rows sequentially.
+            for (int i = 0; i < N; ++i)
+            {
+                const float *x = X.ptr<float>(i);
+                for (int f = begin; f < end; ++f)
+                    columns[size_t(f - begin) * N + i] = x[f];
+            }
+            for (int f = begin; f < end; ++f)
+            {
+                const float *column = &columns[size_t(f - begin) * N];
+                std::copy(column, column + N, sorted.begin());
+                std::sort(sorted.begin(), sorted.end());
+                std::vector<float> &f_cuts = cuts[f];
+                for (int q = 1; q < n_bins_; ++q)
+                {
+                    const float v = sorted[size_t(q) * N / n_bins_];
+                    if (v < sorted.back() && (f_cuts.empty() || v > f_cuts.back()))
+                        f_cuts.push_back(v);
+                }
+                uchar *f_bins = bins.ptr<uchar>(f);
+                for (int i = 0; i < N; ++i)
+                    f_bins[i] = uchar(std::lower_bound(f_cuts.begin(), f_cuts.end(), column[i]) -
+                                      f_cuts.begin());
+            }
+        }
+    });
+}
+
+void FlatForest::grow_tree(const cv::Mat &bins, const std::vector<std::vector<float>> &cuts,
+                           const int *labels, uint64 seed,
+                           std::vector<ForestNode> &nodes) const
+{
+    const int N = bins.cols;
+    const int D = bins.rows;
+    const int C = n_classes_;
+    const int active_vars = active_vars_ > 0 ? std::min(active_vars_, D)
+                                             : std::max(1, int(std::sqrt(double(D))));
+    cv::RNG rng(seed);
+
+    // Bootstrap sample. A node owns a range of it.
+    std::vector<int> samples(N);
+    for (int i = 0; i < N; ++i)
+        samples[i] = rng.uniform(0, N);
+
+    struct Task
+    {
+        int node;
+        int begin;
+        int end;
+        int depth;
+    };
+    std::vector<Task> tasks;
+    tasks.push_back(Task{0, 0, N, 0});
+    nodes.assign(1, ForestNode{-1, 0.0f, 0});
+
+    std::vector<int> features(D);
+    std::iota(features.begin(), features.end(), 0);
+    std::vector<int> counts(C), left(C), hist(size_t(n_bins_) * C);
+    std::vector<std::pair<int, int>> pairs; // (bin, label) of a small node.
+
+    while (!tasks.empty())
+    {
+        const Task task = tasks.back();
+        tasks.pop_back();
+        const int n = task.end - task.begin;
+        std::fill(counts.begin(), counts.end(), 0);
+        for (int s = task.begin; s < task.end; ++s)
+            ++counts[labels[samples[s]]];
+        const int majority = int(std::max_element(counts.begin(), counts.end()) - counts.begin());
+
+        int best_feature = -1;
+        int best_bin = 0;
+        const bool splittable = counts[majority] < n && n >= 2 * min_samples_leaf_ &&
+                                (max_depth_ == 0 || task.depth < max_depth_);
+        if (splittable)
+        {
+            // Maximizing sum(L_c^2)/n_L + sum(R_c^2)/n_R minimizes the
+            // weighted Gini impurity of the children.
+            double parent_score = 0.0;
+            for (int c = 0; c < C; ++c)
+                parent_score += double(counts[c]) * counts[c];
+            double best_score = parent_score / n + FOREST_MIN_GAIN;
+
+            for (int k = 0; k < active_vars; ++k)
+            {
+                std::swap(features[k], features[k + rng.uniform(0, D - k)]);
+                const int f = features[k];
+                const int n_cuts = int(cuts[f].size());
+                if (n_cuts == 0)
+                    continue;
+                const uchar *f_bins = bins.ptr<uchar>(f);
+                std::fill(left.begin(), left.end(), 0);
+                int n_left = 0;
+                auto consider = [&](int bin)
+                {
+                    const int n_right = n - n_left;
+                    if (n_left < min_samples_leaf_ || n_right < min_samples_leaf_)
+                        return;
+                    double l2 = 0.0, r2 = 0.0;
+                    for (int c = 0; c < C; ++c)
+                    {
+                        const double r = counts[c] - left[c];
+                        l2 += double(left[c]) * left[c];
+                        r2 += r * r;
+                    }
+                    const double score = l2 / n_left + r2 / n_right;
+                    if (score > best_score)
+                    {
+                        best_score = score;
+                        best_feature = f;
+                        best_bin = bin;
+                    }
+                };
+
+                if (n < n_cuts)
+                {
+                    // Few samples: sorting them is cheaper than the histogram.
+                    pairs.resize(n);
+                    for (int s = 0; s < n; ++s)
+                    {
+                        const int i = samples[task.begin + s];
+                        pairs[s] = std::make_pair(int(f_bins[i]), labels[i]);
+                    }
+                    std::sort(pairs.begin(), pairs.end());
+                    for (int s = 0; s < n; ++s)
+                    {
+                        ++left[pairs[s].second];
+                        ++n_left;
+                        if (s + 1 < n && pairs[s + 1].first != pairs[s].first)
+                            consider(pairs[s].first);
+                    }
+                }
+                else
+                {
+                    std::fill(hist.begin(), hist.begin() + size_t(n_cuts + 1) * C, 0);
+                    for (int s = task.begin; s < task.end; ++s)
+                    {
+                        const int i = samples[s];
+                        ++hist[size_t(f_bins[i]) * C + labels[i]];
+                    }
+                    for (int bin = 0; bin < n_cuts && n - n_left >= min_samples_leaf_; ++bin)
+                    {
+                        const int *h = &hist[size_t(bin) * C];
+                        int n_bin = 0;
+                        for (int c = 0; c < C; ++c)
+                        {
+                            left[c] += h[c];
+                            n_bin += h[c];
+                        }
+                        n_left += n_bin;
+                        if (n_bin > 0)
+                            consider(bin);
+                    }
+                }
+            }
+        }
+
+        if (best_feature < 0)
+        {
+            nodes[task.node] = ForestNode{-1, 0.0f, majority};
+            continue;
+        }
+        const uchar *f_bins = bins.ptr<uchar>(best_feature);
+        const int mid = int(std::partition(samples.begin() + task.begin,
+                                           samples.begin() + task.end,
+                                           [&](int i) { return f_bins[i] <= best_bin; }) -
+                            samples.begin());
+        const int child = int(nodes.size());
+        nodes.resize(nodes.size() + 2, ForestNode{-1, 0.0f, 0});
+        nodes[task.node] = ForestNode{best_feature, cuts[best_feature][best_bin], child};
+        tasks.push_back(Task{child + 1, mid, task.end, task.depth + 1});
+        tasks.push_back(Task{child, task.begin, mid, task.depth + 1});
+    }
+}
+
+bool FlatForest::train(const cv::Ptr<cv::ml::TrainData> &data, int flags)
+{
+    CV_Assert(data != nullptr);
+    clear();
+    cv::Mat X = data->getTrainSamples(cv::ml::ROW_SAMPLE);
+    if (X.type() != CV_32FC1)
+        X.convertTo(X, CV_32F);
+    cv::Mat labels;
+    data->getTrainResponses().convertTo(labels, CV_32S);
+    CV_Assert(X.rows > 0 && int(labels.total()) == X.rows);
+    labels = labels.reshape(1, X.rows);
+    if (!labels.isContinuous())
+        labels = labels.clone();
+    double min_label = 0.0, max_label = 0.0;
+    cv::minMaxLoc(labels, &min_label, &max_label);
+    CV_Assert(min_label >= 0.0);
+    n_classes_ = int(max_label) + 1;
+    n_features_ = X.cols;
+
+    cv::Mat bins;
+    std::vector<std::vector<float>> cuts;
+    bin_features(X, bins, cuts);
+
+    // The seeds are drawn here, so the forest does not depend on which
+    // thread grows each tree.
+    std::vector<uint64> seeds(n_trees_);
+    for (int t = 0; t < n_trees_; ++t)
+        seeds[t] = uint64(cv::theRNG().next()) + 1;
+    std::vector<std::vector<ForestNode>> trees(n_trees_);
+    cv::parallel_for_(cv::Range(0, n_trees_), [&](const cv::Range &range)
+    {
+        for (int t = range.start; t < range.end; ++t)
+            grow_tree(bins, cuts, labels.ptr<int>(), seeds[t], trees[t]);
+    });
+
+    // Concatenate the trees, moving the children indices.
+    int n_nodes = 0;
+    roots_.create(1, n_trees_, CV_32SC1);
+    for (int t = 0; t < n_trees_; ++t)
+    {
+        roots_.at<int>(t) = n_nodes;
+        n_nodes += int(trees[t].size());
+    }
+    nodes_.create(n_nodes, int(sizeof(ForestNode)), CV_8UC1);
+    ForestNode *all = reinterpret_cast<ForestNode *>(nodes_.ptr());
+    for (int t = 0; t < n_trees_; ++t)
+    {
+        const int root = roots_.at<int>(t);
+        for (size_t k = 0; k < trees[t].size(); ++k)
+        {
+            ForestNode node = trees[t][k];
+            if (node.feature >= 0)
+                node.child += root;
+            all[root + k] = node;
+        }
+    }
+    return isTrained();
+}
+
+void FlatForest::vote(const cv::Mat &X, cv::Mat &votes) const
+{
+    CV_Assert(isTrained());
+    CV_Assert(X.type() == CV_32FC1 && X.cols == n_features_);
+    votes = cv::Mat::zeros(X.rows, n_classes_, CV_32SC1);
+    const ForestNode *all = nodes();
+    const int n_blocks = (X.rows + FOREST_PREDICT_BLOCK - 1) / FOREST_PREDICT_BLOCK;
+    cv::parallel_for_(cv::Range(0, n_blocks), [&](const cv::Range &range)
+    {
+        for (int b = range.start; b < range.end; ++b)
+        {
+            const int begin = b * FOREST_PREDICT_BLOCK;
+            const int end = std::min(X.rows, begin + FOREST_PREDICT_BLOCK);
+            for (int t = 0; t < roots_.cols; ++t)
+            {
+                const int root = roots_.at<int>(t);
+                for (int i = begin; i < end; ++i)
+                {
+                    const float *x = X.ptr<float>(i);
+                    const ForestNode *node = all + root;
+                    while (node->feature >= 0)
+                        node = all + node->child + (x[node->feature] > node->threshold);
+                    ++votes.at<int>(i, node->child);
+                }
+            }
+        }
+    });
+}
+
+void FlatForest::predict_margins(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                 cv::Mat &labels, cv::Mat &margins) const
+{
+    CV_Assert(isTrained());
+    labels.create(X.rows, 1, CV_32SC1);
+    margins.create(X.rows, 1, CV_32FC1);
+    cv::Mat X_f, votes;
+    for (int begin = 0; begin < X.rows; begin += FOREST_DECODE_BLOCK)
+    {
+        const int end = std::min(X.rows, begin + FOREST_DECODE_BLOCK);
+        cv::Mat block = X.rowRange(begin, end);
+        if (block.type() != CV_32FC1)
+        {
+            quantizer.decode(block, X_f);
+            block = X_f;
+        }
+        vote(block, votes);
+        for (int i = begin; i < end; ++i)
+        {
+            const int *v = votes.ptr<int>(i - begin);
+            int first = 0, second = 0;
+            for (int c = 0; c < votes.cols; ++c)
+                if (v[c] > first)
+                {
+                    second = first;
+                    first = v[c];
+                    labels.at<int>(i) = c;
+                }
+                else if (v[c] > second)
+                    second = v[c];
+            if (first == 0)
+                labels.at<int>(i) = 0;
+            margins.at<float>(i) = float(first - second) / float(roots_.cols);
+        }
+    }
+}
+
+void FlatForest::predict_scores(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                cv::Mat &scores) const
+{
+    CV_Assert(isTrained());
+    scores.create(X.rows, n_classes_, CV_32FC1);
+    cv::Mat X_f, votes;
+    for (int begin = 0; begin < X.rows; begin += FOREST_DECODE_BLOCK)
+    {
+        const int end = std::min(X.rows, begin + FOREST_DECODE_BLOCK);
+        cv::Mat block = X.rowRange(begin, end);
+        if (block.type() != CV_32FC1)
+        {
+            quantizer.decode(block, X_f);
+            block = X_f;
+        }
+        vote(block, votes);
+        votes.convertTo(scores.rowRange(begin, end), CV_32F, 1.0 / roots_.cols);
+    }
+}
+
+float FlatForest::predict(cv::InputArray samples, cv::OutputArray results, int flags) const
+{
+    cv::Mat X = samples.getMat();
+    if (X.type() != CV_32FC1)
+        X.convertTo(X, CV_32F);
+    cv::Mat votes;
+    vote(X, votes);
+    cv::Mat labels(X.rows, 1, CV_32FC1);
+    for (int i = 0; i < votes.rows; ++i)
+    {
+        const int *v = votes.ptr<int>(i);
+        labels.at<float>(i) = float(std::max_element(v, v + votes.cols) - v);
+    }
+    if (results.needed())
+        labels.copyTo(results);
+    return labels.empty() ? 0.0f : labels.at<float>(0);
+}
+
+void FlatForest::write_params(cv::FileStorage &fs) const
+{
+    fs << "fsiv_forest_n_trees" << n_trees_;
+    fs << "fsiv_forest_active_vars" << active_vars_;
+    fs << "fsiv_forest_max_depth" << max_depth_;
+    fs << "fsiv_forest_min_samples_leaf" << min_samples_leaf_;
+    fs << "fsiv_forest_n_bins" << n_bins_;
+    fs << "fsiv_forest_n_features" << n_features_;
+    fs << "fsiv_forest_n_classes" << n_classes_;
+}
+
+void FlatForest::read_params(const cv::FileNode &fn)
+{
+    auto classes_node = fn["fsiv_forest_n_classes"];
+    if (classes_node.empty())
+        throw std::runtime_error("Could not load the 'fsiv_forest_n_classes' label from file.");
+    n_trees_ = int(fn["fsiv_forest_n_trees"]);
+    active_vars_ = int(fn["fsiv_forest_active_vars"]);
+    max_depth_ = int(fn["fsiv_forest_max_depth"]);
+    min_samples_leaf_ = int(fn["fsiv_forest_min_samples_leaf"]);
+    n_bins_ = int(fn["fsiv_forest_n_bins"]);
+    n_features_ = int(fn["fsiv_forest_n_features"]);
+    n_classes_ = int(classes_node);
+}
+
+void FlatForest::write(cv::FileStorage &fs) const
+{
+    write_params(fs);
+    fs << "fsiv_forest_roots" << roots_;
+    fs << "fsiv_forest_nodes" << nodes_;
+}
+
+void FlatForest::read(const cv::FileNode &fn)
+{
+    clear();
+    read_params(fn);
+    fn["fsiv_forest_roots"] >> roots_;
+    fn["fsiv_forest_nodes"] >> nodes_;
+    CV_Assert(roots_.type() == CV_32SC1 && nodes_.type() == CV_8UC1);
+    CV_Assert(nodes_.cols == int(sizeof(ForestNode)) && nodes_.isContinuous());
+}
+
+void FlatForest::write_mapped(cv::FileStorage &fs, ModelFileWriter &out) const
+{
+    write_params(fs);
+    out.add_section("fsiv_forest_roots", roots_);
+    out.add_section("fsiv_forest_nodes", nodes_);
+}
+
+void FlatForest::read_mapped(const cv::FileNode &fn, const ModelFileReader &in)
+{
+    clear();
+    read_params(fn);
+    roots_ = in.get_section("fsiv_forest_roots");
+    nodes_ = in.get_section("fsiv_forest_nodes");
+    mapping_ = in.mapping();
+    CV_Assert(roots_.type() == CV_32SC1 && nodes_.type() == CV_8UC1);
+    CV_Assert(nodes_.cols == int(sizeof(ForestNode)) && nodes_.isContinuous());
+}
@@ -0,0 +1,141 @@
+/**
+ *  @file flat_forest.hpp
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/ml.hpp>
+#include "classifiers.hpp"
+#include "model_file.hpp"
+
+/**
+ * @brief Node of a FlatForest tree.
+ */
+struct ForestNode
+{
+    std::int32_t feature; // -1 for a leaf.
+    float threshold;      // go to the left child if x[feature] <= threshold.
+    std::int32_t child;   // left child index (the right one follows) or the leaf label.
+};
+
+/**
+ * @brief Random forest classifier with the trees grown in parallel.
+ *
+ * Before growing, each feature is binned in up to 256 quantile bins
+ * (a histogram split only scans the bins, not the sorted values) and the
+ * trees are grown concurrently (see cv::setNumThreads), each one with its
+ * bootstrap sample, active_vars random features by node and the Gini
+ * impurity.
+ *
+ * All the nodes of all the trees are stored in one flat array with the two
+ * children of a node next to each other. A prediction walks a block of
+ * samples through a tree before going to the next one, so the tree stays
+ * in the cache, and the blocks are evaluated in parallel.
+ */
+class FlatForest : public cv::ml::StatModel, public MappableModel,
+                   public MarginModel
+{
+public:
+    FlatForest();
+
+    /**
+     * @brief Create an untrained classifier.
+     *
+     * Needed by cv::Algorithm::load<FlatForest>().
+     * @param n_trees is the number of trees.
+     * @param active_vars is the number of random features tried by node (0
+     * means sqrt(number of features)).
+     * @param max_depth is the max depth of a tree (0 means no limit).
+     * @param min_samples_leaf is the min number of samples of a leaf.
+     * @param n_bins is the max number of bins by feature (2..256).
+     */
+    static cv::Ptr<FlatForest> create(int n_trees = 50, int active_vars = 0,
+                                      int max_depth = 0, int min_samples_leaf = 1,
+                                      int n_bins = 256);
+
+    int get_n_trees() const;
+    int get_active_vars() const;
+    int get_max_depth() const;
+    int get_min_samples_leaf() const;
+    int get_n_bins() const;
+
+    /**
+     * @brief Get the number of nodes of all the trees.
+     */
+    int get_n_nodes() const;
+
+    using cv::ml::StatModel::train;
+    virtual bool train(const cv::Ptr<cv::ml::TrainData> &data, int flags = 0) override;
+    virtual float predict(cv::InputArray samples, cv::OutputArray results = cv::noArray(),
+                          int flags = 0) const override;
+    virtual int getVarCount() const override;
+    virtual bool isTrained() const override;
+    virtual bool isClassifier() const override;
+    virtual void clear() override;
+    virtual void write(cv::FileStorage &fs) const override;
+    virtual void read(const cv::FileNode &fn) override;
+    virtual std::string getDefaultName() const override;
+    virtual void write_mapped(cv::FileStorage &fs, ModelFileWriter &out) const override;
+    virtual void read_mapped(const cv::FileNode &fn, const ModelFileReader &in) override;
+
+    /**
+     * @brief Count the votes of the trees.
+     * @param X are the samples (CV_32FC1).
+     * @param votes are the votes (CV_32SC1, X.rows x classes).
+     */
+    void vote(const cv::Mat &X, cv::Mat &votes) const;
+
+    /**
+     * @brief Predict with the gap between the vote fractions of the two most
+     * voted classes as margin.
+     */
+    virtual void predict_margins(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                 cv::Mat &labels, cv::Mat &margins) const override;
+
+    /**
+     * @brief Predict the class scores (the vote fractions).
+     */
+    virtual void predict_scores(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                cv::Mat &scores) const override;
+
+protected:
+
+    /**
+     * @brief Bin the features.
+     * @param X are the samples (CV_32FC1).
+     * @param bins are the bin of each value (CV_8UC1, features x samples).
+     * @param cuts are the upper values of the bins of each feature (the last
+     * bin has not upper value).
+     */
+    void bin_features(const cv::Mat &X, cv::Mat &bins,
+                      std::vector<std::vector<float>> &cuts) const;
+
+    /**
+     * @brief Grow a tree.
+     * @param bins are the binned features.
+     * @param cuts are the upper values of the bins.
+     * @param labels are the labels of the samples.
+     * @param seed is the seed of the bootstrap sample and features.
+     * @param nodes are the tree nodes (the root is the first one).
+     */
+    void grow_tree(const cv::Mat &bins, const std::vector<std::vector<float>> &cuts,
+                   const int *labels, uint64 seed, std::vector<ForestNode> &nodes) const;
+
+    const ForestNode *nodes() const;
+    void write_params(cv::FileStorage &fs) const;
+    void read_params(const cv::FileNode &fn);
+
+    int n_trees_;
+    int active_vars_;
+    int max_depth_;
+    int min_samples_leaf_;
+    int n_bins_;
+    int n_features_;
+    int n_classes_;
+    cv::Mat nodes_; // Nx(sizeof(ForestNode)) CV_8UC1, all the trees.
+    cv::Mat roots_; // 1xT CV_32SC1, root node of each tree.
+    std::shared_ptr<MappedFile> mapping_; // owner of the mapped sections, if loaded.
+};
@@ -19,6 +19,9 @@ GrayLevelsFeatures::get_extractor_name () const
             throw std::runtime_error("unknown type of gray level extractor.");
             break;
     }
+    if (get_downscaled_size() > 0)
+        name += " Downscaled to " + std::to_string(get_downscaled_size()) + "x" +
+                std::to_string(get_downscaled_size()) + ".";
     return name;
 }
 
@@ -70,6 +73,34 @@ fsiv_extract_mean_stddev_normalized_gray_levels(cv::Mat const& img)
     return feature;
 }
 
+void
+fsiv_extract_graylevels_batch(const cv::Mat& rows, cv::Mat& out, int mode)
+{
+    CV_Assert(rows.type()==CV_8UC1);
+    CV_Assert(out.rows==rows.rows && out.cols==rows.cols && out.type()==CV_32FC1);
+    switch (mode)
+    {
+        case 0:
+            // The whole block is converted in one pass.
+            rows.convertTo(out, CV_32F, 1.0 / 255.0);
+            break;
+        case 1:
+            for (int i = 0; i < rows.rows; ++i)
+            {
+                cv::Scalar mean, stddev;
+                cv::meanStdDev(rows.row(i), mean, stddev);
+                cv::Mat feature = out.row(i);
+                rows.row(i).convertTo(feature, CV_32F, 1.0, -mean[0]);
+                feature = feature / (stddev[0] + 1e-6);
+            }
+            break;
+        default:
+            throw std::runtime_error("Unknown gray level feature extractor type: "
+                + std::to_string(mode));
+            break;
+    }
+}
+
 GrayLevelsFeatures::GrayLevelsFeatures()
 {
     type_ = FSIV_GREY_LEVELS;
@@ -78,17 +109,36 @@ GrayLevelsFeatures::GrayLevelsFeatures()
 
 GrayLevelsFeatures::~GrayLevelsFeatures() {}
 
+cv::Ptr<FeaturesExtractor>
+GrayLevelsFeatures::clone() const
+{
+    cv::Ptr<GrayLevelsFeatures> extractor = cv::makePtr<GrayLevelsFeatures>(*this);
+    extractor->small_ = cv::Mat();
+    return extractor;
+}
+
+int
+GrayLevelsFeatures::get_downscaled_size() const
+{
+    return (params_.size() > 1 && params_[1] > 0.0f) ? int(params_[1]) : 0;
+}
+
 cv::Mat
 GrayLevelsFeatures::extract_features(const cv::Mat& img)
 {    
     cv::Mat feature;
+    cv::Mat src = img;
+    const int S = get_downscaled_size();
+    if (S > 0)
+        cv::resize(fsiv_to_gray_image(img), src, cv::Size(S, S), 0.0, 0.0,
+                   cv::INTER_AREA);
     switch (int(params_[0]))
     {
         case 0:
-            feature = fsiv_extract_01_normalized_graylevels(img);
+            feature = fsiv_extract_01_normalized_graylevels(src);
             break;
         case 1:
-            feature = fsiv_extract_mean_stddev_normalized_gray_levels(img);
+            feature = fsiv_extract_mean_stddev_normalized_gray_levels(src);
             break;
         default:
             throw std::runtime_error("Unknown gray level feature extractor type: " 
@@ -99,3 +149,24 @@ GrayLevelsFeatures::extract_features(const cv::Mat& img)
     CV_Assert(feature.type()==CV_32FC1);
     return feature;
 }
+
+void
+GrayLevelsFeatures::extract_batch(const cv::Mat& rows, cv::Mat& out)
+{
+    const int S = get_downscaled_size();
+    if (S > 0)
+    {
+        CV_Assert(out.rows == rows.rows && out.cols == S * S);
+        for (int i = 0; i < rows.rows; ++i)
+        {
+            cv::resize(fsiv_to_gray_image(rows.row(i)), small_, cv::Size(S, S),
+                       0.0, 0.0, cv::INTER_AREA);
+            cv::Mat feature = out.row(i);
+            fsiv_extract_graylevels_batch(small_.reshape(1, 1), feature, int(params_[0]));
+        }
+    }
+    else if (rows.channels() != 1)
+        FeaturesExtractor::extract_batch(rows, out);
+    else
+        fsiv_extract_graylevels_batch(rows, out, int(params_[0]));
+}
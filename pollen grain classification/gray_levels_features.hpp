@@ -3,6 +3,13 @@
 
 #include "features.hpp"
 
+/**
+ * @brief Gray levels features.
+ *
+ * Parameters: [M, S] where M=0 means [0,1] normalized and M=1 mean/stddev
+ * normalized. If S>0 the image is first downscaled to SxS (area
+ * interpolation), else the full image is used (default).
+ */
 class GrayLevelsFeatures: public FeaturesExtractor
 {
 public:
@@ -13,11 +20,30 @@ public:
     ~GrayLevelsFeatures();
 
     virtual std::string get_extractor_name() const override;
+    virtual cv::Ptr<FeaturesExtractor> clone() const override;
     virtual cv::Mat extract_features(const cv::Mat& img) override;
+    virtual void extract_batch(const cv::Mat& rows, cv::Mat& out) override;
 
+    /**
+     * @brief Get the side of the downscaled image (0 means no downscaling).
+     */
+    int get_downscaled_size() const;
 
+protected:
+    cv::Mat small_; // scratch: downscaled image.
 };
 
 cv::Mat fsiv_extract_01_normalized_graylevels(const cv::Mat& img);
 
 cv::Mat fsiv_extract_mean_stddev_normalized_gray_levels(const cv::Mat& img);
+
+/**
+ * @brief Extract gray levels features from a block of gray images.
+ *
+ * Each row gives the same result than the single image functions.
+ *
+ * @param rows are the images (one by row, CV_8UC1).
+ * @param out is the preallocated output (CV_32FC1, same rows).
+ * @param mode 0 means [0,1] normalized, 1 means mean/stddev normalized.
+ */
+void fsiv_extract_graylevels_batch(const cv::Mat& rows, cv::Mat& out, int mode);
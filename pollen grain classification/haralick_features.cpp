@@ -0,0 +1,151 @@
+#include <cmath>
+#include "haralick_features.hpp"
+
+static const int HARALICK_DISTANCES[] = {1, 2, 4};
+static const int HARALICK_N_OFFSETS = 12; // 3 distances x 4 angles.
+static const int HARALICK_N_STATS = 5;
+static const int HARALICK_PAD = 4;        // max distance.
+
+HaralickFeatures::HaralickFeatures()
+{
+    type_ = FSIV_HARALICK;
+    params_ = {16.0};
+}
+
+HaralickFeatures::~HaralickFeatures() {}
+
+cv::Ptr<FeaturesExtractor>
+HaralickFeatures::clone() const
+{
+    return cv::makePtr<HaralickFeatures>(*this);
+}
+
+std::string
+HaralickFeatures::get_extractor_name() const
+{
+    return "Haralick GLCM features L=" + std::to_string(get_n_levels()) + ".";
+}
+
+int HaralickFeatures::get_n_levels() const
+{
+    const int L = (params_.size() > 0 && params_[0] > 0.0f) ? int(params_[0]) : 16;
+    CV_Assert(1 < L && L <= 64);
+    return L;
+}
+
+int HaralickFeatures::get_feature_size() const
+{
+    return HARALICK_N_OFFSETS * HARALICK_N_STATS;
+}
+
+void HaralickFeatures::compute(const cv::Mat &img, float *feature)
+{
+    CV_Assert(img.type() == CV_8UC1);
+    const int L = get_n_levels();
+    const int S = L + 1; // level L marks the padding.
+    const int W = img.cols;
+    const int H = img.rows;
+    const int PW = W + 2 * HARALICK_PAD;
+    const int PH = H + 2 * HARALICK_PAD;
+
+    uchar lut[256];
+    for (int v = 0; v < 256; ++v)
+        lut[v] = uchar((v * L) >> 8);
+
+    // Quantized image surrounded by a padding level, so the counting loop
+    // needs no bounds checks. Pairs with the padding level are ignored.
+    quantized_.assign(size_t(PW) * PH, uchar(L));
+    for (int y = 0; y < H; ++y)
+    {
+        const uchar *src = img.ptr<uchar>(y);
+        uchar *dst = &quantized_[(y + HARALICK_PAD) * PW + HARALICK_PAD];
+        for (int x = 0; x < W; ++x)
+            dst[x] = lut[src[x]];
+    }
+
+    // Angles 0, 45, 90 and 135 degrees for each distance.
+    int delta[HARALICK_N_OFFSETS];
+    for (int k = 0; k < 3; ++k)
+    {
+        const int d = HARALICK_DISTANCES[k];
+        delta[k * 4 + 0] = d;
+        delta[k * 4 + 1] = -d * PW + d;
+        delta[k * 4 + 2] = -d * PW;
+        delta[k * 4 + 3] = -d * PW - d;
+    }
+
+    // All the offsets are counted in the same pass over the image.
+    const int SS = S * S;
+    counts_.assign(size_t(HARALICK_N_OFFSETS) * SS, 0);
+    std::uint32_t *counts = counts_.data();
+    for (int y = 0; y < H; ++y)
+    {
+        const uchar *q = &quantized_[(y + HARALICK_PAD) * PW + HARALICK_PAD];
+        for (int x = 0; x < W; ++x)
+        {
+            const int a = q[x] * S;
+            for (int o = 0; o < HARALICK_N_OFFSETS; ++o)
+                ++counts[o * SS + a + q[x + delta[o]]];
+        }
+    }
+
+    for (int o = 0; o < HARALICK_N_OFFSETS; ++o)
+    {
+        const std::uint32_t *c = counts + o * SS;
+        // Symmetric matrix P(i,j) = C(i,j) + C(j,i).
+        double total = 0.0;
+        for (int i = 0; i < L; ++i)
+            for (int j = 0; j < L; ++j)
+                total += double(c[i * S + j]) + double(c[j * S + i]);
+        const double inv_total = total > 0.0 ? 1.0 / total : 0.0;
+
+        double contrast = 0.0, energy = 0.0, homogeneity = 0.0, entropy = 0.0;
+        double mean = 0.0, sum_ij = 0.0, sum_ii = 0.0;
+        for (int i = 0; i < L; ++i)
+        {
+            for (int j = 0; j < L; ++j)
+            {
+                const std::uint32_t n = c[i * S + j] + c[j * S + i];
+                if (n == 0)
+                    continue;
+                const double p = n * inv_total;
+                const double d2 = double((i - j) * (i - j));
+                contrast += d2 * p;
+                energy += p * p;
+                homogeneity += p / (1.0 + d2);
+                entropy -= p * std::log(p);
+                mean += i * p;
+                sum_ii += double(i * i) * p;
+                sum_ij += double(i * j) * p;
+            }
+        }
+        // Being symmetric, both marginals have the same mean and variance.
+        const double var = sum_ii - mean * mean;
+        const double correlation = var > 1.0e-12 ? (sum_ij - mean * mean) / var : 0.0;
+
+        float *f = feature + o * HARALICK_N_STATS;
+        f[0] = float(contrast);
+        f[1] = float(correlation);
+        f[2] = float(energy);
+        f[3] = float(homogeneity);
+        f[4] = float(entropy);
+    }
+}
+
+cv::Mat
+HaralickFeatures::extract_features(const cv::Mat &img)
+{
+    cv::Mat feature(1, get_feature_size(), CV_32FC1);
+    compute(fsiv_to_gray_image(img), feature.ptr<float>());
+    CV_Assert(feature.rows==1);
+    CV_Assert(feature.type()==CV_32FC1);
+    return feature;
+}
+
+void HaralickFeatures::extract_batch(const cv::Mat &rows, cv::Mat &out)
+{
+    CV_Assert(out.rows == rows.rows && out.cols == get_feature_size());
+    CV_Assert(out.type() == CV_32FC1);
+    for (int i = 0; i < rows.rows; ++i)
+        compute(fsiv_to_gray_image(rows.row(i)), out.ptr<float>(i));
+}
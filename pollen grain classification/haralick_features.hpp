@@ -0,0 +1,56 @@
+/**
+ *  @file haralick_features.hpp
+ */
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "features.hpp"
+
+/**
+ * @brief Haralick texture features from gray level co-occurrence matrices.
+ *
+ * The image is quantized to L gray levels and a symmetric co-occurrence
+ * matrix is computed for each distance d in {1,2,4} and angle in
+ * {0,45,90,135} degrees. From each matrix the contrast, correlation,
+ * energy (angular second moment), homogeneity and entropy are computed,
+ * giving 12*5=60 features.
+ *
+ * Parameters: [L]. Default (or values <= 0) L=16. L must be <= 64.
+ */
+class HaralickFeatures: public FeaturesExtractor
+{
+public:
+    /**
+     * @brief Create and set the default parameters.
+     */
+    HaralickFeatures();
+    ~HaralickFeatures();
+
+    virtual std::string get_extractor_name() const override;
+    virtual cv::Ptr<FeaturesExtractor> clone() const override;
+    virtual cv::Mat extract_features(const cv::Mat& img) override;
+    virtual void extract_batch(const cv::Mat& rows, cv::Mat& out) override;
+
+    /**
+     * @brief Get the number of quantization levels.
+     */
+    int get_n_levels() const;
+
+    /**
+     * @brief Get the size of the feature vector.
+     */
+    int get_feature_size() const;
+
+protected:
+
+    /**
+     * @brief Compute the features of a gray image.
+     * @param img is a CV_8UC1 image.
+     * @param feature points to the output (get_feature_size() floats).
+     */
+    void compute(const cv::Mat& img, float* feature);
+
+    std::vector<uchar> quantized_;      // scratch: padded quantized image.
+    std::vector<std::uint32_t> counts_; // scratch: co-occurrence counts.
+};
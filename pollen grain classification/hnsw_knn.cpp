@@ -0,0 +1,703 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <string>
+#include <opencv2/core/utility.hpp>
+#include "hnsw_knn.hpp"
+#include "exact_knn.hpp"
+
+// Nodes inserted serially before the parallel build, so the first
+// parallel insertions find a connected graph.
+static const int HNSW_SERIAL_INSERTIONS = 256;
+static const int HNSW_QUERY_BLOCK = 64;
+
+/**
+ * @brief Per thread search state.
+ */
+struct HnswKNN::Scratch
+{
+    std::vector<unsigned> visited; // visited[n]==tag if visited.
+    unsigned tag = 0;
+    std::vector<int> neighbours;   // copy of a links list.
+    std::vector<Neighbour> candidates;
+    std::vector<int> selected;
+    cv::Mat query;                 // decoded query.
+    cv::Mat other;                 // decoded sample.
+    cv::Mat base;                  // decoded sample.
+
+    explicit Scratch(int n = 0) : visited(n, 0) {}
+
+    /**
+     * @brief Fit the visited tags to a graph of n nodes. They are only
+     * cleared when n changes, otherwise new_search() is enough.
+     */
+    void resize(int n)
+    {
+        if (int(visited.size()) != n)
+        {
+            visited.assign(n, 0);
+            tag = 0;
+        }
+    }
+
+    void new_search()
+    {
+        if (++tag == 0)
+        {
+            std::fill(visited.begin(), visited.end(), 0);
+            tag = 1;
+        }
+    }
+};
+
+HnswKNN::HnswKNN()
+    : K_(1), M_(16), ef_construction_(200), ef_(64), n_classes_(0),
+      entry_(-1), max_level_(-1)
+{
+}
+
+cv::Ptr<HnswKNN>
+HnswKNN::create(int K, int M, int ef_construction, int ef)
+{
+    cv::Ptr<HnswKNN> knn = cv::makePtr<HnswKNN>();
+    knn->setDefaultK(K);
+    knn->set_M(M);
+    knn->set_ef_construction(ef_construction);
+    knn->set_ef(ef);
+    return knn;
+}
+
+void HnswKNN::setDefaultK(int K)
+{
+    CV_Assert(K > 0);
+    K_ = K;
+}
+
+int HnswKNN::getDefaultK() const
+{
+    return K_;
+}
+
+void HnswKNN::set_M(int M)
+{
+    CV_Assert(M >= 2);
+    M_ = M;
+}
+
+int HnswKNN::get_M() const
+{
+    return M_;
+}
+
+void HnswKNN::set_ef_construction(int ef_construction)
+{
+    CV_Assert(ef_construction > 0);
+    ef_construction_ = ef_construction;
+}
+
+int HnswKNN::get_ef_construction() const
+{
+    return ef_construction_;
+}
+
+void HnswKNN::set_ef(int ef)
+{
+    CV_Assert(ef > 0);
+    ef_ = ef;
+}
+
+int HnswKNN::get_ef() const
+{
+    return ef_;
+}
+
+int HnswKNN::getVarCount() const
+{
+    return samples_.cols;
+}
+
+bool HnswKNN::isTrained() const
+{
+    return !samples_.empty();
+}
+
+bool HnswKNN::isClassifier() const
+{
+    return true;
+}
+
+void HnswKNN::clear()
+{
+    samples_.release();
+    labels_.release();
+    levels_.clear();
+    links0_.clear();
+    upper_.clear();
+    mapping_.reset();
+    entry_ = -1;
+    max_level_ = -1;
+    n_classes_ = 0;
+}
+
+std::string
+HnswKNN::getDefaultName() const
+{
+    return "fsiv_hnsw_knn";
+}
+
+const cv::Mat &
+HnswKNN::get_samples() const
+{
+    return samples_;
+}
+
+const cv::Mat &
+HnswKNN::get_labels() const
+{
+    return labels_;
+}
+
+const FeatureQuantizer &
+HnswKNN::get_quantizer() const
+{
+    return quantizer_;
+}
+
+int *HnswKNN::links(int node, int level)
+{
+    if (level == 0)
+        return &links0_[size_t(node) * (1 + 2 * M_)];
+    return &upper_[node][size_t(level - 1) * (1 + M_)];
+}
+
+const int *HnswKNN::links(int node, int level) const
+{
+    if (level == 0)
+        return &links0_[size_t(node) * (1 + 2 * M_)];
+    return &upper_[node][size_t(level - 1) * (1 + M_)];
+}
+
+const float *HnswKNN::decode_row(int node, cv::Mat &buffer) const
+{
+    if (samples_.type() == CV_32FC1)
+        return samples_.ptr<float>(node);
+    quantizer_.decode(samples_.row(node), buffer);
+    return buffer.ptr<float>();
+}
+
+void HnswKNN::greedy_search(const float *q, int top_level, int bottom_level,
+                            int &ep, float &ep_dist,
+                            std::vector<std::mutex> *locks) const
+{
+    for (int level = top_level; level > bottom_level; --level)
+    {
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            std::unique_lock<std::mutex> lock;
+            if (locks != nullptr)
+                lock = std::unique_lock<std::mutex>((*locks)[ep]);
+            const int *l = links(ep, level);
+            for (int j = 1; j <= l[0]; ++j)
+            {
+                const float d = quantizer_.l2sqr(samples_, l[j], q);
+                if (d < ep_dist)
+                {
+                    ep_dist = d;
+                    ep = l[j];
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+void HnswKNN::search_layer(const float *q, int ep, float ep_dist, int ef, int level,
+                           Scratch &s, std::vector<std::mutex> *locks,
+                           std::vector<Neighbour> &result) const
+{
+    s.new_search();
+    // Min-heap of nodes to expand and max-heap of the ef nearest found.
+    std::priority_queue<Neighbour, std::vector<Neighbour>, std::greater<Neighbour>> candidates;
+    std::priority_queue<Neighbour> nearest;
+    candidates.emplace(ep_dist, ep);
+    nearest.emplace(ep_dist, ep);
+    s.visited[ep] = s.tag;
+
+    while (!candidates.empty())
+    {
+        const Neighbour c = candidates.top();
+        if (c.first > nearest.top().first && int(nearest.size()) >= ef)
+            break;
+        candidates.pop();
+        {
+            std::unique_lock<std::mutex> lock;
+            if (locks != nullptr)
+                lock = std::unique_lock<std::mutex>((*locks)[c.second]);
+            const int *l = links(c.second, level);
+            s.neighbours.assign(l + 1, l + 1 + l[0]);
+        }
+        for (int n : s.neighbours)
+        {
+            if (s.visited[n] == s.tag)
+                continue;
+            s.visited[n] = s.tag;
+            const float d = quantizer_.l2sqr(samples_, n, q);
+            if (int(nearest.size()) < ef || d < nearest.top().first)
+            {
+                candidates.emplace(d, n);
+                nearest.emplace(d, n);
+                if (int(nearest.size()) > ef)
+                    nearest.pop();
+            }
+        }
+    }
+
+    result.resize(nearest.size());
+    for (int i = int(result.size()) - 1; i >= 0; --i)
+    {
+        result[i] = nearest.top();
+        nearest.pop();
+    }
+}
+
+void HnswKNN::select_neighbours(const std::vector<Neighbour> &candidates, int m,
+                                Scratch &s, std::vector<int> &selected) const
+{
+    // Keep a candidate only if it is nearer to the base than to any
+    // selected one, so the links spread in different directions.
+    selected.clear();
+    for (const Neighbour &c : candidates)
+    {
+        if (int(selected.size()) >= m)
+            break;
+        const float *v = decode_row(c.second, s.other);
+        bool keep = true;
+        for (int r : selected)
+        {
+            if (quantizer_.l2sqr(samples_, r, v) < c.first)
+            {
+                keep = false;
+                break;
+            }
+        }
+        if (keep)
+            selected.push_back(c.second);
+    }
+}
+
+void HnswKNN::connect(int node, int level, const std::vector<int> &neighbours,
+                      Scratch &s, std::vector<std::mutex> &locks)
+{
+    const int m_max = level == 0 ? 2 * M_ : M_;
+    {
+        std::lock_guard<std::mutex> lock(locks[node]);
+        int *l = links(node, level);
+        l[0] = int(neighbours.size());
+        std::copy(neighbours.begin(), neighbours.end(), l + 1);
+    }
+    for (int n : neighbours)
+    {
+        std::lock_guard<std::mutex> lock(locks[n]);
+        int *l = links(n, level);
+        if (l[0] < m_max)
+        {
+            l[1 + l[0]] = node;
+            ++l[0];
+            continue;
+        }
+        // The list is full: select again among the old links and the node.
+        const float *v = decode_row(n, s.base);
+        s.candidates.clear();
+        s.candidates.emplace_back(quantizer_.l2sqr(samples_, node, v), node);
+        for (int j = 1; j <= l[0]; ++j)
+            s.candidates.emplace_back(quantizer_.l2sqr(samples_, l[j], v), l[j]);
+        std::sort(s.candidates.begin(), s.candidates.end());
+        select_neighbours(s.candidates, m_max, s, s.selected);
+        l[0] = int(s.selected.size());
+        std::copy(s.selected.begin(), s.selected.end(), l + 1);
+    }
+}
+
+void HnswKNN::insert(int node, Scratch &s, std::vector<std::mutex> &locks,
+                     std::mutex &global)
+{
+    const int level = levels_[node];
+    const float *q = decode_row(node, s.query);
+
+    // The global lock is kept while inserting a node above the top layer.
+    std::unique_lock<std::mutex> global_lock(global);
+    const int max_level = max_level_;
+    int ep = entry_;
+    if (level <= max_level)
+        global_lock.unlock();
+
+    float ep_dist = quantizer_.l2sqr(samples_, ep, q);
+    greedy_search(q, max_level, level, ep, ep_dist, &locks);
+    std::vector<Neighbour> nearest;
+    for (int l = std::min(level, max_level); l >= 0; --l)
+    {
+        search_layer(q, ep, ep_dist, ef_construction_, l, s, &locks, nearest);
+        std::vector<int> selected;
+        select_neighbours(nearest, M_, s, selected);
+        connect(node, l, selected, s, locks);
+        ep = nearest[0].second;
+        ep_dist = nearest[0].first;
+    }
+
+    if (level > max_level)
+    {
+        entry_ = node;
+        max_level_ = level;
+    }
+}
+
+void HnswKNN::build()
+{
+    const int N = samples_.rows;
+    const double level_mult = 1.0 / std::log(double(M_));
+    cv::RNG &rng = cv::theRNG();
+    levels_.resize(N);
+    links0_.assign(size_t(N) * (1 + 2 * M_), 0);
+    upper_.assign(N, std::vector<int>());
+    for (int i = 0; i < N; ++i)
+    {
+        const double u = rng.uniform(1.0e-12, 1.0);
+        levels_[i] = std::min(16, int(-std::log(u) * level_mult));
+        if (levels_[i] > 0)
+            upper_[i].assign(size_t(levels_[i]) * (1 + M_), 0);
+    }
+
+    entry_ = 0;
+    max_level_ = levels_[0];
+    std::vector<std::mutex> locks(N);
+    std::mutex global;
+    const int n_serial = std::min(N, HNSW_SERIAL_INSERTIONS);
+    {
+        Scratch s(N);
+        for (int i = 1; i < n_serial; ++i)
+            insert(i, s, locks, global);
+    }
+    cv::parallel_for_(cv::Range(n_serial, N), [&](const cv::Range &range)
+    {
+        Scratch s(N);
+        for (int i = range.start; i < range.end; ++i)
+            insert(i, s, locks, global);
+    }, std::max(1, cv::getNumThreads() * 8));
+}
+
+void HnswKNN::train_encoded(const cv::Mat &X, const cv::Mat &y,
+                            const FeatureQuantizer &quantizer)
+{
+    CV_Assert(!X.empty() && X.type() == quantizer.get_type());
+    CV_Assert(y.rows == X.rows && y.cols == 1);
+    quantizer_ = quantizer;
+    samples_ = X;
+    y.convertTo(labels_, CV_32S);
+    double min_label = 0.0, max_label = 0.0;
+    cv::minMaxLoc(labels_, &min_label, &max_label);
+    CV_Assert(min_label >= 0.0);
+    n_classes_ = int(max_label) + 1;
+    build();
+}
+
+bool HnswKNN::train(const cv::Ptr<cv::ml::TrainData> &data, int flags)
+{
+    CV_Assert(data != nullptr);
+    cv::Mat X = data->getTrainSamples(cv::ml::ROW_SAMPLE);
+    if (X.type() != CV_32FC1)
+        X.convertTo(X, CV_32F);
+    train_encoded(X, data->getTrainResponses(), FeatureQuantizer());
+    return isTrained();
+}
+
+void HnswKNN::search(const cv::Mat &X, const FeatureQuantizer &quantizer, int k,
+                     cv::Mat &indices, cv::Mat &dists) const
+{
+    CV_Assert(isTrained());
+    CV_Assert(X.type() == quantizer.get_type() && X.cols == samples_.cols);
+    CV_Assert(k > 0);
+    const int M = X.rows;
+    indices.create(M, k, CV_32SC1);
+    dists.create(M, k, CV_32FC1);
+    const int ef = std::max(ef_, k);
+
+    const int n_blocks = (M + HNSW_QUERY_BLOCK - 1) / HNSW_QUERY_BLOCK;
+    cv::parallel_for_(cv::Range(0, n_blocks), [&](const cv::Range &range)
+    {
+        // Kept by each worker thread across calls, so a predict of a few
+        // queries does not allocate and clear N tags every time.
+        thread_local Scratch s;
+        s.resize(samples_.rows);
+        cv::Mat &query = s.query;
+        std::vector<Neighbour> nearest;
+        for (int b = range.start; b < range.end; ++b)
+        {
+            const int end = std::min(M, (b + 1) * HNSW_QUERY_BLOCK);
+            for (int i = b * HNSW_QUERY_BLOCK; i < end; ++i)
+            {
+                quantizer.decode(X.row(i), query);
+                const float *q = query.ptr<float>();
+                int ep = entry_;
+                float ep_dist = quantizer_.l2sqr(samples_, ep, q);
+                greedy_search(q, max_level_, 0, ep, ep_dist, nullptr);
+                search_layer(q, ep, ep_dist, ef, 0, s, nullptr, nearest);
+
+                int *idx = indices.ptr<int>(i);
+                float *dist = dists.ptr<float>(i);
+                for (int j = 0; j < k; ++j)
+                {
+                    const bool found = j < int(nearest.size());
+                    idx[j] = found ? nearest[j].second : -1;
+                    dist[j] = found ? nearest[j].first : FLT_MAX;
+                }
+            }
+        }
+    });
+}
+
+void HnswKNN::predict_encoded(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                              cv::Mat &labels) const
+{
+    cv::Mat indices, dists;
+    search(X, quantizer, K_, indices, dists);
+    fsiv_knn_vote(indices, labels_, n_classes_, labels);
+}
+
+float HnswKNN::predict(cv::InputArray samples, cv::OutputArray results, int flags) const
+{
+    cv::Mat X = samples.getMat();
+    if (X.type() != CV_32FC1)
+        X.convertTo(X, CV_32F);
+    cv::Mat labels;
+    predict_encoded(X, FeatureQuantizer(), labels);
+    if (results.needed())
+        labels.convertTo(results, CV_32F);
+    return labels.empty() ? 0.0f : float(labels.at<int>(0));
+}
+
+void HnswKNN::write(cv::FileStorage &fs) const
+{
+    fs << "fsiv_knn_K" << K_;
+    fs << "fsiv_hnsw_M" << M_;
+    fs << "fsiv_hnsw_ef_construction" << ef_construction_;
+    fs << "fsiv_hnsw_ef" << ef_;
+    quantizer_.write(fs);
+    fs << "fsiv_knn_labels" << labels_;
+    fsiv_write_features(fs, "fsiv_knn_samples", samples_);
+    fs << "fsiv_hnsw_entry" << entry_;
+    fs << "fsiv_hnsw_levels" << levels_;
+    fs << "fsiv_hnsw_links0" << links0_;
+    fs << "fsiv_hnsw_upper" << concat_upper();
+}
+
+std::vector<int>
+HnswKNN::concat_upper() const
+{
+    // The upper layers are concatenated in nodes order, their sizes are
+    // given by the levels.
+    std::vector<int> upper;
+    for (const auto &l : upper_)
+        upper.insert(upper.end(), l.begin(), l.end());
+    return upper;
+}
+
+void HnswKNN::write_mapped(cv::FileStorage &fs, ModelFileWriter &out) const
+{
+    fs << "fsiv_knn_K" << K_;
+    fs << "fsiv_hnsw_M" << M_;
+    fs << "fsiv_hnsw_ef_construction" << ef_construction_;
+    fs << "fsiv_hnsw_ef" << ef_;
+    fs << "fsiv_hnsw_entry" << entry_;
+    quantizer_.write(fs);
+    out.add_section("fsiv_knn_labels", labels_);
+    out.add_section("fsiv_knn_samples", samples_);
+    out.add_section("fsiv_hnsw_levels", cv::Mat(levels_));
+    out.add_section("fsiv_hnsw_links0", cv::Mat(links0_));
+    out.add_section("fsiv_hnsw_upper", cv::Mat(concat_upper()));
+}
+
+static void
+section_to_vector(const cv::Mat &m, std::vector<int> &v)
+{
+    if (m.empty())
+    {
+        v.clear();
+        return;
+    }
+    CV_Assert(m.type() == CV_32SC1 && m.isContinuous());
+    const int *p = m.ptr<int>();
+    v.assign(p, p + m.total());
+}
+
+void HnswKNN::read_mapped(const cv::FileNode &fn, const ModelFileReader &in)
+{
+    clear();
+    auto k_node = fn["fsiv_knn_K"];
+    auto entry_node = fn["fsiv_hnsw_entry"];
+    if (k_node.empty() || entry_node.empty())
+        throw std::runtime_error("Could not load the 'fsiv_knn_K' and "
+                                 "'fsiv_hnsw_entry' labels from file.");
+    K_ = int(k_node);
+    M_ = int(fn["fsiv_hnsw_M"]);
+    ef_construction_ = int(fn["fsiv_hnsw_ef_construction"]);
+    ef_ = int(fn["fsiv_hnsw_ef"]);
+    entry_ = int(entry_node);
+    quantizer_.read(fn);
+    labels_ = in.get_section("fsiv_knn_labels");
+    samples_ = in.get_section("fsiv_knn_samples");
+    mapping_ = in.mapping();
+    CV_Assert(samples_.type() == quantizer_.get_type());
+    // The links are copied, they are small compared with the samples.
+    section_to_vector(in.get_section("fsiv_hnsw_levels"), levels_);
+    section_to_vector(in.get_section("fsiv_hnsw_links0"), links0_);
+    std::vector<int> upper;
+    section_to_vector(in.get_section("fsiv_hnsw_upper"), upper);
+    init_loaded(upper);
+}
+
+void HnswKNN::read(const cv::FileNode &fn)
+{
+    clear();
+    auto k_node = fn["fsiv_knn_K"];
+    auto labels_node = fn["fsiv_knn_labels"];
+    auto entry_node = fn["fsiv_hnsw_entry"];
+    if (k_node.empty() || labels_node.empty() || entry_node.empty())
+        throw std::runtime_error("Could not load the 'fsiv_knn_K', 'fsiv_knn_labels' "
+                                 "and 'fsiv_hnsw_entry' labels from file.");
+    K_ = int(k_node);
+    M_ = int(fn["fsiv_hnsw_M"]);
+    ef_construction_ = int(fn["fsiv_hnsw_ef_construction"]);
+    ef_ = int(fn["fsiv_hnsw_ef"]);
+    quantizer_.read(fn);
+    labels_node >> labels_;
+    samples_ = fsiv_read_features(fn["fsiv_knn_samples"], quantizer_.get_type());
+    entry_ = int(entry_node);
+    fn["fsiv_hnsw_levels"] >> levels_;
+    fn["fsiv_hnsw_links0"] >> links0_;
+    std::vector<int> upper;
+    fn["fsiv_hnsw_upper"] >> upper;
+    init_loaded(upper);
+}
+
+/**
+ * @brief Check a links list read from a file: the count fits the
+ * capacity, the unused slots hold ids in [-1, N) and the used ones are
+ * nodes that exist at this level, so a search never reads out of bounds.
+ */
+static void
+check_links(const int *l, int capacity, int level, const std::vector<int> &levels)
+{
+    const int N = int(levels.size());
+    if (l[0] < 0 || l[0] > capacity)
+        throw std::runtime_error("Corrupt HNSW model: a links list has "
+                                 + std::to_string(l[0]) + " neighbours, the capacity is "
+                                 + std::to_string(capacity) + ".");
+    for (int j = 1; j <= capacity; ++j)
+    {
+        const int n = l[j];
+        if (n < -1 || n >= N)
+            throw std::runtime_error("Corrupt HNSW model: neighbour id "
+                                     + std::to_string(n) + " is out of range.");
+        if (j <= l[0] && (n < 0 || levels[n] < level))
+            throw std::runtime_error("Corrupt HNSW model: neighbour id "
+                                     + std::to_string(n) + " is not a node of level "
+                                     + std::to_string(level) + ".");
+    }
+}
+
+void HnswKNN::init_loaded(const std::vector<int> &upper)
+{
+    const int N = samples_.rows;
+    CV_Assert(labels_.type() == CV_32SC1 && labels_.rows == N);
+    if (M_ <= 0 || int(levels_.size()) != N
+        || links0_.size() != size_t(N) * (1 + 2 * M_))
+        throw std::runtime_error("Corrupt HNSW model: the links do not match "
+                                 "the number of samples.");
+    if (entry_ < 0 || entry_ >= N)
+        throw std::runtime_error("Corrupt HNSW model: the entry point is out of range.");
+    upper_.assign(N, std::vector<int>());
+    size_t pos = 0;
+    for (int i = 0; i < N; ++i)
+    {
+        if (levels_[i] < 0)
+            throw std::runtime_error("Corrupt HNSW model: negative node level.");
+        const size_t size = size_t(levels_[i]) * (1 + M_);
+        if (pos + size > upper.size())
+            throw std::runtime_error("Corrupt HNSW model: the upper layers are truncated.");
+        upper_[i].assign(upper.begin() + pos, upper.begin() + pos + size);
+        pos += size;
+    }
+    for (int i = 0; i < N; ++i)
+    {
+        check_links(links(i, 0), 2 * M_, 0, levels_);
+        for (int level = 1; level <= levels_[i]; ++level)
+            check_links(links(i, level), M_, level, levels_);
+    }
+    max_level_ = levels_[entry_];
+    double min_label = 0.0, max_label = 0.0;
+    cv::minMaxLoc(labels_, &min_label, &max_label);
+    n_classes_ = int(max_label) + 1;
+}
+
+void fsiv_hnsw_recall_report(HnswKNN &model, const cv::Mat &X,
+                             const FeatureQuantizer &quantizer, int max_queries,
+                             std::ostream &out)
+{
+    CV_Assert(model.isTrained() && max_queries > 0);
+    const int k = model.getDefaultK();
+    CV_Assert(k <= model.get_samples().rows);
+    const int step = std::max(1, X.rows / max_queries);
+    cv::Mat queries;
+    for (int i = 0; i < X.rows && queries.rows < max_queries; i += step)
+        queries.push_back(X.row(i));
+
+    // The exact answer, shares the samples with the model.
+    ExactKNN exact;
+    exact.train_encoded(model.get_samples(), model.get_labels(), model.get_quantizer());
+    cv::Mat exact_idx, exact_dists, idx, dists;
+    double exact_seconds = 0.0;
+    for (int i = 0; i < queries.rows; ++i)
+    {
+        const int64 t0 = cv::getTickCount();
+        exact.search(queries.row(i), quantizer, k, idx, dists);
+        exact_seconds += (cv::getTickCount() - t0) / cv::getTickFrequency();
+        exact_idx.push_back(idx);
+    }
+
+    out << "HNSW recall@" << k << " vs latency (" << queries.rows << " queries, M="
+        << model.get_M() << ", ef_construction=" << model.get_ef_construction() << ")."
+        << std::endl;
+    out << "exact:\trecall 1\t" << 1000.0 * exact_seconds / queries.rows << " ms/query"
+        << std::endl;
+
+    const int saved_ef = model.get_ef();
+    std::vector<int> efs = {k, 16, 32, 64, 128, 256, saved_ef};
+    std::sort(efs.begin(), efs.end());
+    efs.erase(std::unique(efs.begin(), efs.end()), efs.end());
+    for (int ef : efs)
+    {
+        if (ef < k)
+            continue;
+        model.set_ef(ef);
+        double seconds = 0.0;
+        int hits = 0;
+        for (int i = 0; i < queries.rows; ++i)
+        {
+            const int64 t0 = cv::getTickCount();
+            model.search(queries.row(i), quantizer, k, idx, dists);
+            seconds += (cv::getTickCount() - t0) / cv::getTickFrequency();
+            const int *ref = exact_idx.ptr<int>(i);
+            const int *found = idx.ptr<int>();
+            for (int j = 0; j < k; ++j)
+                hits += std::find(ref, ref + k, found[j]) != ref + k;
+        }
+        out << "ef=" << ef << (ef == saved_ef ? "*" : "") << ":\trecall "
+            << double(hits) / (double(k) * queries.rows) << "\t"
+            << 1000.0 * seconds / queries.rows << " ms/query" << std::endl;
+    }
+    model.set_ef(saved_ef);
+}
@@ -0,0 +1,160 @@
+/**
+ *  @file hnsw_knn.hpp
+ */
+#pragma once
+
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/ml.hpp>
+#include "classifiers.hpp"
+#include "model_file.hpp"
+
+/**
+ * @brief Approximate K-NN classifier with a HNSW graph index.
+ *
+ * Hierarchical Navigable Small World graph: each train sample is a node
+ * with a random level, linked to its (heuristically selected) nearest
+ * nodes in every layer up to its level. A search descends greedily from
+ * the top layer and explores the bottom layer with a beam of size ef.
+ *
+ * Parameters: M links by node and layer (2M in the bottom layer),
+ * ef_construction the beam size used to build the graph and ef the beam
+ * size used to predict (at least K). Larger values give more recall and
+ * more latency.
+ *
+ * The graph is built in parallel (see cv::setNumThreads) with a lock by
+ * node. The train samples are kept in the format they were given (float32
+ * or a FeatureQuantizer format) and the distances are computed from it.
+ */
+class HnswKNN : public cv::ml::StatModel, public EncodedFeaturesModel,
+                public MappableModel
+{
+public:
+    HnswKNN();
+
+    /**
+     * @brief Create an untrained classifier.
+     *
+     * Needed by cv::Algorithm::load<HnswKNN>().
+     * @param K is the number of neighbours.
+     * @param M is the number of links by node and layer.
+     * @param ef_construction is the beam size used to build the graph.
+     * @param ef is the beam size used to predict.
+     */
+    static cv::Ptr<HnswKNN> create(int K = 1, int M = 16, int ef_construction = 200,
+                                   int ef = 64);
+
+    void setDefaultK(int K);
+    int getDefaultK() const;
+    void set_M(int M);
+    int get_M() const;
+    void set_ef_construction(int ef_construction);
+    int get_ef_construction() const;
+
+    /**
+     * @brief Set the beam size used to predict.
+     *
+     * It can be changed on a trained model.
+     */
+    void set_ef(int ef);
+    int get_ef() const;
+
+    using cv::ml::StatModel::train;
+    virtual bool train(const cv::Ptr<cv::ml::TrainData> &data, int flags = 0) override;
+    virtual float predict(cv::InputArray samples, cv::OutputArray results = cv::noArray(),
+                          int flags = 0) const override;
+    virtual int getVarCount() const override;
+    virtual bool isTrained() const override;
+    virtual bool isClassifier() const override;
+    virtual void clear() override;
+    virtual void write(cv::FileStorage &fs) const override;
+    virtual void read(const cv::FileNode &fn) override;
+    virtual std::string getDefaultName() const override;
+    virtual void write_mapped(cv::FileStorage &fs, ModelFileWriter &out) const override;
+    virtual void read_mapped(const cv::FileNode &fn, const ModelFileReader &in) override;
+
+    /**
+     * @brief Train the model building the graph.
+     *
+     * The samples are not copied, the model keeps a reference to X.
+     */
+    virtual void train_encoded(const cv::Mat &X, const cv::Mat &y,
+                               const FeatureQuantizer &quantizer) override;
+    virtual void predict_encoded(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                 cv::Mat &labels) const override;
+
+    /**
+     * @brief Find the (approximate) k nearest train samples of each query.
+     *
+     * @param X are the queries (one by row).
+     * @param quantizer is the format of X.
+     * @param k is the number of neighbours.
+     * @param indices are the train samples indices (CV_32SC1, X.rows x k)
+     * sorted by increasing distance, -1 if less than k were found.
+     * @param dists are the squared distances (CV_32FC1, X.rows x k).
+     * @pre isTrained()
+     */
+    void search(const cv::Mat &X, const FeatureQuantizer &quantizer, int k,
+                cv::Mat &indices, cv::Mat &dists) const;
+
+    const cv::Mat &get_samples() const;
+    const cv::Mat &get_labels() const;
+    const FeatureQuantizer &get_quantizer() const;
+
+protected:
+    typedef std::pair<float, int> Neighbour;
+    struct Scratch;
+
+    void build();
+    std::vector<int> concat_upper() const;
+    void init_loaded(const std::vector<int> &upper);
+    void insert(int node, Scratch &s, std::vector<std::mutex> &locks,
+                std::mutex &global);
+    int *links(int node, int level);
+    const int *links(int node, int level) const;
+    const float *decode_row(int node, cv::Mat &buffer) const;
+    void greedy_search(const float *q, int top_level, int bottom_level, int &ep,
+                       float &ep_dist, std::vector<std::mutex> *locks) const;
+    void search_layer(const float *q, int ep, float ep_dist, int ef, int level,
+                      Scratch &s, std::vector<std::mutex> *locks,
+                      std::vector<Neighbour> &result) const;
+    void select_neighbours(const std::vector<Neighbour> &candidates, int m,
+                           Scratch &s, std::vector<int> &selected) const;
+    void connect(int node, int level, const std::vector<int> &neighbours,
+                 Scratch &s, std::vector<std::mutex> &locks);
+
+    int K_;
+    int M_;
+    int ef_construction_;
+    int ef_;
+    int n_classes_;                       // max label + 1.
+    FeatureQuantizer quantizer_;          // format of samples_.
+    cv::Mat samples_;                     // NxD train samples.
+    cv::Mat labels_;                      // Nx1 CV_32SC1 labels.
+    std::vector<int> levels_;             // level of each node.
+    int entry_;                           // entry point node.
+    int max_level_;                       // level of the entry point.
+    std::vector<int> links0_;             // bottom layer: N x (1+2M), count first.
+    std::vector<std::vector<int>> upper_; // layers 1..level: level x (1+M).
+    std::shared_ptr<MappedFile> mapping_; // owner of the mapped sections, if loaded.
+};
+
+/**
+ * @brief Print the recall vs latency of a HNSW model against the exact
+ * answer, for several beam sizes.
+ *
+ * The queries are searched one by one, as an interactive tool would do.
+ *
+ * @param model is the trained model. Its ef is restored at the end.
+ * @param X are the queries (one by row).
+ * @param quantizer is the format of X.
+ * @param max_queries is the max number of queries (evenly spaced) used.
+ * @param out is the output stream.
+ */
+void fsiv_hnsw_recall_report(HnswKNN &model, const cv::Mat &X,
+                             const FeatureQuantizer &quantizer, int max_queries,
+                             std::ostream &out);
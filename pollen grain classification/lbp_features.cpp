@@ -0,0 +1,180 @@
+#include <cmath>
+#include <opencv2/core/hal/intrin.hpp>
+#include <opencv2/imgproc.hpp>
+#include "lbp_features.hpp"
+
+/**
+ * @brief Table mapping an 8 bits LBP code to its rotation invariant
+ * uniform code: the number of 1 bits for uniform patterns (at most two 0/1
+ * transitions) or 9 for the rest.
+ */
+static const std::vector<uchar> &
+riu2_table()
+{
+    static const std::vector<uchar> table = []()
+    {
+        std::vector<uchar> t(256);
+        for (int c = 0; c < 256; ++c)
+        {
+            int transitions = 0;
+            int ones = 0;
+            for (int k = 0; k < 8; ++k)
+            {
+                const int b = (c >> k) & 1;
+                const int next = (c >> ((k + 1) % 8)) & 1;
+                transitions += (b != next);
+                ones += b;
+            }
+            t[c] = uchar(transitions <= 2 ? ones : 9);
+        }
+        return t;
+    }();
+    return table;
+}
+
+#if CV_SIMD128
+static inline cv::v_uint8x16
+lbp_bit(const cv::v_uint8x16 &n, const cv::v_uint8x16 &c, const cv::v_uint8x16 &bit)
+{
+#if CV_VERSION_MAJOR >= 5
+    return cv::v_and(cv::v_ge(n, c), bit);
+#else
+    return (n >= c) & bit;
+#endif
+}
+
+static inline cv::v_uint8x16
+lbp_or(const cv::v_uint8x16 &a, const cv::v_uint8x16 &b)
+{
+#if CV_VERSION_MAJOR >= 5
+    return cv::v_or(a, b);
+#else
+    return a | b;
+#endif
+}
+#endif
+
+void fsiv_compute_lbp_codes(const cv::Mat &img, int y, int r, uchar *codes)
+{
+    CV_Assert(img.type() == CV_8UC1);
+    CV_Assert(r <= y && y < img.rows - r);
+    const int d = std::max(1, int(std::lround(r / std::sqrt(2.0))));
+    const uchar *c = img.ptr<uchar>(y);
+    const uchar *up = img.ptr<uchar>(y - r);
+    const uchar *down = img.ptr<uchar>(y + r);
+    const uchar *dup = img.ptr<uchar>(y - d);
+    const uchar *ddown = img.ptr<uchar>(y + d);
+    // Neighbours counterclockwise starting at the right one.
+    const uchar *n[8] = {c + r, dup + d, up, dup - d, c - r, ddown - d, down, ddown + d};
+
+    int x = r;
+    const int end = img.cols - r;
+#if CV_SIMD128
+    const int lanes = 16;
+    for (; x + lanes <= end; x += lanes)
+    {
+        const cv::v_uint8x16 vc = cv::v_load(c + x);
+        cv::v_uint8x16 code = lbp_bit(cv::v_load(n[0] + x), vc, cv::v_setall_u8(1));
+        for (int k = 1; k < 8; ++k)
+            code = lbp_or(code, lbp_bit(cv::v_load(n[k] + x), vc, cv::v_setall_u8(uchar(1 << k))));
+        cv::v_store(codes + x, code);
+    }
+#endif
+    for (; x < end; ++x)
+    {
+        uchar code = 0;
+        for (int k = 0; k < 8; ++k)
+            code |= uchar((n[k][x] >= c[x]) << k);
+        codes[x] = code;
+    }
+}
+
+LBPFeatures::LBPFeatures()
+{
+    type_ = FSIV_LBP;
+    params_ = {4.0, 3.0};
+}
+
+LBPFeatures::~LBPFeatures() {}
+
+cv::Ptr<FeaturesExtractor>
+LBPFeatures::clone() const
+{
+    return cv::makePtr<LBPFeatures>(*this);
+}
+
+std::string
+LBPFeatures::get_extractor_name() const
+{
+    return "LBP riu2 histograms grid=" + std::to_string(get_grid_size()) +
+           " radii=" + std::to_string(get_n_radii()) + ".";
+}
+
+int LBPFeatures::get_grid_size() const
+{
+    return (params_.size() > 0 && params_[0] > 0.0f) ? int(params_[0]) : 4;
+}
+
+int LBPFeatures::get_n_radii() const
+{
+    return (params_.size() > 1 && params_[1] > 0.0f) ? int(params_[1]) : 3;
+}
+
+int LBPFeatures::get_feature_size() const
+{
+    const int G = get_grid_size();
+    return G * G * get_n_radii() * 10;
+}
+
+void LBPFeatures::compute(const cv::Mat &img, float *feature)
+{
+    const int G = get_grid_size();
+    const int R = get_n_radii();
+    const int W = img.cols;
+    const int H = img.rows;
+    CV_Assert(2 * R < W && 2 * R < H);
+    const std::vector<uchar> &lut = riu2_table();
+
+    codes_.resize(W);
+    counts_.assign(G * G * R * 10, 0);
+    for (int r = 1; r <= R; ++r)
+    {
+        int *r_counts = &counts_[(r - 1) * G * G * 10];
+        for (int y = r; y < H - r; ++y)
+        {
+            fsiv_compute_lbp_codes(img, y, r, codes_.data());
+            int *row_counts = r_counts + ((y * G) / H) * G * 10;
+            for (int x = r; x < W - r; ++x)
+                ++row_counts[((x * G) / W) * 10 + lut[codes_[x]]];
+        }
+    }
+
+    for (int cell = 0; cell < G * G * R; ++cell)
+    {
+        const int *h = &counts_[cell * 10];
+        int total = 0;
+        for (int b = 0; b < 10; ++b)
+            total += h[b];
+        const float scale = total > 0 ? 1.0f / total : 0.0f;
+        for (int b = 0; b < 10; ++b)
+            feature[cell * 10 + b] = h[b] * scale;
+    }
+}
+
+cv::Mat
+LBPFeatures::extract_features(const cv::Mat &img)
+{
+    cv::Mat feature(1, get_feature_size(), CV_32FC1);
+    compute(fsiv_to_gray_image(img), feature.ptr<float>());
+    CV_Assert(feature.rows==1);
+    CV_Assert(feature.type()==CV_32FC1);
+    return feature;
+}
+
+void LBPFeatures::extract_batch(const cv::Mat &rows, cv::Mat &out)
+{
+    CV_Assert(out.rows == rows.rows && out.cols == get_feature_size());
+    CV_Assert(out.type() == CV_32FC1);
+    for (int i = 0; i < rows.rows; ++i)
+        compute(fsiv_to_gray_image(rows.row(i)), out.ptr<float>(i));
+}
@@ -0,0 +1,72 @@
+/**
+ *  @file lbp_features.hpp
+ */
+#pragma once
+
+#include <vector>
+#include "features.hpp"
+
+/**
+ * @brief Local binary patterns texture features.
+ *
+ * For each radius r=1..R a rotation invariant uniform LBP code (8 neighbours,
+ * 10 different codes) is computed for each pixel and the codes are
+ * histogrammed in a GxG grid of cells. Each histogram is L1 normalized.
+ *
+ * Parameters: [G, R]. Default (or values <= 0) G=4, R=3, which gives
+ * 4*4*3*10=480 features.
+ */
+class LBPFeatures: public FeaturesExtractor
+{
+public:
+    /**
+     * @brief Create and set the default parameters.
+     */
+    LBPFeatures();
+    ~LBPFeatures();
+
+    virtual std::string get_extractor_name() const override;
+    virtual cv::Ptr<FeaturesExtractor> clone() const override;
+    virtual cv::Mat extract_features(const cv::Mat& img) override;
+    virtual void extract_batch(const cv::Mat& rows, cv::Mat& out) override;
+
+    /**
+     * @brief Get the number of grid cells by side.
+     */
+    int get_grid_size() const;
+
+    /**
+     * @brief Get the number of radii.
+     */
+    int get_n_radii() const;
+
+    /**
+     * @brief Get the size of the feature vector.
+     */
+    int get_feature_size() const;
+
+protected:
+
+    /**
+     * @brief Compute the features of a gray image.
+     * @param img is a 128x128 CV_8UC1 image.
+     * @param feature points to the output (get_feature_size() floats).
+     */
+    void compute(const cv::Mat& img, float* feature);
+
+    std::vector<uchar> codes_;  // scratch: LBP codes of a row.
+    std::vector<int> counts_;   // scratch: histogram counts.
+};
+
+/**
+ * @brief Compute the 8 neighbours LBP codes of an image row.
+ *
+ * codes[x] has bit k set if the k-th neighbour at radius r of pixel (y,x)
+ * is >= than the pixel. Only pixels with r<=x<img.cols-r are computed.
+ *
+ * @param img is a CV_8UC1 image.
+ * @param y is the row (r<=y<img.rows-r).
+ * @param r is the radius.
+ * @param codes is the output (img.cols values).
+ */
+void fsiv_compute_lbp_codes(const cv::Mat& img, int y, int r, uchar* codes);
@@ -0,0 +1,453 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <numeric>
+#include <vector>
+#include <opencv2/core/utility.hpp>
+#include "linear_sgd.hpp"
+
+// Rows by block when computing scores and features by block when
+// computing the gradient. Each block is a task of the parallel loops.
+static const int SGD_ROW_BLOCK = 64;
+static const int SGD_FEATURE_BLOCK = 512;
+static const int SGD_PREDICT_BLOCK = 1024;
+static const float ADAGRAD_EPS = 1.0e-8f;
+
+LinearSGD::LinearSGD()
+    : epochs_(10), learning_rate_(0.1f), batch_size_(256), lambda_(1.0e-4f),
+      loss_sum_(0.0), loss_count_(0), loss_(0.0f)
+{
+}
+
+cv::Ptr<LinearSGD>
+LinearSGD::create(int epochs, float learning_rate, int batch_size, float lambda)
+{
+    cv::Ptr<LinearSGD> sgd = cv::makePtr<LinearSGD>();
+    sgd->set_epochs(epochs);
+    sgd->set_learning_rate(learning_rate);
+    sgd->set_batch_size(batch_size);
+    sgd->set_lambda(lambda);
+    return sgd;
+}
+
+void LinearSGD::set_epochs(int epochs)
+{
+    CV_Assert(epochs > 0);
+    epochs_ = epochs;
+}
+
+int LinearSGD::get_epochs() const
+{
+    return epochs_;
+}
+
+void LinearSGD::set_learning_rate(float learning_rate)
+{
+    CV_Assert(learning_rate > 0.0f);
+    learning_rate_ = learning_rate;
+}
+
+float LinearSGD::get_learning_rate() const
+{
+    return learning_rate_;
+}
+
+void LinearSGD::set_batch_size(int batch_size)
+{
+    CV_Assert(batch_size > 0);
+    batch_size_ = batch_size;
+}
+
+int LinearSGD::get_batch_size() const
+{
+    return batch_size_;
+}
+
+void LinearSGD::set_lambda(float lambda)
+{
+    CV_Assert(lambda >= 0.0f);
+    lambda_ = lambda;
+}
+
+float LinearSGD::get_lambda() const
+{
+    return lambda_;
+}
+
+int LinearSGD::get_n_classes() const
+{
+    return W_.cols;
+}
+
+float LinearSGD::get_loss() const
+{
+    return loss_;
+}
+
+int LinearSGD::getVarCount() const
+{
+    return W_.empty() ? 0 : W_.rows - 1;
+}
+
+bool LinearSGD::isTrained() const
+{
+    return !W_.empty();
+}
+
+bool LinearSGD::isClassifier() const
+{
+    return true;
+}
+
+void LinearSGD::clear()
+{
+    W_.release();
+    G2_.release();
+    loss_sum_ = 0.0;
+    loss_count_ = 0;
+    loss_ = 0.0f;
+}
+
+std::string
+LinearSGD::getDefaultName() const
+{
+    return "fsiv_linear_sgd";
+}
+
+void LinearSGD::grow(int n_features, int n_classes)
+{
+    if (W_.empty())
+    {
+        W_ = cv::Mat::zeros(n_features + 1, n_classes, CV_32FC1);
+        G2_ = cv::Mat::zeros(n_features + 1, n_classes, CV_32FC1);
+        return;
+    }
+    if (W_.rows != n_features + 1)
+        throw std::runtime_error("Expected " + std::to_string(W_.rows - 1) +
+                                 " features, but got " + std::to_string(n_features) + ".");
+    if (G2_.empty())
+        G2_ = cv::Mat::zeros(W_.size(), CV_32FC1);
+    if (n_classes > W_.cols)
+    {
+        cv::Mat W = cv::Mat::zeros(W_.rows, n_classes, CV_32FC1);
+        cv::Mat G2 = cv::Mat::zeros(W_.rows, n_classes, CV_32FC1);
+        W_.copyTo(W.colRange(0, W_.cols));
+        G2_.copyTo(G2.colRange(0, G2_.cols));
+        W_ = W;
+        G2_ = G2;
+    }
+}
+
+void LinearSGD::scores(const cv::Mat &X, cv::Mat &S) const
+{
+    const int D = W_.rows - 1;
+    const int n_blocks = (X.rows + SGD_ROW_BLOCK - 1) / SGD_ROW_BLOCK;
+    S.create(X.rows, W_.cols, CV_32FC1);
+    const cv::Mat W = W_.rowRange(0, D);
+    const float *bias = W_.ptr<float>(D);
+    cv::parallel_for_(cv::Range(0, n_blocks), [&](const cv::Range &range)
+    {
+        cv::Mat S_b;
+        for (int b = range.start; b < range.end; ++b)
+        {
+            const int begin = b * SGD_ROW_BLOCK;
+            const int end = std::min(X.rows, begin + SGD_ROW_BLOCK);
+            cv::gemm(X.rowRange(begin, end), W, 1.0, cv::noArray(), 0.0, S_b);
+            for (int i = begin; i < end; ++i)
+            {
+                const float *s_b = S_b.ptr<float>(i - begin);
+                float *s = S.ptr<float>(i);
+                for (int c = 0; c < S.cols; ++c)
+                    s[c] = s_b[c] + bias[c];
+            }
+        }
+    });
+}
+
+void LinearSGD::step(const cv::Mat &X, const int *y)
+{
+    const int B = X.rows;
+    const int D = W_.rows - 1;
+    const int C = W_.cols;
+
+    // E = dLoss/dScores = (softmax(S) - onehot(y)) / B.
+    cv::Mat E;
+    scores(X, E);
+    for (int i = 0; i < B; ++i)
+    {
+        float *e = E.ptr<float>(i);
+        const float max_s = *std::max_element(e, e + C);
+        float sum = 0.0f;
+        for (int c = 0; c < C; ++c)
+        {
+            e[c] = std::exp(e[c] - max_s);
+            sum += e[c];
+        }
+        for (int c = 0; c < C; ++c)
+            e[c] /= sum;
+        loss_sum_ -= std::log(std::max(e[y[i]], FLT_MIN));
+        e[y[i]] -= 1.0f;
+        for (int c = 0; c < C; ++c)
+            e[c] /= B;
+    }
+    loss_count_ += B;
+
+    // Each block of features gets its gradient X_b^T E with a GEMM and
+    // updates its own weight rows. The last block includes the bias row.
+    const int n_blocks = (D + SGD_FEATURE_BLOCK - 1) / SGD_FEATURE_BLOCK;
+    cv::parallel_for_(cv::Range(0, n_blocks), [&](const cv::Range &range)
+    {
+        cv::Mat G;
+        for (int b = range.start; b < range.end; ++b)
+        {
+            const int begin = b * SGD_FEATURE_BLOCK;
+            const int end = std::min(D, begin + SGD_FEATURE_BLOCK);
+            cv::gemm(X.colRange(begin, end), E, 1.0, cv::noArray(), 0.0, G, cv::GEMM_1_T);
+            for (int d = begin; d < end; ++d)
+            {
+                const float *g = G.ptr<float>(d - begin);
+                float *w = W_.ptr<float>(d);
+                float *g2 = G2_.ptr<float>(d);
+                for (int c = 0; c < C; ++c)
+                {
+                    const float grad = g[c] + lambda_ * w[c];
+                    g2[c] += grad * grad;
+                    w[c] -= learning_rate_ * grad / (std::sqrt(g2[c]) + ADAGRAD_EPS);
+                }
+            }
+            if (b == n_blocks - 1)
+            {
+                float *w = W_.ptr<float>(D);
+                float *g2 = G2_.ptr<float>(D);
+                for (int c = 0; c < C; ++c)
+                {
+                    float grad = 0.0f;
+                    for (int i = 0; i < B; ++i)
+                        grad += E.at<float>(i, c);
+                    g2[c] += grad * grad;
+                    w[c] -= learning_rate_ * grad / (std::sqrt(g2[c]) + ADAGRAD_EPS);
+                }
+            }
+        }
+    });
+}
+
+void LinearSGD::train_rows(const cv::Mat &X, const cv::Mat &y,
+                           const std::vector<int> &order,
+                           const FeatureQuantizer &quantizer)
+{
+    cv::Mat Q(std::min(batch_size_, int(order.size())), X.cols, X.type());
+    cv::Mat X_f;
+    std::vector<int> y_b(Q.rows);
+    for (size_t begin = 0; begin < order.size(); begin += batch_size_)
+    {
+        const int n = int(std::min(order.size() - begin, size_t(batch_size_)));
+        for (int i = 0; i < n; ++i)
+        {
+            X.row(order[begin + i]).copyTo(Q.row(i));
+            y_b[i] = y.at<int>(order[begin + i]);
+        }
+        quantizer.decode(Q.rowRange(0, n), X_f);
+        step(X_f, y_b.data());
+    }
+}
+
+void LinearSGD::start_epoch(int epoch)
+{
+    if (loss_count_ > 0)
+        loss_ = float(loss_sum_ / loss_count_);
+    loss_sum_ = 0.0;
+    loss_count_ = 0;
+}
+
+void LinearSGD::train_batch(const cv::Mat &X, const cv::Mat &y)
+{
+    CV_Assert(X.type() == CV_32FC1 && y.type() == CV_32SC1);
+    CV_Assert(int(y.total()) == X.rows);
+    if (X.rows == 0)
+        return;
+    double min_label = 0.0, max_label = 0.0;
+    cv::minMaxLoc(y, &min_label, &max_label);
+    CV_Assert(min_label >= 0.0);
+    grow(X.cols, int(max_label) + 1);
+
+    std::vector<int> order(X.rows);
+    std::iota(order.begin(), order.end(), 0);
+    cv::randShuffle(order);
+    train_rows(X, y, order, FeatureQuantizer());
+}
+
+void LinearSGD::finish_training()
+{
+    start_epoch(epochs_);
+    // The AdaGrad state is only needed while training.
+    G2_.release();
+}
+
+void LinearSGD::train_encoded(const cv::Mat &X, const cv::Mat &y,
+                              const FeatureQuantizer &quantizer)
+{
+    CV_Assert(!X.empty() && X.type() == quantizer.get_type());
+    CV_Assert(y.type() == CV_32SC1 && int(y.total()) == X.rows);
+    clear();
+    double min_label = 0.0, max_label = 0.0;
+    cv::minMaxLoc(y, &min_label, &max_label);
+    CV_Assert(min_label >= 0.0);
+    grow(X.cols, int(max_label) + 1);
+
+    std::vector<int> order(X.rows);
+    std::iota(order.begin(), order.end(), 0);
+    for (int epoch = 0; epoch < epochs_; ++epoch)
+    {
+        start_epoch(epoch);
+        cv::randShuffle(order);
+        train_rows(X, y, order, quantizer);
+    }
+    finish_training();
+}
+
+bool LinearSGD::train(const cv::Ptr<cv::ml::TrainData> &data, int flags)
+{
+    CV_Assert(data != nullptr);
+    cv::Mat X = data->getTrainSamples(cv::ml::ROW_SAMPLE);
+    if (X.type() != CV_32FC1)
+        X.convertTo(X, CV_32F);
+    cv::Mat y;
+    data->getTrainResponses().convertTo(y, CV_32S);
+    train_encoded(X, y, FeatureQuantizer());
+    return isTrained();
+}
+
+void LinearSGD::predict_encoded(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                cv::Mat &labels) const
+{
+    classify(X, quantizer, labels, nullptr);
+}
+
+void LinearSGD::predict_margins(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                cv::Mat &labels, cv::Mat &margins) const
+{
+    classify(X, quantizer, labels, &margins);
+}
+
+void LinearSGD::predict_scores(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                               cv::Mat &scores) const
+{
+    CV_Assert(isTrained());
+    CV_Assert(X.type() == quantizer.get_type() && X.cols == W_.rows - 1);
+    const int D = W_.rows - 1;
+    scores.create(X.rows, W_.cols, CV_32FC1);
+    const cv::Mat W = W_.rowRange(0, D);
+    const float *bias = W_.ptr<float>(D);
+    const int n_blocks = (X.rows + SGD_PREDICT_BLOCK - 1) / SGD_PREDICT_BLOCK;
+    cv::parallel_for_(cv::Range(0, n_blocks), [&](const cv::Range &range)
+    {
+        cv::Mat X_f;
+        for (int b = range.start; b < range.end; ++b)
+        {
+            const int begin = b * SGD_PREDICT_BLOCK;
+            const int end = std::min(X.rows, begin + SGD_PREDICT_BLOCK);
+            cv::Mat block = X.rowRange(begin, end);
+            if (block.type() != CV_32FC1)
+            {
+                quantizer.decode(block, X_f);
+                block = X_f;
+            }
+            cv::Mat S = scores.rowRange(begin, end);
+            cv::gemm(block, W, 1.0, cv::noArray(), 0.0, S);
+            for (int i = 0; i < S.rows; ++i)
+            {
+                float *s = S.ptr<float>(i);
+                for (int c = 0; c < S.cols; ++c)
+                    s[c] += bias[c];
+            }
+        }
+    });
+}
+
+void LinearSGD::classify(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                         cv::Mat &labels, cv::Mat *margins) const
+{
+    CV_Assert(isTrained());
+    CV_Assert(X.type() == quantizer.get_type() && X.cols == W_.rows - 1);
+    labels.create(X.rows, 1, CV_32SC1);
+    if (margins != nullptr)
+        margins->create(X.rows, 1, CV_32FC1);
+    const int D = W_.rows - 1;
+    const cv::Mat W = W_.rowRange(0, D);
+    const float *bias = W_.ptr<float>(D);
+    const int n_blocks = (X.rows + SGD_PREDICT_BLOCK - 1) / SGD_PREDICT_BLOCK;
+    cv::parallel_for_(cv::Range(0, n_blocks), [&](const cv::Range &range)
+    {
+        cv::Mat X_f, S;
+        for (int b = range.start; b < range.end; ++b)
+        {
+            const int begin = b * SGD_PREDICT_BLOCK;
+            const int end = std::min(X.rows, begin + SGD_PREDICT_BLOCK);
+            cv::Mat block = X.rowRange(begin, end);
+            if (block.type() != CV_32FC1)
+            {
+                quantizer.decode(block, X_f);
+                block = X_f;
+            }
+            cv::gemm(block, W, 1.0, cv::noArray(), 0.0, S);
+            for (int i = begin; i < end; ++i)
+            {
+                const float *s = S.ptr<float>(i - begin);
+                int best = 0;
+                for (int c = 1; c < S.cols; ++c)
+                    if (s[c] + bias[c] > s[best] + bias[best])
+                        best = c;
+                labels.at<int>(i) = best;
+                if (margins == nullptr)
+                    continue;
+                // Gap between the two largest softmax probabilities.
+                const float s_best = s[best] + bias[best];
+                float sum = 0.0f, second = 0.0f;
+                for (int c = 0; c < S.cols; ++c)
+                {
+                    const float e = std::exp(s[c] + bias[c] - s_best);
+                    sum += e;
+                    if (c != best)
+                        second = std::max(second, e);
+                }
+                margins->at<float>(i) = (1.0f - second) / sum;
+            }
+        }
+    });
+}
+
+float LinearSGD::predict(cv::InputArray samples, cv::OutputArray results, int flags) const
+{
+    cv::Mat X = samples.getMat();
+    if (X.type() != CV_32FC1)
+        X.convertTo(X, CV_32F);
+    cv::Mat labels;
+    predict_encoded(X, FeatureQuantizer(), labels);
+    if (results.needed())
+        labels.convertTo(results, CV_32F);
+    return labels.empty() ? 0.0f : float(labels.at<int>(0));
+}
+
+void LinearSGD::write(cv::FileStorage &fs) const
+{
+    fs << "fsiv_sgd_epochs" << epochs_;
+    fs << "fsiv_sgd_learning_rate" << learning_rate_;
+    fs << "fsiv_sgd_batch_size" << batch_size_;
+    fs << "fsiv_sgd_lambda" << lambda_;
+    fs << "fsiv_sgd_weights" << W_;
+}
+
+void LinearSGD::read(const cv::FileNode &fn)
+{
+    clear();
+    auto weights_node = fn["fsiv_sgd_weights"];
+    if (weights_node.empty())
+        throw std::runtime_error("Could not load the 'fsiv_sgd_weights' label from file.");
+    epochs_ = int(fn["fsiv_sgd_epochs"]);
+    learning_rate_ = float(fn["fsiv_sgd_learning_rate"]);
+    batch_size_ = int(fn["fsiv_sgd_batch_size"]);
+    lambda_ = float(fn["fsiv_sgd_lambda"]);
+    weights_node >> W_;
+    CV_Assert(W_.type() == CV_32FC1 && W_.rows >= 2);
+}
@@ -0,0 +1,145 @@
+/**
+ *  @file linear_sgd.hpp
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/ml.hpp>
+#include "classifiers.hpp"
+
+/**
+ * @brief Linear softmax (multinomial logistic) classifier trained with
+ * mini-batch SGD and AdaGrad steps.
+ *
+ * The model is a (D+1)xC weights matrix (the last row is the bias) and a
+ * prediction is a single GEMM followed by an argmax.
+ *
+ * Each mini-batch step computes the scores by blocks of rows in parallel
+ * and the gradient by blocks of features in parallel (each worker owns its
+ * weight rows, so there is no reduction), and updates every weight with
+ * its own AdaGrad step lr/sqrt(sum of squared gradients). An L2 penalty
+ * lambda*||W||^2/2 (not on the bias) is added.
+ *
+ * It can be trained with a stream of batches (BatchTrainable), where the
+ * rows are shuffled inside each batch, or with the whole encoded features
+ * (EncodedFeaturesModel), where they are shuffled each epoch. The number of
+ * classes grows with the largest label seen.
+ */
+class LinearSGD : public cv::ml::StatModel, public BatchTrainable,
+                  public EncodedFeaturesModel, public MarginModel
+{
+public:
+    LinearSGD();
+
+    /**
+     * @brief Create an untrained classifier.
+     *
+     * Needed by cv::Algorithm::load<LinearSGD>().
+     * @param epochs is the number of passes over the train samples.
+     * @param learning_rate is the AdaGrad base learning rate.
+     * @param batch_size is the mini-batch size.
+     * @param lambda is the L2 regularization weight.
+     */
+    static cv::Ptr<LinearSGD> create(int epochs = 10, float learning_rate = 0.1f,
+                                     int batch_size = 256, float lambda = 1.0e-4f);
+
+    void set_epochs(int epochs);
+    void set_learning_rate(float learning_rate);
+    float get_learning_rate() const;
+    void set_batch_size(int batch_size);
+    int get_batch_size() const;
+    void set_lambda(float lambda);
+    float get_lambda() const;
+
+    /**
+     * @brief Get the number of classes (max label seen + 1).
+     */
+    int get_n_classes() const;
+
+    /**
+     * @brief Get the mean cross entropy of the last trained epoch.
+     */
+    float get_loss() const;
+
+    using cv::ml::StatModel::train;
+    virtual bool train(const cv::Ptr<cv::ml::TrainData> &data, int flags = 0) override;
+    virtual float predict(cv::InputArray samples, cv::OutputArray results = cv::noArray(),
+                          int flags = 0) const override;
+    virtual int getVarCount() const override;
+    virtual bool isTrained() const override;
+    virtual bool isClassifier() const override;
+    virtual void clear() override;
+    virtual void write(cv::FileStorage &fs) const override;
+    virtual void read(const cv::FileNode &fn) override;
+    virtual std::string getDefaultName() const override;
+
+    virtual int get_epochs() const override;
+    virtual void start_epoch(int epoch) override;
+    virtual void train_batch(const cv::Mat &X, const cv::Mat &y) override;
+    virtual void finish_training() override;
+
+    virtual void train_encoded(const cv::Mat &X, const cv::Mat &y,
+                               const FeatureQuantizer &quantizer) override;
+    virtual void predict_encoded(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                 cv::Mat &labels) const override;
+
+    /**
+     * @brief Predict with the gap between the two largest class
+     * probabilities as margin.
+     */
+    virtual void predict_margins(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                 cv::Mat &labels, cv::Mat &margins) const override;
+
+    /**
+     * @brief Predict the class scores (the logits).
+     */
+    virtual void predict_scores(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                cv::Mat &scores) const override;
+
+protected:
+
+    /**
+     * @brief Predict labels and, if margins is not null, the margins.
+     */
+    void classify(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                  cv::Mat &labels, cv::Mat *margins) const;
+
+    /**
+     * @brief Make room for the features and classes of a batch.
+     */
+    void grow(int n_features, int n_classes);
+
+    /**
+     * @brief Do a SGD step with a mini-batch.
+     * @param X are the samples (CV_32FC1).
+     * @param y are the labels.
+     */
+    void step(const cv::Mat &X, const int *y);
+
+    /**
+     * @brief Do the SGD steps of the rows of X in the given order.
+     * @param X are the samples.
+     * @param y are the labels.
+     * @param order are the rows to use.
+     * @param quantizer is the format of X.
+     */
+    void train_rows(const cv::Mat &X, const cv::Mat &y, const std::vector<int> &order,
+                    const FeatureQuantizer &quantizer);
+
+    /**
+     * @brief Compute the class scores of samples (CV_32FC1).
+     */
+    void scores(const cv::Mat &X, cv::Mat &S) const;
+
+    int epochs_;
+    float learning_rate_;
+    int batch_size_;
+    float lambda_;
+    cv::Mat W_;          // (D+1)xC weights, the last row is the bias.
+    cv::Mat G2_;         // (D+1)xC AdaGrad sums of squared gradients.
+    double loss_sum_;    // cross entropy sum of the current epoch.
+    int loss_count_;     // samples of the current epoch.
+    float loss_;         // mean cross entropy of the last epoch.
+};
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
 #include <iostream>
 #include "metrics.hpp"
 
@@ -6,35 +9,15 @@ fsiv_compute_confusion_matrix(const cv::Mat& true_labels,
                               const cv::Mat& predicted_labels,
                               int n_categories)
 {
-    CV_Assert(true_labels.rows == predicted_labels.rows);
-    CV_Assert(true_labels.type()==CV_32SC1);
-    CV_Assert(predicted_labels.type()==CV_32SC1);
-    cv::Mat cmat = cv::Mat::zeros(n_categories, n_categories, CV_32F);
-
-    
-    std::cout<<"true labels rows "<<true_labels.rows<<std::endl;
-    std::cout<<"predicted label rows "<<predicted_labels<<std::endl;
-
-    
-
-    for(int i = 0; i < true_labels.rows; ++i){
-        int true_label = true_labels.at<int>(i, 0);
-        int predicted_label = predicted_labels.at<int>(i,0);
-        if(true_label >= 0 && true_label < n_categories &&
-        predicted_label >= 0 && predicted_label < n_categories){
-            cmat.at<float>(true_label, predicted_label) += 1;
-        }else{
-            std::cerr<<"invalid label: true label "<< true_label<<" and predicted label "<<
-            predicted_label<<std::endl;
-        }
-    }
-
-  
-    std::cout<<"confusion matrix sum "<<cv::sum(cmat)[0]<<std::endl;
-
-    CV_Assert(cmat.type()==CV_32FC1);
-    CV_Assert(std::abs(cv::sum(cmat)[0]-static_cast<double>(true_labels.rows))<=1.0e-6);
-    return cmat;
+    MetricsAccumulator metrics(n_categories);
+    metrics.add(true_labels, predicted_labels);
+    const ClassificationMetrics m = metrics.compute();
+    if (m.n_invalid > 0)
+        std::cerr << "Warning: " << m.n_invalid
+                  << " samples with an invalid label were not scored." << std::endl;
+
+    CV_Assert(m.confusion.type()==CV_32FC1);
+    return m.confusion;
 }
 
 cv::Mat
@@ -43,10 +26,12 @@ fsiv_compute_recognition_rates(const cv::Mat& cmat)
     CV_Assert(!cmat.empty() && cmat.type()==CV_32FC1);
     CV_Assert(cmat.rows == cmat.cols);
     cv::Mat RR = cv::Mat::zeros (cmat.rows, 1, CV_32FC1);
+    cv::Mat totals;
+    cv::reduce(cmat, totals, 1, cv::REDUCE_SUM, CV_32F);
 
     for(int i = 0; i < cmat.rows; ++i){
         float true_positives = cmat.at<float>(i,i);
-        float total_in_class = cv::sum(cmat.row(i))[0];
+        float total_in_class = totals.at<float>(i);
         RR.at<float>(i,0) = (total_in_class > 0.0f) ? (true_positives / total_in_class) : 0.0f;
     }
     //
@@ -89,3 +74,135 @@ fsiv_compute_mean_recognition_rate(const cv::Mat& RRs)
 
     return m_rr;
 }
+
+MetricsAccumulator::MetricsAccumulator(int n_categories, int top_k)
+    : n_categories_(n_categories), top_k_(std::max(1, std::min(top_k, n_categories)))
+{
+    CV_Assert(n_categories > 0);
+    clear();
+}
+
+void MetricsAccumulator::clear()
+{
+    counts_.assign(size_t(n_categories_) * n_categories_, 0);
+    n_invalid_ = 0;
+    n_scored_ = 0;
+    top_k_hits_ = 0;
+}
+
+int MetricsAccumulator::get_n_categories() const
+{
+    return n_categories_;
+}
+
+std::int64_t MetricsAccumulator::get_n_samples() const
+{
+    std::int64_t n = 0;
+    for (std::int64_t c : counts_)
+        n += c;
+    return n;
+}
+
+void MetricsAccumulator::add(const cv::Mat &true_labels, const cv::Mat &predicted_labels)
+{
+    CV_Assert(true_labels.rows == predicted_labels.rows);
+    CV_Assert(true_labels.type() == CV_32SC1);
+    CV_Assert(predicted_labels.type() == CV_32SC1);
+    for (int i = 0; i < true_labels.rows; ++i)
+    {
+        const int t = true_labels.at<int>(i, 0);
+        const int p = predicted_labels.at<int>(i, 0);
+        if (t >= 0 && t < n_categories_ && p >= 0 && p < n_categories_)
+            ++counts_[size_t(t) * n_categories_ + p];
+        else
+            ++n_invalid_;
+    }
+}
+
+void MetricsAccumulator::add_scores(const cv::Mat &true_labels, const cv::Mat &in_scores,
+                                    cv::Mat *predicted_labels)
+{
+    CV_Assert(true_labels.rows == in_scores.rows);
+    CV_Assert(true_labels.type() == CV_32SC1);
+    CV_Assert(in_scores.type() == CV_32FC1 && in_scores.cols <= n_categories_);
+    // The models size the scores with the largest train label, so the
+    // categories not seen in training get the worst score.
+    cv::Mat scores = in_scores;
+    if (scores.cols < n_categories_)
+    {
+        scores = cv::Mat(in_scores.rows, n_categories_, CV_32FC1, cv::Scalar(-FLT_MAX));
+        in_scores.copyTo(scores.colRange(0, in_scores.cols));
+    }
+    cv::Mat labels(scores.rows, 1, CV_32SC1);
+    for (int i = 0; i < scores.rows; ++i)
+    {
+        const float *s = scores.ptr<float>(i);
+        const int best = int(std::max_element(s, s + scores.cols) - s);
+        labels.at<int>(i) = best;
+        const int t = true_labels.at<int>(i, 0);
+        if (t < 0 || t >= n_categories_)
+            continue;
+        // The true label is in the top-k if less than k labels have a
+        // better score (ties counted in favour of the lower labels).
+        int rank = 0;
+        for (int c = 0; c < scores.cols && rank < top_k_; ++c)
+            rank += s[c] > s[t] || (s[c] == s[t] && c < t);
+        top_k_hits_ += rank < top_k_;
+        ++n_scored_;
+    }
+    add(true_labels, labels);
+    if (predicted_labels != nullptr)
+        *predicted_labels = labels;
+}
+
+void MetricsAccumulator::merge(const MetricsAccumulator &other)
+{
+    CV_Assert(other.n_categories_ == n_categories_ && other.top_k_ == top_k_);
+    for (size_t i = 0; i < counts_.size(); ++i)
+        counts_[i] += other.counts_[i];
+    n_invalid_ += other.n_invalid_;
+    n_scored_ += other.n_scored_;
+    top_k_hits_ += other.top_k_hits_;
+}
+
+ClassificationMetrics MetricsAccumulator::compute() const
+{
+    const int C = n_categories_;
+    ClassificationMetrics m;
+    m.confusion.create(C, C, CV_32FC1);
+    m.recall = cv::Mat::zeros(C, 1, CV_32FC1);
+    m.precision = cv::Mat::zeros(C, 1, CV_32FC1);
+    m.f1 = cv::Mat::zeros(C, 1, CV_32FC1);
+    std::vector<std::int64_t> predicted(C, 0);
+    std::int64_t hits = 0;
+    for (int t = 0; t < C; ++t)
+    {
+        std::int64_t actual = 0;
+        for (int p = 0; p < C; ++p)
+        {
+            const std::int64_t n = counts_[size_t(t) * C + p];
+            m.confusion.at<float>(t, p) = float(n);
+            actual += n;
+            predicted[p] += n;
+        }
+        const std::int64_t tp = counts_[size_t(t) * C + t];
+        hits += tp;
+        m.n_samples += actual;
+        m.recall.at<float>(t) = actual > 0 ? float(double(tp) / actual) : 0.0f;
+    }
+    for (int c = 0; c < C; ++c)
+    {
+        const std::int64_t tp = counts_[size_t(c) * C + c];
+        const float p = predicted[c] > 0 ? float(double(tp) / predicted[c]) : 0.0f;
+        const float r = m.recall.at<float>(c);
+        m.precision.at<float>(c) = p;
+        m.f1.at<float>(c) = (p + r) > 0.0f ? 2.0f * p * r / (p + r) : 0.0f;
+        m.mean_rr += r / C;
+    }
+    m.accuracy = m.n_samples > 0 ? float(double(hits) / m.n_samples) : 0.0f;
+    m.top_k = top_k_;
+    if (n_scored_ > 0)
+        m.top_k_accuracy = float(double(top_k_hits_) / n_scored_);
+    m.n_invalid = n_invalid_;
+    return m;
+}
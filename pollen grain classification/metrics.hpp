@@ -1,9 +1,13 @@
 #pragma once
+#include <cstdint>
 #include <vector>
 #include <opencv2/core.hpp>
 
 /**
  * @brief Compute a confusion matrix.
+ *
+ * The samples with a label out of [0, n_categories) are not counted, a
+ * warning with their number is printed.
  * 
  * @param true_labels are annotated true labels.
  * @param predicted_labels are the predicted labels.
@@ -13,7 +17,7 @@
  * @pre true_labels.type()==CV_32SC1
  * @pre predicted_labels.type()==CV_32SC1
  * @post ret_v.type()==CV_32FC1
- * @post sum(ret_v)[0]==true_labels.rows
+ * @post sum(ret_v)[0]<=true_labels.rows
  */
 cv::Mat fsiv_compute_confusion_matrix(const cv::Mat& true_labels,
                                       const cv::Mat& predicted_labels,
@@ -48,3 +52,87 @@ cv::Mat fsiv_compute_recognition_rates(const cv::Mat& cmat);
  * @return the mean Recognition Rate.
  */
 float fsiv_compute_mean_recognition_rate(const cv::Mat& RRs);
+
+/**
+ * @brief Metrics computed by a MetricsAccumulator.
+ */
+struct ClassificationMetrics
+{
+    cv::Mat confusion;          // CV_32FC1 n_categories x n_categories.
+    cv::Mat recall;             // CV_32FC1 n_categories x 1 (the RRs).
+    cv::Mat precision;          // CV_32FC1 n_categories x 1.
+    cv::Mat f1;                 // CV_32FC1 n_categories x 1.
+    float mean_rr = 0.0f;       // mean of the recalls.
+    float accuracy = 0.0f;
+    float top_k_accuracy = -1.0f; // -1 if no scores were added.
+    int top_k = 0;
+    std::int64_t n_samples = 0; // valid samples.
+    std::int64_t n_invalid = 0; // samples with a label out of range.
+};
+
+/**
+ * @brief Accumulate the classification metrics of a stream of prediction
+ * batches.
+ *
+ * Each batch only increments integer counts (the confusion matrix and the
+ * top-k hits), so the predictions can be scored as they are computed, and
+ * compute() derives all the metrics from the counts at the end.
+ */
+class MetricsAccumulator
+{
+public:
+    /**
+     * @brief Create an empty accumulator.
+     * @param n_categories is the number of categories.
+     * @param top_k is the k of the top-k accuracy.
+     */
+    MetricsAccumulator(int n_categories, int top_k = 5);
+
+    /**
+     * @brief Add a batch of predicted labels.
+     * @param true_labels are the true labels (CV_32SC1).
+     * @param predicted_labels are the predicted labels (CV_32SC1).
+     * @pre true_labels.rows==predicted_labels.rows
+     */
+    void add(const cv::Mat &true_labels, const cv::Mat &predicted_labels);
+
+    /**
+     * @brief Add a batch of class scores (larger is better).
+     *
+     * The predicted label is the one with the best score, and the top-k
+     * hits are counted too.
+     * @param true_labels are the true labels (CV_32SC1).
+     * @param scores are the scores (CV_32FC1, a row by sample and a column
+     * by category). It may have less columns than categories (e.g. a model
+     * that did not see the last labels), the missing ones score -FLT_MAX.
+     * @param[out] predicted_labels if not null, the predicted labels.
+     */
+    void add_scores(const cv::Mat &true_labels, const cv::Mat &scores,
+                    cv::Mat *predicted_labels = nullptr);
+
+    /**
+     * @brief Add the counts of other accumulator.
+     */
+    void merge(const MetricsAccumulator &other);
+
+    /**
+     * @brief Reset the counts.
+     */
+    void clear();
+
+    /**
+     * @brief Compute the metrics from the counts.
+     */
+    ClassificationMetrics compute() const;
+
+    int get_n_categories() const;
+    std::int64_t get_n_samples() const;
+
+protected:
+    int n_categories_;
+    int top_k_;
+    std::vector<std::int64_t> counts_; // row major confusion matrix.
+    std::int64_t n_invalid_;
+    std::int64_t n_scored_;            // samples added with scores.
+    std::int64_t top_k_hits_;
+};
@@ -0,0 +1,198 @@
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "model_file.hpp"
+
+/**
+ * @brief Header of a model file.
+ *
+ * It is followed by the sections and the sections table.
+ */
+struct ModelFileHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t n_sections;
+    std::uint64_t table_offset;
+};
+
+static const char MODEL_FILE_MAGIC[8] = {'F', 'S', 'I', 'V', 'M', 'D', 'L', '1'};
+static const std::uint32_t MODEL_FILE_VERSION = 1;
+// Enough for the widest SIMD loads, while keeping the padding small
+// (the model size is part of the score).
+static const std::uint64_t MODEL_FILE_ALIGNMENT = 64;
+
+ModelFileWriter::ModelFileWriter(const std::string &path)
+    : path_(path), tmp_path_(fsiv_make_temp_path(path)), closed_(false)
+{
+    out_.open(tmp_path_, std::ios::out | std::ios::binary);
+    if (!out_)
+        throw std::runtime_error("Error: could not create the model file " +
+                                 tmp_path_);
+    // The header is rewritten by close().
+    ModelFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    out_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    metadata_.open(".yml", cv::FileStorage::WRITE_BASE64 | cv::FileStorage::MEMORY);
+}
+
+ModelFileWriter::~ModelFileWriter()
+{
+    if (!closed_)
+    {
+        out_.close();
+        std::remove(tmp_path_.c_str());
+    }
+}
+
+cv::FileStorage &
+ModelFileWriter::metadata()
+{
+    return metadata_;
+}
+
+void ModelFileWriter::add_section(const std::string &name, const cv::Mat &m)
+{
+    CV_Assert(!closed_ && m.dims <= 2);
+    if (name.empty() || name.size() >= sizeof(ModelFileSection::name))
+        throw std::runtime_error("Invalid model file section name: '" + name + "'.");
+    for (const ModelFileSection &s : sections_)
+        if (name == s.name)
+            throw std::runtime_error("Duplicated model file section: '" + name + "'.");
+
+    ModelFileSection section;
+    std::memset(&section, 0, sizeof(section));
+    std::strncpy(section.name, name.c_str(), sizeof(section.name) - 1);
+    section.rows = m.rows;
+    section.cols = m.cols;
+    section.type = m.type();
+    section.offset = fsiv_write_padding(out_, MODEL_FILE_ALIGNMENT);
+    section.size = std::uint64_t(m.rows) * m.cols * m.elemSize();
+    for (int i = 0; i < m.rows; ++i)
+        out_.write(reinterpret_cast<const char *>(m.ptr(i)), m.cols * m.elemSize());
+    sections_.push_back(section);
+}
+
+void ModelFileWriter::add_text(const std::string &name, const std::string &text)
+{
+    add_section(name, cv::Mat(1, int(text.size()), CV_8UC1,
+                              const_cast<char *>(text.data())));
+}
+
+bool ModelFileWriter::close()
+{
+    CV_Assert(!closed_);
+    add_text("fsiv_metadata", metadata_.releaseAndGetString());
+
+    ModelFileHeader header;
+    std::memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+    header.version = MODEL_FILE_VERSION;
+    header.n_sections = std::uint32_t(sections_.size());
+    header.table_offset = fsiv_write_padding(out_, MODEL_FILE_ALIGNMENT);
+    out_.write(reinterpret_cast<const char *>(sections_.data()),
+               sections_.size() * sizeof(ModelFileSection));
+    out_.seekp(0);
+    out_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out_.close();
+    closed_ = true;
+    if (!out_)
+    {
+        std::remove(tmp_path_.c_str());
+        return false;
+    }
+    return fsiv_replace_file(tmp_path_, path_);
+}
+
+std::shared_ptr<ModelFileReader>
+ModelFileReader::open(const std::string &path)
+{
+    auto file = MappedFile::open(path);
+    if (file == nullptr || file->size() < sizeof(ModelFileHeader))
+        return nullptr;
+    ModelFileHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic)) != 0)
+        return nullptr;
+    if (header.version != MODEL_FILE_VERSION)
+        throw std::runtime_error("Unsupported model file version " +
+                                 std::to_string(header.version) + ": " + path);
+
+    const std::uint64_t table_size = std::uint64_t(header.n_sections) * sizeof(ModelFileSection);
+    if (header.table_offset + table_size > file->size())
+        throw std::runtime_error("Truncated model file: " + path);
+
+    std::shared_ptr<ModelFileReader> reader(new ModelFileReader());
+    reader->file_ = file;
+    reader->sections_.resize(header.n_sections);
+    std::memcpy(reader->sections_.data(), file->data() + header.table_offset, table_size);
+    for (ModelFileSection &s : reader->sections_)
+    {
+        s.name[sizeof(s.name) - 1] = '\0';
+        if (s.rows < 0 || s.cols < 0 || s.offset + s.size > file->size() ||
+            s.size != std::uint64_t(s.rows) * s.cols * CV_ELEM_SIZE(s.type))
+            throw std::runtime_error("Truncated model file: " + path);
+    }
+    reader->metadata_.open(reader->get_text("fsiv_metadata"),
+                           cv::FileStorage::READ | cv::FileStorage::MEMORY);
+    if (!reader->metadata_.isOpened())
+        throw std::runtime_error("Could not read the metadata of the model file: " + path);
+    return reader;
+}
+
+cv::FileNode
+ModelFileReader::metadata() const
+{
+    return metadata_.root();
+}
+
+bool ModelFileReader::has_section(const std::string &name) const
+{
+    for (const ModelFileSection &s : sections_)
+        if (name == s.name)
+            return true;
+    return false;
+}
+
+const ModelFileSection &
+ModelFileReader::find(const std::string &name) const
+{
+    for (const ModelFileSection &s : sections_)
+        if (name == s.name)
+            return s;
+    throw std::runtime_error("Could not find the section '" + name +
+                             "' in the model file " + file_->path());
+}
+
+const std::shared_ptr<MappedFile> &
+ModelFileReader::mapping() const
+{
+    return file_;
+}
+
+cv::Mat
+ModelFileReader::get_section(const std::string &name) const
+{
+    const ModelFileSection &s = find(name);
+    if (s.size == 0)
+        return cv::Mat(s.rows, s.cols, s.type);
+    return cv::Mat(s.rows, s.cols, s.type, file_->data() + s.offset);
+}
+
+std::string
+ModelFileReader::get_text(const std::string &name) const
+{
+    const ModelFileSection &s = find(name);
+    return std::string(reinterpret_cast<const char *>(file_->data() + s.offset),
+                       size_t(s.size));
+}
+
+cv::FileStorage
+fsiv_open_model_metadata(const std::string &path)
+{
+    auto in = ModelFileReader::open(path);
+    if (in != nullptr)
+        return cv::FileStorage(in->get_text("fsiv_metadata"),
+                               cv::FileStorage::READ | cv::FileStorage::MEMORY);
+    return cv::FileStorage(path, cv::FileStorage::READ);
+}
@@ -0,0 +1,185 @@
+/**
+ *  @file model_file.hpp
+ *  Binary container of the trained models.
+ */
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "binary_io.hpp"
+
+/**
+ * @brief Entry of the sections table of a model file.
+ */
+struct ModelFileSection
+{
+    char name[48];
+    std::int32_t rows;
+    std::int32_t cols;
+    std::int32_t type;     // OpenCV type of the matrix.
+    std::int32_t reserved;
+    std::uint64_t offset;  // from the file start, aligned.
+    std::uint64_t size;    // in bytes.
+};
+
+/**
+ * @brief Write a model file.
+ *
+ * A model file has a header, the sections (each one aligned to 64 bytes)
+ * and the sections table. The small values (classifier type, extractor id
+ * and parameters, seed, ...) are written with a cv::FileStorage into the 'fsiv_metadata' section, while the big
+ * matrices (e.g. the KNN train samples) are raw sections that can be
+ * mapped as cv::Mat without parsing or copying.
+ *
+ * The sections are written as they are added, and the file only appears
+ * at its pathname when close() succeeds.
+ */
+class ModelFileWriter
+{
+public:
+
+    /**
+     * @brief Start writing a model file.
+     * @param path is the pathname of the model file.
+     * @throw std::runtime_error if the file could not be created.
+     */
+    ModelFileWriter(const std::string &path);
+    ~ModelFileWriter();
+
+    /**
+     * @brief Get the storage of the metadata.
+     *
+     * It is opened to write in memory (matrices are base64 encoded).
+     */
+    cv::FileStorage &metadata();
+
+    /**
+     * @brief Add a matrix section.
+     * @param name is the section name (less than 48 chars, unique).
+     * @param m is a 2D matrix of any type.
+     */
+    void add_section(const std::string &name, const cv::Mat &m);
+
+    /**
+     * @brief Add a text section.
+     */
+    void add_text(const std::string &name, const std::string &text);
+
+    /**
+     * @brief Write the metadata and the sections table and publish the file.
+     * @return true if success.
+     */
+    bool close();
+
+protected:
+    std::string path_;
+    std::string tmp_path_;
+    std::ofstream out_;
+    cv::FileStorage metadata_;
+    std::vector<ModelFileSection> sections_;
+    bool closed_;
+};
+
+/**
+ * @brief Read a model file written by ModelFileWriter.
+ *
+ * The file is memory mapped. The matrix sections are returned as views
+ * over the mapping, so the models keeping them must also keep mapping().
+ */
+class ModelFileReader
+{
+public:
+
+    /**
+     * @brief Open a model file.
+     * @param path is the pathname.
+     * @return the reader or nullptr if the file is not a model file (e.g.
+     * a model saved as an OpenCV FileStorage by older versions).
+     * @throw std::runtime_error if the file is a truncated model file.
+     */
+    static std::shared_ptr<ModelFileReader> open(const std::string &path);
+
+    /**
+     * @brief Get the root node of the metadata.
+     */
+    cv::FileNode metadata() const;
+
+    /**
+     * @brief Has the file a section with this name?
+     */
+    bool has_section(const std::string &name) const;
+
+    /**
+     * @brief Get the mapping of the file.
+     *
+     * The views returned by get_section() are valid while it is alive.
+     */
+    const std::shared_ptr<MappedFile> &mapping() const;
+
+    /**
+     * @brief Get a matrix section.
+     * @return a view over the mapped memory, see mapping().
+     * @throw std::runtime_error if there is not such section.
+     */
+    cv::Mat get_section(const std::string &name) const;
+
+    /**
+     * @brief Get a text section.
+     * @throw std::runtime_error if there is not such section.
+     */
+    std::string get_text(const std::string &name) const;
+
+protected:
+    ModelFileReader() = default;
+    const ModelFileSection &find(const std::string &name) const;
+
+    std::shared_ptr<MappedFile> file_;
+    std::vector<ModelFileSection> sections_;
+    cv::FileStorage metadata_;
+};
+
+/**
+ * @brief Interface of the models that save their big matrices as sections
+ * of a model file.
+ *
+ * The models implementing it are loaded from a model file without parsing
+ * their matrices, the other ones are kept as a FileStorage text section.
+ */
+class MappableModel
+{
+public:
+    virtual ~MappableModel() {}
+
+    /**
+     * @brief Write the model.
+     * @param fs is where the small values are written.
+     * @param out is the model file where the matrices are added as sections.
+     */
+    virtual void write_mapped(cv::FileStorage &fs, ModelFileWriter &out) const = 0;
+
+    /**
+     * @brief Read the model.
+     * @param fn is the node where the small values were written.
+     * @param in is the model file. The matrices may be kept as views over
+     * it, holding in.mapping() until they are released.
+     */
+    virtual void read_mapped(const cv::FileNode &fn, const ModelFileReader &in) = 0;
+};
+
+/**
+ * @brief Open the metadata of a model.
+ *
+ * For a model file it is the 'fsiv_metadata' section and for an older
+ * FileStorage model it is the whole file, so the callers do not mind the
+ * model format.
+ *
+ * @param path is the model pathname.
+ * @return the storage opened to read (not opened if the file could not be
+ * read).
+ */
+cv::FileStorage fsiv_open_model_metadata(const std::string &path);
@@ -17,6 +17,12 @@ MyExtractor::MyExtractor()
 
 MyExtractor::~MyExtractor() {}
 
+cv::Ptr<FeaturesExtractor>
+MyExtractor::clone() const
+{
+    return cv::makePtr<MyExtractor>(*this);
+}
+
 cv::Mat
 MyExtractor::extract_features(const cv::Mat& img)
 {    
@@ -38,3 +44,12 @@ MyExtractor::extract_features(const cv::Mat& img)
     CV_Assert(feature.type()==CV_32FC1);
     return feature;
 }
+
+void
+MyExtractor::extract_batch(const cv::Mat& rows, cv::Mat& out)
+{
+    if (rows.channels() != 1)
+        FeaturesExtractor::extract_batch(rows, out);
+    else
+        fsiv_extract_graylevels_batch(rows, out, int(params_[0]));
+}
@@ -17,7 +17,9 @@ public:
     ~MyExtractor();
 
     virtual std::string get_extractor_name() const override;
+    virtual cv::Ptr<FeaturesExtractor> clone() const override;
     virtual cv::Mat extract_features(const cv::Mat& img) override;
+    virtual void extract_batch(const cv::Mat& rows, cv::Mat& out) override;
 
     //This extractor does not need override these methods:
     //virtual void train(const cv::Mat& samples) override;
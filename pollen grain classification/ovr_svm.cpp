@@ -0,0 +1,661 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+#include <opencv2/core/utility.hpp>
+#include "ovr_svm.hpp"
+
+// Same stopping tolerance and iterations bound as LIBSVM.
+static const double SVM_EPS = 1.0e-3;
+static const double SVM_TAU = 1.0e-12;
+static const long long SVM_MAX_ITER = 10000000;
+static const int SVM_QUERY_BLOCK = 128;
+// Encoded samples decoded at once by predict_margins().
+static const int SVM_DECODE_BLOCK = 4096;
+
+void SVMKernel::compute(const cv::Mat &A, const float *a_sqnorms, const cv::Mat &B,
+                        const float *b_sqnorms, cv::Mat &K) const
+{
+    CV_Assert(A.type() == CV_32FC1 && B.type() == CV_32FC1 && A.cols == B.cols);
+    K.create(A.rows, B.rows, CV_32FC1);
+    switch (type)
+    {
+        case cv::ml::SVM::LINEAR:
+            cv::gemm(A, B, 1.0, cv::noArray(), 0.0, K, cv::GEMM_2_T);
+            break;
+        case cv::ml::SVM::POLY:
+            cv::gemm(A, B, gamma, cv::noArray(), 0.0, K, cv::GEMM_2_T);
+            for (int i = 0; i < K.rows; ++i)
+            {
+                float *k = K.ptr<float>(i);
+                for (int j = 0; j < K.cols; ++j)
+                    k[j] = float(std::pow(k[j] + coef0, degree));
+            }
+            break;
+        case cv::ml::SVM::RBF:
+            cv::gemm(A, B, -2.0, cv::noArray(), 0.0, K, cv::GEMM_2_T);
+            for (int i = 0; i < K.rows; ++i)
+            {
+                float *k = K.ptr<float>(i);
+                for (int j = 0; j < K.cols; ++j)
+                {
+                    // Rounding may give tiny negative distances.
+                    const float d = std::max(0.0f, a_sqnorms[i] + b_sqnorms[j] + k[j]);
+                    k[j] = std::exp(float(-gamma) * d);
+                }
+            }
+            break;
+        case cv::ml::SVM::SIGMOID:
+            cv::gemm(A, B, gamma, cv::noArray(), 0.0, K, cv::GEMM_2_T);
+            for (int i = 0; i < K.rows; ++i)
+            {
+                float *k = K.ptr<float>(i);
+                for (int j = 0; j < K.cols; ++j)
+                    k[j] = float(std::tanh(k[j] + coef0));
+            }
+            break;
+        case cv::ml::SVM::CHI2:
+        case cv::ml::SVM::INTER:
+            for (int i = 0; i < K.rows; ++i)
+            {
+                const float *a = A.ptr<float>(i);
+                float *k = K.ptr<float>(i);
+                for (int j = 0; j < K.cols; ++j)
+                {
+                    const float *b = B.ptr<float>(j);
+                    float s = 0.0f;
+                    if (type == cv::ml::SVM::INTER)
+                        for (int d = 0; d < A.cols; ++d)
+                            s += std::min(a[d], b[d]);
+                    else
+                    {
+                        for (int d = 0; d < A.cols; ++d)
+                        {
+                            const float sum = a[d] + b[d];
+                            if (sum != 0.0f)
+                                s += (a[d] - b[d]) * (a[d] - b[d]) / sum;
+                        }
+                        s = std::exp(float(-gamma) * s);
+                    }
+                    k[j] = s;
+                }
+            }
+            break;
+        default:
+            throw std::runtime_error("Unknown SVM kernel type " + std::to_string(type) + ".");
+    }
+}
+
+KernelCache::KernelCache(const cv::Mat &X, const SVMKernel &kernel, size_t max_bytes)
+    : X_(X), kernel_(kernel)
+{
+    CV_Assert(!X.empty() && X.type() == CV_32FC1);
+    const int N = X.rows;
+    sqnorms_.resize(N);
+    diag_.resize(N);
+    cv::parallel_for_(cv::Range(0, N), [&](const cv::Range &range)
+    {
+        cv::Mat k;
+        for (int i = range.start; i < range.end; ++i)
+        {
+            const float *x = X_.ptr<float>(i);
+            sqnorms_[i] = fsiv_dot(x, x, X_.cols);
+            kernel_.compute(X_.row(i), &sqnorms_[i], X_.row(i), &sqnorms_[i], k);
+            diag_[i] = k.at<float>(0);
+        }
+    });
+    // Each solver holds at most two rows, so a tiny budget still works
+    // although the rows will be computed again and again.
+    max_rows_ = std::max<size_t>(1, max_bytes / (sizeof(float) * size_t(N)));
+}
+
+KernelCache::Row
+KernelCache::row(int i)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = rows_.find(i);
+        if (it != rows_.end())
+        {
+            lru_.splice(lru_.begin(), lru_, it->second.second);
+            return it->second.first;
+        }
+    }
+
+    // The row is computed without the lock, so the other solvers go on. Two
+    // solvers asking for the same missing row compute it twice, but only
+    // one copy is kept.
+    std::shared_ptr<std::vector<float>> values =
+        std::make_shared<std::vector<float>>(X_.rows);
+    cv::Mat K(1, X_.rows, CV_32FC1, values->data());
+    kernel_.compute(X_.row(i), &sqnorms_[i], X_, sqnorms_.data(), K);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = rows_.find(i);
+    if (it != rows_.end())
+        return it->second.first;
+    lru_.push_front(i);
+    rows_[i] = std::make_pair(Row(values), lru_.begin());
+    while (rows_.size() > max_rows_)
+    {
+        rows_.erase(lru_.back());
+        lru_.pop_back();
+    }
+    return values;
+}
+
+float KernelCache::diag(int i) const
+{
+    return diag_[i];
+}
+
+OvrSVM::OvrSVM() : C_(1.0), cache_mb_(1024) {}
+
+cv::Ptr<OvrSVM>
+OvrSVM::create(int kernel, double C, double degree, double gamma, int cache_mb)
+{
+    CV_Assert(kernel >= cv::ml::SVM::LINEAR && kernel <= cv::ml::SVM::INTER);
+    CV_Assert(C > 0.0 && cache_mb > 0);
+    cv::Ptr<OvrSVM> svm = cv::makePtr<OvrSVM>();
+    svm->kernel_.type = kernel;
+    svm->kernel_.degree = degree;
+    svm->kernel_.gamma = gamma;
+    svm->C_ = C;
+    svm->cache_mb_ = cache_mb;
+    return svm;
+}
+
+int OvrSVM::get_kernel_type() const
+{
+    return kernel_.type;
+}
+
+double OvrSVM::get_C() const
+{
+    return C_;
+}
+
+double OvrSVM::get_degree() const
+{
+    return kernel_.degree;
+}
+
+double OvrSVM::get_gamma() const
+{
+    return kernel_.gamma;
+}
+
+int OvrSVM::get_n_support_vectors() const
+{
+    return sv_.rows;
+}
+
+int OvrSVM::getVarCount() const
+{
+    return sv_.cols;
+}
+
+bool OvrSVM::isTrained() const
+{
+    return !coefs_.empty();
+}
+
+bool OvrSVM::isClassifier() const
+{
+    return true;
+}
+
+void OvrSVM::clear()
+{
+    sv_.release();
+    sv_sqnorms_.release();
+    coefs_.release();
+    bias_.release();
+    mapping_.reset();
+}
+
+std::string
+OvrSVM::getDefaultName() const
+{
+    return "fsiv_ovr_svm";
+}
+
+float OvrSVM::solve(const std::vector<schar> &y, KernelCache &cache,
+                    std::vector<float> &alpha_out) const
+{
+    // Dual problem: min 0.5 a'Qa - e'a, 0 <= a <= C, y'a = 0 with
+    // Q_ij = y_i y_j K_ij and G = Qa - e its gradient.
+    const int N = int(y.size());
+    const double C = C_;
+    std::vector<double> alpha(N, 0.0);
+    std::vector<double> G(N, -1.0);
+    const long long max_iter = std::max(SVM_MAX_ITER, 100LL * N);
+
+    for (long long iter = 0; iter < max_iter; ++iter)
+    {
+        // i is the most violating sample of the "up" set and j the one of
+        // the "low" set that most decreases the objective (second order).
+        double G_max = -DBL_MAX;
+        int i = -1;
+        for (int t = 0; t < N; ++t)
+            if (y[t] > 0 ? alpha[t] < C : alpha[t] > 0.0)
+            {
+                const double v = -y[t] * G[t];
+                if (v >= G_max)
+                {
+                    G_max = v;
+                    i = t;
+                }
+            }
+        if (i < 0)
+            break;
+
+        const KernelCache::Row row_i = cache.row(i);
+        const float *K_i = row_i->data();
+        const double K_ii = cache.diag(i);
+        double G_max2 = -DBL_MAX;
+        double obj_min = DBL_MAX;
+        int j = -1;
+        for (int t = 0; t < N; ++t)
+            if (y[t] > 0 ? alpha[t] > 0.0 : alpha[t] < C)
+            {
+                const double v = y[t] * G[t];
+                G_max2 = std::max(G_max2, v);
+                const double grad_diff = G_max + v;
+                if (grad_diff > 0.0)
+                {
+                    double quad = K_ii + cache.diag(t) - 2.0 * K_i[t];
+                    if (quad <= 0.0)
+                        quad = SVM_TAU;
+                    const double obj = -grad_diff * grad_diff / quad;
+                    if (obj <= obj_min)
+                    {
+                        obj_min = obj;
+                        j = t;
+                    }
+                }
+            }
+        if (j < 0 || G_max + G_max2 < SVM_EPS)
+            break;
+
+        const KernelCache::Row row_j = cache.row(j);
+        const float *K_j = row_j->data();
+        double quad = K_ii + cache.diag(j) - 2.0 * K_i[j];
+        if (quad <= 0.0)
+            quad = SVM_TAU;
+        const double old_ai = alpha[i];
+        const double old_aj = alpha[j];
+        double ai = old_ai;
+        double aj = old_aj;
+        if (y[i] != y[j])
+        {
+            const double delta = (-G[i] - G[j]) / quad;
+            const double diff = ai - aj;
+            ai += delta;
+            aj += delta;
+            if (diff > 0.0)
+            {
+                if (aj < 0.0)
+                {
+                    aj = 0.0;
+                    ai = diff;
+                }
+                if (ai > C)
+                {
+                    ai = C;
+                    aj = C - diff;
+                }
+            }
+            else
+            {
+                if (ai < 0.0)
+                {
+                    ai = 0.0;
+                    aj = -diff;
+                }
+                if (aj > C)
+                {
+                    aj = C;
+                    ai = C + diff;
+                }
+            }
+        }
+        else
+        {
+            const double delta = (G[i] - G[j]) / quad;
+            const double sum = ai + aj;
+            ai -= delta;
+            aj += delta;
+            if (sum > C)
+            {
+                if (ai > C)
+                {
+                    ai = C;
+                    aj = sum - C;
+                }
+                if (aj > C)
+                {
+                    aj = C;
+                    ai = sum - C;
+                }
+            }
+            else
+            {
+                if (aj < 0.0)
+                {
+                    aj = 0.0;
+                    ai = sum;
+                }
+                if (ai < 0.0)
+                {
+                    ai = 0.0;
+                    aj = sum;
+                }
+            }
+        }
+        alpha[i] = ai;
+        alpha[j] = aj;
+
+        const double d_i = y[i] * (ai - old_ai);
+        const double d_j = y[j] * (aj - old_aj);
+        for (int t = 0; t < N; ++t)
+            G[t] += y[t] * (K_i[t] * d_i + K_j[t] * d_j);
+    }
+
+    // rho is the mean of y*G over the free samples or, if there are none,
+    // the middle of the feasible interval.
+    double ub = DBL_MAX, lb = -DBL_MAX, sum_free = 0.0;
+    int n_free = 0;
+    for (int t = 0; t < N; ++t)
+    {
+        const double yG = y[t] * G[t];
+        if (alpha[t] >= C)
+        {
+            if (y[t] < 0)
+                ub = std::min(ub, yG);
+            else
+                lb = std::max(lb, yG);
+        }
+        else if (alpha[t] <= 0.0)
+        {
+            if (y[t] > 0)
+                ub = std::min(ub, yG);
+            else
+                lb = std::max(lb, yG);
+        }
+        else
+        {
+            ++n_free;
+            sum_free += yG;
+        }
+    }
+    double rho = 0.0;
+    if (n_free > 0)
+        rho = sum_free / n_free;
+    else if (ub == DBL_MAX)
+        rho = lb;
+    else if (lb == -DBL_MAX)
+        rho = ub;
+    else
+        rho = (ub + lb) / 2.0;
+
+    alpha_out.resize(N);
+    for (int t = 0; t < N; ++t)
+        alpha_out[t] = float(alpha[t]);
+    return float(-rho);
+}
+
+bool OvrSVM::train(const cv::Ptr<cv::ml::TrainData> &data, int flags)
+{
+    CV_Assert(data != nullptr);
+    clear();
+    cv::Mat X = data->getTrainSamples(cv::ml::ROW_SAMPLE);
+    if (X.type() != CV_32FC1)
+        X.convertTo(X, CV_32F);
+    cv::Mat labels;
+    data->getTrainResponses().convertTo(labels, CV_32S);
+    const int N = X.rows;
+    CV_Assert(N > 0 && int(labels.total()) == N);
+    labels = labels.reshape(1, N);
+    double min_label = 0.0, max_label = 0.0;
+    cv::minMaxLoc(labels, &min_label, &max_label);
+    CV_Assert(min_label >= 0.0);
+    const int n_classes = int(max_label) + 1;
+
+    // A binary problem by class, all sharing the kernel rows.
+    KernelCache cache(X, kernel_, size_t(cache_mb_) << 20);
+    std::vector<std::vector<float>> alphas(n_classes);
+    std::vector<float> biases(n_classes, -FLT_MAX);
+    cv::parallel_for_(cv::Range(0, n_classes), [&](const cv::Range &range)
+    {
+        std::vector<schar> y(N);
+        for (int c = range.start; c < range.end; ++c)
+        {
+            int n_positives = 0;
+            for (int t = 0; t < N; ++t)
+            {
+                y[t] = labels.at<int>(t) == c ? 1 : -1;
+                n_positives += y[t] > 0;
+            }
+            // A class without samples is never predicted.
+            if (n_positives > 0)
+                biases[c] = solve(y, cache, alphas[c]);
+            else
+                alphas[c].assign(N, 0.0f);
+        }
+    });
+
+    // Keep the union of the support vectors.
+    std::vector<int> sv_rows;
+    for (int t = 0; t < N; ++t)
+        for (int c = 0; c < n_classes; ++c)
+            if (alphas[c][t] > 0.0f)
+            {
+                sv_rows.push_back(t);
+                break;
+            }
+    const int S = int(sv_rows.size());
+    sv_.create(S, X.cols, CV_32FC1);
+    coefs_.create(S, n_classes, CV_32FC1);
+    for (int s = 0; s < S; ++s)
+    {
+        const int t = sv_rows[s];
+        X.row(t).copyTo(sv_.row(s));
+        float *coef = coefs_.ptr<float>(s);
+        for (int c = 0; c < n_classes; ++c)
+            coef[c] = labels.at<int>(t) == c ? alphas[c][t] : -alphas[c][t];
+    }
+    bias_.create(1, n_classes, CV_32FC1);
+    for (int c = 0; c < n_classes; ++c)
+        bias_.at<float>(c) = biases[c];
+    compute_sv_sqnorms();
+    return isTrained();
+}
+
+void OvrSVM::compute_sv_sqnorms()
+{
+    sv_sqnorms_.create(sv_.rows, 1, CV_32FC1);
+    for (int s = 0; s < sv_.rows; ++s)
+    {
+        const float *x = sv_.ptr<float>(s);
+        sv_sqnorms_.at<float>(s) = fsiv_dot(x, x, sv_.cols);
+    }
+}
+
+void OvrSVM::decision_function(const cv::Mat &X, cv::Mat &D) const
+{
+    CV_Assert(isTrained());
+    CV_Assert(X.type() == CV_32FC1 && X.cols == sv_.cols);
+    D.create(X.rows, coefs_.cols, CV_32FC1);
+    const float *bias = bias_.ptr<float>();
+    const int n_blocks = (X.rows + SVM_QUERY_BLOCK - 1) / SVM_QUERY_BLOCK;
+    cv::parallel_for_(cv::Range(0, n_blocks), [&](const cv::Range &range)
+    {
+        cv::Mat K, D_b;
+        std::vector<float> q_sqnorms(SVM_QUERY_BLOCK);
+        for (int b = range.start; b < range.end; ++b)
+        {
+            const int begin = b * SVM_QUERY_BLOCK;
+            const int end = std::min(X.rows, begin + SVM_QUERY_BLOCK);
+            const cv::Mat queries = X.rowRange(begin, end);
+            for (int i = 0; i < queries.rows; ++i)
+            {
+                const float *q = queries.ptr<float>(i);
+                q_sqnorms[i] = fsiv_dot(q, q, queries.cols);
+            }
+            // The kernel values are computed once for all the classes.
+            if (sv_.rows > 0)
+            {
+                kernel_.compute(queries, q_sqnorms.data(), sv_, sv_sqnorms_.ptr<float>(), K);
+                cv::gemm(K, coefs_, 1.0, cv::noArray(), 0.0, D_b);
+            }
+            else
+                D_b = cv::Mat::zeros(queries.rows, coefs_.cols, CV_32FC1);
+            for (int i = begin; i < end; ++i)
+            {
+                const float *d_b = D_b.ptr<float>(i - begin);
+                float *d = D.ptr<float>(i);
+                for (int c = 0; c < D.cols; ++c)
+                    d[c] = d_b[c] + bias[c];
+            }
+        }
+    });
+}
+
+void OvrSVM::predict_margins(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                             cv::Mat &labels, cv::Mat &margins) const
+{
+    CV_Assert(isTrained());
+    labels.create(X.rows, 1, CV_32SC1);
+    margins.create(X.rows, 1, CV_32FC1);
+    cv::Mat X_f, D;
+    for (int begin = 0; begin < X.rows; begin += SVM_DECODE_BLOCK)
+    {
+        const int end = std::min(X.rows, begin + SVM_DECODE_BLOCK);
+        cv::Mat block = X.rowRange(begin, end);
+        if (block.type() != CV_32FC1)
+        {
+            quantizer.decode(block, X_f);
+            block = X_f;
+        }
+        decision_function(block, D);
+        for (int i = begin; i < end; ++i)
+        {
+            const float *d = D.ptr<float>(i - begin);
+            int best = 0;
+            float second = -FLT_MAX;
+            for (int c = 1; c < D.cols; ++c)
+                if (d[c] > d[best])
+                {
+                    second = d[best];
+                    best = c;
+                }
+                else if (d[c] > second)
+                    second = d[c];
+            labels.at<int>(i) = best;
+            margins.at<float>(i) = D.cols > 1 ? d[best] - second : FLT_MAX;
+        }
+    }
+}
+
+void OvrSVM::predict_scores(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                            cv::Mat &scores) const
+{
+    CV_Assert(isTrained());
+    scores.create(X.rows, coefs_.cols, CV_32FC1);
+    cv::Mat X_f, D;
+    for (int begin = 0; begin < X.rows; begin += SVM_DECODE_BLOCK)
+    {
+        const int end = std::min(X.rows, begin + SVM_DECODE_BLOCK);
+        cv::Mat block = X.rowRange(begin, end);
+        if (block.type() != CV_32FC1)
+        {
+            quantizer.decode(block, X_f);
+            block = X_f;
+        }
+        decision_function(block, D);
+        D.copyTo(scores.rowRange(begin, end));
+    }
+}
+
+float OvrSVM::predict(cv::InputArray samples, cv::OutputArray results, int flags) const
+{
+    cv::Mat X = samples.getMat();
+    if (X.type() != CV_32FC1)
+        X.convertTo(X, CV_32F);
+    cv::Mat D;
+    decision_function(X, D);
+    cv::Mat labels(X.rows, 1, CV_32FC1);
+    for (int i = 0; i < D.rows; ++i)
+    {
+        const float *d = D.ptr<float>(i);
+        labels.at<float>(i) = float(std::max_element(d, d + D.cols) - d);
+    }
+    if (results.needed())
+        labels.copyTo(results);
+    return labels.empty() ? 0.0f : labels.at<float>(0);
+}
+
+void OvrSVM::write_params(cv::FileStorage &fs) const
+{
+    fs << "fsiv_ovr_svm_kernel" << kernel_.type;
+    fs << "fsiv_ovr_svm_C" << C_;
+    fs << "fsiv_ovr_svm_degree" << kernel_.degree;
+    fs << "fsiv_ovr_svm_gamma" << kernel_.gamma;
+    fs << "fsiv_ovr_svm_coef0" << kernel_.coef0;
+    fs << "fsiv_ovr_svm_cache_mb" << cache_mb_;
+    fs << "fsiv_ovr_svm_bias" << bias_;
+}
+
+void OvrSVM::read_params(const cv::FileNode &fn)
+{
+    auto kernel_node = fn["fsiv_ovr_svm_kernel"];
+    auto bias_node = fn["fsiv_ovr_svm_bias"];
+    if (kernel_node.empty() || bias_node.empty())
+        throw std::runtime_error("Could not load the 'fsiv_ovr_svm_kernel' and "
+                                 "'fsiv_ovr_svm_bias' labels from file.");
+    kernel_.type = int(kernel_node);
+    C_ = double(fn["fsiv_ovr_svm_C"]);
+    kernel_.degree = double(fn["fsiv_ovr_svm_degree"]);
+    kernel_.gamma = double(fn["fsiv_ovr_svm_gamma"]);
+    kernel_.coef0 = double(fn["fsiv_ovr_svm_coef0"]);
+    cache_mb_ = int(fn["fsiv_ovr_svm_cache_mb"]);
+    bias_node >> bias_;
+}
+
+void OvrSVM::write(cv::FileStorage &fs) const
+{
+    write_params(fs);
+    fs << "fsiv_ovr_svm_coefs" << coefs_;
+    fs << "fsiv_ovr_svm_support_vectors" << sv_;
+}
+
+void OvrSVM::read(const cv::FileNode &fn)
+{
+    clear();
+    read_params(fn);
+    fn["fsiv_ovr_svm_coefs"] >> coefs_;
+    fn["fsiv_ovr_svm_support_vectors"] >> sv_;
+    CV_Assert(coefs_.type() == CV_32FC1 && bias_.cols == coefs_.cols);
+    CV_Assert(sv_.rows == coefs_.rows);
+    compute_sv_sqnorms();
+}
+
+void OvrSVM::write_mapped(cv::FileStorage &fs, ModelFileWriter &out) const
+{
+    write_params(fs);
+    out.add_section("fsiv_ovr_svm_coefs", coefs_);
+    out.add_section("fsiv_ovr_svm_support_vectors", sv_);
+}
+
+void OvrSVM::read_mapped(const cv::FileNode &fn, const ModelFileReader &in)
+{
+    clear();
+    read_params(fn);
+    coefs_ = in.get_section("fsiv_ovr_svm_coefs");
+    sv_ = in.get_section("fsiv_ovr_svm_support_vectors");
+    mapping_ = in.mapping();
+    CV_Assert(coefs_.type() == CV_32FC1 && bias_.cols == coefs_.cols);
+    CV_Assert(sv_.type() == CV_32FC1 && sv_.rows == coefs_.rows);
+    compute_sv_sqnorms();
+}
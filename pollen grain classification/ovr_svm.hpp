@@ -0,0 +1,181 @@
+/**
+ *  @file ovr_svm.hpp
+ */
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/ml.hpp>
+#include "classifiers.hpp"
+#include "model_file.hpp"
+
+/**
+ * @brief Kernel function of a SVM.
+ */
+struct SVMKernel
+{
+    int type = cv::ml::SVM::RBF; // cv::ml::SVM::KernelTypes.
+    double gamma = 1.0;
+    double coef0 = 0.0;
+    double degree = 3.0;
+
+    /**
+     * @brief Compute the kernel between two sets of samples.
+     *
+     * Linear, polynomial, RBF and sigmoid kernels use a GEMM.
+     *
+     * @param A are samples (CV_32FC1, one by row).
+     * @param a_sqnorms are their squared norms (only used by RBF).
+     * @param B are samples (CV_32FC1, one by row).
+     * @param b_sqnorms are their squared norms (only used by RBF).
+     * @param K is the kernel matrix (CV_32FC1, A.rows x B.rows).
+     */
+    void compute(const cv::Mat &A, const float *a_sqnorms, const cv::Mat &B,
+                 const float *b_sqnorms, cv::Mat &K) const;
+};
+
+/**
+ * @brief Cache of the kernel matrix rows of the train samples.
+ *
+ * It is shared by several solvers running in parallel: a row is computed
+ * once and used by all of them until it is evicted (least recently used
+ * first) when the cache is full. A row being used is not freed.
+ */
+class KernelCache
+{
+public:
+    typedef std::shared_ptr<const std::vector<float>> Row;
+
+    /**
+     * @brief Create a cache.
+     * @param X are the train samples (CV_32FC1).
+     * @param kernel is the kernel function.
+     * @param max_bytes is the memory budget of the cached rows.
+     */
+    KernelCache(const cv::Mat &X, const SVMKernel &kernel, size_t max_bytes);
+
+    /**
+     * @brief Get the kernel values between a sample and all the samples.
+     */
+    Row row(int i);
+
+    /**
+     * @brief Get K(x_i, x_i).
+     */
+    float diag(int i) const;
+
+protected:
+    const cv::Mat X_;
+    SVMKernel kernel_;
+    std::vector<float> sqnorms_;
+    std::vector<float> diag_;
+    size_t max_rows_;
+    std::mutex mutex_;
+    std::list<int> lru_; // most recently used first.
+    std::unordered_map<int, std::pair<Row, std::list<int>::iterator>> rows_;
+};
+
+/**
+ * @brief One-vs-rest SVM classifier with the binary problems trained in
+ * parallel.
+ *
+ * Each class gets a C-SVC against the rest, solved by SMO with the second
+ * order working set selection (as LIBSVM does, without shrinking). The
+ * binary problems are solved concurrently (see cv::setNumThreads) and share
+ * one kernel cache, since they all use the same train samples.
+ *
+ * The model keeps the union of the support vectors and a coefficients
+ * matrix with a column by class, so a prediction computes the kernel of a
+ * block of queries against all the support vectors once (a GEMM for the
+ * dot product kernels) for all the classes.
+ */
+class OvrSVM : public cv::ml::StatModel, public MappableModel,
+               public MarginModel
+{
+public:
+    OvrSVM();
+
+    /**
+     * @brief Create an untrained classifier.
+     *
+     * Needed by cv::Algorithm::load<OvrSVM>().
+     * @param kernel is the kernel type (cv::ml::SVM::KernelTypes).
+     * @param C is the penalty parameter.
+     * @param degree is the degree of the polynomial kernel.
+     * @param gamma is the gamma of the polynomial, RBF, sigmoid and CHI2 kernels.
+     * @param cache_mb is the memory budget of the kernel cache in Mb.
+     */
+    static cv::Ptr<OvrSVM> create(int kernel = cv::ml::SVM::RBF, double C = 1.0,
+                                  double degree = 3.0, double gamma = 1.0,
+                                  int cache_mb = 1024);
+
+    int get_kernel_type() const;
+    double get_C() const;
+    double get_degree() const;
+    double get_gamma() const;
+    int get_n_support_vectors() const;
+
+    using cv::ml::StatModel::train;
+    virtual bool train(const cv::Ptr<cv::ml::TrainData> &data, int flags = 0) override;
+    virtual float predict(cv::InputArray samples, cv::OutputArray results = cv::noArray(),
+                          int flags = 0) const override;
+    virtual int getVarCount() const override;
+    virtual bool isTrained() const override;
+    virtual bool isClassifier() const override;
+    virtual void clear() override;
+    virtual void write(cv::FileStorage &fs) const override;
+    virtual void read(const cv::FileNode &fn) override;
+    virtual std::string getDefaultName() const override;
+    virtual void write_mapped(cv::FileStorage &fs, ModelFileWriter &out) const override;
+    virtual void read_mapped(const cv::FileNode &fn, const ModelFileReader &in) override;
+
+    /**
+     * @brief Compute the decision values.
+     * @param X are the samples (CV_32FC1).
+     * @param D are the decision values (CV_32FC1, X.rows x classes).
+     */
+    void decision_function(const cv::Mat &X, cv::Mat &D) const;
+
+    /**
+     * @brief Predict with the gap between the two largest decision values as
+     * margin.
+     */
+    virtual void predict_margins(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                 cv::Mat &labels, cv::Mat &margins) const override;
+
+    /**
+     * @brief Predict the class scores (the decision values).
+     */
+    virtual void predict_scores(const cv::Mat &X, const FeatureQuantizer &quantizer,
+                                cv::Mat &scores) const override;
+
+protected:
+
+    /**
+     * @brief Solve a binary C-SVC with SMO.
+     * @param y are the labels (+1/-1).
+     * @param cache is the kernel cache.
+     * @param alpha are the dual coefficients.
+     * @return the bias.
+     */
+    float solve(const std::vector<schar> &y, KernelCache &cache,
+                std::vector<float> &alpha) const;
+
+    void write_params(cv::FileStorage &fs) const;
+    void read_params(const cv::FileNode &fn);
+    void compute_sv_sqnorms();
+
+    SVMKernel kernel_;
+    double C_;
+    int cache_mb_;
+    cv::Mat sv_;         // SxD support vectors.
+    cv::Mat sv_sqnorms_; // Sx1 squared norms.
+    cv::Mat coefs_;      // SxC alpha*y of each class (0 if not a SV).
+    cv::Mat bias_;       // 1xC biases.
+    std::shared_ptr<MappedFile> mapping_; // owner of the mapped sections, if loaded.
+};
@@ -0,0 +1,245 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <opencv2/core/utility.hpp>
+#include "pca_gray_levels_features.hpp"
+
+static const int PCA_BLOCK_SIZE = 1024;
+
+/**
+ * @brief Compute Y = A*M where A are the centered normalized samples.
+ *
+ * A is never formed: the samples are normalized by blocks of rows.
+ *
+ * @param samples are the samples (one by row, CV_8UC1).
+ * @param mean is the mean of the normalized samples (1xD).
+ * @param M is a DxL matrix.
+ * @return the NxL product.
+ */
+static cv::Mat
+centered_product(const cv::Mat &samples, const cv::Mat &mean, const cv::Mat &M)
+{
+    cv::Mat Y(samples.rows, M.cols, CV_32FC1);
+    cv::Mat mean_M = mean * M;
+    const int n_blocks = (samples.rows + PCA_BLOCK_SIZE - 1) / PCA_BLOCK_SIZE;
+    cv::parallel_for_(cv::Range(0, n_blocks), [&](const cv::Range &range)
+    {
+        cv::Mat Xb;
+        for (int b = range.start; b < range.end; ++b)
+        {
+            const int begin = b * PCA_BLOCK_SIZE;
+            const int end = std::min(samples.rows, begin + PCA_BLOCK_SIZE);
+            samples.rowRange(begin, end).convertTo(Xb, CV_32F, 1.0 / 255.0);
+            cv::Mat Yb = Y.rowRange(begin, end);
+            cv::gemm(Xb, M, 1.0, cv::noArray(), 0.0, Yb);
+            for (int i = 0; i < Yb.rows; ++i)
+            {
+                cv::Mat y = Yb.row(i);
+                y -= mean_M;
+            }
+        }
+    });
+    return Y;
+}
+
+/**
+ * @brief Compute Z = A^T*P where A are the centered normalized samples.
+ *
+ * Each worker accumulates the blocks b = w (mod n_workers) and the partial
+ * sums are added in order, so the result does not depend on scheduling.
+ *
+ * @param samples are the samples (one by row, CV_8UC1).
+ * @param mean is the mean of the normalized samples (1xD).
+ * @param P is a NxL matrix.
+ * @return the DxL product.
+ */
+static cv::Mat
+centered_transposed_product(const cv::Mat &samples, const cv::Mat &mean,
+                            const cv::Mat &P)
+{
+    const int n_blocks = (samples.rows + PCA_BLOCK_SIZE - 1) / PCA_BLOCK_SIZE;
+    const int n_workers = std::max(1, std::min(cv::getNumThreads(), n_blocks));
+    std::vector<cv::Mat> partial(n_workers);
+    cv::parallel_for_(cv::Range(0, n_workers), [&](const cv::Range &range)
+    {
+        cv::Mat Xb;
+        for (int w = range.start; w < range.end; ++w)
+        {
+            partial[w] = cv::Mat::zeros(samples.cols, P.cols, CV_32FC1);
+            for (int b = w; b < n_blocks; b += n_workers)
+            {
+                const int begin = b * PCA_BLOCK_SIZE;
+                const int end = std::min(samples.rows, begin + PCA_BLOCK_SIZE);
+                samples.rowRange(begin, end).convertTo(Xb, CV_32F, 1.0 / 255.0);
+                cv::gemm(Xb, P.rowRange(begin, end), 1.0, partial[w], 1.0,
+                         partial[w], cv::GEMM_1_T);
+            }
+        }
+    }, n_workers);
+
+    cv::Mat Z = partial[0];
+    for (int w = 1; w < n_workers; ++w)
+        Z += partial[w];
+    cv::Mat P_sum;
+    cv::reduce(P, P_sum, 0, cv::REDUCE_SUM, CV_32F);
+    cv::gemm(mean, P_sum, -1.0, Z, 1.0, Z, cv::GEMM_1_T);
+    return Z;
+}
+
+/**
+ * @brief Orthonormalize the columns of a tall matrix.
+ *
+ * Uses two passes of the Cholesky-QR method through the eigen
+ * decomposition of the (small) Gram matrix in double precision.
+ */
+static cv::Mat
+orthonormalize(const cv::Mat &Y)
+{
+    cv::Mat Q;
+    Y.convertTo(Q, CV_64F);
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        cv::Mat G, evals, evecs;
+        cv::gemm(Q, Q, 1.0, cv::noArray(), 0.0, G, cv::GEMM_1_T);
+        cv::eigen(G, evals, evecs);
+        const double eps = std::max(evals.at<double>(0), 1.0e-300) * 1.0e-14;
+        cv::Mat S = evecs.t();
+        for (int j = 0; j < S.cols; ++j)
+        {
+            cv::Mat s = S.col(j);
+            s *= 1.0 / std::sqrt(std::max(evals.at<double>(j), eps));
+        }
+        Q = Q * S;
+    }
+    Q.convertTo(Q, CV_32F);
+    return Q;
+}
+
+PCAGrayLevelsFeatures::PCAGrayLevelsFeatures()
+{
+    type_ = FSIV_PCA_GREY_LEVELS;
+    params_ = {100.0, 2.0};
+}
+
+PCAGrayLevelsFeatures::~PCAGrayLevelsFeatures() {}
+
+cv::Ptr<FeaturesExtractor>
+PCAGrayLevelsFeatures::clone() const
+{
+    // The trained state is read only, but the scratch buffer must not be shared.
+    cv::Ptr<PCAGrayLevelsFeatures> extractor = cv::makePtr<PCAGrayLevelsFeatures>(*this);
+    extractor->scratch_ = cv::Mat();
+    return extractor;
+}
+
+std::string
+PCAGrayLevelsFeatures::get_extractor_name() const
+{
+    return "PCA of [0,1] normalized gray levels K=" +
+           std::to_string(get_n_components()) + ".";
+}
+
+int PCAGrayLevelsFeatures::get_n_components() const
+{
+    return (params_.size() > 0 && params_[0] > 0.0f) ? int(params_[0]) : 100;
+}
+
+int PCAGrayLevelsFeatures::get_n_power_iterations() const
+{
+    return (params_.size() > 1 && params_[1] >= 0.0f) ? int(params_[1]) : 2;
+}
+
+const cv::Mat &
+PCAGrayLevelsFeatures::get_basis() const
+{
+    return basis_;
+}
+
+void PCAGrayLevelsFeatures::train(const cv::Mat &samples)
+{
+    CV_Assert(!samples.empty() && samples.type() == CV_8UC1);
+    const int N = samples.rows;
+    const int D = samples.cols;
+    const int L = std::min(get_n_components() + 10, std::min(N, D));
+    const int K = std::min(get_n_components(), L);
+
+    cv::reduce(samples, mean_, 0, cv::REDUCE_SUM, CV_64F);
+    mean_.convertTo(mean_, CV_32F, 1.0 / (255.0 * N));
+
+    // Range finder: Q spans the dominant left singular subspace of A.
+    cv::Mat omega(D, L, CV_32FC1);
+    cv::randn(omega, 0.0, 1.0);
+    cv::Mat Q = orthonormalize(centered_product(samples, mean_, omega));
+    for (int q = 0; q < get_n_power_iterations(); ++q)
+    {
+        cv::Mat Z = orthonormalize(centered_transposed_product(samples, mean_, Q));
+        Q = orthonormalize(centered_product(samples, mean_, Z));
+    }
+
+    // A ~ Q*B. The right singular vectors of B are the eigenvectors of
+    // B*B^T (LxL) mapped through B^T.
+    cv::Mat Bt = centered_transposed_product(samples, mean_, Q);
+    cv::Mat Bt64, C, evals, evecs;
+    Bt.convertTo(Bt64, CV_64F);
+    cv::gemm(Bt64, Bt64, 1.0, cv::noArray(), 0.0, C, cv::GEMM_1_T);
+    cv::eigen(C, evals, evecs);
+
+    cv::Mat basis;
+    cv::gemm(evecs.rowRange(0, K), Bt64, 1.0, cv::noArray(), 0.0, basis, cv::GEMM_2_T);
+    for (int k = 0; k < K; ++k)
+    {
+        cv::Mat b = basis.row(k);
+        b *= 1.0 / std::sqrt(std::max(evals.at<double>(k), 1.0e-300));
+    }
+    basis.convertTo(basis_, CV_32F);
+    cv::gemm(mean_, basis_, 1.0, cv::noArray(), 0.0, proj_mean_, cv::GEMM_2_T);
+}
+
+void PCAGrayLevelsFeatures::extract_batch(const cv::Mat &rows, cv::Mat &out)
+{
+    if (basis_.empty())
+        throw std::runtime_error("The PCA features extractor is not trained.");
+    CV_Assert(rows.type() == CV_8UC1 && rows.cols == basis_.cols);
+    CV_Assert(out.rows == rows.rows && out.cols == basis_.rows);
+    CV_Assert(out.type() == CV_32FC1);
+
+    rows.convertTo(scratch_, CV_32F, 1.0 / 255.0);
+    cv::gemm(scratch_, basis_, 1.0, cv::noArray(), 0.0, out, cv::GEMM_2_T);
+    for (int i = 0; i < out.rows; ++i)
+    {
+        cv::Mat feature = out.row(i);
+        feature -= proj_mean_;
+    }
+}
+
+cv::Mat
+PCAGrayLevelsFeatures::extract_features(const cv::Mat &img)
+{
+    if (basis_.empty())
+        throw std::runtime_error("The PCA features extractor is not trained.");
+    cv::Mat row = (img.isContinuous() ? img : img.clone()).reshape(1, 1);
+    cv::Mat feature(1, basis_.rows, CV_32FC1);
+    extract_batch(row, feature);
+    CV_Assert(feature.rows==1);
+    CV_Assert(feature.type()==CV_32FC1);
+    return feature;
+}
+
+void PCAGrayLevelsFeatures::write_state(cv::FileStorage &f) const
+{
+    f << "fsiv_pca_mean" << mean_;
+    f << "fsiv_pca_basis" << basis_;
+}
+
+void PCAGrayLevelsFeatures::read_state(const cv::FileNode &node)
+{
+    auto mean_node = node["fsiv_pca_mean"];
+    auto basis_node = node["fsiv_pca_basis"];
+    if (mean_node.empty() || basis_node.empty())
+        throw std::runtime_error("Could not load the 'fsiv_pca_mean' and "
+                                 "'fsiv_pca_basis' labels from file.");
+    mean_node >> mean_;
+    basis_node >> basis_;
+    CV_Assert(mean_.cols == basis_.cols);
+    cv::gemm(mean_, basis_, 1.0, cv::noArray(), 0.0, proj_mean_, cv::GEMM_2_T);
+}
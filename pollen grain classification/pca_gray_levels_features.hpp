@@ -0,0 +1,56 @@
+/**
+ *  @file pca_gray_levels_features.hpp
+ */
+#pragma once
+
+#include "features.hpp"
+
+/**
+ * @brief Project the [0,1] normalized gray levels onto their first
+ * principal components.
+ *
+ * The components are fitted in train() with a randomized truncated SVD
+ * (range finder with power iterations), so the covariance matrix of the
+ * 16384 gray levels is never formed.
+ *
+ * Parameters: [K, Q] where K is the number of components (default 100) and
+ * Q the number of power iterations (default 2).
+ */
+class PCAGrayLevelsFeatures: public FeaturesExtractor
+{
+public:
+    /**
+     * @brief Create and set the default parameters.
+     */
+    PCAGrayLevelsFeatures();
+    ~PCAGrayLevelsFeatures();
+
+    virtual std::string get_extractor_name() const override;
+    virtual cv::Ptr<FeaturesExtractor> clone() const override;
+    virtual void train(const cv::Mat& samples) override;
+    virtual cv::Mat extract_features(const cv::Mat& img) override;
+    virtual void extract_batch(const cv::Mat& rows, cv::Mat& out) override;
+    virtual void write_state(cv::FileStorage& f) const override;
+    virtual void read_state(const cv::FileNode& node) override;
+
+    /**
+     * @brief Get the requested number of components.
+     */
+    int get_n_components() const;
+
+    /**
+     * @brief Get the number of power iterations.
+     */
+    int get_n_power_iterations() const;
+
+    /**
+     * @brief Get the fitted basis (one component by row, CV_32FC1).
+     */
+    const cv::Mat& get_basis() const;
+
+protected:
+    cv::Mat mean_;      // 1xD mean of the normalized gray levels.
+    cv::Mat basis_;     // KxD principal components.
+    cv::Mat proj_mean_; // 1xK projection of the mean.
+    cv::Mat scratch_;   // normalized gray levels of a block.
+};
@@ -0,0 +1,264 @@
+#include <numeric>
+#include <opencv2/imgproc.hpp>
+#include "pipeline_extractor.hpp"
+
+/**
+ * @brief Default children: LBP "4 3", Haralick "16" and gray levels
+ * downscaled to 32x32.
+ */
+static const std::vector<float> PIPELINE_DEFAULT_CHILDREN = {
+    3.0,
+    float(FSIV_LBP), 2.0, 4.0, 3.0,
+    float(FSIV_HARALICK), 1.0, 16.0,
+    float(FSIV_GREY_LEVELS), 2.0, 0.0, 32.0};
+
+/**
+ * @brief Parse the pipeline parameters.
+ *
+ * @param params are the parameters (see PipelineExtractor).
+ * @param steps are the parsed preprocessing steps.
+ * @param children are the created child extractors.
+ * @throw std::runtime_error if the parameters are malformed.
+ */
+static void
+parse_pipeline_params(const std::vector<float> &params, std::vector<int> &steps,
+                      std::vector<cv::Ptr<FeaturesExtractor>> &children)
+{
+    size_t pos = 0;
+    auto next = [&](const std::string &what) -> int
+    {
+        if (pos >= params.size())
+            throw std::runtime_error("Pipeline parameters: missing " + what + ".");
+        return int(params[pos++]);
+    };
+
+    steps.clear();
+    const int n_steps = next("the number of preprocessing steps");
+    for (int k = 0; k < n_steps; ++k)
+    {
+        const int step = next("a preprocessing step");
+        if (step < FSIV_PIPELINE_EQUALIZE || step > FSIV_PIPELINE_MEDIAN)
+            throw std::runtime_error("Pipeline parameters: unknown preprocessing step " +
+                                     std::to_string(step) + ".");
+        steps.push_back(step);
+    }
+
+    children.clear();
+    if (pos == params.size())
+    {
+        // Only the preprocessing was given: use the default children.
+        std::vector<float> defaults(params);
+        defaults.insert(defaults.end(), PIPELINE_DEFAULT_CHILDREN.begin(),
+                        PIPELINE_DEFAULT_CHILDREN.end());
+        parse_pipeline_params(defaults, steps, children);
+        return;
+    }
+    const int n_children = next("the number of child extractors");
+    if (n_children < 1)
+        throw std::runtime_error("Pipeline parameters: at least a child extractor is needed.");
+    for (int k = 0; k < n_children; ++k)
+    {
+        const int id = next("a child feature id");
+        const int n_params = next("the number of child parameters");
+        if (n_params < 0 || pos + n_params > params.size())
+            throw std::runtime_error("Pipeline parameters: missing child parameters.");
+        std::vector<float> child_params(params.begin() + pos,
+                                        params.begin() + pos + n_params);
+        pos += n_params;
+        cv::Ptr<FeaturesExtractor> child = FeaturesExtractor::create(FEATURE_IDS(id));
+        child->set_params(child_params);
+        children.push_back(child);
+    }
+    if (pos != params.size())
+        throw std::runtime_error("Pipeline parameters: too many values.");
+}
+
+PipelineExtractor::PipelineExtractor()
+{
+    type_ = FSIV_PIPELINE;
+    params_ = {0.0};
+    params_.insert(params_.end(), PIPELINE_DEFAULT_CHILDREN.begin(),
+                   PIPELINE_DEFAULT_CHILDREN.end());
+}
+
+PipelineExtractor::~PipelineExtractor() {}
+
+cv::Ptr<FeaturesExtractor>
+PipelineExtractor::clone() const
+{
+    cv::Ptr<PipelineExtractor> extractor = cv::makePtr<PipelineExtractor>(*this);
+    for (auto &child : extractor->children_)
+        child = child->clone();
+    extractor->pre_ = cv::Mat();
+    extractor->img_ = cv::Mat();
+    return extractor;
+}
+
+std::string
+PipelineExtractor::get_extractor_name() const
+{
+    static const char *step_names[] = {"", "equalize", "gaussian", "median"};
+    std::vector<int> steps;
+    std::vector<cv::Ptr<FeaturesExtractor>> children;
+    parse_pipeline_params(params_, steps, children);
+
+    std::string name = "Pipeline [";
+    for (size_t k = 0; k < steps.size(); ++k)
+        name += (k > 0 ? ", " : "") + std::string(step_names[steps[k]]);
+    name += "] ->";
+    for (size_t k = 0; k < children.size(); ++k)
+        name += (k > 0 ? " + " : " ") + children[k]->get_extractor_name();
+    return name;
+}
+
+void PipelineExtractor::build()
+{
+    if (!children_.empty() && built_params_ == params_)
+        return;
+    parse_pipeline_params(params_, steps_, children_);
+    built_params_ = params_;
+    sizes_.clear();
+}
+
+const std::vector<cv::Ptr<FeaturesExtractor>> &
+PipelineExtractor::get_children()
+{
+    build();
+    return children_;
+}
+
+cv::Mat
+PipelineExtractor::preprocess(const cv::Mat &rows)
+{
+    if (steps_.empty())
+        return rows;
+
+    const cv::Mat first = fsiv_to_gray_image(rows.row(0));
+    pre_.create(rows.rows, int(first.total()), CV_8UC1);
+    for (int i = 0; i < rows.rows; ++i)
+    {
+        cv::Mat src = fsiv_to_gray_image(rows.row(i));
+        cv::Mat dst = pre_.row(i).reshape(1, src.rows);
+        for (int step : steps_)
+        {
+            switch (step)
+            {
+            case FSIV_PIPELINE_EQUALIZE:
+                cv::equalizeHist(src, img_);
+                break;
+            case FSIV_PIPELINE_GAUSSIAN:
+                cv::GaussianBlur(src, img_, cv::Size(5, 5), 1.0);
+                break;
+            case FSIV_PIPELINE_MEDIAN:
+                cv::medianBlur(src, img_, 3);
+                break;
+            }
+            img_.copyTo(dst);
+            src = dst;
+        }
+    }
+    return pre_;
+}
+
+const std::vector<int> &
+PipelineExtractor::get_feature_sizes(const cv::Mat &sample)
+{
+    if (sizes_.size() != children_.size())
+    {
+        sizes_.clear();
+        for (auto &child : children_)
+            sizes_.push_back(child->extract_features(sample).cols);
+    }
+    return sizes_;
+}
+
+void PipelineExtractor::train(const cv::Mat &samples)
+{
+    build();
+    cv::Mat in = preprocess(samples);
+    pre_.release();
+    for (auto &child : children_)
+        child->train(in);
+    // A trained child may change its feature size (e.g. PCA components).
+    sizes_.clear();
+}
+
+void PipelineExtractor::extract_batch(const cv::Mat &rows, cv::Mat &out)
+{
+    build();
+    const cv::Mat in = preprocess(rows);
+    const std::vector<int> &sizes = get_feature_sizes(in.row(0));
+    CV_Assert(out.rows == rows.rows && out.type() == CV_32FC1);
+    CV_Assert(out.cols == std::accumulate(sizes.begin(), sizes.end(), 0));
+
+    int offset = 0;
+    for (size_t k = 0; k < children_.size(); ++k)
+    {
+        cv::Mat child_out = out.colRange(offset, offset + sizes[k]);
+        children_[k]->extract_batch(in, child_out);
+        offset += sizes[k];
+    }
+}
+
+cv::Mat
+PipelineExtractor::extract_features(const cv::Mat &img)
+{
+    build();
+    cv::Mat gray = fsiv_to_gray_image(img);
+    cv::Mat row = (gray.isContinuous() ? gray : gray.clone()).reshape(1, 1);
+    const std::vector<int> &sizes = get_feature_sizes(preprocess(row));
+    cv::Mat feature(1, std::accumulate(sizes.begin(), sizes.end(), 0), CV_32FC1);
+    extract_batch(row, feature);
+    CV_Assert(feature.rows==1);
+    CV_Assert(feature.type()==CV_32FC1);
+    return feature;
+}
+
+void PipelineExtractor::write_state(cv::FileStorage &f) const
+{
+    // If never built, the children are the untrained ones given by params_.
+    std::vector<int> steps;
+    std::vector<cv::Ptr<FeaturesExtractor>> children = children_;
+    if (children.empty() || built_params_ != params_)
+        parse_pipeline_params(params_, steps, children);
+
+    f << "fsiv_pipeline_children" << "[";
+    for (auto &child : children)
+    {
+        f << "{";
+        f << "fsiv_feature_id" << int(child->get_extractor_type());
+        f << "fsiv_feature_params" << child->get_params();
+        child->write_state(f);
+        f << "}";
+    }
+    f << "]";
+}
+
+void PipelineExtractor::read_state(const cv::FileNode &node)
+{
+    build();
+    auto children_node = node["fsiv_pipeline_children"];
+    if (children_node.empty() || !children_node.isSeq())
+        throw std::runtime_error("Could not load the 'fsiv_pipeline_children' "
+                                 "label from file.");
+
+    // The children are rebuilt from the nested nodes.
+    children_.clear();
+    for (int k = 0; k < int(children_node.size()); ++k)
+    {
+        const cv::FileNode child_node = children_node[k];
+        auto id_node = child_node["fsiv_feature_id"];
+        if (id_node.empty() || !id_node.isInt())
+            throw std::runtime_error("Could not load the 'fsiv_feature_id' "
+                                     "label of a pipeline child.");
+        cv::Ptr<FeaturesExtractor> child = FeaturesExtractor::create(FEATURE_IDS(int(id_node)));
+        std::vector<float> child_params;
+        child_node["fsiv_feature_params"] >> child_params;
+        child->set_params(child_params);
+        child->read_state(child_node);
+        children_.push_back(child);
+    }
+    if (children_.empty())
+        throw std::runtime_error("The pipeline model has no child extractors.");
+    sizes_.clear();
+}
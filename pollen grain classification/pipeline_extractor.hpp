@@ -0,0 +1,89 @@
+/**
+ *  @file pipeline_extractor.hpp
+ */
+#pragma once
+
+#include <vector>
+#include "features.hpp"
+
+/**
+ * @brief Define the preprocessing steps of a pipeline.
+ */
+typedef enum {
+    FSIV_PIPELINE_EQUALIZE = 1, // Histogram equalization.
+    FSIV_PIPELINE_GAUSSIAN = 2, // Gaussian blur 5x5, sigma 1.
+    FSIV_PIPELINE_MEDIAN = 3,   // Median filter 3x3.
+} PIPELINE_STEPS;
+
+/**
+ * @brief Chain preprocessing steps and concatenate the features of several
+ * child extractors.
+ *
+ * The preprocessing steps are applied in order to the gray image, then each
+ * child computes its features from the preprocessed image straight into its
+ * columns of the output row.
+ *
+ * Parameters: [P, s_1 .. s_P, C, id_1, n_1, p_1 .. p_n_1, ..., id_C, n_C, ...]
+ * where P is the number of preprocessing steps s_k (see PIPELINE_STEPS),
+ * C is the number of children and each child is given by its feature id,
+ * its number of parameters and the parameters (n=0 means the defaults).
+ * If only the preprocessing part is given, the default children are used:
+ * LBP "4 3", Haralick "16" and gray levels downscaled to 32x32 "0 32".
+ *
+ * Default: no preprocessing and the default children.
+ *
+ * The ids, parameters and trained state of the children are saved nested
+ * in the model file with label 'fsiv_pipeline_children'.
+ */
+class PipelineExtractor: public FeaturesExtractor
+{
+public:
+    /**
+     * @brief Create and set the default parameters.
+     */
+    PipelineExtractor();
+    ~PipelineExtractor();
+
+    virtual std::string get_extractor_name() const override;
+    virtual cv::Ptr<FeaturesExtractor> clone() const override;
+    virtual void train(const cv::Mat& samples) override;
+    virtual cv::Mat extract_features(const cv::Mat& img) override;
+    virtual void extract_batch(const cv::Mat& rows, cv::Mat& out) override;
+    virtual void write_state(cv::FileStorage& f) const override;
+    virtual void read_state(const cv::FileNode& node) override;
+
+    /**
+     * @brief Get the child extractors.
+     *
+     * They are (re)built from the parameters if these have changed.
+     */
+    const std::vector<cv::Ptr<FeaturesExtractor>>& get_children();
+
+protected:
+
+    /**
+     * @brief Build the steps and children from the parameters if needed.
+     */
+    void build();
+
+    /**
+     * @brief Apply the preprocessing steps to a block of images.
+     * @param rows are the images (one by row).
+     * @return the preprocessed images (one by row, CV_8UC1). It is rows
+     * itself when there are no steps.
+     */
+    cv::Mat preprocess(const cv::Mat& rows);
+
+    /**
+     * @brief Get the feature size of each child, computing them once from
+     * a preprocessed sample.
+     */
+    const std::vector<int>& get_feature_sizes(const cv::Mat& sample);
+
+    std::vector<int> steps_;
+    std::vector<cv::Ptr<FeaturesExtractor>> children_;
+    std::vector<float> built_params_; // params_ used to build the children.
+    std::vector<int> sizes_;          // feature size of each child.
+    cv::Mat pre_;                     // scratch: preprocessed block.
+    cv::Mat img_;                     // scratch: output of a step.
+};
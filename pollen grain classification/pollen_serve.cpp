@@ -0,0 +1,623 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/ml.hpp>
+
+#include "common_code.hpp"
+
+#ifndef NDEBUG
+int __Debug_Level = 0;
+#endif
+
+const char *keys =
+    "{help h usage ? |      | print this message   }"
+    "{socket         |/tmp/pollen_serve.sock | UNIX socket pathname.}"
+    "{max_batch      |32    | Max requests predicted together.}"
+    "{max_wait       |2.0   | Max milliseconds the first request of a micro-batch waits "
+    "for more requests.}"
+    "{report         |10    | Seconds between the latency reports. 0 only reports at exit.}"
+#ifndef NDEBUG
+    "{verbose        |0     | Set the verbose level.}"
+#endif
+    "{@model         |<none>| Model filename.}";
+
+static const char *PROTOCOL =
+    "Requests (one by line, each one gets a reply line):\n"
+    "  PATH <image pathname>  classify an image file.\n"
+    "  RAW                    followed by 16384 bytes, a 128x128 gray image.\n"
+    "  STATS                  get the latency report.\n"
+    "  QUIT                   close the connection.\n"
+    "Replies: '<label> <label name>', the report or 'ERROR <message>'.\n";
+
+static const int IMAGE_SIZE = 128;
+static const int SAMPLE_SIZE = IMAGE_SIZE * IMAGE_SIZE;
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<bool> stop_requested(false);
+
+static void
+on_signal(int)
+{
+    stop_requested = true;
+}
+
+/**
+ * @brief Latency and throughput of the served requests.
+ *
+ * The latency of a request is the time from its arrival (its request line
+ * read from the socket) to its prediction, so it includes loading the
+ * image of a PATH request and reading the payload of a RAW one.
+ */
+class ServeStats
+{
+public:
+    ServeStats() : start_(Clock::now()), window_start_(start_) {}
+
+    /**
+     * @brief Add the latencies (ms) of a predicted batch.
+     */
+    void add_batch(const std::vector<double> &latencies)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        window_.insert(window_.end(), latencies.begin(), latencies.end());
+        ++window_batches_;
+        total_requests_ += latencies.size();
+        ++total_batches_;
+    }
+
+    /**
+     * @brief Get the report of the requests since the last reset.
+     * @param reset starts a new window.
+     */
+    std::string report(bool reset)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const Clock::time_point now = Clock::now();
+        const double seconds = std::chrono::duration<double>(now - window_start_).count();
+        std::vector<double> sorted(window_);
+        std::sort(sorted.begin(), sorted.end());
+        auto percentile = [&](double p)
+        {
+            return sorted.empty() ? 0.0
+                                  : sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+        };
+        std::ostringstream out;
+        out << "requests=" << sorted.size()
+            << " batches=" << window_batches_
+            << " mean_batch=" << (window_batches_ > 0 ? double(sorted.size()) / window_batches_ : 0.0)
+            << " p50=" << percentile(0.50) << "ms"
+            << " p99=" << percentile(0.99) << "ms"
+            << " throughput=" << (seconds > 0.0 ? sorted.size() / seconds : 0.0) << "req/s"
+            << " (total " << total_requests_ << " requests in " << total_batches_
+            << " batches, "
+            << std::chrono::duration<double>(now - start_).count() << "s)";
+        if (reset)
+        {
+            window_.clear();
+            window_batches_ = 0;
+            window_start_ = now;
+        }
+        return out.str();
+    }
+
+protected:
+    std::mutex mutex_;
+    Clock::time_point start_;
+    Clock::time_point window_start_;
+    std::vector<double> window_;
+    size_t window_batches_ = 0;
+    size_t total_requests_ = 0;
+    size_t total_batches_ = 0;
+};
+
+/**
+ * @brief Queue of the pending requests, predicted by micro-batches.
+ *
+ * A worker thread waits for a request, then waits up to max_wait for
+ * more ones (or a full batch) and extracts and predicts them together.
+ */
+class MicroBatcher
+{
+public:
+    MicroBatcher(cv::Ptr<FeaturesExtractor> &extractor,
+                 cv::Ptr<cv::ml::StatModel> &clf,
+                 const FeatureQuantizer &quantizer,
+                 int max_batch, double max_wait_ms, ServeStats &stats)
+        : extractor_(extractor), clf_(clf), quantizer_(quantizer),
+          max_batch_(std::max(1, max_batch)),
+          max_wait_(std::chrono::duration_cast<Clock::duration>(
+              std::chrono::duration<double, std::milli>(std::max(0.0, max_wait_ms)))),
+          stats_(stats), stopping_(false)
+    {
+        worker_ = std::thread([this]() { run(); });
+    }
+
+    ~MicroBatcher()
+    {
+        stop();
+    }
+
+    /**
+     * @brief Queue a sample.
+     * @param sample is a 1x16384 CV_8UC1 image.
+     * @param arrival is when the request arrived.
+     * @return the future label.
+     */
+    std::future<int> submit(const cv::Mat &sample, Clock::time_point arrival)
+    {
+        Request request;
+        request.sample = sample;
+        request.arrival = arrival;
+        std::future<int> label = request.label.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_)
+                throw std::runtime_error("the server is stopping.");
+            queue_.push_back(std::move(request));
+        }
+        cv_.notify_one();
+        return label;
+    }
+
+    /**
+     * @brief Predict the queued requests and stop the worker.
+     */
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        if (worker_.joinable())
+            worker_.join();
+    }
+
+protected:
+    struct Request
+    {
+        cv::Mat sample;
+        std::promise<int> label;
+        Clock::time_point arrival;
+    };
+
+    void run()
+    {
+        std::vector<Request> batch;
+        std::vector<double> latencies;
+        cv::Mat rows;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+                if (queue_.empty())
+                    return;
+                const Clock::time_point deadline = queue_.front().arrival + max_wait_;
+                cv_.wait_until(lock, deadline, [this]()
+                {
+                    return stopping_ || int(queue_.size()) >= max_batch_;
+                });
+                const int n = std::min(max_batch_, int(queue_.size()));
+                batch.clear();
+                for (int i = 0; i < n; ++i)
+                {
+                    batch.push_back(std::move(queue_.front()));
+                    queue_.pop_front();
+                }
+            }
+
+            rows.create(int(batch.size()), SAMPLE_SIZE, CV_8UC1);
+            for (size_t i = 0; i < batch.size(); ++i)
+                batch[i].sample.copyTo(rows.row(int(i)));
+            try
+            {
+                cv::Mat X = fsiv_extract_features(rows, extractor_, nullptr, &quantizer_);
+                cv::Mat labels = fsiv_predict_labels(clf_, X, quantizer_);
+                for (size_t i = 0; i < batch.size(); ++i)
+                    batch[i].label.set_value(labels.at<int>(int(i)));
+            }
+            catch (...)
+            {
+                for (auto &request : batch)
+                    request.label.set_exception(std::current_exception());
+            }
+
+            const Clock::time_point now = Clock::now();
+            latencies.clear();
+            for (auto &request : batch)
+                latencies.push_back(
+                    std::chrono::duration<double, std::milli>(now - request.arrival).count());
+            stats_.add_batch(latencies);
+        }
+    }
+
+    cv::Ptr<FeaturesExtractor> &extractor_;
+    cv::Ptr<cv::ml::StatModel> &clf_;
+    FeatureQuantizer quantizer_;
+    const int max_batch_;
+    const Clock::duration max_wait_;
+    ServeStats &stats_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Request> queue_;
+    bool stopping_;
+    std::thread worker_;
+};
+
+/**
+ * @brief Open connections, so they can be shut down when the server stops.
+ */
+class Connections
+{
+public:
+    void add(int fd)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fds_.insert(fd);
+    }
+
+    /**
+     * @brief Close a connection (called by its thread when it ends).
+     */
+    void remove(int fd)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fds_.erase(fd);
+        ::close(fd);
+        cv_.notify_all();
+    }
+
+    /**
+     * @brief Shut down the open connections and wait for their threads.
+     */
+    void shutdown_all()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (int fd : fds_)
+            ::shutdown(fd, SHUT_RDWR);
+        cv_.wait(lock, [this]() { return fds_.empty(); });
+    }
+
+protected:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::set<int> fds_;
+};
+
+/**
+ * @brief Buffered reader of a socket.
+ */
+class SocketReader
+{
+public:
+    SocketReader(int fd) : fd_(fd), begin_(0), end_(0) {}
+
+    /**
+     * @brief Read a line (without the end of line).
+     * @return false if the connection was closed.
+     */
+    bool read_line(std::string &line)
+    {
+        line.clear();
+        for (;;)
+        {
+            if (begin_ == end_ && !fill())
+                return false;
+            const char c = buffer_[begin_++];
+            if (c == '\n')
+                break;
+            if (c != '\r')
+                line.push_back(c);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Read n bytes.
+     * @return false if the connection was closed.
+     */
+    bool read_exact(void *data, size_t n)
+    {
+        char *dst = static_cast<char *>(data);
+        while (n > 0)
+        {
+            if (begin_ == end_ && !fill())
+                return false;
+            const size_t k = std::min(n, end_ - begin_);
+            std::memcpy(dst, buffer_ + begin_, k);
+            begin_ += k;
+            dst += k;
+            n -= k;
+        }
+        return true;
+    }
+
+protected:
+    bool fill()
+    {
+        ssize_t n;
+        do
+            n = ::read(fd_, buffer_, sizeof(buffer_));
+        while (n < 0 && errno == EINTR);
+        begin_ = 0;
+        end_ = n > 0 ? size_t(n) : 0;
+        return n > 0;
+    }
+
+    int fd_;
+    char buffer_[4096];
+    size_t begin_;
+    size_t end_;
+};
+
+static bool
+write_all(int fd, const std::string &text)
+{
+    size_t done = 0;
+    while (done < text.size())
+    {
+        const ssize_t n = ::send(fd, text.data() + done, text.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += size_t(n);
+    }
+    return true;
+}
+
+/**
+ * @brief Load an image file as a dataset sample.
+ * @return a 1x16384 CV_8UC1 row.
+ */
+static cv::Mat
+load_image_sample(const std::string &path)
+{
+    cv::Mat img = cv::imread(path, cv::IMREAD_GRAYSCALE);
+    if (img.empty())
+        throw std::runtime_error("could not read the image '" + path + "'.");
+    if (img.rows != IMAGE_SIZE || img.cols != IMAGE_SIZE)
+        cv::resize(img, img, cv::Size(IMAGE_SIZE, IMAGE_SIZE), 0.0, 0.0, cv::INTER_AREA);
+    return (img.isContinuous() ? img : img.clone()).reshape(1, 1);
+}
+
+/**
+ * @brief Serve the requests of a connection until it is closed.
+ */
+static void
+serve_connection(int fd, MicroBatcher &batcher, ServeStats &stats)
+{
+    SocketReader in(fd);
+    std::string line;
+    while (in.read_line(line))
+    {
+        std::istringstream request(line);
+        std::string op;
+        request >> op;
+        if (op.empty())
+            continue;
+        if (op == "QUIT")
+            break;
+        const Clock::time_point arrival = Clock::now();
+
+        std::string reply;
+        try
+        {
+            cv::Mat sample;
+            if (op == "PATH")
+            {
+                std::string path;
+                std::getline(request >> std::ws, path);
+                sample = load_image_sample(path);
+            }
+            else if (op == "RAW")
+            {
+                sample.create(1, SAMPLE_SIZE, CV_8UC1);
+                if (!in.read_exact(sample.data, SAMPLE_SIZE))
+                    break;
+            }
+            else if (op == "STATS")
+                reply = stats.report(false) + "\n";
+            else
+                throw std::runtime_error("unknown request '" + op + "'.");
+
+            if (!sample.empty())
+            {
+                const int label = batcher.submit(sample, arrival).get();
+                reply = std::to_string(label) + " " + fsiv_get_dataset_label_name(label) + "\n";
+            }
+        }
+        catch (std::exception &e)
+        {
+            reply = std::string("ERROR ") + e.what() + "\n";
+        }
+        if (!write_all(fd, reply))
+            break;
+    }
+}
+
+/**
+ * @brief Create the listening socket.
+ * @throw std::runtime_error if it could not be created.
+ */
+static int
+listen_unix_socket(const std::string &path)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("Invalid socket pathname '" + path + "'.");
+    std::strcpy(addr.sun_path, path.c_str());
+
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        throw std::runtime_error(std::string("Could not create the socket: ") +
+                                 std::strerror(errno));
+    // A previous server may have left the socket file.
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        ::listen(fd, SOMAXCONN) < 0)
+    {
+        const std::string error = std::strerror(errno);
+        ::close(fd);
+        throw std::runtime_error("Could not listen on '" + path + "': " + error);
+    }
+    return fd;
+}
+
+int main(int argc, char *const *argv)
+{
+  int retCode = EXIT_SUCCESS;
+
+  try
+  {
+
+    cv::CommandLineParser parser(argc, argv, keys);
+    parser.about("Serve the predictions of a model over a UNIX socket.\n" +
+                 std::string(PROTOCOL));
+    if (parser.has("help"))
+    {
+      parser.printMessage();
+      return 0;
+    }
+
+#ifndef NDEBUG
+    __Debug_Level = parser.get<int>("verbose");
+#endif
+    std::string model_fname = parser.get<std::string>("@model");
+    std::string socket_path = parser.get<std::string>("socket");
+    int max_batch = parser.get<int>("max_batch");
+    double max_wait = parser.get<double>("max_wait");
+    double report_seconds = parser.get<double>("report");
+    if (!parser.check())
+    {
+      parser.printErrors();
+      return 0;
+    }
+
+    std::cout.setf(std::ios::unitbuf);
+
+    // The model is loaded once.
+    auto extractor = FeaturesExtractor::create(model_fname);
+    if (extractor == nullptr)
+      throw std::runtime_error("Error: could not read the model " + model_fname);
+    std::cout << "Feature extractor: " << extractor->get_extractor_name()
+              << std::endl;
+    cv::Ptr<cv::ml::StatModel> clsf = fsiv_load_classifier_model(model_fname);
+    if (clsf == nullptr || !clsf->isTrained())
+    {
+      std::cerr << "Error: I need a trained model!" << std::endl;
+      return EXIT_FAILURE;
+    }
+    FeatureQuantizer quantizer;
+    {
+      cv::FileStorage f = fsiv_open_model_metadata(model_fname);
+      quantizer.read(f.root());
+    }
+
+    ServeStats stats;
+    MicroBatcher batcher(extractor, clsf, quantizer, max_batch, max_wait, stats);
+    Connections connections;
+
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+    std::signal(SIGPIPE, SIG_IGN);
+    const int listen_fd = listen_unix_socket(socket_path);
+    std::cout << "Listening on " << socket_path << " (max_batch=" << max_batch
+              << " max_wait=" << max_wait << "ms)." << std::endl;
+
+    // The connection threads use batcher, stats and connections, so they
+    // are stopped before leaving this scope, also on errors.
+    auto stop_serving = [&]()
+    {
+      ::close(listen_fd);
+      ::unlink(socket_path.c_str());
+      connections.shutdown_all();
+      batcher.stop();
+    };
+
+    Clock::time_point last_report = Clock::now();
+    try
+    {
+      while (!stop_requested)
+      {
+        pollfd pfd;
+        pfd.fd = listen_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        const int ready = ::poll(&pfd, 1, 200);
+        if (ready < 0 && errno != EINTR)
+          throw std::runtime_error(std::string("poll: ") + std::strerror(errno));
+        if (ready > 0 && (pfd.revents & POLLIN))
+        {
+          const int fd = ::accept(listen_fd, nullptr, nullptr);
+          if (fd >= 0)
+          {
+            connections.add(fd);
+            try
+            {
+              std::thread([fd, &batcher, &stats, &connections]()
+              {
+                serve_connection(fd, batcher, stats);
+                connections.remove(fd);
+              }).detach();
+            }
+            catch (...)
+            {
+              // Otherwise shutdown_all() would wait for it forever.
+              connections.remove(fd);
+              throw;
+            }
+          }
+        }
+        if (report_seconds > 0.0 &&
+            std::chrono::duration<double>(Clock::now() - last_report).count() >= report_seconds)
+        {
+          std::cout << stats.report(true) << std::endl;
+          last_report = Clock::now();
+        }
+      }
+    }
+    catch (...)
+    {
+      stop_serving();
+      throw;
+    }
+
+    std::cout << "Stopping ..." << std::endl;
+    stop_serving();
+    std::cout << stats.report(true) << std::endl;
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Exception caught: " << e.what() << std::endl;
+    retCode = EXIT_FAILURE;
+  }
+  return retCode;
+}
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "profiling.hpp"
+
+size_t fsiv_get_peak_rss()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    // Linux reports it in Kb.
+    return size_t(usage.ru_maxrss) * 1024;
+}
+
+size_t fsiv_get_current_rss()
+{
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if (!(statm >> pages >> resident))
+        return 0;
+    return resident * size_t(sysconf(_SC_PAGESIZE));
+}
+
+/**
+ * @brief Quote a string as a JSON value.
+ */
+static std::string
+json_string(const std::string &s)
+{
+    std::string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20)
+            out += c;
+    }
+    return out + "\"";
+}
+
+Profiler::Profiler()
+    : enabled_(false), origin_(std::chrono::steady_clock::now())
+{}
+
+Profiler &Profiler::instance()
+{
+    static Profiler profiler;
+    return profiler;
+}
+
+void Profiler::set_enabled(bool enabled)
+{
+    enabled_ = enabled;
+}
+
+bool Profiler::is_enabled() const
+{
+    return enabled_;
+}
+
+double Profiler::to_us(std::chrono::steady_clock::time_point t) const
+{
+    return std::chrono::duration<double, std::micro>(t - origin_).count();
+}
+
+int Profiler::thread_index()
+{
+    // Called with the mutex locked.
+    auto it = threads_.find(std::this_thread::get_id());
+    if (it == threads_.end())
+        it = threads_.emplace(std::this_thread::get_id(), int(threads_.size())).first;
+    return it->second;
+}
+
+void Profiler::add_phase(const std::string &name,
+                         std::chrono::steady_clock::time_point start,
+                         std::chrono::steady_clock::time_point end)
+{
+    if (!enabled_)
+        return;
+    const double rss_mb = fsiv_get_current_rss() / (1024.0 * 1024.0);
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back({name, to_us(start), to_us(end) - to_us(start), thread_index()});
+    samples_.push_back({"rss_mb", to_us(end), rss_mb});
+}
+
+void Profiler::set_counter(const std::string &name, double value)
+{
+    if (!enabled_)
+        return;
+    const double now = to_us(std::chrono::steady_clock::now());
+    std::lock_guard<std::mutex> lock(mutex_);
+    counters_[name] = value;
+    samples_.push_back({name, now, value});
+}
+
+std::vector<double> Profiler::self_times() const
+{
+    // Called with the mutex locked. The events of a thread are sorted by
+    // start (the outer one first on ties), so the stack holds the open
+    // phases and each event is subtracted from its direct parent only.
+    std::vector<size_t> order(events_.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        const Event &e_a = events_[a], &e_b = events_[b];
+        if (e_a.thread != e_b.thread)
+            return e_a.thread < e_b.thread;
+        if (e_a.start_us != e_b.start_us)
+            return e_a.start_us < e_b.start_us;
+        return e_a.duration_us > e_b.duration_us;
+    });
+    std::vector<double> self(events_.size());
+    std::vector<size_t> open;
+    for (size_t k = 0; k < order.size(); ++k)
+    {
+        const Event &e = events_[order[k]];
+        self[order[k]] = e.duration_us;
+        while (!open.empty())
+        {
+            const Event &p = events_[open.back()];
+            if (p.thread == e.thread &&
+                e.start_us + e.duration_us <= p.start_us + p.duration_us)
+                break;
+            open.pop_back();
+        }
+        if (!open.empty())
+            self[open.back()] -= e.duration_us;
+        open.push_back(order[k]);
+    }
+    return self;
+}
+
+bool Profiler::write_json(const std::string &fname, const std::string &tool) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Totals by phase in order of first appearance.
+    struct Total
+    {
+        int calls = 0;
+        double us = 0.0;
+        double self_us = 0.0;
+    };
+    const std::vector<double> self = self_times();
+    std::vector<std::string> names;
+    std::map<std::string, Total> totals;
+    for (size_t i = 0; i < events_.size(); ++i)
+    {
+        Total &total = totals[events_[i].name];
+        if (total.calls == 0)
+            names.push_back(events_[i].name);
+        ++total.calls;
+        total.us += events_[i].duration_us;
+        total.self_us += self[i];
+    }
+
+    std::ofstream out(fname);
+    if (!out)
+        return false;
+    out << std::fixed << std::setprecision(6);
+    out << "{\n  \"tool\": " << json_string(tool) << ",\n";
+    out << "  \"wall_seconds\": "
+        << to_us(std::chrono::steady_clock::now()) * 1.0e-6 << ",\n";
+    out << "  \"peak_rss_mb\": " << fsiv_get_peak_rss() / (1024.0 * 1024.0) << ",\n";
+    out << "  \"phases\": [";
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        const Total &total = totals[names[i]];
+        out << (i ? ",\n" : "\n") << "    {\"name\": " << json_string(names[i])
+            << ", \"calls\": " << total.calls
+            << ", \"seconds\": " << total.us * 1.0e-6
+            << ", \"self_seconds\": " << total.self_us * 1.0e-6 << "}";
+    }
+    out << "\n  ],\n  \"counters\": {";
+    bool first = true;
+    for (const auto &counter : counters_)
+    {
+        out << (first ? "\n" : ",\n") << "    " << json_string(counter.first) << ": "
+            << counter.second;
+        first = false;
+    }
+    out << "\n  }\n}\n";
+    return bool(out);
+}
+
+bool Profiler::write_chrome_trace(const std::string &fname) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ofstream out(fname);
+    if (!out)
+        return false;
+    // Microseconds with a fixed ns resolution, the default 6 significant
+    // digits lose the order of the short phases after a few seconds.
+    out << std::fixed << std::setprecision(3);
+    const int pid = int(getpid());
+    out << "{\"traceEvents\": [";
+    bool first = true;
+    for (const Event &e : events_)
+    {
+        out << (first ? "\n" : ",\n") << "{\"name\": " << json_string(e.name)
+            << ", \"ph\": \"X\", \"ts\": " << e.start_us << ", \"dur\": " << e.duration_us
+            << ", \"pid\": " << pid << ", \"tid\": " << e.thread << "}";
+        first = false;
+    }
+    for (const CounterSample &s : samples_)
+    {
+        out << (first ? "\n" : ",\n") << "{\"name\": " << json_string(s.name)
+            << ", \"ph\": \"C\", \"ts\": " << s.time_us << ", \"pid\": " << pid
+            << ", \"args\": {" << json_string(s.name) << ": " << s.value << "}}";
+        first = false;
+    }
+    out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    return bool(out);
+}
+
+ScopedTimer::ScopedTimer(const char *name)
+    : name_(name), running_(Profiler::instance().is_enabled())
+{
+    if (running_)
+        start_ = std::chrono::steady_clock::now();
+}
+
+ScopedTimer::~ScopedTimer()
+{
+    stop();
+}
+
+void ScopedTimer::stop()
+{
+    if (!running_)
+        return;
+    running_ = false;
+    Profiler::instance().add_phase(name_, start_, std::chrono::steady_clock::now());
+}
+
+void fsiv_write_profile_reports(const std::string &json_fname,
+                                const std::string &trace_fname,
+                                const std::string &tool)
+{
+    const Profiler &profiler = Profiler::instance();
+    if (!json_fname.empty() && !profiler.write_json(json_fname, tool))
+        throw std::runtime_error("Error: could not write the profile to " + json_fname);
+    if (!trace_fname.empty() && !profiler.write_chrome_trace(trace_fname))
+        throw std::runtime_error("Error: could not write the trace to " + trace_fname);
+}
@@ -0,0 +1,149 @@
+/**
+ *  @file profiling.hpp
+ */
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Get the peak resident set size of the process.
+ * @return the size in bytes (0 if it is not available).
+ */
+size_t fsiv_get_peak_rss();
+
+/**
+ * @brief Get the current resident set size of the process.
+ * @return the size in bytes (0 if it is not available).
+ */
+size_t fsiv_get_current_rss();
+
+/**
+ * @brief Process wide recorder of timed phases and counters.
+ *
+ * It is disabled by default, so a ScopedTimer only costs a flag check
+ * when no report was asked for. Once enabled, each finished phase is kept
+ * as an event (name, start, duration and thread) and the RSS is sampled at
+ * its end, so the run can be written as a JSON summary (totals by phase,
+ * counters and peak RSS) and as a Chrome trace (chrome://tracing or
+ * Perfetto).
+ *
+ * Phases may nest (e.g. the extraction of each batch inside "train"). The
+ * "seconds" of a phase in the summary include its nested phases and its
+ * "self_seconds" do not, so only the self times add up to the run time.
+ */
+class Profiler
+{
+public:
+    /**
+     * @brief Get the process profiler.
+     */
+    static Profiler &instance();
+
+    void set_enabled(bool enabled);
+    bool is_enabled() const;
+
+    /**
+     * @brief Record a finished phase.
+     * @param name is the phase name.
+     * @param start is when it started.
+     * @param end is when it finished.
+     */
+    void add_phase(const std::string &name,
+                   std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::time_point end);
+
+    /**
+     * @brief Set a counter (e.g. number of samples, Mb of features).
+     *
+     * The last value is reported and each change is a trace sample.
+     */
+    void set_counter(const std::string &name, double value);
+
+    /**
+     * @brief Write the JSON summary.
+     * @param fname is the file name.
+     * @param tool is the name of the tool written in the summary.
+     * @return false if the file could not be written.
+     */
+    bool write_json(const std::string &fname, const std::string &tool) const;
+
+    /**
+     * @brief Write the Chrome trace (Trace Event Format).
+     * @param fname is the file name.
+     * @return false if the file could not be written.
+     */
+    bool write_chrome_trace(const std::string &fname) const;
+
+protected:
+    Profiler();
+
+    struct Event
+    {
+        std::string name;
+        double start_us;
+        double duration_us;
+        int thread;
+    };
+    struct CounterSample
+    {
+        std::string name;
+        double time_us;
+        double value;
+    };
+
+    double to_us(std::chrono::steady_clock::time_point t) const;
+
+    /**
+     * @brief Get the duration of each event minus its nested events.
+     */
+    std::vector<double> self_times() const;
+    int thread_index();
+
+    bool enabled_;
+    std::chrono::steady_clock::time_point origin_;
+    mutable std::mutex mutex_;
+    std::vector<Event> events_;
+    std::vector<CounterSample> samples_;
+    std::map<std::string, double> counters_;
+    std::map<std::thread::id, int> threads_;
+};
+
+/**
+ * @brief Time a phase from its construction until stop() or its
+ * destruction.
+ *
+ * Usage: ScopedTimer timer("extract"); ... timer.stop();
+ */
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(const char *name);
+    ~ScopedTimer();
+
+    /**
+     * @brief Record the phase now (only the first call counts).
+     */
+    void stop();
+
+protected:
+    const char *name_;
+    bool running_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ * @brief Write the reports of the process profiler.
+ * @param json_fname is the JSON summary file name (empty means none).
+ * @param trace_fname is the Chrome trace file name (empty means none).
+ * @param tool is the name of the tool written in the summary.
+ * @throw std::runtime_error if a report could not be written.
+ */
+void fsiv_write_profile_reports(const std::string &json_fname,
+                                const std::string &trace_fname,
+                                const std::string &tool);
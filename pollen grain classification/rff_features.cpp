@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cmath>
+#include <opencv2/core/utility.hpp>
+#include "rff_features.hpp"
+
+static const int RFF_DEFAULT_FREQUENCIES = 512;
+// Samples used to estimate gamma.
+static const int RFF_GAMMA_SAMPLES = 1000;
+
+/**
+ * @brief Default child: gray levels downscaled to 32x32.
+ */
+static const std::vector<float> RFF_DEFAULT_CHILD = {
+    float(FSIV_GREY_LEVELS), 2.0, 0.0, 32.0};
+
+/**
+ * @brief Create the child extractor given by the parameters.
+ *
+ * @param params are the parameters (see RandomFourierFeatures).
+ * @return the untrained child.
+ * @throw std::runtime_error if the parameters are malformed.
+ */
+static cv::Ptr<FeaturesExtractor>
+parse_rff_child(const std::vector<float> &params)
+{
+    std::vector<float> child(params.begin() + std::min<size_t>(params.size(), 3),
+                             params.end());
+    if (child.empty())
+        child = RFF_DEFAULT_CHILD;
+    if (child.size() < 2)
+        throw std::runtime_error("RFF parameters: missing the number of child parameters.");
+    const int id = int(child[0]);
+    const int n_params = int(child[1]);
+    if (n_params < 0 || size_t(n_params) + 2 != child.size())
+        throw std::runtime_error("RFF parameters: expected " + std::to_string(n_params) +
+                                 " child parameters.");
+    if (id == FSIV_RFF)
+        throw std::runtime_error("RFF parameters: the child can not be another RFF extractor.");
+    cv::Ptr<FeaturesExtractor> extractor = FeaturesExtractor::create(FEATURE_IDS(id));
+    extractor->set_params(std::vector<float>(child.begin() + 2, child.end()));
+    return extractor;
+}
+
+RandomFourierFeatures::RandomFourierFeatures()
+    : seed_(0), gamma_(0.0), input_size_(0)
+{
+    type_ = FSIV_RFF;
+    params_ = {float(RFF_DEFAULT_FREQUENCIES), 0.0, 0.0};
+    params_.insert(params_.end(), RFF_DEFAULT_CHILD.begin(), RFF_DEFAULT_CHILD.end());
+}
+
+RandomFourierFeatures::~RandomFourierFeatures() {}
+
+cv::Ptr<FeaturesExtractor>
+RandomFourierFeatures::clone() const
+{
+    // W is read only, but the child and the scratch buffers must not be shared.
+    cv::Ptr<RandomFourierFeatures> extractor = cv::makePtr<RandomFourierFeatures>(*this);
+    if (extractor->child_)
+        extractor->child_ = child_->clone();
+    extractor->in_ = cv::Mat();
+    extractor->phase_ = cv::Mat();
+    extractor->magnitude_ = cv::Mat();
+    return extractor;
+}
+
+std::string
+RandomFourierFeatures::get_extractor_name() const
+{
+    cv::Ptr<FeaturesExtractor> child = child_ ? child_ : parse_rff_child(params_);
+    return "Random Fourier features M=" + std::to_string(get_n_frequencies()) +
+           " gamma=" + std::to_string(get_gamma()) + " of " +
+           child->get_extractor_name();
+}
+
+int RandomFourierFeatures::get_n_frequencies() const
+{
+    return (params_.size() > 0 && params_[0] > 0.0f) ? int(params_[0])
+                                                     : RFF_DEFAULT_FREQUENCIES;
+}
+
+double RandomFourierFeatures::get_gamma() const
+{
+    if (gamma_ > 0.0)
+        return gamma_;
+    return params_.size() > 1 ? std::max(0.0f, params_[1]) : 0.0;
+}
+
+void RandomFourierFeatures::build()
+{
+    if (child_ && built_params_ == params_)
+        return;
+    child_ = parse_rff_child(params_);
+    built_params_ = params_;
+    W_.release();
+    input_size_ = 0;
+}
+
+void RandomFourierFeatures::make_basis()
+{
+    CV_Assert(seed_ != 0 && gamma_ > 0.0 && input_size_ > 0);
+    W_.create(input_size_, get_n_frequencies(), CV_32FC1);
+    cv::RNG rng(static_cast<uint64>(seed_));
+    rng.fill(W_, cv::RNG::NORMAL, 0.0, std::sqrt(2.0 * gamma_));
+}
+
+void RandomFourierFeatures::train(const cv::Mat &samples)
+{
+    CV_Assert(!samples.empty());
+    build();
+    child_->train(samples);
+    input_size_ = child_->extract_features(samples.row(0)).cols;
+
+    gamma_ = params_.size() > 1 ? std::max(0.0f, params_[1]) : 0.0;
+    if (gamma_ <= 0.0)
+    {
+        // gamma = 1/(D*var(x)) as the 'scale' heuristic, using evenly
+        // spaced samples.
+        const int n = std::min(samples.rows, RFF_GAMMA_SAMPLES);
+        cv::Mat rows(n, samples.cols, samples.type());
+        for (int i = 0; i < n; ++i)
+            samples.row(int(int64(i) * samples.rows / n)).copyTo(rows.row(i));
+        cv::Mat X(n, input_size_, CV_32FC1);
+        child_->extract_batch(rows, X);
+        cv::Scalar mean, stddev;
+        cv::meanStdDev(X, mean, stddev);
+        const double var = stddev[0] * stddev[0];
+        gamma_ = var > 0.0 ? 1.0 / (input_size_ * var) : 1.0;
+    }
+    seed_ = (params_.size() > 2 && params_[2] > 0.0f) ? int(params_[2])
+                                                       : int(cv::theRNG().next() & 0x7fffffff) + 1;
+    make_basis();
+}
+
+void RandomFourierFeatures::extract_batch(const cv::Mat &rows, cv::Mat &out)
+{
+    if (W_.empty())
+        throw std::runtime_error("The RFF features extractor is not trained.");
+    const int M = W_.cols;
+    CV_Assert(out.rows == rows.rows && out.cols == 2 * M && out.type() == CV_32FC1);
+
+    in_.create(rows.rows, input_size_, CV_32FC1);
+    child_->extract_batch(rows, in_);
+    cv::gemm(in_, W_, 1.0, cv::noArray(), 0.0, phase_);
+    if (magnitude_.size() != phase_.size())
+        magnitude_ = cv::Mat(phase_.size(), CV_32FC1, cv::Scalar(1.0 / std::sqrt(double(M))));
+    cv::Mat cos_out = out.colRange(0, M);
+    cv::Mat sin_out = out.colRange(M, 2 * M);
+    cv::polarToCart(magnitude_, phase_, cos_out, sin_out);
+}
+
+cv::Mat
+RandomFourierFeatures::extract_features(const cv::Mat &img)
+{
+    if (W_.empty())
+        throw std::runtime_error("The RFF features extractor is not trained.");
+    cv::Mat gray = fsiv_to_gray_image(img);
+    cv::Mat row = (gray.isContinuous() ? gray : gray.clone()).reshape(1, 1);
+    cv::Mat feature(1, 2 * W_.cols, CV_32FC1);
+    extract_batch(row, feature);
+    CV_Assert(feature.rows==1);
+    CV_Assert(feature.type()==CV_32FC1);
+    return feature;
+}
+
+void RandomFourierFeatures::write_state(cv::FileStorage &f) const
+{
+    cv::Ptr<FeaturesExtractor> child = child_ ? child_ : parse_rff_child(params_);
+    f << "fsiv_rff_seed" << seed_;
+    f << "fsiv_rff_gamma" << gamma_;
+    f << "fsiv_rff_input_size" << input_size_;
+    f << "fsiv_rff_child" << "{";
+    f << "fsiv_feature_id" << int(child->get_extractor_type());
+    f << "fsiv_feature_params" << child->get_params();
+    child->write_state(f);
+    f << "}";
+}
+
+void RandomFourierFeatures::read_state(const cv::FileNode &node)
+{
+    build();
+    auto seed_node = node["fsiv_rff_seed"];
+    auto child_node = node["fsiv_rff_child"];
+    if (seed_node.empty() || child_node.empty() || !child_node.isMap())
+        throw std::runtime_error("Could not load the 'fsiv_rff_seed' and "
+                                 "'fsiv_rff_child' labels from file.");
+    auto id_node = child_node["fsiv_feature_id"];
+    if (id_node.empty() || !id_node.isInt())
+        throw std::runtime_error("Could not load the 'fsiv_feature_id' "
+                                 "label of the RFF child.");
+    child_ = FeaturesExtractor::create(FEATURE_IDS(int(id_node)));
+    std::vector<float> child_params;
+    child_node["fsiv_feature_params"] >> child_params;
+    child_->set_params(child_params);
+    child_->read_state(child_node);
+
+    seed_ = int(seed_node);
+    gamma_ = double(node["fsiv_rff_gamma"]);
+    input_size_ = int(node["fsiv_rff_input_size"]);
+    W_.release();
+    if (seed_ != 0)
+        make_basis();
+}
@@ -0,0 +1,80 @@
+/**
+ *  @file rff_features.hpp
+ */
+#pragma once
+
+#include <vector>
+#include "features.hpp"
+
+/**
+ * @brief Random Fourier features of the output of a child extractor.
+ *
+ * It maps the features x of the child to
+ * z(x) = [cos(W^T x), sin(W^T x)] / sqrt(M), with the M columns of W drawn
+ * from N(0, 2*gamma*I), so z(x)^T z(y) approximates the RBF kernel
+ * exp(-gamma*||x-y||^2) (the one of svm_K=2) and a linear classifier (e.g.
+ * clf=5) trained with z approximates the RBF SVM.
+ *
+ * A block of rows is projected with one GEMM and cos/sin are computed
+ * together by cv::polarToCart() (vectorized). W is not saved: the model
+ * keeps its seed, gamma and the input size, and W is drawn again when it is
+ * loaded.
+ *
+ * Parameters: [M, gamma, seed, id, n, p_1 .. p_n] where M is the number of
+ * random frequencies (2M features, default 512), gamma the RBF gamma (<=0
+ * means 1/(D*var(x)) estimated when training), seed the seed of W (0 means
+ * drawn when training), and the child is given by its feature id, its
+ * number of parameters and the parameters. Without child, gray levels
+ * downscaled to 32x32 are used.
+ *
+ * The child is saved nested with label 'fsiv_rff_child'.
+ */
+class RandomFourierFeatures: public FeaturesExtractor
+{
+public:
+    /**
+     * @brief Create and set the default parameters.
+     */
+    RandomFourierFeatures();
+    ~RandomFourierFeatures();
+
+    virtual std::string get_extractor_name() const override;
+    virtual cv::Ptr<FeaturesExtractor> clone() const override;
+    virtual void train(const cv::Mat& samples) override;
+    virtual cv::Mat extract_features(const cv::Mat& img) override;
+    virtual void extract_batch(const cv::Mat& rows, cv::Mat& out) override;
+    virtual void write_state(cv::FileStorage& f) const override;
+    virtual void read_state(const cv::FileNode& node) override;
+
+    /**
+     * @brief Get the number of random frequencies M.
+     */
+    int get_n_frequencies() const;
+
+    /**
+     * @brief Get the RBF gamma (the estimated one once trained).
+     */
+    double get_gamma() const;
+
+protected:
+
+    /**
+     * @brief Build the child from the parameters if needed.
+     */
+    void build();
+
+    /**
+     * @brief Draw the random frequencies W from the seed.
+     */
+    void make_basis();
+
+    cv::Ptr<FeaturesExtractor> child_;
+    std::vector<float> built_params_; // params_ used to build the child.
+    int seed_;                        // seed of W (0 if untrained).
+    double gamma_;                    // used gamma (0 if untrained).
+    int input_size_;                  // feature size of the child.
+    cv::Mat W_;                       // DxM random frequencies.
+    cv::Mat in_;                      // scratch: child features of a block.
+    cv::Mat phase_;                   // scratch: projection of a block.
+    cv::Mat magnitude_;               // scratch: 1/sqrt(M).
+};
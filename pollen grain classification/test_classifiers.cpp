@@ -0,0 +1,646 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/ml.hpp>
+
+#include "common_code.hpp"
+
+#ifndef NDEBUG
+int __Debug_Level = 0;
+#endif
+
+/**
+ * @brief Print the result of a check.
+ * @return ok.
+ */
+static bool
+check(bool ok, const std::string &what)
+{
+    std::cout << (ok ? "[PASSED] " : "[FAILED] ") << what << std::endl;
+    return ok;
+}
+
+/**
+ * @brief Make two separable gaussian clusters (labels 0 and 1).
+ */
+static void
+make_two_clusters(int n_by_class, cv::Mat &X, cv::Mat &y)
+{
+    X.create(2 * n_by_class, 2, CV_32FC1);
+    y.create(2 * n_by_class, 1, CV_32SC1);
+    cv::randn(X, 0.0, 0.5);
+    for (int i = 0; i < X.rows; ++i)
+    {
+        const int label = i < n_by_class ? 0 : 1;
+        y.at<int>(i) = label;
+        X.at<float>(i, 0) += label ? 2.0f : -2.0f;
+        X.at<float>(i, 1) += label ? 1.0f : -1.0f;
+    }
+}
+
+/**
+ * @brief Check the SMO solver of OvrSVM against cv::ml::SVM.
+ *
+ * With two classes each one-vs-rest problem is the binary C-SVC, so the
+ * decision values must be the ones of cv::ml::SVM (one class positive and
+ * the other one its negation).
+ */
+static bool
+test_ovr_svm()
+{
+    cv::Mat X, y;
+    make_two_clusters(40, X, y);
+
+    cv::Ptr<cv::ml::StatModel> ref = fsiv_create_svm_classifier(cv::ml::SVM::LINEAR,
+                                                                1.0, 3.0, 1.0);
+    fsiv_train_classifier(ref, X, y);
+    cv::Mat ref_labels = fsiv_predict_labels(ref, X);
+    cv::Mat ref_values;
+    ref->predict(X, ref_values, cv::ml::StatModel::RAW_OUTPUT);
+
+    cv::Ptr<cv::ml::StatModel> clf = fsiv_create_ovr_svm_classifier(cv::ml::SVM::LINEAR,
+                                                                    1.0, 3.0, 1.0, 16);
+    fsiv_train_classifier(clf, X, y);
+    cv::Mat labels = fsiv_predict_labels(clf, X);
+    cv::Mat D;
+    dynamic_cast<const OvrSVM *>(clf.get())->decision_function(X, D);
+
+    // cv::ml::SVM gives the value of one of the two classes, which one is
+    // found with the sign of its predictions.
+    int positive_label = -1;
+    for (int i = 0; i < X.rows && positive_label < 0; ++i)
+        if (ref_values.at<float>(i) > 0.0f)
+            positive_label = ref_labels.at<int>(i);
+    bool ok = check(positive_label >= 0 && D.cols == 2, "OvrSVM: two classes");
+    if (!ok)
+        return false;
+
+    int same_labels = 0;
+    float max_error = 0.0f, max_symmetry_error = 0.0f;
+    for (int i = 0; i < X.rows; ++i)
+    {
+        const float d = D.at<float>(i, positive_label);
+        const float r = ref_values.at<float>(i);
+        same_labels += labels.at<int>(i) == ref_labels.at<int>(i);
+        max_error = std::max(max_error, std::abs(d - r) / (1.0f + std::abs(r)));
+        max_symmetry_error = std::max(max_symmetry_error,
+                                      std::abs(d + D.at<float>(i, 1 - positive_label)) /
+                                      (1.0f + std::abs(d)));
+    }
+    ok &= check(same_labels == X.rows, "OvrSVM: same labels as cv::ml::SVM");
+    ok &= check(max_error < 0.02f, "OvrSVM: same decision values as cv::ml::SVM "
+                                   "(max relative error " + std::to_string(max_error) + ")");
+    ok &= check(max_symmetry_error < 0.02f, "OvrSVM: the values of the two classes are "
+                                            "opposite");
+    return ok;
+}
+
+/**
+ * @brief Check ExactKNN against cv::ml::KNearest.
+ *
+ * The squared distances of the K neighbours must be the same. The labels
+ * must be the same too, except on vote ties: KNearest gives the lowest
+ * tied label and ExactKNN the one of the nearest neighbour.
+ */
+static bool
+test_exact_knn()
+{
+    const int N = 300, D = 8, n_queries = 100, n_classes = 3;
+    cv::Mat X(N, D, CV_32FC1), y(N, 1, CV_32SC1), Q(n_queries, D, CV_32FC1);
+    cv::randn(X, 0.0, 1.0);
+    cv::randn(Q, 0.0, 1.0);
+    for (int i = 0; i < N; ++i)
+    {
+        y.at<int>(i) = i % n_classes;
+        X.at<float>(i, 0) += float(i % n_classes);
+    }
+
+    bool ok = true;
+    for (int K : {1, 5})
+    {
+        cv::Ptr<cv::ml::StatModel> ref = fsiv_create_knn_classifier(K);
+        fsiv_train_classifier(ref, X, y);
+        cv::Mat ref_labels, ref_responses, ref_dists;
+        dynamic_cast<cv::ml::KNearest *>(ref.get())->findNearest(
+            Q, K, ref_labels, ref_responses, ref_dists);
+
+        cv::Ptr<cv::ml::StatModel> clf = fsiv_create_exact_knn_classifier(K);
+        fsiv_train_classifier(clf, X, y);
+        const cv::Mat labels = fsiv_predict_labels(clf, Q);
+        cv::Mat indices, dists;
+        dynamic_cast<const ExactKNN *>(clf.get())->search(Q, FeatureQuantizer(), K,
+                                                          indices, dists);
+
+        float max_error = 0.0f;
+        int same = 0, compared = 0;
+        for (int i = 0; i < n_queries; ++i)
+        {
+            int votes[n_classes] = {0, 0, 0};
+            for (int j = 0; j < K; ++j)
+            {
+                const float r = ref_dists.at<float>(i, j);
+                max_error = std::max(max_error,
+                                     std::abs(dists.at<float>(i, j) - r) / (1.0f + r));
+                ++votes[y.at<int>(indices.at<int>(i, j))];
+            }
+            const int top = *std::max_element(votes, votes + n_classes);
+            if (std::count(votes, votes + n_classes, top) > 1)
+                continue;
+            ++compared;
+            same += labels.at<int>(i) == int(ref_labels.at<float>(i));
+        }
+        ok &= check(max_error < 1.0e-4f, "ExactKNN: K=" + std::to_string(K) +
+                                         " neighbour distances equal cv::ml::KNearest");
+        ok &= check(same == compared && compared > n_queries / 2,
+                    "ExactKNN: K=" + std::to_string(K) + " labels equal cv::ml::KNearest (" +
+                    std::to_string(same) + " of " + std::to_string(compared) +
+                    " queries without ties)");
+    }
+    return ok;
+}
+
+/**
+ * @brief Check the encoded distance kernels against the decoded features.
+ *
+ * The size is not a multiple of the SIMD width, so the tails are checked
+ * too.
+ */
+static bool
+test_encoded_kernels()
+{
+    const int N = 50, D = 67;
+    cv::Mat X_f(N, D, CV_32FC1), b(1, D, CV_32FC1);
+    cv::randu(X_f, -1.0, 1.0);
+    cv::randu(b, -1.0, 1.0);
+    bool ok = true;
+    for (FEATURE_PRECISION precision :
+         {FSIV_PRECISION_F32, FSIV_PRECISION_F16, FSIV_PRECISION_Q8})
+    {
+        FeatureQuantizer quantizer(precision);
+        if (!quantizer.is_fitted())
+            quantizer.fit(X_f);
+        cv::Mat Q, X;
+        quantizer.encode(X_f, Q);
+        quantizer.decode(Q, X);
+        double max_error = 0.0;
+        for (int i = 0; i < N; ++i)
+        {
+            const double expected = cv::norm(X.row(i), b, cv::NORM_L2SQR);
+            const double d = quantizer.l2sqr(Q, i, b.ptr<float>());
+            max_error = std::max(max_error, std::abs(d - expected) / (1.0 + expected));
+        }
+        ok &= check(max_error < 1.0e-5, "Kernels: l2sqr with fprec=" +
+                                        std::to_string(int(precision)) +
+                                        " equals the decoded distance");
+    }
+    return ok;
+}
+
+/**
+ * @brief Check the recall of the HNSW graph against the exact K-NN.
+ *
+ * Uniform random data has no structure to help the graph, so it is a
+ * pessimistic case. The int8 features use the encoded distance kernels.
+ */
+static bool
+test_hnsw_recall()
+{
+    const int N = 4000, D = 16, K = 10, n_queries = 200;
+    cv::Mat X_f(N, D, CV_32FC1), Q_f(n_queries, D, CV_32FC1);
+    cv::randu(X_f, 0.0, 1.0);
+    cv::randu(Q_f, 0.0, 1.0);
+    cv::Mat y = cv::Mat::zeros(N, 1, CV_32SC1);
+
+    bool ok = true;
+    for (FEATURE_PRECISION precision : {FSIV_PRECISION_F32, FSIV_PRECISION_Q8})
+    {
+        FeatureQuantizer quantizer(precision);
+        cv::Mat X, Q;
+        if (!quantizer.is_fitted())
+            quantizer.fit(X_f);
+        quantizer.encode(X_f, X);
+        quantizer.encode(Q_f, Q);
+
+        ExactKNN exact;
+        exact.train_encoded(X, y, quantizer);
+        cv::Ptr<HnswKNN> hnsw = HnswKNN::create(K, 16, 200, 64);
+        hnsw->train_encoded(X, y, quantizer);
+
+        cv::Mat exact_idx, idx, dists;
+        exact.search(Q, quantizer, K, exact_idx, dists);
+        hnsw->search(Q, quantizer, K, idx, dists);
+        int hits = 0;
+        for (int i = 0; i < n_queries; ++i)
+        {
+            const int *ref = exact_idx.ptr<int>(i);
+            const int *found = idx.ptr<int>(i);
+            for (int j = 0; j < K; ++j)
+                hits += std::find(ref, ref + K, found[j]) != ref + K;
+        }
+        const double recall = double(hits) / (double(K) * n_queries);
+        ok &= check(recall >= 0.9, "HNSW: recall@" + std::to_string(K) + " with " +
+                                   (precision == FSIV_PRECISION_F32 ? "float32" : "int8") +
+                                   " features is " + std::to_string(recall) + " (>= 0.9)");
+    }
+    return ok;
+}
+
+/**
+ * @brief Load a partition of the synthetic dataset, generating it if needed.
+ */
+static void
+load_synthetic_partition(const std::string &part, int n_images, std::uint64_t seed,
+                         cv::Mat &X, cv::Mat &y)
+{
+    const std::string dir = "test_classifiers_data";
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec)
+        throw std::runtime_error("Error: could not create the folder " + dir);
+    std::string folder = dir + "/synthetic_" + std::to_string(n_images) + "_" +
+                         std::to_string(seed) + "_" + part;
+    if (!std::ifstream(folder + ".csv").good())
+        fsiv_generate_synthetic_dataset(folder, n_images, seed);
+    fsiv_load_dataset(folder, X, y);
+}
+
+/**
+ * @brief Generate a small synthetic dataset from scratch (no cache).
+ * @return the dataset pathname.
+ */
+static std::string
+fresh_synthetic_dataset(const std::string &name, int n_images, std::uint64_t seed)
+{
+    const std::string folder = "test_classifiers_data/" + name;
+    std::error_code ec;
+    std::filesystem::remove_all(folder, ec);
+    std::filesystem::remove(folder + ".cache", ec);
+    fsiv_generate_synthetic_dataset(folder, n_images, seed);
+    return folder;
+}
+
+/**
+ * @brief Read the csv rows (without the header) of a dataset.
+ */
+static std::vector<std::string>
+read_csv_rows(const std::string &folder)
+{
+    std::ifstream csv(folder + ".csv");
+    std::vector<std::string> rows;
+    std::string line;
+    std::getline(csv, line);
+    while (std::getline(csv, line))
+        rows.push_back(line);
+    return rows;
+}
+
+/**
+ * @brief Write the csv of a dataset.
+ */
+static void
+write_csv_rows(const std::string &folder, const std::vector<std::string> &rows)
+{
+    std::ofstream csv(folder + ".csv");
+    csv << "sample,species\n";
+    for (const std::string &row : rows)
+        csv << row << "\n";
+}
+
+/**
+ * @brief Check that the images that can not be decoded are dropped.
+ *
+ * A file that is not an image and a truncated png are listed between the
+ * good images. Both the decoding and the packed cache must keep only the
+ * good images, in the csv order.
+ */
+static bool
+test_corrupt_images()
+{
+    const std::string folder = fresh_synthetic_dataset("corrupt", 4, 3);
+    std::vector<std::string> rows = read_csv_rows(folder);
+    {
+        std::ofstream garbage(folder + "/garbage.png", std::ios::binary);
+        garbage << "this is not an image";
+        std::ifstream png(folder + "/000001.png", std::ios::binary);
+        std::vector<char> head(64);
+        png.read(head.data(), head.size());
+        std::ofstream truncated(folder + "/truncated.png", std::ios::binary);
+        truncated.write(head.data(), png.gcount());
+    }
+    rows.insert(rows.begin() + 1, "garbage.png,alnus");
+    rows.insert(rows.begin() + 3, "truncated.png,betula");
+    write_csv_rows(folder, rows);
+
+    bool ok = true;
+    for (const char *pass : {"decoded", "cached"})
+    {
+        std::string path = folder;
+        cv::Mat X, y;
+        fsiv_load_dataset(path, X, y);
+        bool same_rows = X.rows == 4;
+        for (int i = 0; same_rows && i < X.rows; ++i)
+        {
+            char fname[32];
+            std::snprintf(fname, sizeof(fname), "/%06d.png", i);
+            const cv::Mat img = cv::imread(folder + fname, cv::IMREAD_GRAYSCALE);
+            same_rows = cv::norm(X.row(i), img.reshape(1, 1), cv::NORM_INF) == 0.0;
+        }
+        ok &= check(same_rows, std::string("Dataset: corrupt images dropped (") + pass +
+                               ", " + std::to_string(X.rows) + " of 6 rows kept)");
+    }
+    return ok;
+}
+
+/**
+ * @brief Move forward the modification time of a file.
+ */
+static void
+touch_file(const std::string &path)
+{
+    std::filesystem::last_write_time(path, std::filesystem::last_write_time(path) +
+                                           std::chrono::seconds(10));
+}
+
+/**
+ * @brief Check that the packed cache is rebuilt when the dataset changes.
+ *
+ * The cache is built, then an image is replaced (with a later mtime) and a
+ * label of the csv is changed. Each load must see the new data, which a
+ * reused cache would not have.
+ */
+static bool
+test_dataset_cache_invalidation()
+{
+    std::string folder = fresh_synthetic_dataset("cache", 4, 4);
+    cv::Mat X, y;
+    fsiv_load_dataset(folder, X, y);
+    bool ok = check(std::filesystem::exists(folder + ".cache"), "Dataset cache: built");
+
+    // Replace the first image with its negative.
+    const std::string image = folder + "/000000.png";
+    cv::Mat negative;
+    cv::bitwise_not(cv::imread(image, cv::IMREAD_GRAYSCALE), negative);
+    cv::imwrite(image, negative);
+    touch_file(image);
+    fsiv_load_dataset(folder, X, y);
+    ok &= check(X.rows == 4 &&
+                cv::norm(X.row(0), negative.reshape(1, 1), cv::NORM_INF) == 0.0,
+                "Dataset cache: rebuilt when an image changes");
+
+    // Change the label of the first image.
+    std::vector<std::string> rows = read_csv_rows(folder);
+    const int new_label = (y.at<int>(0) + 1) % 15;
+    rows[0] = "000000.png," + fsiv_get_dataset_label_name(new_label);
+    write_csv_rows(folder, rows);
+    touch_file(folder + ".csv");
+    fsiv_load_dataset(folder, X, y);
+    ok &= check(y.rows == 4 && y.at<int>(0) == new_label,
+                "Dataset cache: rebuilt when the csv changes");
+    return ok;
+}
+
+/**
+ * @brief Check that the parallel extraction gives the serial features.
+ *
+ * The images span several blocks, so several extractor clones work at the
+ * same time. The result must be the one of a single thread and, row by
+ * row, the one of FeaturesExtractor::extract_features.
+ */
+static bool
+test_parallel_extraction()
+{
+    cv::Mat X, y;
+    load_synthetic_partition("train", 900, 1, X, y);
+    X = X.rowRange(0, 600);
+    const int n_threads = cv::getNumThreads();
+    bool ok = true;
+    for (FEATURE_IDS id : {FSIV_GREY_LEVELS, FSIV_LBP, FSIV_HARALICK})
+    {
+        cv::Ptr<FeaturesExtractor> extractor = FeaturesExtractor::create(id);
+        extractor->train(X);
+        cv::setNumThreads(1);
+        const cv::Mat serial = fsiv_extract_features(X, extractor);
+        cv::setNumThreads(n_threads);
+        FeatureExtractionStats stats;
+        const cv::Mat parallel = fsiv_extract_features(X, extractor, &stats);
+
+        float max_row_error = 0.0f;
+        for (int i = 0; i < X.rows; i += 37)
+        {
+            const cv::Mat row = extractor->extract_features(X.row(i));
+            max_row_error = std::max(max_row_error,
+                                     float(cv::norm(row, serial.row(i), cv::NORM_INF)));
+        }
+        const std::string name = extractor->get_extractor_name();
+        ok &= check(serial.size() == parallel.size() &&
+                    cv::norm(serial, parallel, cv::NORM_INF) == 0.0,
+                    "Extraction: " + name + " with " + std::to_string(stats.n_workers) +
+                    " workers equals one thread");
+        ok &= check(max_row_error < 1.0e-5f, "Extraction: " + name +
+                                             " batches equal the single image extraction");
+    }
+    return ok;
+}
+
+/**
+ * @brief Check the accuracy of the binned flat forest against cv::ml::RTrees
+ * on LBP features of the synthetic dataset.
+ *
+ * Both forests get the same number of trees and features tried per node,
+ * the binned splits may only lose a little accuracy.
+ */
+static bool
+test_flat_forest()
+{
+    cv::Mat X_t, y_t, X_v, y_v;
+    load_synthetic_partition("train", 900, 1, X_t, y_t);
+    load_synthetic_partition("test", 450, 2, X_v, y_v);
+    cv::Ptr<FeaturesExtractor> extractor = FeaturesExtractor::create(FSIV_LBP);
+    extractor->train(X_t);
+    const cv::Mat F_t = fsiv_extract_features(X_t, extractor);
+    const cv::Mat F_v = fsiv_extract_features(X_v, extractor);
+
+    cv::Ptr<cv::ml::StatModel> ref = fsiv_create_rtrees_classifier(0, 50, 0.1f);
+    fsiv_train_classifier(ref, F_t, y_t);
+    const float ref_acc = fsiv_compute_accuracy(
+        fsiv_compute_confusion_matrix(y_v, fsiv_predict_labels(ref, F_v), 15));
+
+    cv::Ptr<cv::ml::StatModel> forest = fsiv_create_flat_forest_classifier(0, 50, 0, 1, 256);
+    fsiv_train_classifier(forest, F_t, y_t);
+    const float acc = fsiv_compute_accuracy(
+        fsiv_compute_confusion_matrix(y_v, fsiv_predict_labels(forest, F_v), 15));
+
+    bool ok = check(ref_acc > 2.0f / 15.0f, "FlatForest: the synthetic classes are "
+                                           "learnable (RTrees accuracy " +
+                                           std::to_string(ref_acc) + ")");
+    ok &= check(acc >= ref_acc - 0.05f, "FlatForest: accuracy " + std::to_string(acc) +
+                                        " vs RTrees " + std::to_string(ref_acc) +
+                                        " (max drop 0.05)");
+    return ok;
+}
+
+/**
+ * @brief Check that the mapped models predict the same after a round trip
+ * through a model file.
+ *
+ * The reader is gone when the model is used, so the loaded model must
+ * keep the mapping of its sections alive by itself.
+ */
+static bool
+test_model_file_round_trip()
+{
+    const int N = 600, D = 8, n_queries = 200, n_classes = 3;
+    cv::Mat X(N, D, CV_32FC1), y(N, 1, CV_32SC1), Q(n_queries, D, CV_32FC1);
+    cv::randn(X, 0.0, 1.0);
+    cv::randn(Q, 0.0, 1.0);
+    for (int i = 0; i < N; ++i)
+    {
+        y.at<int>(i) = i % n_classes;
+        X.at<float>(i, 0) += float(i % n_classes);
+    }
+
+    const std::string dir = "test_classifiers_data";
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec)
+        throw std::runtime_error("Error: could not create the folder " + dir);
+    const std::string model_fname = dir + "/round_trip.model";
+
+    const std::pair<std::string, cv::Ptr<cv::ml::StatModel>> models[] = {
+        {"ExactKNN", fsiv_create_exact_knn_classifier(5)},
+        {"HnswKNN", fsiv_create_hnsw_knn_classifier(5, 16, 200, 64)},
+        {"FlatForest", fsiv_create_flat_forest_classifier(0, 20, 0, 1, 256)}};
+    bool ok = true;
+    for (auto model : models)
+    {
+        fsiv_train_classifier(model.second, X, y);
+        const cv::Mat expected = fsiv_predict_labels(model.second, Q);
+        {
+            ModelFileWriter out(model_fname);
+            fsiv_save_classifier_model(model.second, out);
+            if (!out.close())
+                throw std::runtime_error("Error: could not write " + model_fname);
+        }
+        cv::Mat labels;
+        {
+            cv::Ptr<cv::ml::StatModel> loaded = fsiv_load_classifier_model(model_fname);
+            labels = fsiv_predict_labels(loaded, Q);
+        }
+        std::remove(model_fname.c_str());
+        ok &= check(cv::norm(labels, expected, cv::NORM_INF) == 0.0,
+                    "Model file: " + model.first + " predicts the same after a "
+                    "save/load round trip");
+    }
+    return ok;
+}
+
+/**
+ * @brief Check MetricsAccumulator on hand-built scores.
+ */
+static bool
+test_metrics_accumulator()
+{
+    // 3 categories, top-2. The last sample has a tie (0 wins the argmax
+    // and ranks before 1).
+    const float scores_data[] = {0.9f, 0.1f, 0.0f,
+                                 0.2f, 0.7f, 0.1f,
+                                 0.5f, 0.3f, 0.2f,
+                                 0.1f, 0.2f, 0.7f,
+                                 0.3f, 0.6f, 0.1f,
+                                 0.4f, 0.4f, 0.2f};
+    const int labels_data[] = {0, 0, 2, 2, 1, 1};
+    const cv::Mat scores(6, 3, CV_32FC1, const_cast<float *>(scores_data));
+    const cv::Mat y(6, 1, CV_32SC1, const_cast<int *>(labels_data));
+    const float expected_cmat[] = {1, 1, 0,
+                                   1, 1, 0,
+                                   1, 0, 1};
+    const float expected_precision[] = {1.0f / 3.0f, 0.5f, 1.0f};
+
+    // Two batches merged give the same counts as one.
+    MetricsAccumulator first(3, 2), second(3, 2);
+    cv::Mat predicted, predicted_b;
+    first.add_scores(y.rowRange(0, 3), scores.rowRange(0, 3), &predicted);
+    second.add_scores(y.rowRange(3, 6), scores.rowRange(3, 6), &predicted_b);
+    predicted.push_back(predicted_b);
+    first.merge(second);
+    const ClassificationMetrics m = first.compute();
+
+    const cv::Mat cmat = fsiv_compute_confusion_matrix(y, predicted, 3);
+    const cv::Mat expected(3, 3, CV_32FC1, const_cast<float *>(expected_cmat));
+    bool ok = check(cv::norm(m.confusion, expected, cv::NORM_INF) == 0.0,
+                    "MetricsAccumulator: confusion matrix");
+    ok &= check(cv::norm(cmat, expected, cv::NORM_INF) == 0.0,
+                "MetricsAccumulator: fsiv_compute_confusion_matrix agrees");
+    ok &= check(std::abs(m.accuracy - 0.5f) < 1.0e-6f &&
+                std::abs(fsiv_compute_accuracy(cmat) - 0.5f) < 1.0e-6f,
+                "MetricsAccumulator: accuracy");
+    ok &= check(std::abs(m.mean_rr - 0.5f) < 1.0e-6f, "MetricsAccumulator: mean RR");
+    bool precision_ok = true;
+    for (int c = 0; c < 3; ++c)
+        precision_ok &= std::abs(m.precision.at<float>(c) - expected_precision[c]) < 1.0e-6f;
+    ok &= check(precision_ok, "MetricsAccumulator: precision");
+    ok &= check(m.top_k == 2 && std::abs(m.top_k_accuracy - 5.0f / 6.0f) < 1.0e-6f,
+                "MetricsAccumulator: top-2 accuracy");
+
+    // A model that did not see the last category gives less columns.
+    MetricsAccumulator narrow(3, 2);
+    const float narrow_data[] = {0.1f, 0.2f};
+    const int narrow_label = 2;
+    narrow.add_scores(cv::Mat(1, 1, CV_32SC1, const_cast<int *>(&narrow_label)),
+                      cv::Mat(1, 2, CV_32FC1, const_cast<float *>(narrow_data)),
+                      &predicted);
+    const ClassificationMetrics n = narrow.compute();
+    ok &= check(predicted.at<int>(0) == 1 && n.top_k_accuracy == 0.0f &&
+                n.n_samples == 1, "MetricsAccumulator: scores of less categories");
+
+    // A label out of range is not counted instead of throwing.
+    const int bad_true[] = {0, 1, 3}, bad_predicted[] = {0, 1, 1};
+    const cv::Mat bad_cmat = fsiv_compute_confusion_matrix(
+        cv::Mat(3, 1, CV_32SC1, const_cast<int *>(bad_true)),
+        cv::Mat(3, 1, CV_32SC1, const_cast<int *>(bad_predicted)), 3);
+    ok &= check(cv::sum(bad_cmat)[0] == 2.0, "MetricsAccumulator: confusion matrix "
+                                             "skips the invalid labels");
+    return ok;
+}
+
+int main(int argc, char *const *argv)
+{
+  int retCode = EXIT_SUCCESS;
+
+  try
+  {
+    cv::theRNG().state = 1;
+    bool ok = true;
+    ok &= test_corrupt_images();
+    ok &= test_dataset_cache_invalidation();
+    ok &= test_parallel_extraction();
+    ok &= test_exact_knn();
+    ok &= test_encoded_kernels();
+    ok &= test_ovr_svm();
+    ok &= test_hnsw_recall();
+    ok &= test_flat_forest();
+    ok &= test_model_file_round_trip();
+    ok &= test_metrics_accumulator();
+    if (!ok)
+      retCode = EXIT_FAILURE;
+    std::cout << (ok ? "All the checks passed." : "Some checks failed.") << std::endl;
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Exception caught: " << e.what() << std::endl;
+    retCode = EXIT_FAILURE;
+  }
+  return retCode;
+}
@@ -17,6 +17,16 @@ int __Debug_Level = 0;
 const char *keys =
     "{help h usage ? |      | print this message   }"
     "{t              |      | Only get test labels (no metrics), used for final upload.}"
+    "{recall         |1000  | Queries used for the recall vs latency report of HNSW K-NN models. "
+    "0 disables it.}"
+    "{top_k          |5     | k of the top-k accuracy, computed for the classifiers that give "
+    "class scores (linear SGD, one-vs-rest SVM and flat forest).}"
+    "{profile        |      | Write the time of each phase, the counters and the peak RSS to "
+    "this JSON file. Default none.}"
+    "{trace          |      | Write the phases and counters as a Chrome trace to this file. "
+    "Default none.}"
+    "{batch          |0     | Predict in batches of this size to bound the memory used. "
+    "Default 0 loads the whole dataset.}"
 #ifndef NDEBUG
     "{verbose        |0     | Set the verbose level.}"
 #endif
@@ -38,12 +48,19 @@ int main(int argc, char *const *argv)
       return 0;
     }
 
+    int verbose = 0;
 #ifndef NDEBUG
     __Debug_Level = parser.get<int>("verbose");
+    verbose = __Debug_Level;
 #endif
     std::string dataset_path = parser.get<std::string>("@dataset_path");
     std::string model_fname = parser.get<std::string>("@model");
     bool only_test = parser.has("t");
+    int batch_size = parser.get<int>("batch");
+    int recall_queries = parser.get<int>("recall");
+    int top_k = parser.get<int>("top_k");
+    std::string profile_fname = parser.get<std::string>("profile");
+    std::string trace_fname = parser.get<std::string>("trace");
     if (!parser.check())
     {
       parser.printErrors();
@@ -51,67 +68,172 @@ int main(int argc, char *const *argv)
     }
 
     std::cout.setf(std::ios::unitbuf);
+    Profiler::instance().set_enabled(!profile_fname.empty() || !trace_fname.empty());
     cv::Mat X, y;
 
-    fsiv_load_dataset(dataset_path, X, y, only_test);
-
-    std::cout << "Loaded dataset with " << X.rows << " samples."
-              << std::endl;
-
-    std::cout << "Test partition with " << X.rows << " samples."
-              << std::endl;
-
-    std::cout << std::endl;
-    std::cout << "Extracting features ... ";
+    ScopedTimer load_model_timer("load_model");
     auto extractor = FeaturesExtractor::create(model_fname);
-    std::cout << "Extracting features ... " << std::endl;
     std::cout << "Feature extractor: " << extractor->get_extractor_name()
               << std::endl;
     std::cout << "Feature extractor params: " << extractor->get_params()
               << std::endl;
-    X = fsiv_extract_features(X, extractor);
-
-    std::cout << "done." << std::endl;
-    std::cout << "Extracted features use "
-              << ((X.rows * X.cols * X.elemSize()) / (1024 * 1024))
-              << " Mb. of memory." << std::endl;
 
     cv::Ptr<cv::ml::StatModel> clsf = fsiv_load_classifier_model(model_fname);
 
+    // The features are encoded as in training.
+    FeatureQuantizer quantizer;
+    {
+      cv::FileStorage f = fsiv_open_model_metadata(model_fname);
+      quantizer.read(f.root());
+    }
+    load_model_timer.stop();
+
     if (clsf == nullptr || !clsf->isTrained())
     {
       std::cerr << "Error: I need a trained model!" << std::endl;
       return EXIT_FAILURE;
     }
 
-    std::cout << std::endl;
-    std::cout << "Computing predictions ... ";
-    cv::Mat predict_labels = fsiv_predict_labels(clsf, X);
-    std::cout << "done.\n"
-              << std::endl;
-    fsiv_save_predictions(dataset_path, predict_labels);
+    // The metrics are accumulated as the predictions are computed.
+    MetricsAccumulator metrics(15, top_k);
+    const MarginModel *scorer = dynamic_cast<const MarginModel *>(clsf.get());
+    auto predict_batch = [&](const cv::Mat &X_f, const cv::Mat &y_b)
+    {
+      cv::Mat labels, scores;
+      ScopedTimer predict_timer("predict");
+      if (scorer != nullptr && !only_test)
+        scorer->predict_scores(X_f, quantizer, scores);
+      else
+        labels = fsiv_predict_labels(clsf, X_f, quantizer);
+      predict_timer.stop();
+      if (only_test)
+        return labels;
+      ScopedTimer metrics_timer("metrics");
+      if (scorer != nullptr)
+        metrics.add_scores(y_b, scores, &labels);
+      else
+        metrics.add(y_b, labels);
+      return labels;
+    };
+
+    cv::Mat predict_labels;
+    if (batch_size > 0)
+    {
+      // Predict and write batch by batch, so only a batch is in memory.
+      DatasetReader reader(dataset_path, batch_size, only_test, 2, verbose);
+      std::cout << "Test partition with " << reader.size()
+                << " samples in batches of " << batch_size << "." << std::endl;
+      std::cout << std::endl;
+
+      std::cout << "Computing predictions ... ";
+      PredictionsWriter writer(dataset_path);
+      cv::Mat X_b, y_b;
+      while (reader.next(X_b, y_b))
+      {
+        ScopedTimer extract_timer("extract");
+        cv::Mat X_f = fsiv_extract_features(X_b, extractor, nullptr, &quantizer);
+        extract_timer.stop();
+        writer.write(predict_batch(X_f, y_b));
+      }
+      std::cout << "done.\n"
+                << std::endl;
+    }
+    else
+    {
+      ScopedTimer load_timer("load");
+      fsiv_load_dataset(dataset_path, X, y, only_test, verbose);
+      load_timer.stop();
+      Profiler::instance().set_counter("test_samples", X.rows);
+
+      std::cout << "Loaded dataset with " << X.rows << " samples."
+                << std::endl;
+
+      std::cout << "Test partition with " << X.rows << " samples."
+                << std::endl;
+
+      std::cout << std::endl;
+      std::cout << "Extracting features ... " << std::endl;
+      FeatureExtractionStats stats;
+      ScopedTimer extract_timer("extract");
+      X = fsiv_extract_features(X, extractor, &stats, &quantizer);
+      extract_timer.stop();
+      Profiler::instance().set_counter("features_mb",
+                                       (X.rows * X.cols * X.elemSize()) / (1024.0 * 1024.0));
+
+      std::cout << "done (" << stats << ")." << std::endl;
+      std::cout << "Extracted features use "
+                << ((X.rows * X.cols * X.elemSize()) / (1024 * 1024))
+                << " Mb. of memory." << std::endl;
+
+      std::cout << std::endl;
+      std::cout << "Computing predictions ... ";
+      predict_labels = predict_batch(X, y);
+      std::cout << "done.\n"
+                << std::endl;
+      fsiv_save_predictions(dataset_path, predict_labels);
+
+      HnswKNN *hnsw = dynamic_cast<HnswKNN *>(clsf.get());
+      if (hnsw != nullptr && recall_queries > 0)
+      {
+        std::cout << "Computing the recall vs latency report ... " << std::endl;
+        fsiv_hnsw_recall_report(*hnsw, X, quantizer, recall_queries, std::cout);
+        std::cout << std::endl;
+      }
+    }
+
+    const CascadeClassifier *cascade = dynamic_cast<const CascadeClassifier *>(clsf.get());
+    if (cascade != nullptr)
+    {
+      const CascadeStats stats = cascade->get_stats();
+      const double n = double(std::max(1LL, stats.n_samples));
+      std::cout << "Cascade: escalated " << 100.0 * stats.n_escalated / n
+                << "% of the samples (threshold " << cascade->get_threshold() << ")."
+                << std::endl;
+      std::cout << "Cascade mean cost: "
+                << 1000.0 * (stats.first_seconds + stats.second_seconds) / n
+                << " ms/sample (first stage "
+                << 1000.0 * stats.first_seconds / n << ", second stage "
+                << 1000.0 * stats.second_seconds / std::max(1LL, stats.n_escalated)
+                << " ms/escalated sample)." << std::endl;
+      std::cout << std::endl;
+    }
 
     if (only_test == false)
     {
 
       std::cout << "Computing metrics ... ";
-      cv::Mat cmat = fsiv_compute_confusion_matrix(y, predict_labels, 15);
-      float acc = fsiv_compute_accuracy(cmat);
-      cv::Mat RRs = fsiv_compute_recognition_rates(cmat);
-      float m_rr = fsiv_compute_mean_recognition_rate(RRs);
+      ScopedTimer metrics_timer("metrics");
+      const ClassificationMetrics m = metrics.compute();
+      metrics_timer.stop();
+      Profiler::instance().set_counter("accuracy", m.accuracy);
       std::cout << "done.\n"
                 << std::endl;
+      if (m.n_invalid > 0)
+        std::cerr << "Warning: " << m.n_invalid
+                  << " samples with an invalid label were not scored." << std::endl;
 
       std::cout << std::endl;
       std::cout << "Model metrics #########################\n"
                 << std::endl;
       std::cout << "RR:\t";
-      for (int i = 0; i < RRs.rows; ++i)
+      for (int i = 0; i < m.recall.rows; ++i)
+        std::cout << "('" << fsiv_get_dataset_label_name(i)
+                  << "':" << m.recall.at<float>(i) << ") ";
+      std::cout << std::endl;
+      std::cout << "Precision:\t";
+      for (int i = 0; i < m.precision.rows; ++i)
+        std::cout << "('" << fsiv_get_dataset_label_name(i)
+                  << "':" << m.precision.at<float>(i) << ") ";
+      std::cout << std::endl;
+      std::cout << "F1:\t";
+      for (int i = 0; i < m.f1.rows; ++i)
         std::cout << "('" << fsiv_get_dataset_label_name(i)
-                  << "':" << RRs.at<float>(i) << ") ";
+                  << "':" << m.f1.at<float>(i) << ") ";
       std::cout << std::endl;
-      std::cout << "mRR:\t" << m_rr << std::endl;
-      std::cout << "Acc:\t" << acc << std::endl;
+      std::cout << "mRR:\t" << m.mean_rr << std::endl;
+      std::cout << "Acc:\t" << m.accuracy << std::endl;
+      if (m.top_k_accuracy >= 0.0f)
+        std::cout << "Top-" << m.top_k << " acc:\t" << m.top_k_accuracy << std::endl;
       size_t model_size = 0;
       if (fsiv_compute_file_size(model_fname, model_size))
       {
@@ -125,6 +247,7 @@ int main(int argc, char *const *argv)
       else
         throw std::runtime_error("Error: could not open the file " + model_fname);
     }
+    fsiv_write_profile_reports(profile_fname, trace_fname, "test_clf");
   }
   catch (std::exception &e)
   {
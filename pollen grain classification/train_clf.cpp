@@ -2,6 +2,8 @@
 
 #include <iostream>
 #include <sstream>
+#include <cstdio>
+#include <functional>
 #include <exception>
 #include <time.h>
 #include <stdlib.h>
@@ -14,6 +16,7 @@
 #include <opencv2/ml/ml.hpp>
 
 #include "common_code.hpp"
+#include "binary_io.hpp"
 
 #ifndef NDEBUG
 int __Debug_Level = 0;
@@ -24,21 +27,72 @@ const char* keys =
     "{rseed        |0     | Use this value as random seed. Default 0 means use time(0)}"
     "{s_ratio      |0.5   | Use a subsample ratio size of the dataset. Default 50% of the dataset.}"
     "{f            |1     | Feature to extract. Default 1 is normalized gray levels. f_params=0 means [0,1] normalized."
-                            " f_params=1 means mean/stddev normalized.}"
+                            " f_params=1 means mean/stddev normalized, an optional second value S"
+                            " downscales the image to SxS. 3 is LBP histograms,"
+                            " f_params=\"G R\" with GxG grid cells and radii 1..R (default \"4 3\")."
+                            " 4 is PCA of gray levels, f_params=\"K Q\" with K components and Q"
+                            " power iterations (default \"100 2\"). 5 is Haralick GLCM features,"
+                            " f_params=L gray levels (default 16). 6 is a pipeline, f_params=\"P s_1..s_P"
+                            " C id_1 n_1 p_1..p_n_1 ...\" with P preprocessing steps (1 equalize,"
+                            " 2 gaussian, 3 median) and C concatenated extractors given by id,"
+                            " number of params and params. 7 is random Fourier features approximating"
+                            " the RBF kernel (train a linear classifier, clf=5, on them),"
+                            " f_params=\"M G seed id n p_1..p_n\" with M frequencies (2M features),"
+                            " RBF gamma G (0 estimates it), seed (0 random) and the child extractor"
+                            " given by id, number of params and params (default \"512 0 0 1 2 0 32\").}"
     "{f_params     |0     | Feature extractor parameters (if any). Format <value>[:<value>:<value>...].}"
     "{v validate   |0.1     | Use the (v*100)% of the dataset to validate."
                              "and validate. Default is to use 10% of samples to validate.}"
-    "{clf          |0     | Classifier to train/test. 0: K-NN, 1:SVM, 2:RTREES.}"
-    "{knn_K        |1     | Parameter K for K-NN class.}"
+    "{clf          |0     | Classifier to train/test. 0: K-NN, 1:SVM, 2:RTREES, "
+    "3: exact K-NN with blocked GEMM distances (multithreaded), 4: approximate K-NN with a HNSW index, "
+    "5: linear softmax trained with mini-batch SGD (multithreaded, it can be trained with batches), "
+    "6: one-vs-rest SVM with the binary problems trained in parallel (uses the svm_* keys), "
+    "7: random forest grown in parallel with binned features (uses rtrees_V, rtrees_T and forest_*), "
+    "8: cascade of a cheap first stage (5, 6 or 7) and an expensive second stage for the samples "
+    "the first one is not confident about (uses casc_*).}"
+    "{knn_K        |1     | Parameter K for K-NN classes.}"
+    "{knn_M        |16    | Links by node and layer of the HNSW index.}"
+    "{knn_efC      |200   | Beam size used to build the HNSW index.}"
+    "{knn_ef       |64    | Beam size used to predict with the HNSW index (more recall, more latency).}"
+    "{proto        |0     | Condense the K-NN train samples into prototypes. 0: keep all the samples, "
+    "1: k-means centers of each class, 2: condensed nearest neighbour selection.}"
+    "{proto_n      |32    | Prototypes by class. One value for all the classes or \"n_0 n_1 ...\" "
+    "with one value by class label.}"
+    "{proto_report |0     | Print the validation accuracy/model size/latency trade-off of the "
+    "prototypes (1/64 to 1/2 of each class, proto_n and all the samples) before training.}"
+    "{sgd_E        |10    | Epochs of the linear SGD classifier.}"
+    "{sgd_L        |0.1   | AdaGrad learning rate of the linear SGD classifier.}"
+    "{sgd_B        |256   | Mini-batch size of the linear SGD classifier.}"
+    "{sgd_R        |0.0001| L2 regularization weight of the linear SGD classifier.}"
     "{svm_C        |1.0   | Parameter C for SVM class.}"
     "{svm_K        |0     | Kernel to use with SVM class. 0:Linear, 1:Polynomial. "
     "2:RBF, 3:SIGMOID, 4:CHI2, 5:INTER}"
     "{svm_D        |3.0   | Degree of svm polynomial kernel.}"
     "{svm_G        |1.0   | Gamma for svm RBF kernel.}"
+    "{svm_cache    |1024  | Kernel cache (Mb) shared by the binary problems of the one-vs-rest SVM.}"
     "{rtrees_V     |0     | Num of random features sampled per node. "
     "Default 0 meas sqrt(num. of total features).}"
     "{rtrees_T     |50    | Max num. of rtrees in the forest.}"
     "{rtrees_E     |0.1   | OOB error to stop adding more rtrees.}"
+    "{forest_D     |0     | Max depth of the flat forest trees. Default 0 means no limit.}"
+    "{forest_L     |1     | Min samples by leaf of the flat forest trees.}"
+    "{forest_B     |256   | Max bins by feature used to grow the flat forest (2..256).}"
+    "{casc_first   |5     | First stage of the cascade classifier (5, 6 or 7).}"
+    "{casc_second  |3     | Second stage of the cascade classifier.}"
+    "{casc_drop    |0.005 | Max validation accuracy drop of the cascade against its second stage, "
+    "used to calibrate the margin under which a sample is escalated.}"
+    "{fstore       |      | Folder used to store the extracted features, so later runs with the "
+    "same dataset, rseed, s_ratio and extractor skip the extraction. Default none.}"
+    "{fprec        |0     | Precision used to store the extracted features. 0: float32, 1: float16, "
+    "2: int8 with a scale and offset by feature fitted on the train features.}"
+    "{profile      |      | Write the time of each phase, the counters and the peak RSS to this JSON "
+    "file. With batch the extraction is nested in train and predict, see self_seconds. "
+    "Default none.}"
+    "{trace        |      | Write the phases and counters as a Chrome trace to this file "
+    "(open it in chrome://tracing or Perfetto). Default none.}"
+    "{batch        |0     | Stream the datasets in batches of this size to bound the memory used. "
+    "The s_ratio subsample is drawn once and the feature store and the prototypes report "
+    "are not used. Default 0 loads the whole datasets.}"
     "{@train_path  |<none>| Train dataset pathname.}"
     "{@valid_path  |<none>| Validation dataset pathname.}"
     "{@test_path   |<none>| Test dataset pathname.}"
@@ -63,6 +117,182 @@ parse_feature_params(const std::string& f_params)
     return feature_params;
 }
 
+/**
+ * @brief Condense the train samples of a K-NN classifier.
+ *
+ * @param clsf is the classifier. Other classifiers keep all the samples.
+ * @param X are the train features.
+ * @param y are the train labels.
+ * @param quantizer is the format of the features.
+ * @param method is the condensation method.
+ * @param n_prototypes are the prototypes by class.
+ * @param[out] P are the samples to train with.
+ * @param[out] P_labels are their labels.
+ */
+static void
+condense_train_samples(const cv::Ptr<cv::ml::StatModel>& clsf, const cv::Mat& X,
+                       const cv::Mat& y, const FeatureQuantizer& quantizer,
+                       PROTOTYPES_METHOD method, const std::vector<int>& n_prototypes,
+                       cv::Mat& P, cv::Mat& P_labels)
+{
+    if (method == FSIV_PROTOTYPES_NONE || !fsiv_is_knn_classifier(clsf))
+    {
+        P = X;
+        P_labels = y;
+        return;
+    }
+    fsiv_condense_prototypes(X, y, quantizer, method, n_prototypes, P, P_labels);
+    std::cout << "(condensed " << X.rows << " samples into " << P.rows
+              << " prototypes) ";
+}
+
+/**
+ * @brief Print the accuracy/size/latency trade-off of several prototypes
+ * counts.
+ *
+ * For each count the classifier is trained with the prototypes, saved to
+ * a temporary model file to get its size and it predicts the validation
+ * features to get the accuracy and the latency.
+ *
+ * @param clsf is the (K-NN) classifier. It is left trained with the last
+ * prototypes.
+ * @param X_t are the train features.
+ * @param y_t are the train labels.
+ * @param X_v are the validation features.
+ * @param y_v are the validation labels.
+ * @param quantizer is the format of the features.
+ * @param method is the condensation method.
+ * @param n_prototypes are the configured prototypes by class.
+ * @param model_fname is the model filename (the temporary files are next to it).
+ */
+static void
+report_prototypes_tradeoff(cv::Ptr<cv::ml::StatModel>& clsf, const cv::Mat& X_t,
+                           const cv::Mat& y_t, const cv::Mat& X_v, const cv::Mat& y_v,
+                           const FeatureQuantizer& quantizer, PROTOTYPES_METHOD method,
+                           const std::vector<int>& n_prototypes,
+                           const std::string& model_fname)
+{
+    std::vector<int> class_sizes;
+    for (int i = 0; i < y_t.rows; ++i)
+    {
+        const int label = y_t.at<int>(i);
+        if (label >= int(class_sizes.size()))
+            class_sizes.resize(label + 1, 0);
+        ++class_sizes[label];
+    }
+
+    std::vector<std::pair<std::string, std::vector<int>>> points;
+    for (int d = 64; d >= 2; d /= 2)
+    {
+        std::vector<int> counts;
+        for (int n : class_sizes)
+            counts.push_back(std::max(1, (n + d / 2) / d));
+        points.emplace_back("1/" + std::to_string(d), counts);
+    }
+    points.emplace_back("proto_n", n_prototypes);
+    points.emplace_back("all", std::vector<int>(1, 0));
+
+    std::cout << "Prototypes trade-off ("
+              << (method == FSIV_PROTOTYPES_CNN ? "CNN" : "k-means") << "):" << std::endl;
+    std::cout << "counts\tprototypes\tvalidation acc.\tmodel Mb\tms/query" << std::endl;
+    for (const auto& point : points)
+    {
+        cv::Mat P, P_labels;
+        if (point.first == "all")
+        {
+            P = X_t;
+            P_labels = y_t;
+        }
+        else
+            fsiv_condense_prototypes(X_t, y_t, quantizer, method, point.second,
+                                     P, P_labels);
+        fsiv_train_classifier(clsf, P, P_labels, quantizer);
+
+        const int64 t0 = cv::getTickCount();
+        cv::Mat predict_labels = fsiv_predict_labels(clsf, X_v, quantizer);
+        const double seconds = (cv::getTickCount() - t0) / cv::getTickFrequency();
+        const float acc = fsiv_compute_accuracy(
+            fsiv_compute_confusion_matrix(y_v, predict_labels, 15));
+
+        const std::string tmp_fname = fsiv_make_temp_path(model_fname);
+        size_t model_size = 0;
+        {
+            ModelFileWriter model_file(tmp_fname);
+            fsiv_save_classifier_model(clsf, model_file);
+            if (model_file.close())
+                fsiv_compute_file_size(tmp_fname, model_size);
+        }
+        std::remove(tmp_fname.c_str());
+
+        std::cout << point.first << "\t" << P.rows << "\t" << acc << "\t"
+                  << model_size / (1024.0 * 1024.0) << "\t"
+                  << 1000.0 * seconds / std::max(1, X_v.rows) << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+/**
+ * @brief Compute the confusion matrix predicting a stream of batches.
+ *
+ * @param clsf is the trained classifier.
+ * @param next_batch gets the next batch (features, labels).
+ * @param quantizer is the format of the features.
+ * @return the confusion matrix.
+ */
+static cv::Mat
+compute_streamed_confusion_matrix(cv::Ptr<cv::ml::StatModel>& clsf,
+                                  const std::function<bool(cv::Mat&, cv::Mat&)>& next_batch,
+                                  const FeatureQuantizer& quantizer)
+{
+    MetricsAccumulator metrics(15);
+    cv::Mat X, y;
+    while (next_batch(X, y))
+        metrics.add(y, fsiv_predict_labels(clsf, X, quantizer));
+    return metrics.compute().confusion;
+}
+
+/**
+ * @brief Calibrate the threshold of a cascade classifier.
+ *
+ * @param cascade is the trained cascade.
+ * @param margins are the first stage margins of the validation samples.
+ * @param first_labels are the first stage labels.
+ * @param second_labels are the second stage labels.
+ * @param y are the validation labels.
+ * @param max_drop is the allowed accuracy drop.
+ */
+static void
+calibrate_cascade(CascadeClassifier& cascade, const cv::Mat& margins,
+                  const cv::Mat& first_labels, const cv::Mat& second_labels,
+                  const cv::Mat& y, float max_drop)
+{
+    const float escalated = cascade.calibrate(margins, first_labels, second_labels,
+                                              y, max_drop);
+    std::cout << "(cascade threshold " << cascade.get_threshold() << " escalates "
+              << 100.0 * escalated << "% of the validation samples) ";
+}
+
+/**
+ * @brief Fit a quantizer with the features of a sample of the dataset.
+ *
+ * @param quantizer is the quantizer to fit.
+ * @param X are the dataset samples.
+ * @param extractor is the (trained) features extractor.
+ * @param max_samples is the maximum number of rows (evenly spaced) used.
+ */
+static void
+fit_quantizer(FeatureQuantizer& quantizer, const cv::Mat& X,
+              cv::Ptr<FeaturesExtractor>& extractor, int max_samples = 2048)
+{
+    if (quantizer.is_fitted())
+        return;
+    const int step = std::max(1, X.rows / max_samples);
+    cv::Mat samples;
+    for (int i = 0; i < X.rows; i += step)
+        samples.push_back(X.row(i));
+    quantizer.fit(fsiv_extract_features(samples, extractor));
+}
+
 int
 main (int argc, char* const* argv)
 {
@@ -83,8 +313,10 @@ main (int argc, char* const* argv)
           return 0;
       }
 
+      int verbose = 0;
 #ifndef NDEBUG
       __Debug_Level = parser.get<int>("verbose");
+      verbose = __Debug_Level;
 #endif
       FEATURE_IDS feature_id = FEATURE_IDS(parser.get<int>("f"));
       std::vector<float> feature_params =
@@ -101,14 +333,38 @@ main (int argc, char* const* argv)
       std::cout << "model file "<< model_fname << "\n";
       int classifier = parser.get<int>("clf");
       int knn_K = parser.get<int>("knn_K");
+      int knn_M = parser.get<int>("knn_M");
+      int knn_efC = parser.get<int>("knn_efC");
+      int knn_ef = parser.get<int>("knn_ef");
+      PROTOTYPES_METHOD proto_method = PROTOTYPES_METHOD(parser.get<int>("proto"));
+      std::vector<int> proto_n;
+      for (float n : parse_feature_params(parser.get<std::string>("proto_n")))
+          proto_n.push_back(int(n));
+      bool proto_report = parser.get<bool>("proto_report");
+      int sgd_E = parser.get<int>("sgd_E");
+      float sgd_L = parser.get<float>("sgd_L");
+      int sgd_B = parser.get<int>("sgd_B");
+      float sgd_R = parser.get<float>("sgd_R");
       float svm_C = parser.get<float>("svm_C");
       int svm_K = parser.get<int>("svm_K");
       float svm_D = parser.get<float>("svm_D");
       float svm_G = parser.get<float>("svm_G");
+      int svm_cache = parser.get<int>("svm_cache");
       int rtrees_V = parser.get<int>("rtrees_V");
       int rtrees_T = parser.get<int>("rtrees_T");
       double rtrees_E = parser.get<double>("rtrees_E");
+      int forest_D = parser.get<int>("forest_D");
+      int forest_L = parser.get<int>("forest_L");
+      int forest_B = parser.get<int>("forest_B");
+      int casc_first = parser.get<int>("casc_first");
+      int casc_second = parser.get<int>("casc_second");
+      float casc_drop = parser.get<float>("casc_drop");
       float s_ratio = parser.get<float>("s_ratio");
+      int batch_size = parser.get<int>("batch");
+      FeatureQuantizer quantizer(FEATURE_PRECISION(parser.get<int>("fprec")));
+      std::string feature_store = parser.get<std::string>("fstore");
+      std::string profile_fname = parser.get<std::string>("profile");
+      std::string trace_fname = parser.get<std::string>("trace");
       size_t seed = parser.get<size_t>("rseed");
       if (!parser.check())
       {
@@ -117,115 +373,417 @@ main (int argc, char* const* argv)
       }
 
       std::cout.setf(std::ios::unitbuf);
+      Profiler::instance().set_enabled(!profile_fname.empty() || !trace_fname.empty());
 
       if (seed==0)
         seed = time(0);
       std::cout << "Set the random seed to: " << seed << std::endl;
       cv::theRNG().state = seed;
 
-      cv::Mat X_t, y_t, X_v, y_v;
-      cv::Mat X_s, y_s;
-
-      fsiv_load_dataset(train_path, X_t, y_t);
-      fsiv_subsample_dataset(X_t, y_t, X_s, y_s, s_ratio);
-
-      X_t = X_s;
-      y_t = y_s;
-
-      fsiv_load_dataset(valid_path, X_v, y_v);
-
-      std::cout << "Train partition with " << X_t.rows << " samples."
-                << std::endl;
-
-      if (validate>0)
-        std::cout << "Validation partition with "
-                    << (X_v.empty()?0:X_v.rows)
-                    << " samples." << std::endl;
+      // Creates a classifier given its id (nullptr if unknown).
+      std::function<cv::Ptr<cv::ml::StatModel>(int)> create_classifier;
+      create_classifier = [&](int id)
+      {
+          cv::Ptr<cv::ml::StatModel> clsf;
+          if (id == 0)
+          {
+            std::cout << "Using a K-NN classifier with k=" << knn_K << std::endl;
+              clsf = fsiv_create_knn_classifier(knn_K);
+          }
+          else if (id == 1)
+          {
+            std::cout << "Using a SVM classifier with K=" << svm_K
+                          << " C=" << svm_C << " D=" << svm_D << " G=" << svm_G
+                          << std::endl;
+              clsf = fsiv_create_svm_classifier(svm_K, svm_C, svm_D, svm_G);
+          }
+          else if (id == 2)
+          {
+            std::cout << "Using a RTrees classifier with V=" << rtrees_V
+                          << " T=" << rtrees_T << " E=" << rtrees_E
+                          << std::endl;
+              clsf = fsiv_create_rtrees_classifier(rtrees_V, rtrees_T, rtrees_E);
+          }
+          else if (id == 3)
+          {
+            std::cout << "Using an exact K-NN classifier with k=" << knn_K << std::endl;
+              clsf = fsiv_create_exact_knn_classifier(knn_K);
+          }
+          else if (id == 4)
+          {
+            std::cout << "Using a HNSW K-NN classifier with k=" << knn_K << " M=" << knn_M
+                      << " efC=" << knn_efC << " ef=" << knn_ef << std::endl;
+              clsf = fsiv_create_hnsw_knn_classifier(knn_K, knn_M, knn_efC, knn_ef);
+          }
+          else if (id == 5)
+          {
+            std::cout << "Using a linear SGD classifier with E=" << sgd_E << " L=" << sgd_L
+                      << " B=" << sgd_B << " R=" << sgd_R << std::endl;
+              clsf = fsiv_create_linear_sgd_classifier(sgd_E, sgd_L, sgd_B, sgd_R);
+          }
+          else if (id == 6)
+          {
+            std::cout << "Using a one-vs-rest SVM classifier with K=" << svm_K
+                      << " C=" << svm_C << " D=" << svm_D << " G=" << svm_G
+                      << " cache=" << svm_cache << "Mb" << std::endl;
+              clsf = fsiv_create_ovr_svm_classifier(svm_K, svm_C, svm_D, svm_G, svm_cache);
+          }
+          else if (id == 7)
+          {
+            std::cout << "Using a flat forest classifier with V=" << rtrees_V
+                      << " T=" << rtrees_T << " D=" << forest_D << " L=" << forest_L
+                      << " B=" << forest_B << std::endl;
+              clsf = fsiv_create_flat_forest_classifier(rtrees_V, rtrees_T, forest_D,
+                                                        forest_L, forest_B);
+          }
+          else if (id == 8)
+          {
+            std::cout << "Using a cascade classifier with first stage " << casc_first
+                      << ", second stage " << casc_second << " and max accuracy drop "
+                      << casc_drop << ":" << std::endl;
+              if (casc_first == 8 || casc_second == 8)
+                  return cv::Ptr<cv::ml::StatModel>();
+              cv::Ptr<cv::ml::StatModel> first = create_classifier(casc_first);
+              cv::Ptr<cv::ml::StatModel> second = create_classifier(casc_second);
+              if (first && second)
+                  clsf = fsiv_create_cascade_classifier(first, second);
+          }
+          return clsf;
+      };
+
+      cv::Ptr<cv::ml::StatModel> clsf = create_classifier(classifier);
+      if (clsf == nullptr)
+      {
+          std::cerr << "Error: unknown classifier." << std::endl;
+          return EXIT_FAILURE;
+      }
+      CascadeClassifier *cascade = dynamic_cast<CascadeClassifier*>(clsf.get());
       std::cout << std::endl;
 
       auto extractor = FeaturesExtractor::create(feature_id);
-      extractor->set_params(feature_params);   
+      extractor->set_params(feature_params);
       std::cout << "Feature extractor: " << extractor->get_extractor_name()
                 << std::endl;
       std::cout << "Feature extractor params: " << extractor->get_params()
                 << std::endl;
-      std::cout << "Training feature extractor ... " << std::endl;
-      extractor->train(X_t);
-      std::cout << "Done." << std::endl;
-      std::cout << "Extracting features ... " << std::endl;
-      X_t = fsiv_extract_features(X_t, extractor);
-      if (!X_v.empty())
-          X_v = fsiv_extract_features(X_v, extractor);
-
-      std::cout << "done." << std::endl;
-      std::cout << "Extracted features use " <<
-                   ((X_t.rows*X_t.cols*X_t.elemSize())+
-                   (X_v.empty() ? 0 : ((X_v.rows*X_v.cols*X_v.elemSize()))))/(1024*1024)
-                << " Mb of memory." << std::endl;
-      std::cout << std::endl;
 
-      cv::Ptr<cv::ml::StatModel> clsf;
-      if (classifier == 0)
-      {
-        std::cout << "Using a K-NN classifier with k=" << knn_K << std::endl;
-          clsf = fsiv_create_knn_classifier(knn_K);
-      }
-      else if (classifier == 1)
-      {
-        std::cout << "Using a SVM classifier with K=" << svm_K
-                      << " C=" << svm_C << " D=" << svm_D << " G=" << svm_G
-                      << std::endl;
-          clsf = fsiv_create_svm_classifier(svm_K, svm_C, svm_D, svm_G);
-      }
-      else if (classifier == 2)
+      cv::Mat X_t, y_t, X_v, y_v;
+      cv::Mat X_s, y_s;
+      cv::Mat predict_labels, cmat;
+      float acc = 0.0;
+
+      if (batch_size > 0)
       {
-        std::cout << "Using a RTrees classifier with V=" << rtrees_V
-                      << " T=" << rtrees_T << " E=" << rtrees_E
-                      << std::endl;
-          clsf = fsiv_create_rtrees_classifier(rtrees_V, rtrees_T, rtrees_E);
+          // Stream the datasets. Only the current batches are in memory,
+          // plus the extracted features if the classifier can not be
+          // trained with batches.
+          DatasetReader train_reader(train_path, batch_size, false, 2, verbose);
+          std::cout << "Train partition with " << train_reader.size()
+                    << " samples in batches of " << batch_size << "."
+                    << std::endl;
+          if (!feature_store.empty())
+              std::cerr << "Warning: the feature store is not used with batches."
+                        << std::endl;
+          if (proto_report)
+              std::cerr << "Warning: the prototypes trade-off is not reported with "
+                           "batches." << std::endl;
+
+          // The s_ratio subsample is drawn once, so every pass (the SGD
+          // epochs and the training accuracy) sees the same train samples.
+          std::vector<char> train_mask(train_reader.size(), 0);
+          {
+              std::vector<int> idxs(train_mask.size());
+              for (size_t i = 0; i < idxs.size(); ++i)
+                  idxs[i] = int(i);
+              cv::randShuffle(idxs);
+              const size_t subsample_size = size_t(idxs.size() * s_ratio);
+              for (size_t i = 0; i < subsample_size; ++i)
+                  train_mask[idxs[i]] = 1;
+          }
+          int train_cursor = 0;
+          auto rewind_train = [&]()
+          {
+              train_reader.rewind();
+              train_cursor = 0;
+          };
+          std::cout << std::endl;
+
+          std::cout << "Training feature extractor with the first batch ... " << std::endl;
+          if (train_reader.next(X_s, y_s))
+          {
+              ScopedTimer timer("extractor_train");
+              extractor->train(X_s);
+              fit_quantizer(quantizer, X_s, extractor);
+          }
+          rewind_train();
+          std::cout << "Done." << std::endl;
+
+          auto next_train_batch = [&](cv::Mat &X, cv::Mat &y)
+          {
+              cv::Mat X_b, y_b;
+              while (train_reader.next(X_b, y_b))
+              {
+                  X.release();
+                  y.release();
+                  for (int i = 0; i < X_b.rows; ++i)
+                      if (train_mask[train_cursor + i])
+                      {
+                          X.push_back(X_b.row(i));
+                          y.push_back(y_b.row(i));
+                      }
+                  train_cursor += X_b.rows;
+                  if (X.rows > 0)
+                  {
+                      ScopedTimer timer("extract");
+                      X = fsiv_extract_features(X, extractor, nullptr, &quantizer);
+                      return true;
+                  }
+              }
+              return false;
+          };
+
+          // The "extract" phases of the batches are nested in "train" and
+          // "predict" (the profile subtracts them in self_seconds).
+          std::cout << "Training ... ";
+          ScopedTimer train_timer("train");
+          if (fsiv_get_batch_trainable(clsf) != nullptr)
+              fsiv_train_classifier_batches(clsf, [&](cv::Mat &X, cv::Mat &y)
+                                            {
+                                                cv::Mat X_q;
+                                                if (!next_train_batch(X_q, y))
+                                                    return false;
+                                                quantizer.decode(X_q, X);
+                                                return true;
+                                            },
+                                            rewind_train);
+          else
+          {
+              while (next_train_batch(X_s, y_s))
+              {
+                  X_t.push_back(X_s);
+                  y_t.push_back(y_s);
+              }
+              std::cout << "(extracted features use "
+                        << (X_t.rows * X_t.cols * X_t.elemSize()) / (1024 * 1024)
+                        << " Mb of memory) ";
+              Profiler::instance().set_counter(
+                  "features_mb", (X_t.rows * X_t.cols * X_t.elemSize()) / (1024.0 * 1024.0));
+              cv::Mat P, P_labels;
+              condense_train_samples(clsf, X_t, y_t, quantizer, proto_method, proto_n,
+                                     P, P_labels);
+              fsiv_train_classifier(clsf, P, P_labels, quantizer);
+          }
+          train_timer.stop();
+          std::cout << "done." << std::endl;
+
+          std::cout << "Computing training accuracy ... ";
+          rewind_train();
+          ScopedTimer train_predict_timer("predict");
+          cmat = compute_streamed_confusion_matrix(clsf, next_train_batch, quantizer);
+          train_predict_timer.stop();
+          acc = fsiv_compute_accuracy(cmat);
+          std::cout << "done." << std::endl;
+          std::cout << "Training accuracy: " << acc << std::endl;
+          std::cout << std::endl;
+
+          if (validate>0.0)
+          {
+              std::cout << "Validating ... ";
+              DatasetReader valid_reader(valid_path, batch_size, false, 2, verbose);
+              auto next_valid_batch = [&](cv::Mat &X, cv::Mat &y)
+              {
+                  if (!valid_reader.next(X, y))
+                      return false;
+                  ScopedTimer timer("extract");
+                  X = fsiv_extract_features(X, extractor, nullptr, &quantizer);
+                  return true;
+              };
+              if (cascade != nullptr)
+              {
+                  cv::Mat first_labels, margins, second_labels, y;
+                  cv::Mat f_b, m_b, s_b, X, y_b;
+                  while (next_valid_batch(X, y_b))
+                  {
+                      cascade->predict_stages(X, quantizer, f_b, m_b, s_b);
+                      first_labels.push_back(f_b);
+                      margins.push_back(m_b);
+                      second_labels.push_back(s_b);
+                      y.push_back(y_b);
+                  }
+                  calibrate_cascade(*cascade, margins, first_labels, second_labels, y,
+                                    casc_drop);
+                  valid_reader.rewind();
+              }
+              ScopedTimer valid_predict_timer("predict");
+              cmat = compute_streamed_confusion_matrix(clsf, next_valid_batch, quantizer);
+              valid_predict_timer.stop();
+              std::cout << "done." << std::endl;
+              acc = fsiv_compute_accuracy(cmat);
+              std::cout << "Validation accuracy: " << acc << std::endl;
+              std::cout << std::endl;
+          }
       }
       else
       {
-          std::cerr << "Error: unknown classifier." << std::endl;
-          return EXIT_FAILURE;
-      }
+          ScopedTimer load_timer("load");
+          fsiv_load_dataset(train_path, X_t, y_t, false, verbose);
+          fsiv_subsample_dataset(X_t, y_t, X_s, y_s, s_ratio);
 
+          X_t = X_s;
+          y_t = y_s;
 
-      std::cout << std::endl;
-      std::cout << "Training ... ";
-      fsiv_train_classifier(clsf, X_t, y_t);      
-      std::cout << "done." << std::endl;
+          fsiv_load_dataset(valid_path, X_v, y_v, false, verbose);
+          load_timer.stop();
+          Profiler::instance().set_counter("train_samples", X_t.rows);
+          Profiler::instance().set_counter("valid_samples", X_v.rows);
 
+          std::cout << "Train partition with " << X_t.rows << " samples."
+                    << std::endl;
 
-      std::cout << "Computing training accuracy ... ";
-      cv::Mat predict_labels = fsiv_predict_labels(clsf, X_t);
-      cv::Mat cmat = fsiv_compute_confusion_matrix(y_t, predict_labels, 15);
-      float acc = fsiv_compute_accuracy(cmat);      
-      std::cout << "done." << std::endl;
-      std::cout << "Training accuracy: " << acc << std::endl;
-      std::cout << std::endl;
+          if (validate>0)
+            std::cout << "Validation partition with "
+                        << (X_v.empty()?0:X_v.rows)
+                        << " samples." << std::endl;
+          std::cout << std::endl;
 
-      if (validate>0.0)
-      {
-          std::cout << "Validating ... ";
-          predict_labels = fsiv_predict_labels(clsf, X_v);
+          std::cout << "Training feature extractor ... " << std::endl;
+          ScopedTimer extractor_timer("extractor_train");
+          extractor->train(X_t);
+          fit_quantizer(quantizer, X_t, extractor);
+          extractor_timer.stop();
+          std::cout << "Done." << std::endl;
+          std::cout << "Extracting features ... " << std::endl;
+          ScopedTimer extract_timer("extract");
+          if (!feature_store.empty())
+          {
+              // The train samples depend on the dataset files and the
+              // subsample, which is fixed by the random seed.
+              std::uint64_t train_key = fsiv_compute_dataset_fingerprint(train_path);
+              train_key = fsiv_hash_value(std::uint64_t(seed), train_key);
+              train_key = fsiv_hash_value(s_ratio, train_key);
+              bool hit = false;
+              X_t = fsiv_extract_features_stored(X_t, y_t, extractor, feature_store,
+                                                 train_key, &hit);
+              std::cout << "Train features " << (hit ? "loaded from" : "saved to")
+                        << " the store '" << feature_store << "'." << std::endl;
+              if (!X_v.empty())
+              {
+                  X_v = fsiv_extract_features_stored(X_v, y_v, extractor, feature_store,
+                                                     fsiv_compute_dataset_fingerprint(valid_path),
+                                                     &hit);
+                  std::cout << "Validation features " << (hit ? "loaded from" : "saved to")
+                            << " the store '" << feature_store << "'." << std::endl;
+              }
+              // The store keeps float32 features.
+              if (quantizer.get_type() != CV_32FC1)
+              {
+                  cv::Mat X_q;
+                  quantizer.encode(X_t, X_q);
+                  X_t = X_q;
+                  if (!X_v.empty())
+                  {
+                      quantizer.encode(X_v, X_q);
+                      X_v = X_q;
+                  }
+              }
+          }
+          else
+          {
+              FeatureExtractionStats stats;
+              X_t = fsiv_extract_features(X_t, extractor, &stats, &quantizer);
+              std::cout << "Train features: " << stats << "." << std::endl;
+              if (!X_v.empty())
+              {
+                  X_v = fsiv_extract_features(X_v, extractor, &stats, &quantizer);
+                  std::cout << "Validation features: " << stats << "." << std::endl;
+              }
+          }
+
+          extract_timer.stop();
           std::cout << "done." << std::endl;
-          cmat = fsiv_compute_confusion_matrix(y_v, predict_labels, 15);
-          acc = fsiv_compute_accuracy(cmat);
-          std::cout << "Validation accuracy: " << acc << std::endl;
+          const size_t features_size = (X_t.rows*X_t.cols*X_t.elemSize())+
+                       (X_v.empty() ? 0 : ((X_v.rows*X_v.cols*X_v.elemSize())));
+          std::cout << "Extracted features use " << features_size/(1024*1024)
+                    << " Mb of memory." << std::endl;
+          Profiler::instance().set_counter("features_mb", features_size / (1024.0 * 1024.0));
+          std::cout << std::endl;
+
+          if (proto_report && fsiv_is_knn_classifier(clsf))
+          {
+              if (validate > 0.0 && !X_v.empty())
+                  report_prototypes_tradeoff(
+                      clsf, X_t, y_t, X_v, y_v, quantizer,
+                      proto_method == FSIV_PROTOTYPES_NONE ? FSIV_PROTOTYPES_KMEANS : proto_method,
+                      proto_n, model_fname);
+              else
+                  std::cerr << "Warning: the prototypes trade-off needs a validation "
+                               "partition." << std::endl;
+          }
+
+          std::cout << "Training ... ";
+          ScopedTimer train_timer("train");
+          cv::Mat P, P_labels;
+          condense_train_samples(clsf, X_t, y_t, quantizer, proto_method, proto_n,
+                                 P, P_labels);
+          fsiv_train_classifier(clsf, P, P_labels, quantizer);
+          train_timer.stop();
+          std::cout << "done." << std::endl;
+
+
+          std::cout << "Computing training accuracy ... ";
+          ScopedTimer train_predict_timer("predict");
+          predict_labels = fsiv_predict_labels(clsf, X_t, quantizer);
+          train_predict_timer.stop();
+          ScopedTimer train_metrics_timer("metrics");
+          cmat = fsiv_compute_confusion_matrix(y_t, predict_labels, 15);
+          acc = fsiv_compute_accuracy(cmat);      
+          train_metrics_timer.stop();
+          std::cout << "done." << std::endl;
+          std::cout << "Training accuracy: " << acc << std::endl;
           std::cout << std::endl;
+
+          if (validate>0.0)
+          {
+              std::cout << "Validating ... ";
+              if (cascade != nullptr)
+              {
+                  cv::Mat first_labels, margins, second_labels;
+                  cascade->predict_stages(X_v, quantizer, first_labels, margins,
+                                          second_labels);
+                  calibrate_cascade(*cascade, margins, first_labels, second_labels, y_v,
+                                    casc_drop);
+              }
+              ScopedTimer valid_predict_timer("predict");
+              predict_labels = fsiv_predict_labels(clsf, X_v, quantizer);
+              valid_predict_timer.stop();
+              std::cout << "done." << std::endl;
+              ScopedTimer valid_metrics_timer("metrics");
+              cmat = fsiv_compute_confusion_matrix(y_v, predict_labels, 15);
+              acc = fsiv_compute_accuracy(cmat);
+              valid_metrics_timer.stop();
+              std::cout << "Validation accuracy: " << acc << std::endl;
+              std::cout << std::endl;
+          }
       }
 
       std::cout << "Saving the model to '" << model_fname << "'." << std::endl;
       
-      // save the classifier's model
-      fsiv_save_classifier_model(clsf, model_fname);
-
-      // save the feature extractor model
-      extractor->save_model(model_fname);
-      cv::FileStorage fs(model_fname, cv::FileStorage::APPEND);
-      fs << "fsiv_random_seed" << static_cast<double>(seed);
-      fs.release();
+      // save the classifier, the feature extractor and the metadata into
+      // a model file.
+      ScopedTimer save_timer("save");
+      ModelFileWriter model_file(model_fname);
+      fsiv_save_classifier_model(clsf, model_file);
+      extractor->write_model(model_file.metadata());
+      model_file.metadata() << "fsiv_random_seed" << static_cast<double>(seed);
+      quantizer.write(model_file.metadata());
+      const bool saved = model_file.close();
+      save_timer.stop();
+      if (!saved)
+      {
+          std::cerr << "Error: could not write the model to '" << model_fname
+                    << "'." << std::endl;
+          return EXIT_FAILURE;
+      }
 
       // compute model size
       size_t model_size = 0;
@@ -238,9 +796,12 @@ main (int argc, char* const* argv)
           << size_score << std::endl;
         std::cout << "Predicted final score 2*(acc*size_score)/(acc+size_score) = " 
           <<  (2.0*acc*size_score)/(acc+size_score) << std::endl;
+        Profiler::instance().set_counter("model_mb", model_size_mb);
       }
       else
         throw std::runtime_error("Error: could not open the file " + model_fname);                  
+      Profiler::instance().set_counter("accuracy", acc);
+      fsiv_write_profile_reports(profile_fname, trace_fname, "train_clf");
   }
   catch (std::exception& e)
   {
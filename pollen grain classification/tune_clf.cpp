@@ -0,0 +1,527 @@
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <time.h>
+#include <stdlib.h>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/ml.hpp>
+
+#include "common_code.hpp"
+
+#ifndef NDEBUG
+int __Debug_Level = 0;
+#endif
+
+const char* keys =
+    "{help h usage ? |      | print this message   }"
+    "{rseed        |0     | Use this value as random seed. Default 0 means use time(0)}"
+    "{s_ratio      |0.5   | Use a subsample ratio size of the dataset. Default 50% of the dataset.}"
+    "{f            |1     | Feature to extract (see train_clf).}"
+    "{f_params     |0     | Feature extractor parameters (see train_clf).}"
+    "{fprec        |0     | Precision used to store the extracted features (see train_clf).}"
+    "{clf          |0     | Classifiers to tune, e.g. \"0 1 2\". 0: K-NN, 1:SVM, 2:RTREES, "
+    "3: exact K-NN, 4: HNSW K-NN, 5: linear SGD, 6: one-vs-rest SVM (uses the svm_* values), "
+    "7: flat forest (uses rtrees_V, rtrees_T and forest_*).}"
+    "{knn_K        |1 3 5 7 9 | Values of K for K-NN classes.}"
+    "{knn_M        |16    | Values of the links by node of the HNSW index.}"
+    "{knn_efC      |200   | Values of the HNSW beam size to build.}"
+    "{knn_ef       |64    | Values of the HNSW beam size to predict.}"
+    "{sgd_E        |10    | Values of the epochs of the linear SGD classifier.}"
+    "{sgd_L        |0.01 0.1 | Values of the AdaGrad learning rate of the linear SGD classifier.}"
+    "{sgd_B        |256   | Values of the mini-batch size of the linear SGD classifier.}"
+    "{sgd_R        |0.00001 0.0001 0.001 | Values of the L2 weight of the linear SGD classifier.}"
+    "{svm_C        |0.1 1 10 100 | Values of C for SVM class.}"
+    "{svm_K        |2     | SVM kernels (see train_clf).}"
+    "{svm_D        |3.0   | Values of the degree of svm polynomial kernel.}"
+    "{svm_G        |0.01 0.1 1 | Values of gamma for svm RBF kernel.}"
+    "{svm_cache    |256   | Kernel cache (Mb) of each one-vs-rest SVM being trained.}"
+    "{rtrees_V     |0     | Values of the num of random features sampled per node.}"
+    "{rtrees_T     |25 50 100 | Values of the max num. of rtrees in the forest.}"
+    "{rtrees_E     |0.1   | Values of the OOB error to stop adding more rtrees.}"
+    "{forest_D     |0     | Values of the max depth of the flat forest trees (0 no limit).}"
+    "{forest_L     |1 5   | Values of the min samples by leaf of the flat forest trees.}"
+    "{forest_B     |256   | Values of the max bins by feature of the flat forest.}"
+    "{folds        |5     | Number of stratified folds.}"
+    "{halving      |0     | Successive halving factor. Default 0 evaluates all the configurations "
+    "on all the folds. A value eta>=2 evaluates them on one fold and keeps the best 1/eta "
+    "for eta times more folds, until all the folds are used.}"
+    "{results      |tune_results.txt | Filename of the ranked results table.}"
+    "{@train_path  |<none>| Train dataset pathname.}"
+    "{@model       |<none>| Filename where the best model is saved.}"
+#ifndef NDEBUG
+    "{verbose        |0     | Set the verbose level.}"
+#endif
+    ;
+
+std::vector<float>
+parse_values(const std::string& values)
+{
+    std::vector<float> parsed;
+    std::istringstream in (values);
+    float v;
+    while (in)
+    {
+        in >> v;
+        if (in)
+            parsed.push_back(v);
+    }
+    return parsed;
+}
+
+/**
+ * @brief Hyperparameters of a classifier configuration.
+ */
+struct ClassifierConfig
+{
+    int clf = 0;
+    int knn_K = 1;
+    int knn_M = 16;
+    int knn_efC = 200;
+    int knn_ef = 64;
+    float svm_C = 1.0f;
+    int svm_K = 0;
+    float svm_D = 3.0f;
+    float svm_G = 1.0f;
+    int svm_cache = 256;
+    int rtrees_V = 0;
+    int rtrees_T = 50;
+    float rtrees_E = 0.1f;
+    int forest_D = 0;
+    int forest_L = 1;
+    int forest_B = 256;
+    int sgd_E = 10;
+    float sgd_L = 0.1f;
+    int sgd_B = 256;
+    float sgd_R = 1.0e-4f;
+
+    /**
+     * @brief Create the untrained classifier.
+     */
+    cv::Ptr<cv::ml::StatModel> create() const
+    {
+        switch (clf)
+        {
+        case 0:
+            return fsiv_create_knn_classifier(knn_K);
+        case 1:
+            return fsiv_create_svm_classifier(svm_K, svm_C, svm_D, svm_G);
+        case 2:
+            return fsiv_create_rtrees_classifier(rtrees_V, rtrees_T, rtrees_E);
+        case 3:
+            return fsiv_create_exact_knn_classifier(knn_K);
+        case 4:
+            return fsiv_create_hnsw_knn_classifier(knn_K, knn_M, knn_efC, knn_ef);
+        case 5:
+            return fsiv_create_linear_sgd_classifier(sgd_E, sgd_L, sgd_B, sgd_R);
+        case 6:
+            return fsiv_create_ovr_svm_classifier(svm_K, svm_C, svm_D, svm_G, svm_cache);
+        case 7:
+            return fsiv_create_flat_forest_classifier(rtrees_V, rtrees_T, forest_D, forest_L,
+                                                      forest_B);
+        default:
+            throw std::runtime_error("Unknown classifier: " + std::to_string(clf));
+        }
+    }
+
+    /**
+     * @brief Get the train_clf arguments of the configuration.
+     */
+    std::string to_string() const
+    {
+        std::ostringstream out;
+        out << "-clf=" << clf;
+        if (clf == 0 || clf == 3 || clf == 4)
+            out << " -knn_K=" << knn_K;
+        if (clf == 4)
+            out << " -knn_M=" << knn_M << " -knn_efC=" << knn_efC << " -knn_ef=" << knn_ef;
+        if (clf == 1 || clf == 6)
+            out << " -svm_K=" << svm_K << " -svm_C=" << svm_C << " -svm_D=" << svm_D
+                << " -svm_G=" << svm_G;
+        if (clf == 6)
+            out << " -svm_cache=" << svm_cache;
+        if (clf == 2)
+            out << " -rtrees_V=" << rtrees_V << " -rtrees_T=" << rtrees_T
+                << " -rtrees_E=" << rtrees_E;
+        if (clf == 7)
+            out << " -rtrees_V=" << rtrees_V << " -rtrees_T=" << rtrees_T
+                << " -forest_D=" << forest_D << " -forest_L=" << forest_L
+                << " -forest_B=" << forest_B;
+        if (clf == 5)
+            out << " -sgd_E=" << sgd_E << " -sgd_L=" << sgd_L << " -sgd_B=" << sgd_B
+                << " -sgd_R=" << sgd_R;
+        return out.str();
+    }
+};
+
+/**
+ * @brief Cross validation results of a configuration.
+ */
+struct ConfigResult
+{
+    ClassifierConfig config;
+    std::vector<float> accuracies; // by evaluated fold.
+    double seconds = 0.0;          // train and predict wall time.
+
+    double mean() const
+    {
+        double sum = 0.0;
+        for (float acc : accuracies)
+            sum += acc;
+        return accuracies.empty() ? 0.0 : sum / accuracies.size();
+    }
+
+    double stddev() const
+    {
+        const double m = mean();
+        double sum = 0.0;
+        for (float acc : accuracies)
+            sum += (acc - m) * (acc - m);
+        return accuracies.size() < 2 ? 0.0 : std::sqrt(sum / (accuracies.size() - 1));
+    }
+};
+
+/**
+ * @brief Expand the parameter lists into the configurations grid.
+ */
+static std::vector<ConfigResult>
+make_grid(const cv::CommandLineParser& parser)
+{
+    auto values = [&](const char* key)
+    {
+        std::vector<float> v = parse_values(parser.get<std::string>(key));
+        if (v.empty())
+            throw std::runtime_error(std::string("Expected at least a value for ") + key);
+        return v;
+    };
+
+    std::vector<ConfigResult> grid;
+    ConfigResult r;
+    r.config.svm_cache = parser.get<int>("svm_cache");
+    for (float clf : values("clf"))
+    {
+        r.config.clf = int(clf);
+        if (r.config.clf == 1 || r.config.clf == 6)
+            for (float K : values("svm_K"))
+                for (float C : values("svm_C"))
+                    for (float D : values("svm_D"))
+                        for (float G : values("svm_G"))
+                        {
+                            r.config.svm_K = int(K);
+                            r.config.svm_C = C;
+                            r.config.svm_D = D;
+                            r.config.svm_G = G;
+                            grid.push_back(r);
+                        }
+        else if (r.config.clf == 2)
+            for (float V : values("rtrees_V"))
+                for (float T : values("rtrees_T"))
+                    for (float E : values("rtrees_E"))
+                    {
+                        r.config.rtrees_V = int(V);
+                        r.config.rtrees_T = int(T);
+                        r.config.rtrees_E = E;
+                        grid.push_back(r);
+                    }
+        else if (r.config.clf == 7)
+            for (float V : values("rtrees_V"))
+                for (float T : values("rtrees_T"))
+                    for (float D : values("forest_D"))
+                        for (float L : values("forest_L"))
+                            for (float B : values("forest_B"))
+                            {
+                                r.config.rtrees_V = int(V);
+                                r.config.rtrees_T = int(T);
+                                r.config.forest_D = int(D);
+                                r.config.forest_L = int(L);
+                                r.config.forest_B = int(B);
+                                grid.push_back(r);
+                            }
+        else if (r.config.clf == 4)
+            for (float K : values("knn_K"))
+                for (float M : values("knn_M"))
+                    for (float efC : values("knn_efC"))
+                        for (float ef : values("knn_ef"))
+                        {
+                            r.config.knn_K = int(K);
+                            r.config.knn_M = int(M);
+                            r.config.knn_efC = int(efC);
+                            r.config.knn_ef = int(ef);
+                            grid.push_back(r);
+                        }
+        else if (r.config.clf == 5)
+            for (float E : values("sgd_E"))
+                for (float L : values("sgd_L"))
+                    for (float B : values("sgd_B"))
+                        for (float R : values("sgd_R"))
+                        {
+                            r.config.sgd_E = int(E);
+                            r.config.sgd_L = L;
+                            r.config.sgd_B = int(B);
+                            r.config.sgd_R = R;
+                            grid.push_back(r);
+                        }
+        else if (r.config.clf == 0 || r.config.clf == 3)
+            for (float K : values("knn_K"))
+            {
+                r.config.knn_K = int(K);
+                grid.push_back(r);
+            }
+        else
+            throw std::runtime_error("Unknown classifier: " + std::to_string(r.config.clf));
+    }
+    return grid;
+}
+
+/**
+ * @brief Evaluate some configurations with a fold.
+ *
+ * The fold partitions are built once and shared (read only) by the
+ * workers, each one training and validating a configuration.
+ *
+ * @param results are the configurations results. The fold accuracy is
+ * appended to the evaluated ones.
+ * @param alive are the indices of the configurations to evaluate.
+ * @param X are the features.
+ * @param y are the labels.
+ * @param folds is the fold of each sample.
+ * @param fold is the validation fold.
+ * @param quantizer is the format of the features.
+ * @param seed is the random seed.
+ */
+static void
+evaluate_fold(std::vector<ConfigResult>& results, const std::vector<int>& alive,
+              const cv::Mat& X, const cv::Mat& y, const cv::Mat& folds, int fold,
+              const FeatureQuantizer& quantizer, size_t seed)
+{
+    const int n_valid = cv::countNonZero(folds == fold);
+    cv::Mat X_t(X.rows - n_valid, X.cols, X.type()), y_t(X.rows - n_valid, 1, CV_32SC1);
+    cv::Mat X_v(n_valid, X.cols, X.type()), y_v(n_valid, 1, CV_32SC1);
+    for (int i = 0, t = 0, v = 0; i < X.rows; ++i)
+    {
+        if (folds.at<int>(i) == fold)
+        {
+            X.row(i).copyTo(X_v.row(v));
+            y_v.at<int>(v++) = y.at<int>(i);
+        }
+        else
+        {
+            X.row(i).copyTo(X_t.row(t));
+            y_t.at<int>(t++) = y.at<int>(i);
+        }
+    }
+
+    // A configuration by stripe. The classifiers' own parallel loops run
+    // serially inside the workers.
+    cv::parallel_for_(cv::Range(0, int(alive.size())), [&](const cv::Range& range)
+    {
+        for (int j = range.start; j < range.end; ++j)
+        {
+            ConfigResult& r = results[alive[j]];
+            cv::theRNG().state = seed + alive[j];
+            const int64 t0 = cv::getTickCount();
+            cv::Ptr<cv::ml::StatModel> clsf = r.config.create();
+            fsiv_train_classifier(clsf, X_t, y_t, quantizer);
+            cv::Mat predict_labels = fsiv_predict_labels(clsf, X_v, quantizer);
+            r.seconds += (cv::getTickCount() - t0) / cv::getTickFrequency();
+            r.accuracies.push_back(fsiv_compute_accuracy(
+                fsiv_compute_confusion_matrix(y_v, predict_labels, 15)));
+        }
+    }, double(alive.size()));
+}
+
+/**
+ * @brief Sort the configurations by evaluated folds and mean accuracy.
+ */
+static void
+rank_results(std::vector<ConfigResult>& results, std::vector<int>& order)
+{
+    std::sort(order.begin(), order.end(), [&](int a, int b)
+    {
+        if (results[a].accuracies.size() != results[b].accuracies.size())
+            return results[a].accuracies.size() > results[b].accuracies.size();
+        return results[a].mean() > results[b].mean();
+    });
+}
+
+/**
+ * @brief Write the ranked results table.
+ */
+static void
+write_results(std::ostream& out, std::vector<ConfigResult>& results,
+              const std::vector<int>& order)
+{
+    out << "rank\tmean acc.\tstd acc.\tfolds\tseconds\tparameters" << std::endl;
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        const ConfigResult& r = results[order[i]];
+        out << (i + 1) << "\t" << r.mean() << "\t" << r.stddev() << "\t"
+            << r.accuracies.size() << "\t" << r.seconds << "\t"
+            << r.config.to_string() << std::endl;
+    }
+}
+
+int
+main (int argc, char* const* argv)
+{
+  int retCode=EXIT_SUCCESS;
+
+  try {
+
+      cv::CommandLineParser parser(argc, argv, keys);
+      parser.about("Tune the classifier hyperparameters with stratified k-fold "
+                   "cross validation using the BAA500 pollen dataset.");
+      if (parser.has("help"))
+      {
+          parser.printMessage();
+          return 0;
+      }
+
+      int verbose = 0;
+#ifndef NDEBUG
+      __Debug_Level = parser.get<int>("verbose");
+      verbose = __Debug_Level;
+#endif
+      FEATURE_IDS feature_id = FEATURE_IDS(parser.get<int>("f"));
+      std::vector<float> feature_params = parse_values(parser.get<std::string>("f_params"));
+      std::string train_path = parser.get<std::string>("@train_path");
+      std::string model_fname = parser.get<std::string>("@model");
+      float s_ratio = parser.get<float>("s_ratio");
+      FeatureQuantizer quantizer(FEATURE_PRECISION(parser.get<int>("fprec")));
+      int n_folds = parser.get<int>("folds");
+      int eta = parser.get<int>("halving");
+      std::string results_fname = parser.get<std::string>("results");
+      size_t seed = parser.get<size_t>("rseed");
+      if (!parser.check())
+      {
+          parser.printErrors();
+          return 0;
+      }
+      if (n_folds < 2)
+      {
+          std::cerr << "Error: at least 2 folds are needed." << std::endl;
+          return EXIT_FAILURE;
+      }
+
+      std::cout.setf(std::ios::unitbuf);
+
+      if (seed==0)
+        seed = time(0);
+      std::cout << "Set the random seed to: " << seed << std::endl;
+      cv::theRNG().state = seed;
+
+      std::vector<ConfigResult> results = make_grid(parser);
+      std::cout << "Tuning " << results.size() << " configurations with "
+                << n_folds << " stratified folds";
+      if (eta >= 2)
+          std::cout << " and successive halving (eta=" << eta << ")";
+      std::cout << "." << std::endl;
+
+      auto extractor = FeaturesExtractor::create(feature_id);
+      extractor->set_params(feature_params);
+      std::cout << "Feature extractor: " << extractor->get_extractor_name()
+                << std::endl;
+      std::cout << "Feature extractor params: " << extractor->get_params()
+                << std::endl;
+
+      // The features are extracted once, all the folds and configurations
+      // share them.
+      cv::Mat X, y, X_s, y_s;
+      fsiv_load_dataset(train_path, X, y, false, verbose);
+      fsiv_subsample_dataset(X, y, X_s, y_s, s_ratio);
+      X.release();
+      std::cout << "Train partition with " << X_s.rows << " samples." << std::endl;
+      std::cout << "Training feature extractor ... " << std::endl;
+      extractor->train(X_s);
+      if (!quantizer.is_fitted())
+      {
+          const int step = std::max(1, X_s.rows / 2048);
+          cv::Mat samples;
+          for (int i = 0; i < X_s.rows; i += step)
+              samples.push_back(X_s.row(i));
+          quantizer.fit(fsiv_extract_features(samples, extractor));
+      }
+      std::cout << "Done." << std::endl;
+      FeatureExtractionStats stats;
+      X = fsiv_extract_features(X_s, extractor, &stats, &quantizer);
+      y = y_s;
+      X_s.release();
+      std::cout << "Train features: " << stats << "." << std::endl;
+      std::cout << std::endl;
+
+      const cv::Mat folds = fsiv_make_stratified_folds(y, n_folds);
+      std::vector<int> alive(results.size());
+      for (size_t i = 0; i < alive.size(); ++i)
+          alive[i] = int(i);
+
+      int done_folds = 0;
+      int rung_folds = eta >= 2 ? 1 : n_folds;
+      while (true)
+      {
+          for (int fold = done_folds; fold < rung_folds; ++fold)
+          {
+              std::cout << "Evaluating " << alive.size() << " configurations with fold "
+                        << fold << " ... ";
+              evaluate_fold(results, alive, X, y, folds, fold, quantizer, seed);
+              std::cout << "done." << std::endl;
+          }
+          done_folds = rung_folds;
+          if (done_folds >= n_folds)
+              break;
+          // Keep the best 1/eta for the next rung.
+          rank_results(results, alive);
+          alive.resize((alive.size() + eta - 1) / eta);
+          rung_folds = std::min(n_folds, rung_folds * eta);
+          std::cout << "Kept " << alive.size() << " configurations, best mean accuracy "
+                    << results[alive[0]].mean() << "." << std::endl;
+      }
+      std::cout << std::endl;
+
+      std::vector<int> order(results.size());
+      for (size_t i = 0; i < order.size(); ++i)
+          order[i] = int(i);
+      rank_results(results, order);
+      write_results(std::cout, results, order);
+      std::cout << std::endl;
+      std::ofstream results_file(results_fname);
+      if (results_file)
+      {
+          write_results(results_file, results, order);
+          std::cout << "Results saved to '" << results_fname << "'." << std::endl;
+      }
+      else
+          std::cerr << "Warning: could not write the results to '" << results_fname
+                    << "'." << std::endl;
+
+      const ClassifierConfig& best = results[order[0]].config;
+      std::cout << "Training the best configuration (" << best.to_string()
+                << ") with all the samples ... ";
+      cv::theRNG().state = seed;
+      cv::Ptr<cv::ml::StatModel> clsf = best.create();
+      fsiv_train_classifier(clsf, X, y, quantizer);
+      std::cout << "done." << std::endl;
+
+      std::cout << "Saving the model to '" << model_fname << "'." << std::endl;
+      ModelFileWriter model_file(model_fname);
+      fsiv_save_classifier_model(clsf, model_file);
+      extractor->write_model(model_file.metadata());
+      model_file.metadata() << "fsiv_random_seed" << static_cast<double>(seed);
+      quantizer.write(model_file.metadata());
+      if (!model_file.close())
+      {
+          std::cerr << "Error: could not write the model to '" << model_fname
+                    << "'." << std::endl;
+          return EXIT_FAILURE;
+      }
+  }
+  catch (std::exception& e)
+  {
+    std::cerr << "Exception caught: " << e.what() << std::endl;
+    retCode = EXIT_FAILURE;
+  }
+  return retCode;
+}